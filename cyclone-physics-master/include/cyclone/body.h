@@ -42,6 +42,11 @@ namespace cyclone {
     class RigidBody
     {
     public:
+        /**
+         * The body store works directly on the state of the bodies
+         * it holds.
+         */
+        friend class RigidBodyStore;
 
         // ... Other RigidBody code as before ...
 
@@ -184,6 +189,13 @@ namespace cyclone {
          */
         bool canSleep;
 
+        /**
+         * Marks a fast moving body whose sphere primitives are swept
+         * along their path by the world, so they can't pass through
+         * thin objects between frames.
+         */
+        bool isBullet = false;
+
         /**
          * Holds a transform matrix for converting body space into
          * world space and vice versa. This can be achieved by calling
@@ -345,6 +357,14 @@ namespace cyclone {
          */
         bool hasFiniteMass() const;
 
+        /**
+         * Returns true if nothing can move the body: both its inverse
+         * mass and its inverse inertia tensor are zero. A body with
+         * zero inverse mass can still be turned by contacts if its
+         * inverse inertia tensor isn't zero.
+         */
+        bool isImmovable() const;
+
         /**
          * Sets the intertia tensor for the rigid body.
          *
@@ -832,6 +852,26 @@ namespace cyclone {
          */
         void setCanSleep(const bool canSleep=true);
 
+        /**
+         * Returns true if the body is treated as a bullet.
+         */
+        bool getBullet() const
+        {
+            return isBullet;
+        }
+
+        /**
+         * Sets whether the body is treated as a bullet. The world
+         * sweeps the sphere primitives of bullets from where they
+         * start each frame to where they end, and stops them at the
+         * first thing they hit. This costs more than the normal
+         * collision detection, so should only be used for small, fast
+         * bodies such as projectiles.
+         *
+         * @param bullet Whether the body is now a bullet.
+         */
+        void setBullet(const bool bullet=true);
+
         /*@}*/
 
 
@@ -0,0 +1,212 @@
+/*
+ * Interface file for the structure-of-arrays rigid body store.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains a store that keeps the state of many rigid
+ * bodies in separate arrays for each component, so they can be
+ * integrated several bodies at a time using the processor's vector
+ * instructions.
+ */
+#ifndef CYCLONE_BODYSTORE_H
+#define CYCLONE_BODYSTORE_H
+
+#include <vector>
+#include "body.h"
+
+namespace cyclone {
+
+    /**
+     * Holds the simulation state of a set of rigid bodies as a
+     * structure of arrays, and integrates them in batches.
+     *
+     * The store is opt-in: the RigidBody objects remain the way the
+     * rest of the engine and the application see the bodies. The
+     * store copies their state in with gather, can integrate them
+     * any number of times, and copies the results back out with
+     * scatter. Between a gather and a scatter the store holds the
+     * current state, so changes made to the RigidBody objects (such
+     * as adding forces) are only seen after the next gather.
+     *
+     * The integration does the same arithmetic in the same order as
+     * RigidBody::integrate, so gives the same results as integrating
+     * each body on its own.
+     */
+    class RigidBodyStore
+    {
+    public:
+        /**
+         * Identifies each of the arrays in the store. Vector
+         * components are stored in separate arrays, in x, y, z
+         * order, as are quaternion components (in r, i, j, k order)
+         * and matrix entries.
+         */
+        enum Field
+        {
+            POSITION = 0,
+            ORIENTATION = POSITION + 3,
+            VELOCITY = ORIENTATION + 4,
+            ROTATION = VELOCITY + 3,
+            FORCE_ACCUM = ROTATION + 3,
+            TORQUE_ACCUM = FORCE_ACCUM + 3,
+            ACCELERATION = TORQUE_ACCUM + 3,
+            LAST_FRAME_ACCELERATION = ACCELERATION + 3,
+            INVERSE_MASS = LAST_FRAME_ACCELERATION + 3,
+            LINEAR_DRAG = INVERSE_MASS + 1,
+            ANGULAR_DRAG = LINEAR_DRAG + 1,
+            INVERSE_INERTIA_TENSOR = ANGULAR_DRAG + 1,
+            INVERSE_INERTIA_TENSOR_WORLD = INVERSE_INERTIA_TENSOR + 9,
+            TRANSFORM_MATRIX = INVERSE_INERTIA_TENSOR_WORLD + 9,
+            AWAKE = TRANSFORM_MATRIX + 12,
+
+            /** The number of arrays: not a field itself. */
+            FIELD_COUNT = AWAKE + 1
+        };
+
+    protected:
+        /**
+         * Holds the bodies in the store, in the order of their
+         * entries in the arrays.
+         */
+        std::vector<RigidBody*> bodies;
+
+        /**
+         * Holds the arrays. The bodies are split into batches, and
+         * each batch has its own short array for every field, so all
+         * the data for one batch is together in memory. Entries after
+         * the last body are never awake.
+         */
+        std::vector<real> data;
+
+        /**
+         * @name Scalar State
+         *
+         * This data is only used outside the batched integration,
+         * so is kept in ordinary arrays.
+         */
+        /*@{*/
+
+        /** Holds the linear damping of each body. */
+        std::vector<real> linearDamping;
+
+        /** Holds the angular damping of each body. */
+        std::vector<real> angularDamping;
+
+        /** Holds the amount of motion of each body. */
+        std::vector<real> motion;
+
+        /** Holds whether each body is allowed to sleep. */
+        std::vector<bool> canSleep;
+
+        /*@}*/
+
+        /**
+         * Holds the duration the drag arrays were last worked out
+         * for. The drag only changes when the duration does.
+         */
+        real dragDuration;
+
+        /**
+         * Returns the value of the given field for the body at the
+         * given index.
+         */
+        real& value(unsigned field, unsigned index);
+
+        /**
+         * Grows the arrays if they are too small for the current
+         * bodies, keeping their contents.
+         */
+        void resize();
+
+        /**
+         * Resets the entry at the given index to a body that is
+         * asleep and has no rotation, as used for the unused entries
+         * in the last batch.
+         */
+        void clearEntry(unsigned index);
+
+        /**
+         * Copies the state of the body at the given index into the
+         * store.
+         */
+        void load(unsigned index);
+
+        /**
+         * Copies the state in the store out to the body at the given
+         * index.
+         */
+        void store(unsigned index);
+
+    public:
+        /**
+         * Creates a new empty store.
+         */
+        RigidBodyStore();
+
+        /**
+         * Returns the number of bodies integrated in each batch.
+         * This depends on the vector instructions the library was
+         * compiled for.
+         */
+        static unsigned getBatchSize();
+
+        /**
+         * Adds a body to the store, copying in its state, and returns
+         * its index.
+         */
+        unsigned add(RigidBody *body);
+
+        /**
+         * Removes the given body from the store. The last body in the
+         * store takes its index. The body's state is not copied out,
+         * so call scatter first if it is needed.
+         */
+        void remove(RigidBody *body);
+
+        /**
+         * Returns the number of bodies in the store.
+         */
+        unsigned getSize() const
+        {
+            return (unsigned)bodies.size();
+        }
+
+        /**
+         * Returns the body at the given index.
+         */
+        RigidBody* getBody(unsigned index) const
+        {
+            return bodies[index];
+        }
+
+        /**
+         * Copies the state of every body into the store.
+         */
+        void gather();
+
+        /**
+         * Copies the state in the store back out to every body.
+         */
+        void scatter();
+
+        /**
+         * Integrates every awake body forward in time by the given
+         * amount, as RigidBody::integrate does, including updating
+         * the derived data and putting bodies to sleep.
+         */
+        void integrate(real duration);
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_BODYSTORE_H
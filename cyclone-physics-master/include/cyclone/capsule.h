@@ -0,0 +1,74 @@
+/*
+ * Interface file for capsule primitives.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains the capsule primitive: a cylinder with a half
+ * sphere on each end, or all the points within a radius of a line
+ * segment. Capsules are a good fit for limbs and characters, and the
+ * tests against them come down to finding the closest points between
+ * the segment and the other shape, which is much cheaper than testing
+ * the fifteen axes that separate two boxes.
+ */
+#ifndef CYCLONE_CAPSULE_H
+#define CYCLONE_CAPSULE_H
+
+#include "collide_fine.h"
+
+namespace cyclone {
+
+    /**
+     * Represents a rigid body that can be treated as a capsule for
+     * collision detection. The segment at the core of the capsule
+     * lies along its Y axis, centred on its origin.
+     *
+     * Capsules collide with spheres, boxes, hulls, other capsules and
+     * planes. The inertia tensor of a solid capsule can be set with
+     * Matrix3::setCapsuleInertiaTensor.
+     */
+    class CollisionCapsule : public CollisionPrimitive
+    {
+    public:
+        /**
+         * Holds the radius of the capsule.
+         */
+        real radius;
+
+        /**
+         * Holds half the length of the segment between the centres
+         * of the two caps.
+         */
+        real halfHeight;
+
+        CollisionCapsule()
+            : CollisionPrimitive(TYPE_CAPSULE), radius(0), halfHeight(0)
+        {
+        }
+
+        /**
+         * Writes the centres of the two caps, in world coordinates.
+         */
+        void getSegment(Vector3 *start, Vector3 *end) const
+        {
+            Vector3 centre = getAxis(3);
+            Vector3 axis = getAxis(1) * halfHeight;
+            *start = centre - axis;
+            *end = centre + axis;
+        }
+
+        virtual BoundingBox getBoundingBox() const;
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_CAPSULE_H
@@ -16,6 +16,11 @@
  * This file contains the coarse collision detection system.  It is
  * used to return pairs of objects that may be in contact, which can
  * then be tested using fined grained methods.
+ *
+ * Two hierarchies are provided: the BVHNode template, which can only
+ * be built up by insertion, and the AABBTree, which supports moving
+ * objects and is the one to use for objects that change position
+ * every frame.
  */
 #ifndef CYCLONE_COLLISION_COARSE_H
 #define CYCLONE_COLLISION_COARSE_H
@@ -26,6 +31,8 @@
 
 namespace cyclone {
 
+    class CollisionPrimitive;
+
     /**
      * Represents a bounding sphere that can be tested for overlap.
      */
@@ -73,6 +80,75 @@ namespace cyclone {
         }
     };
 
+    /**
+     * Represents an axis aligned bounding box that can be tested for
+     * overlap.
+     */
+    struct BoundingBox
+    {
+        /** Holds the corner of the box with the smallest coordinates. */
+        Vector3 lower;
+
+        /** Holds the corner of the box with the largest coordinates. */
+        Vector3 upper;
+
+    public:
+        /**
+         * Creates a new bounding box with both corners at the origin.
+         */
+        BoundingBox() {}
+
+        /**
+         * Creates a new bounding box between the given corners.
+         */
+        BoundingBox(const Vector3 &lower, const Vector3 &upper);
+
+        /**
+         * Creates a bounding box to enclose the two given bounding
+         * boxes.
+         */
+        BoundingBox(const BoundingBox &one, const BoundingBox &two);
+
+        /**
+         * Checks if the bounding box overlaps with the other given
+         * bounding box.
+         */
+        bool overlaps(const BoundingBox *other) const;
+
+        /**
+         * Checks if the given bounding box lies entirely inside this
+         * one.
+         */
+        bool contains(const BoundingBox &other) const;
+
+        /**
+         * Reports how much this bounding box would have to grow by
+         * to incorporate the given bounding box, as the change in its
+         * surface area.
+         */
+        real getGrowth(const BoundingBox &other) const;
+
+        /**
+         * Returns the surface area of the bounding box. This is the
+         * measure of cost used when building trees of boxes.
+         */
+        real getSurfaceArea() const
+        {
+            Vector3 extent = upper - lower;
+            return ((real)2.0) *
+                (extent.x*extent.y + extent.y*extent.z + extent.z*extent.x);
+        }
+
+        /**
+         * Returns the volume of this bounding box.
+         */
+        real getSize() const
+        {
+            Vector3 extent = upper - lower;
+            return extent.x * extent.y * extent.z;
+        }
+    };
+
     /**
      * Stores a potential contact to check later.
      */
@@ -82,6 +158,13 @@ namespace cyclone {
          * Holds the bodies that might be in contact.
          */
         RigidBody* body[2];
+
+        /**
+         * Holds the primitives that might be in contact. These are
+         * NULL if the hierarchy that found the contact only tracks
+         * bodies.
+         */
+        CollisionPrimitive* primitive[2];
     };
 
     /**
@@ -342,6 +425,7 @@ namespace cyclone {
         {
             contacts->body[0] = body;
             contacts->body[1] = other->body;
+            contacts->primitive[0] = contacts->primitive[1] = NULL;
             return 1;
         }
 
@@ -383,6 +467,263 @@ namespace cyclone {
         }
     }
 
+    /**
+     * This is the basic polymorphic interface for objects that are
+     * told about the proxies a ray passes through when it is cast
+     * through an AABBTree.
+     */
+    class RayCastCallback
+    {
+    public:
+        virtual ~RayCastCallback() {}
+
+        /**
+         * Called for each proxy whose fat box the ray passes through
+         * before its current end. Returns the distance the ray should
+         * now end at: the given distance to carry on as before, a
+         * shorter distance to clip the ray (at a hit, for example),
+         * or zero to stop the cast.
+         */
+        virtual real reportProxy(unsigned proxy, real maxDistance) = 0;
+    };
+
+    /**
+     * A bounding volume hierarchy of axis aligned boxes that can be
+     * updated as objects move.
+     *
+     * Each object in the tree is represented by a proxy: a leaf node
+     * whose box is the object's bounding box enlarged by a margin.
+     * When the object moves, the tree only needs to change if the
+     * object has left this enlarged ("fat") box, so objects that are
+     * at rest or moving slowly cost almost nothing to update. The
+     * tree is kept balanced by rotating nodes as leaves are inserted.
+     *
+     * Nodes are held in a single contiguous array and refer to each
+     * other by index, so creating and moving proxies does not
+     * allocate memory once the array has grown large enough.
+     */
+    class AABBTree
+    {
+    public:
+        /**
+         * The index used to mean "no node".
+         */
+        static const unsigned nullNode = 0xffffffff;
+
+    protected:
+        /**
+         * Holds a single node in the tree.
+         */
+        struct Node
+        {
+            /**
+             * Holds the bounding box enclosing everything below this
+             * node. For leaves this is the fat box of the proxy.
+             */
+            BoundingBox box;
+
+            /** Holds the rigid body of a leaf node. */
+            RigidBody *body;
+
+            /** Holds the collision primitive of a leaf node. */
+            CollisionPrimitive *primitive;
+
+            /**
+             * Holds the node above this one in the tree. For nodes
+             * that are not in use this holds the next free node.
+             */
+            unsigned parent;
+
+            /** Holds the two child nodes, or nullNode for leaves. */
+            unsigned children[2];
+
+            /**
+             * Holds the height of the subtree below this node: zero
+             * for leaves, and -1 for nodes that are not in use.
+             */
+            int height;
+
+            /**
+             * Checks if this node is at the bottom of the hierarchy.
+             */
+            bool isLeaf() const
+            {
+                return children[0] == nullNode;
+            }
+        };
+
+        /** Holds all the nodes, both in use and free. */
+        std::vector<Node> nodes;
+
+        /** Holds the index of the root node. */
+        unsigned root;
+
+        /** Holds the first node in the list of free nodes. */
+        unsigned freeList;
+
+        /** Holds the number of proxies in the tree. */
+        unsigned proxyCount;
+
+        /**
+         * Holds the distance the bounding box of each proxy is
+         * enlarged by in every direction.
+         */
+        real margin;
+
+        /**
+         * Holds the stack of node pairs used when searching the tree
+         * for potential contacts.
+         */
+        mutable std::vector<unsigned> pairStack;
+
+        /**
+         * Takes a node from the free list, growing the array if it
+         * is empty.
+         */
+        unsigned allocateNode();
+
+        /**
+         * Returns the given node to the free list.
+         */
+        void freeNode(unsigned node);
+
+        /**
+         * Adds the given leaf to the tree, next to the node whose
+         * box grows the least to include it.
+         */
+        void insertLeaf(unsigned leaf);
+
+        /**
+         * Removes the given leaf from the tree, without freeing it.
+         */
+        void removeLeaf(unsigned leaf);
+
+        /**
+         * Walks from the given node up to the root, rebalancing and
+         * recalculating the bounding box of each node on the way.
+         */
+        void refit(unsigned node);
+
+        /**
+         * Performs a rotation at the given node if its two subtrees
+         * differ in height by more than one. Returns the node now in
+         * its place in the tree.
+         */
+        unsigned balance(unsigned node);
+
+    public:
+        /**
+         * Creates a new empty tree. The margin is the distance the
+         * box of each proxy is enlarged by in every direction.
+         */
+        AABBTree(real margin = (real)0.1);
+
+        /**
+         * Adds an object with the given bounding box to the tree,
+         * and returns the proxy used to refer to it from then on.
+         */
+        unsigned createProxy(const BoundingBox &box,
+                             RigidBody *body,
+                             CollisionPrimitive *primitive = NULL);
+
+        /**
+         * Removes the given proxy from the tree.
+         */
+        void destroyProxy(unsigned proxy);
+
+        /**
+         * Updates the tree with the new bounding box of the given
+         * proxy. Nothing is done if the box is still inside the
+         * proxy's fat box. Otherwise the proxy is reinserted with a
+         * new fat box, which is also stretched along the given
+         * displacement (typically the object's velocity times the
+         * duration of a frame) to anticipate further movement.
+         * Returns true if the proxy was reinserted.
+         */
+        bool moveProxy(unsigned proxy,
+                       const BoundingBox &box,
+                       const Vector3 &displacement = Vector3());
+
+        /**
+         * Returns the fat box of the given proxy.
+         */
+        const BoundingBox& getFatBox(unsigned proxy) const
+        {
+            return nodes[proxy].box;
+        }
+
+        /**
+         * Returns the rigid body of the given proxy.
+         */
+        RigidBody* getBody(unsigned proxy) const
+        {
+            return nodes[proxy].body;
+        }
+
+        /**
+         * Returns the collision primitive of the given proxy.
+         */
+        CollisionPrimitive* getPrimitive(unsigned proxy) const
+        {
+            return nodes[proxy].primitive;
+        }
+
+        /**
+         * Returns the number of proxies in the tree.
+         */
+        unsigned getProxyCount() const
+        {
+            return proxyCount;
+        }
+
+        /**
+         * Returns the height of the tree, or zero if it is empty.
+         */
+        unsigned getHeight() const;
+
+        /**
+         * Checks the whole tree for pairs of proxies whose fat boxes
+         * overlap, writing them to the given array (up to the given
+         * limit). Pairs of proxies attached to the same rigid body
+         * are not reported, and nor are pairs of primitives whose
+         * filters exclude each other (see
+         * CollisionPrimitive::canCollideWith). Returns the number of
+         * potential contacts it found.
+         */
+        unsigned getPotentialContacts(PotentialContact* contacts,
+                                      unsigned limit) const;
+
+        /**
+         * Finds the proxies whose fat boxes overlap the given box,
+         * writing them to the given array (up to the given limit).
+         * Returns the number of proxies it found. Like raycast, this
+         * keeps its working memory on the stack, so several threads
+         * can query the same tree at once.
+         */
+        unsigned query(const BoundingBox &box,
+                       unsigned *proxies,
+                       unsigned limit) const;
+
+        /**
+         * Casts a ray from the given origin along the given direction
+         * (which must be a unit vector), telling the callback about
+         * each proxy whose fat box it passes through within
+         * maxDistance of the origin. Giving a radius casts a sphere
+         * of that radius instead, by enlarging each box. Proxies are
+         * reported in no particular order, but the callback can clip
+         * the ray to skip the parts of the tree beyond a hit.
+         *
+         * Unlike getPotentialContacts this keeps its working memory
+         * on the stack, so several rays can be cast through the same
+         * tree at once from different threads.
+         */
+        void raycast(const Vector3 &origin,
+                     const Vector3 &direction,
+                     real maxDistance,
+                     real radius,
+                     RayCastCallback *callback) const;
+    };
+
 } // namespace cyclone
 
 #endif // CYCLONE_COLLISION_FINE_H
\ No newline at end of file
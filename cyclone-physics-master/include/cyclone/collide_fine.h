@@ -26,12 +26,17 @@
 #define CYCLONE_COLLISION_FINE_H
 
 #include "contacts.h"
+#include "collide_coarse.h"
+#include "contactbuffer.h"
 
 namespace cyclone {
 
     // Forward declarations of primitive friends
     class IntersectionTests;
     class CollisionDetector;
+    class CollisionConvex;
+    class CollisionHeightfield;
+    class CollisionCapsule;
 
     /**
      * Represents a primitive to detect collisions against.
@@ -47,6 +52,24 @@ namespace cyclone {
         friend class IntersectionTests;
         friend class CollisionDetector;
 
+        /**
+         * Identifies the shape of a primitive, so the collision
+         * detector can pick the right routine for a pair of
+         * primitives.
+         */
+        enum Type
+        {
+            TYPE_SPHERE,
+            TYPE_BOX,
+            TYPE_CONVEX,
+            TYPE_TRIANGLE_MESH,
+            TYPE_HEIGHTFIELD,
+            TYPE_CAPSULE,
+
+            /** The number of types: not a valid type itself. */
+            TYPE_COUNT
+        };
+
         /**
          * The rigid body that is represented by this primitive.
          */
@@ -58,10 +81,77 @@ namespace cyclone {
         Matrix4 offset;
 
         /**
-         * Calculates the internals for the primitive.
+         * @name Collision Filtering
+         *
+         * These decide which pairs of primitives are tested against
+         * each other at all. Pairs that are filtered out are dropped
+         * when the broadphase reports its potential contacts, so they
+         * never reach the collision detector.
+         *
+         * Each primitive belongs to the categories whose bits are set
+         * in category, and collides with the categories whose bits are
+         * set in mask. Two primitives collide only if each one's mask
+         * includes a category of the other. By default primitives are
+         * in the first category and collide with everything.
+         *
+         * The group overrides the bits: two primitives with the same
+         * positive group always collide, and two with the same
+         * negative group never do. A group of zero means no group.
+         */
+        /*@{*/
+
+        /**
+         * Holds the bits of the categories this primitive is in.
+         */
+        unsigned category;
+
+        /**
+         * Holds the bits of the categories this primitive collides
+         * with.
+         */
+        unsigned mask;
+
+        /**
+         * Holds the group of this primitive, or zero if it has none.
+         */
+        int group;
+
+        /**
+         * Checks if this primitive should be tested against the
+         * given one.
+         */
+        bool canCollideWith(const CollisionPrimitive &other) const
+        {
+            if (group != 0 && group == other.group) return group > 0;
+            return (category & other.mask) != 0 &&
+                (mask & other.category) != 0;
+        }
+
+        /*@}*/
+
+        virtual ~CollisionPrimitive() {}
+
+        /**
+         * Calculates the internals for the primitive. A primitive
+         * with no body is placed by its offset alone, which is useful
+         * for shapes that are only used to query the scene.
          */
         void calculateInternals();
 
+        /**
+         * Returns the type of this primitive.
+         */
+        Type getType() const
+        {
+            return type;
+        }
+
+        /**
+         * Returns an axis aligned box enclosing the primitive, based
+         * on the transform last worked out by calculateInternals.
+         */
+        virtual BoundingBox getBoundingBox() const;
+
         /**
          * This is a convenience function to allow access to the
          * axis vectors in the transform for this primitive.
@@ -90,6 +180,21 @@ namespace cyclone {
          * with the transform of the rigid body.
          */
         Matrix4 transform;
+
+        /**
+         * Holds the type of this primitive.
+         */
+        Type type;
+
+        /**
+         * Creates a new primitive of the given type. This is called
+         * by the constructors of the concrete primitives.
+         */
+        CollisionPrimitive(Type type)
+            : body(NULL), category(1), mask(0xffffffff), group(0),
+              type(type)
+        {
+        }
     };
 
     /**
@@ -103,6 +208,13 @@ namespace cyclone {
          * The radius of the sphere.
          */
         real radius;
+
+        CollisionSphere()
+            : CollisionPrimitive(TYPE_SPHERE)
+        {
+        }
+
+        virtual BoundingBox getBoundingBox() const;
     };
 
     /**
@@ -122,6 +234,34 @@ namespace cyclone {
          * The distance of the plane from the origin.
          */
         real offset;
+
+        /**
+         * Holds the bits of the categories this plane is in. Planes
+         * are filtered against primitives in the same way as
+         * primitives are against each other (see
+         * CollisionPrimitive::canCollideWith), but have no group.
+         */
+        unsigned category;
+
+        /**
+         * Holds the bits of the categories this plane collides with.
+         */
+        unsigned mask;
+
+        CollisionPlane()
+            : offset(0), category(1), mask(0xffffffff)
+        {
+        }
+
+        /**
+         * Checks if the given primitive should be tested against this
+         * plane.
+         */
+        bool canCollideWith(const CollisionPrimitive &primitive) const
+        {
+            return (category & primitive.mask) != 0 &&
+                (mask & primitive.category) != 0;
+        }
     };
 
     /**
@@ -135,6 +275,160 @@ namespace cyclone {
          * Holds the half-sizes of the box along each of its local axes.
          */
         Vector3 halfSize;
+
+        CollisionBox()
+            : CollisionPrimitive(TYPE_BOX)
+        {
+        }
+
+        virtual BoundingBox getBoundingBox() const;
+    };
+
+    /**
+     * Holds the bounding boxes of a set of primitives laid out by
+     * component, so that CollisionDetector::collideWithPlanes can
+     * cull several primitives at once against a plane without going
+     * through each primitive's transform.
+     *
+     * Each primitive has a fixed slot in the batch. The batch is
+     * meant to be kept from frame to frame, and each slot rewritten
+     * with set when its primitive's bounding box is worked out, so
+     * there is no separate pass to copy the primitives in. Slots in
+     * different blocks can be set from different threads. The batch
+     * does not take ownership of the primitives.
+     */
+    class PrimitiveBatch
+    {
+        friend class CollisionDetector;
+
+    protected:
+        /** Holds the primitive in each slot, or NULL if it is empty. */
+        std::vector<const CollisionPrimitive*> primitives;
+
+        /**
+         * Holds the boxes one block at a time. Each block holds the
+         * x component of the centre of every box in the block, then
+         * the y, then the z, then each component of the half-sizes.
+         */
+        std::vector<real> blocks;
+
+    public:
+        /**
+         * Sets the number of slots. Slots that are kept keep their
+         * contents, and new ones are empty.
+         */
+        void resize(unsigned size);
+
+        /**
+         * Writes a primitive and its bounding box into a slot.
+         * Passing a NULL primitive empties the slot, so it is
+         * skipped.
+         */
+        void set(unsigned index,
+                 const CollisionPrimitive *primitive,
+                 const BoundingBox &box);
+
+        /** Returns the number of slots in the batch. */
+        unsigned getSize() const
+        {
+            return (unsigned)primitives.size();
+        }
+    };
+
+    /**
+     * Receives the triangles found by a search of a triangle surface.
+     */
+    class TriangleCallback
+    {
+    public:
+        virtual ~TriangleCallback() {}
+
+        /**
+         * Called for each triangle that may overlap the box being
+         * searched for.
+         */
+        virtual void reportTriangle(unsigned triangle) = 0;
+    };
+
+    /**
+     * Represents fixed geometry made of triangles, such as a triangle
+     * mesh or a heightfield. The collision detector sees the
+     * triangles only through the functions here, so each kind of
+     * surface can store and search them in its own way. Everything is
+     * given in the primitive's own coordinates.
+     *
+     * Each triangle only pushes objects out of its front, the side
+     * its vertices are anticlockwise from.
+     */
+    class TriangleSurface : public CollisionPrimitive
+    {
+    public:
+        /**
+         * Writes the three corners of the given triangle.
+         */
+        virtual void getTriangle(unsigned triangle,
+                                 Vector3 *corners) const = 0;
+
+        /**
+         * Reports each triangle that may overlap the given box. A
+         * few triangles just outside the box may be reported too.
+         */
+        virtual void findTriangles(const BoundingBox &box,
+                                   TriangleCallback *callback) const = 0;
+
+        /**
+         * Finds the nearest triangle hit by a ray, from either side,
+         * before the given distance. If there is one, its index and
+         * the distance to it are written out and true is returned.
+         */
+        virtual bool raycastTriangles(const Vector3 &origin,
+                                      const Vector3 &direction,
+                                      real maxDistance,
+                                      unsigned *triangle,
+                                      real *distance) const = 0;
+
+    protected:
+        TriangleSurface(Type type)
+            : CollisionPrimitive(type)
+        {
+        }
+    };
+
+    /**
+     * Holds a ray, or the path of a sphere, for casting into the
+     * scene.
+     */
+    struct Ray
+    {
+        /** Holds the point the ray starts from. */
+        Vector3 origin;
+
+        /** Holds the direction of the ray, as a unit vector. */
+        Vector3 direction;
+
+        /** Holds the distance along the ray at which it ends. */
+        real maxDistance;
+    };
+
+    /**
+     * Holds the details of where a ray hit a primitive.
+     */
+    struct RayHit
+    {
+        /** Holds the primitive that was hit. */
+        const CollisionPrimitive *primitive;
+
+        /** Holds the point on the primitive's surface that was hit. */
+        Vector3 point;
+
+        /**
+         * Holds the normal of the primitive's surface at the hit,
+         * facing back towards the ray.
+         */
+        Vector3 normal;
+
+        /** Holds the distance along the ray to the hit. */
+        real distance;
     };
 
     /**
@@ -173,9 +467,254 @@ namespace cyclone {
         static bool boxAndHalfSpace(
             const CollisionBox &box,
             const CollisionPlane &plane);
+
+        static bool boxAndSphere(
+            const CollisionBox &box,
+            const CollisionSphere &sphere);
+
+        /**
+         * @name Sweep Tests
+         *
+         * These move a sphere in a straight line, by the given
+         * displacement, from its current position, and find the
+         * first time at which it touches the other object, which is
+         * treated as not moving. If they touch before the sphere has
+         * moved the whole way, the fraction of the displacement
+         * moved before touching (between zero and one) is written
+         * into time, and true is returned. A sphere that already
+         * touches the object has a time of zero.
+         */
+        /*@{*/
+
+        static bool sweptSphereAndHalfSpace(
+            const CollisionSphere &sphere,
+            const Vector3 &displacement,
+            const CollisionPlane &plane,
+            real *time);
+
+        static bool sweptSphereAndSphere(
+            const CollisionSphere &sphere,
+            const Vector3 &displacement,
+            const CollisionSphere &other,
+            real *time);
+
+        /**
+         * The box test steps along the path by the distance to the
+         * box, which can never step past the first touch, and stops
+         * within the given fraction of the sphere's radius of the box.
+         */
+        static bool sweptSphereAndBox(
+            const CollisionSphere &sphere,
+            const Vector3 &displacement,
+            const CollisionBox &box,
+            real *time,
+            real tolerance = (real)0.001);
+
+        /*@}*/
+
+        /**
+         * @name Ray Tests
+         *
+         * These cast a ray into a primitive. Giving a radius casts a
+         * sphere of that radius along the ray instead. If the ray
+         * touches the primitive before its maximum distance, the
+         * details are written into hit and true is returned. A ray
+         * that starts inside the primitive hits it at a distance of
+         * zero, with a normal facing back along the ray.
+         */
+        /*@{*/
+
+        static bool rayAndSphere(
+            const Ray &ray,
+            real radius,
+            const CollisionSphere &sphere,
+            RayHit *hit);
+
+        /**
+         * A ray is tested against the faces of the box exactly. A
+         * sphere uses the same stepping as sweptSphereAndBox, so it
+         * stops within the given fraction of its radius of the box.
+         */
+        static bool rayAndBox(
+            const Ray &ray,
+            real radius,
+            const CollisionBox &box,
+            RayHit *hit,
+            real tolerance = (real)0.001);
+
+        /**
+         * A ray is tested against the faces of the hull exactly. A
+         * sphere steps along the ray by its distance from the hull,
+         * and stops within the given fraction of its radius of it.
+         */
+        static bool rayAndConvex(
+            const Ray &ray,
+            real radius,
+            const CollisionConvex &convex,
+            RayHit *hit,
+            real tolerance = (real)0.001);
+
+        /**
+         * The ray is tested against the cylinder and the two caps of
+         * the capsule exactly, grown by the radius of the sphere if
+         * there is one.
+         */
+        static bool rayAndCapsule(
+            const Ray &ray,
+            real radius,
+            const CollisionCapsule &capsule,
+            RayHit *hit);
+
+        /**
+         * A ray is tested against the triangles of the surface
+         * exactly, hitting them from either side. A sphere steps
+         * towards each triangle near its path by its distance from
+         * it, and stops within the given fraction of its radius of it.
+         */
+        static bool rayAndTriangles(
+            const Ray &ray,
+            real radius,
+            const TriangleSurface &surface,
+            RayHit *hit,
+            real tolerance = (real)0.001);
+
+        /**
+         * Finds where the line from the given origin along the given
+         * direction crosses a triangle, from either side. If it does
+         * so between zero and the given distance, the distance along
+         * the direction is written out and true is returned.
+         */
+        static bool rayAndTriangle(
+            const Vector3 &origin,
+            const Vector3 &direction,
+            const Vector3 *corners,
+            real maxDistance,
+            real *distance);
+
+        /*@}*/
     };
 
 
+    /**
+     * Remembers which axis kept each pair of boxes apart, so
+     * CollisionDetector::boxAndBox can try it first the next frame.
+     * Most pairs the broadphase finds are not touching, and those
+     * that were apart along an axis last frame nearly always still
+     * are, so they are rejected with a single projection instead of
+     * up to fifteen.
+     *
+     * Axes found while generating one frame's contacts are used for
+     * the next; pairs that aren't tested in a frame are forgotten.
+     * Set it as the axisCache of the CollisionData, and call update
+     * after each frame's contacts have been generated.
+     */
+    class SeparatingAxisCache
+    {
+    protected:
+        /**
+         * Holds the axis that separated a pair of primitives, with
+         * the primitives in address order. Empty slots have no
+         * primitives.
+         */
+        struct Entry
+        {
+            const CollisionPrimitive *primitive[2];
+            unsigned axis;
+        };
+
+        /**
+         * Holds the axes found last frame, as a hash table whose size
+         * is a power of two.
+         */
+        std::vector<Entry> entries;
+
+        /** Holds the number of pairs in entries. */
+        unsigned size;
+
+        /** Holds the axes found so far this frame, in the same way. */
+        std::vector<Entry> found;
+
+        /** Holds the number of pairs in found. */
+        unsigned foundSize;
+
+        /**
+         * Holds the cache whose axes from last frame are looked up by
+         * find, or NULL to use this one's.
+         */
+        const SeparatingAxisCache *source;
+
+        /**
+         * Returns the slot of the given table where the given pair
+         * is, or the empty slot where it would go.
+         */
+        static unsigned findSlot(const std::vector<Entry> &table,
+                                 const CollisionPrimitive *one,
+                                 const CollisionPrimitive *two);
+
+        /**
+         * Empties the table, resizing it to hold the given number of
+         * pairs comfortably.
+         */
+        static void resetTable(std::vector<Entry> &table, unsigned count);
+
+    public:
+        /** The axis returned when a pair has none stored. */
+        static const unsigned noAxis = 0xffffffff;
+
+        SeparatingAxisCache();
+
+        /**
+         * Returns the axis that separated the given primitives last
+         * frame, or noAxis. The axis is numbered from the first
+         * primitive's point of view, as in boxAndBox.
+         */
+        unsigned find(const CollisionPrimitive *one,
+                      const CollisionPrimitive *two) const;
+
+        /**
+         * Records the axis that separated the given primitives this
+         * frame.
+         */
+        void store(const CollisionPrimitive *one,
+                   const CollisionPrimitive *two,
+                   unsigned axis);
+
+        /**
+         * Makes the axes recorded this frame the ones found next
+         * frame, forgetting the pairs that weren't separated.
+         */
+        void update();
+
+        /**
+         * Forgets all the stored axes.
+         */
+        void clear();
+
+        /**
+         * Makes find look up the axes from last frame in the given
+         * cache, rather than this one, or in this one again if NULL is
+         * given. Threads that test boxes at the same time can each
+         * record axes in a cache of their own, reading from a shared
+         * cache, and the axes they record can then be merged into
+         * the shared cache.
+         */
+        void setSource(const SeparatingAxisCache *source);
+
+        /**
+         * Moves the axes the given cache recorded this frame into
+         * this one.
+         */
+        void merge(SeparatingAxisCache &other);
+
+        /**
+         * Returns the number of pairs stored.
+         */
+        unsigned getSize() const
+        {
+            return size;
+        }
+    };
+
     /**
      * A helper structure that contains information for the detector to use
      * in building its contact data.
@@ -211,6 +750,31 @@ namespace cyclone {
          */
         real tolerance;
 
+        /**
+         * Holds the cache of separating axes between boxes, or NULL
+         * to test every axis each time.
+         */
+        SeparatingAxisCache *axisCache;
+
+        /**
+         * Holds the buffer the contact array is part of, or NULL if
+         * the array is a fixed size. A buffer grows as contacts are
+         * added, so none are dropped.
+         */
+        ContactBuffer<Contact> *buffer;
+
+        /**
+         * Holds the room kept free in a buffer: the most contacts
+         * that one of the collision detector's routines writes at
+         * once, which is a box's eight corners against a plane.
+         */
+        static const unsigned minimumBufferSpace = 8;
+
+        CollisionData()
+            : axisCache(NULL), buffer(NULL)
+        {
+        }
+
         /**
          * Checks if there are more contacts available in the contact
          * data.
@@ -225,6 +789,7 @@ namespace cyclone {
          */
         void reset(unsigned maxContacts)
         {
+            buffer = NULL;
             contactsLeft = maxContacts;
             contactCount = 0;
             contacts = contactArray;
@@ -242,6 +807,37 @@ namespace cyclone {
 
             // Move the array forward
             contacts += count;
+
+            // Grow the buffer before it is too full for the next test.
+            if (buffer)
+            {
+                buffer->add(count);
+                if (contactsLeft < (int)minimumBufferSpace) reserveBufferSpace();
+            }
+        }
+
+        /**
+         * Sets the data to write its contacts onto the end of the
+         * given buffer, with no used contacts recorded. The contact
+         * array moves when the buffer grows, so contactArray must be
+         * read again after each call to addContacts.
+         */
+        void setBuffer(ContactBuffer<Contact> *buffer)
+        {
+            CollisionData::buffer = buffer;
+            contactCount = 0;
+            reserveBufferSpace();
+        }
+
+        /**
+         * Makes room in the buffer for at least the next test, and
+         * points the array at where it now is.
+         */
+        void reserveBufferSpace()
+        {
+            contacts = buffer->reserve(minimumBufferSpace);
+            contactArray = contacts - contactCount;
+            contactsLeft = (int)buffer->getSpace();
         }
     };
 
@@ -256,6 +852,72 @@ namespace cyclone {
     class CollisionDetector
     {
     public:
+        /**
+         * The format of the routines held in the dispatch tables
+         * used by collide.
+         */
+        typedef unsigned (*PairFunction)(
+            const CollisionPrimitive &one,
+            const CollisionPrimitive &two,
+            CollisionData *data
+            );
+
+        /**
+         * The format of the routines held in the dispatch table
+         * used by collideWithPlane.
+         */
+        typedef unsigned (*PlaneFunction)(
+            const CollisionPrimitive &primitive,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on any two primitives, looking up
+         * the routine to use from their types. Pairs of types that
+         * have no routine generate no contacts.
+         */
+        static unsigned collide(
+            const CollisionPrimitive &one,
+            const CollisionPrimitive &two,
+            CollisionData *data
+            );
+
+        /**
+         * Does a collision test on any primitive and a plane
+         * representing a half-space, looking up the routine to use
+         * from the primitive's type.
+         */
+        static unsigned collideWithPlane(
+            const CollisionPrimitive &primitive,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        /**
+         * The number of primitives tested together in a block of a
+         * PrimitiveBatch.
+         */
+        static const unsigned batchWidth = 8;
+
+        /**
+         * Does a collision test between each primitive in a range of
+         * slots of the batch and each of the given planes, and writes
+         * the same contacts in the same order as calling
+         * collideWithPlane for each primitive, for each plane it can
+         * collide with. The boxes of a block of primitives are tested
+         * against each plane at once, reading only the batch, and only
+         * the primitives whose boxes come within the collision
+         * tolerance of a plane are given to their exact test.
+         */
+        static unsigned collideWithPlanes(
+            const PrimitiveBatch &batch,
+            unsigned begin,
+            unsigned end,
+            const CollisionPlane *const *planes,
+            unsigned numPlanes,
+            CollisionData *data
+            );
 
         static unsigned sphereAndHalfSpace(
             const CollisionSphere &sphere,
@@ -286,6 +948,12 @@ namespace cyclone {
             CollisionData *data
             );
 
+        /**
+         * Does a collision test on two boxes, using the separating
+         * axis test on their faces and the cross products of their
+         * edges. If the data has an axis cache, the axis that kept
+         * the pair apart last frame is tried first.
+         */
         static unsigned boxAndBox(
             const CollisionBox &one,
             const CollisionBox &two,
@@ -303,6 +971,179 @@ namespace cyclone {
             const CollisionSphere &sphere,
             CollisionData *data
             );
+
+        /**
+         * @name Convex Hull Tests
+         *
+         * These use the general convex tests, so work for any pair of
+         * shapes. Where a face of one shape rests on a face of the
+         * other, the face of the other is clipped to the first to
+         * give up to four contacts around the area they share.
+         */
+        /*@{*/
+
+        static unsigned convexAndHalfSpace(
+            const CollisionConvex &convex,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        static unsigned convexAndSphere(
+            const CollisionConvex &convex,
+            const CollisionSphere &sphere,
+            CollisionData *data
+            );
+
+        static unsigned convexAndBox(
+            const CollisionConvex &convex,
+            const CollisionBox &box,
+            CollisionData *data
+            );
+
+        static unsigned convexAndConvex(
+            const CollisionConvex &one,
+            const CollisionConvex &two,
+            CollisionData *data
+            );
+
+        static unsigned convexAndCapsule(
+            const CollisionConvex &convex,
+            const CollisionCapsule &capsule,
+            CollisionData *data
+            );
+
+        /*@}*/
+
+        /**
+         * @name Capsule Tests
+         *
+         * These find the closest points between the segment at the
+         * core of the capsule and the other shape, and treat the
+         * capsule as a sphere around its closest point. A capsule
+         * lying along a flat surface, or along another capsule, gets
+         * a contact at each end of the part that touches, so it can
+         * rest without rocking.
+         */
+        /*@{*/
+
+        static unsigned capsuleAndHalfSpace(
+            const CollisionCapsule &capsule,
+            const CollisionPlane &plane,
+            CollisionData *data
+            );
+
+        static unsigned capsuleAndSphere(
+            const CollisionCapsule &capsule,
+            const CollisionSphere &sphere,
+            CollisionData *data
+            );
+
+        /**
+         * The closest points between the segment and the box are
+         * found exactly, by solving for the nearest point on each
+         * stretch of the segment between the planes of the box's
+         * faces. If the segment passes into the box, the capsule is
+         * pushed out through the face it overlaps least.
+         */
+        static unsigned capsuleAndBox(
+            const CollisionCapsule &capsule,
+            const CollisionBox &box,
+            CollisionData *data
+            );
+
+        static unsigned capsuleAndCapsule(
+            const CollisionCapsule &one,
+            const CollisionCapsule &two,
+            CollisionData *data
+            );
+
+        /*@}*/
+
+        /**
+         * @name Triangle Surface Tests
+         *
+         * These work on triangle meshes and heightfields. They only
+         * test the triangles the surface finds near the other
+         * primitive: those in the mesh's tree whose boxes overlap it,
+         * or those in the cells of the heightfield under it. Each
+         * triangle touching the primitive adds its own contacts, and
+         * a contact at the same point as one already found for the
+         * surface is dropped, so a vertex or edge shared by several
+         * triangles only makes one contact.
+         */
+        /*@{*/
+
+        static unsigned sphereAndTriangles(
+            const CollisionSphere &sphere,
+            const TriangleSurface &surface,
+            CollisionData *data
+            );
+
+        /**
+         * Each triangle is tested against the box on the axes that
+         * could separate them. A triangle the box touches pushes it
+         * out along the triangle's normal: the faces of the box that
+         * face the triangle are clipped to the triangle's edges, and
+         * up to four of the points below it become contacts.
+         */
+        static unsigned boxAndTriangles(
+            const CollisionBox &box,
+            const TriangleSurface &surface,
+            CollisionData *data
+            );
+
+        /**
+         * Generates a contact for a point below a heightfield, such
+         * as a wheel or a foot of the given body, which may be NULL.
+         * The point is pushed up out of the triangle under it, however
+         * deep it is, so this only looks at a single cell.
+         */
+        static unsigned pointAndHeightfield(
+            const Vector3 &point,
+            RigidBody *body,
+            const CollisionHeightfield &heightfield,
+            CollisionData *data
+            );
+
+        /*@}*/
+
+        /**
+         * @name Manifold Helpers
+         *
+         * These are used by the routines that build a manifold of
+         * contacts where two faces touch.
+         */
+        /*@{*/
+
+        /**
+         * Clips a convex polygon to the half-space behind the given
+         * plane, writing the result and returning its number of
+         * vertices. The output needs room for one more vertex than
+         * the input.
+         */
+        static unsigned clipPolygon(
+            const Vector3 *input,
+            unsigned count,
+            const Vector3 &normal,
+            real offset,
+            Vector3 *output
+            );
+
+        /**
+         * Picks up to four of the given points to keep as contacts:
+         * the deepest, the one furthest from it, and the two that
+         * make the largest triangles with those on either side.
+         * Writes their indices and returns how many were picked.
+         */
+        static unsigned selectContacts(
+            const Vector3 *points,
+            const real *depths,
+            unsigned count,
+            const Vector3 &normal,
+            unsigned *selected
+            );
+
+        /*@}*/
     };
 
 
@@ -0,0 +1,194 @@
+/*
+ * Interface file for the growable contact buffer.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains the buffer the worlds write their contacts
+ * into each frame. Rather than dropping the contacts that don't fit,
+ * as a fixed array does, the buffer grows to take them, and keeps its
+ * room from frame to frame. It also counts how full it gets, so that
+ * it can be given the right size to start with.
+ */
+#ifndef CYCLONE_CONTACTBUFFER_H
+#define CYCLONE_CONTACTBUFFER_H
+
+#include <cstddef>
+#include <vector>
+
+namespace cyclone {
+
+    /**
+     * Holds the contacts generated in a frame, growing when it runs
+     * out of room. Contacts are added to the end of the buffer: a
+     * contact generator asks for room with reserve, writes into it,
+     * then reports how many it wrote with add.
+     *
+     * The contacts are kept in one array, so they can be handed
+     * straight to a resolver. This means growing the buffer moves
+     * them, and any pointers into the buffer must be fetched again
+     * after a call to reserve.
+     *
+     * The buffer never shrinks, so once it has grown to fit the
+     * busiest frame no more memory is allocated.
+     */
+    template<class ContactType>
+    class ContactBuffer
+    {
+        /** Holds the contacts, sized to the buffer's capacity. */
+        std::vector<ContactType> contacts;
+
+        /** Holds the number of contacts in use. */
+        unsigned count;
+
+        /**
+         * Holds the number of contacts in use when the buffer was
+         * last cleared, which is the most used in the last frame.
+         */
+        unsigned lastFrameHighWater;
+
+        /** Holds the most contacts in use at once in any frame. */
+        unsigned highWater;
+
+        /** Holds the number of times the buffer has grown. */
+        unsigned overflowCount;
+
+    public:
+        /**
+         * Creates a buffer with room for the given number of
+         * contacts.
+         */
+        ContactBuffer(unsigned capacity = 0)
+            : contacts(capacity), count(0),
+              lastFrameHighWater(0), highWater(0), overflowCount(0)
+        {
+        }
+
+        /**
+         * Empties the buffer, ready for a new frame. Its room is
+         * kept. Contacts are only added between clears, so the
+         * number in use now is the most the frame needed.
+         */
+        void clear()
+        {
+            lastFrameHighWater = count;
+            count = 0;
+        }
+
+        /**
+         * Makes sure there is room for at least the given number of
+         * contacts after the ones in use, and returns the first of
+         * them. The buffer grows to at least twice its size when it
+         * runs out of room, so it grows only a few times before it
+         * fits.
+         */
+        ContactType* reserve(unsigned space)
+        {
+            const static unsigned minimumCapacity = 64;
+
+            if (space > getSpace())
+            {
+                unsigned capacity = (unsigned)contacts.size() * 2;
+                if (capacity < count + space) capacity = count + space;
+                if (capacity < minimumCapacity) capacity = minimumCapacity;
+                contacts.resize(capacity);
+                overflowCount++;
+            }
+            return getContacts() + count;
+        }
+
+        /**
+         * Marks the given number of contacts after the ones in use as
+         * written. They must already have been reserved.
+         */
+        void add(unsigned added)
+        {
+            count += added;
+            if (count > highWater) highWater = count;
+        }
+
+        /** Returns the contacts in use, or NULL if there is no room. */
+        ContactType* getContacts()
+        {
+            return contacts.empty() ? NULL : &contacts[0];
+        }
+
+        /** Returns the contacts in use, or NULL if there is no room. */
+        const ContactType* getContacts() const
+        {
+            return contacts.empty() ? NULL : &contacts[0];
+        }
+
+        /** Returns the number of contacts in use. */
+        unsigned getCount() const
+        {
+            return count;
+        }
+
+        /** Returns the number of contacts the buffer has room for. */
+        unsigned getCapacity() const
+        {
+            return (unsigned)contacts.size();
+        }
+
+        /**
+         * Returns the number of contacts that can be added before
+         * the buffer has to grow.
+         */
+        unsigned getSpace() const
+        {
+            return (unsigned)contacts.size() - count;
+        }
+
+        /**
+         * Returns the most contacts that were in use in the last
+         * frame, that is, when the buffer was last cleared. The
+         * number in the frame under way is given by getCount.
+         */
+        unsigned getLastFrameHighWater() const
+        {
+            return lastFrameHighWater;
+        }
+
+        /**
+         * Returns the most contacts that have been in use at once in
+         * any frame since the statistics were last reset. Starting
+         * the buffer at this size avoids it growing.
+         */
+        unsigned getHighWater() const
+        {
+            return highWater;
+        }
+
+        /**
+         * Returns the number of times the buffer has run out of room
+         * and grown since the statistics were last reset.
+         */
+        unsigned getOverflowCount() const
+        {
+            return overflowCount;
+        }
+
+        /**
+         * Resets the all-time high water mark and the overflow count.
+         * The last frame's high water mark is kept.
+         */
+        void resetStatistics()
+        {
+            highWater = count;
+            overflowCount = 0;
+        }
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_CONTACTBUFFER_H
@@ -26,7 +26,9 @@
 #ifndef CYCLONE_CONTACTS_H
 #define CYCLONE_CONTACTS_H
 
+#include <vector>
 #include "body.h"
+#include "tasks.h"
 
 namespace cyclone {
 
@@ -100,6 +102,23 @@ namespace cyclone {
          */
         real penetration;
 
+        /**
+         * Identifies the features of the two bodies that are touching
+         * (such as the vertex of a box, or the axis two boxes are
+         * separated along), so the same contact can be recognised in
+         * the next frame. This is set to zero by setBodyData.
+         */
+        unsigned feature;
+
+        /**
+         * Holds the total impulse applied at this contact by the
+         * resolver, in contact coordinates. When the resolver is warm
+         * starting, whatever this holds at the start of resolution is
+         * applied before any other impulse: a ContactCache sets it
+         * from the previous frame.
+         */
+        Vector3 accumulatedImpulse;
+
         /**
          * Sets the data that doesn't normally depend on the position
          * of the contact (i.e. the bodies, and their material properties).
@@ -154,7 +173,9 @@ namespace cyclone {
         /**
          * Updates the awake state of rigid bodies that are taking
          * place in the given contact. A body will be made awake if it
-         * is in contact with a body that is awake.
+         * is in contact with a body that is awake. A body that can't
+         * move is never woken, so contacts that share only such a
+         * body can be resolved on different threads.
          */
         void matchAwakeState();
 
@@ -177,6 +198,12 @@ namespace cyclone {
          */
         void calculateContactBasis();
 
+        /**
+         * Returns true if the bodies are closing or separating slowly
+         * enough at this contact for it to be treated as resting.
+         */
+        bool isResting() const;
+
         /**
          * Applies an impulse to the given body, returning the
          * change in velocities.
@@ -184,6 +211,21 @@ namespace cyclone {
         void applyImpulse(const Vector3 &impulse, RigidBody *body,
                           Vector3 *velocityChange, Vector3 *rotationChange);
 
+        /**
+         * Applies the given impulse, in contact coordinates, to both
+         * bodies, returning the change in their velocities.
+         */
+        void applyContactImpulse(const Vector3 &impulseContact,
+                                 const Matrix3 inverseInertiaTensor[2],
+                                 Vector3 velocityChange[2],
+                                 Vector3 rotationChange[2]);
+
+        /**
+         * Applies the accumulated impulse carried over from the
+         * previous frame.
+         */
+        void applyWarmStart();
+
         /**
          * Performs an inertia-weighted impulse based resolution of this
          * contact alone.
@@ -268,6 +310,29 @@ namespace cyclone {
      */
     class ContactResolver
     {
+    public:
+        /**
+         * Identifies the algorithm used to resolve velocities.
+         */
+        enum VelocitySolver
+        {
+            /**
+             * Resolves the contact that needs the largest change in
+             * velocity, then the next largest, and so on, one at a
+             * time. This is the default.
+             */
+            VELOCITY_WORST_FIRST,
+
+            /**
+             * Splits the contacts into colours, where no two contacts
+             * of the same colour share a body that can move, then
+             * sweeps through the colours a fixed number of times.
+             * The contacts in each colour are independent, so they
+             * are resolved in parallel if an executor has been set.
+             */
+            VELOCITY_COLOURED
+        };
+
     protected:
         /**
          * Holds the number of iterations to perform when resolving
@@ -318,6 +383,156 @@ namespace cyclone {
          */
         bool validSettings;
 
+    protected:
+        /**
+         * @name Contact Adjacency
+         *
+         * Rather than scanning every contact after each resolution
+         * step, the resolver builds an index from each body to the
+         * contacts it takes part in at the start of each call. The
+         * index is stored in compressed rows: the contacts for body
+         * group g are bodyContacts[bodyContactStart[g]] up to (but
+         * not including) bodyContacts[bodyContactStart[g+1]], in
+         * increasing contact order. The arrays are kept between calls
+         * so their memory is reused from frame to frame.
+         */
+        /*@{*/
+
+        /**
+         * Holds the offset of each body group's contacts in the
+         * bodyContacts array, plus one final entry for the end.
+         */
+        std::vector<unsigned> bodyContactStart;
+
+        /**
+         * Holds the contact indices for every body group, one row
+         * after another.
+         */
+        std::vector<unsigned> bodyContacts;
+
+        /**
+         * Holds the body group of each of the two bodies in each
+         * contact, or noBodyGroup if the body is NULL.
+         */
+        std::vector<unsigned> contactBodyGroup;
+
+        /**
+         * Scratch array of (body, contact) pairs used to build the
+         * index.
+         */
+        std::vector< std::pair<RigidBody*, unsigned> > bodyContactPairs;
+
+        /*@}*/
+
+        /**
+         * @name Severity Heap
+         *
+         * An indexed binary max-heap of contacts, ordered by the
+         * quantity being resolved (penetration or desired delta
+         * velocity), with ties broken towards the lower contact
+         * index. This gives exactly the same choice of contact as a
+         * linear scan for the first maximum, but only contacts whose
+         * values change need to be re-sorted.
+         */
+        /*@{*/
+
+        /** Holds the contact indices in heap order. */
+        std::vector<unsigned> heap;
+
+        /** Holds the position of each contact in the heap. */
+        std::vector<unsigned> heapPosition;
+
+        /** Holds the sort key of each contact. */
+        std::vector<real> heapKey;
+
+        /*@}*/
+
+        /**
+         * Marks an unused body slot in contactBodyGroup.
+         */
+        static const unsigned noBodyGroup = 0xffffffff;
+
+        /**
+         * True if the impulses already in the contacts should be
+         * applied before velocity resolution starts.
+         */
+        bool warmStarting;
+
+        /**
+         * Holds whether each contact was resting when velocity
+         * resolution started. Only resting contacts are warm started,
+         * so the impulse of an impact is never applied twice.
+         */
+        std::vector<bool> contactResting;
+
+        /**
+         * Holds the algorithm used to resolve velocities.
+         */
+        VelocitySolver velocitySolver;
+
+        /**
+         * Holds the number of times the coloured solver sweeps
+         * through all the contacts.
+         */
+        unsigned velocitySweeps;
+
+        /**
+         * Holds the executor used by the coloured solver, or NULL to
+         * resolve every colour on the calling thread.
+         */
+        TaskExecutor *executor;
+
+        /**
+         * @name Contact Colouring
+         *
+         * The coloured solver groups the contacts so that no two
+         * contacts in a group share a body that can move. The
+         * contacts of colour k are colourContacts[colourStart[k]] up
+         * to (but not including) colourContacts[colourStart[k+1]],
+         * in increasing contact order.
+         */
+        /*@{*/
+
+        /** Holds the offset of each colour in colourContacts. */
+        std::vector<unsigned> colourStart;
+
+        /** Holds the contact indices, one colour after another. */
+        std::vector<unsigned> colourContacts;
+
+        /** Holds the colour of each contact. */
+        std::vector<unsigned> contactColour;
+
+        /**
+         * Holds, for each body group, a bit for each colour in the
+         * current block of 32 that already has a contact on that
+         * body.
+         */
+        std::vector<unsigned> groupColours;
+
+        /*@}*/
+
+        /**
+         * Marks a contact that has not been given a colour yet.
+         */
+        static const unsigned noColour = 0xffffffff;
+
+        /**
+         * The parallel task that resolves a range of the contacts
+         * in one colour.
+         */
+        struct ColourSolver : public ParallelTask
+        {
+            ContactResolver *resolver;
+            Contact *contacts;
+            const unsigned *indices;
+            real duration;
+
+            /** Counts the contacts that needed an impulse. */
+            std::atomic<unsigned> resolved;
+
+            virtual void run(unsigned begin, unsigned end);
+        };
+
     public:
         /**
          * Creates a new contact resolver with the given number of iterations
@@ -364,6 +579,39 @@ namespace cyclone {
         void setEpsilon(real velocityEpsilon,
                         real positionEpsilon);
 
+        /**
+         * Sets whether the resolver should warm start. When it does,
+         * the accumulatedImpulse of each resting contact is applied
+         * before velocity resolution, so every contact passed in must
+         * have it set (normally by a ContactCache). When it doesn't,
+         * the accumulated impulses are reset to zero.
+         */
+        void setWarmStarting(bool warmStarting);
+
+        /**
+         * Sets the algorithm used to resolve velocities. The sweeps
+         * are only used by the coloured solver, which ignores the
+         * number of velocity iterations.
+         */
+        void setVelocitySolver(VelocitySolver velocitySolver,
+                               unsigned sweeps=10);
+
+        /**
+         * Returns the algorithm used to resolve velocities.
+         */
+        VelocitySolver getVelocitySolver() const
+        {
+            return velocitySolver;
+        }
+
+        /**
+         * Sets the executor the coloured solver uses to resolve the
+         * contacts in each colour in parallel. The resolver does not
+         * take ownership of the executor. Passing NULL (the default)
+         * resolves everything on the calling thread.
+         */
+        void setExecutor(TaskExecutor *executor);
+
         /**
          * Resolves a set of contacts for both penetration and velocity.
          *
@@ -411,6 +659,38 @@ namespace cyclone {
             unsigned numContacts,
             real duration);
 
+        /**
+         * Resolves the velocity issues with the given array of
+         * constraints by sweeping through the contact colours. Each
+         * contact's closing velocity is worked out again from its
+         * bodies when it is reached, so contacts in the same colour
+         * never need to update each other.
+         */
+        void adjustVelocitiesColoured(Contact *contactArray,
+            unsigned numContacts,
+            real duration);
+
+        /**
+         * Splits the contacts into colours. This must be called after
+         * the contact adjacency has been built.
+         */
+        void buildContactColours(Contact *contactArray,
+            unsigned numContacts);
+
+        /**
+         * Works out the closing velocity of a single contact from its
+         * bodies, and applies an impulse if it needs one. Returns
+         * true if an impulse was applied.
+         */
+        bool resolveContactVelocity(Contact &contact, real duration);
+
+        /**
+         * Clears the accumulated impulse of every contact that was
+         * not resting, so impacts aren't carried into the next frame.
+         */
+        void discardImpacts(Contact *contactArray,
+            unsigned numContacts);
+
         /**
          * Resolves the positional issues with the given array of constraints,
          * using the given number of iterations.
@@ -418,6 +698,146 @@ namespace cyclone {
         void adjustPositions(Contact *contacts,
             unsigned numContacts,
             real duration);
+
+        /**
+         * Builds the body to contact index for the given contacts.
+         * This must be called after the contacts have been prepared,
+         * since preparation can swap the bodies in a contact.
+         */
+        void buildContactAdjacency(Contact *contactArray,
+            unsigned numContacts);
+
+        /**
+         * Applies the accumulated impulse of each resting contact,
+         * then works out the closing velocity of every contact again.
+         */
+        void warmStartContacts(Contact *contactArray,
+            unsigned numContacts,
+            real duration);
+
+        /**
+         * Fills the severity heap with the given keys, one per
+         * contact. Keys that do not exceed the given epsilon are
+         * treated as resolved and will never reach the top of the
+         * heap ahead of an unresolved contact.
+         */
+        void buildHeap(unsigned numContacts, real epsilon);
+
+        /**
+         * Changes the key of the given contact and restores the heap
+         * order.
+         */
+        void updateHeap(unsigned index, real key, real epsilon);
+
+    private:
+        /** Returns true if contact a should be resolved before b. */
+        bool heapBefore(unsigned a, unsigned b) const
+        {
+            return heapKey[a] > heapKey[b] ||
+                (heapKey[a] == heapKey[b] && a < b);
+        }
+
+        /** Moves the contact at the given heap position up. */
+        void siftUp(unsigned position);
+
+        /** Moves the contact at the given heap position down. */
+        void siftDown(unsigned position);
+    };
+
+    /**
+     * Remembers the impulses applied at contacts in one frame, so
+     * they can be used to warm start the same contacts in the next.
+     *
+     * Bodies resting on one another need about the same impulse at
+     * each contact every frame. Without a cache, the resolver has to
+     * build that impulse up again from nothing, which takes many
+     * iterations for a stack of bodies, and the stack jitters when
+     * it runs out. Contacts are matched by their bodies and feature,
+     * and by the contact point being close to where it was on the
+     * first body.
+     *
+     * Only the impulse along the contact normal is carried over. The
+     * resolver can't take back an impulse that turns out to be too
+     * large, and friction depends more on how the bodies happen to be
+     * moving this frame, so it is left for the resolver to work out.
+     *
+     * To use a cache, turn on warm starting in the resolver, then
+     * call load before resolving the contacts and store after.
+     */
+    class ContactCache
+    {
+    protected:
+        /**
+         * Holds the impulse applied at one contact.
+         */
+        struct Entry
+        {
+            RigidBody *body[2];
+            unsigned feature;
+
+            /** Holds the contact point, relative to the first body. */
+            Vector3 localPoint;
+
+            Vector3 contactNormal;
+
+            /** Holds the impulse along the contact normal. */
+            real impulse;
+        };
+
+        /**
+         * Holds the entries, sorted by their bodies and feature.
+         */
+        std::vector<Entry> entries;
+
+        /**
+         * Holds the proportion of the previous impulse that is used
+         * to warm start each contact.
+         */
+        real warmStartFactor;
+
+        /**
+         * Holds how far a contact point can move on the first body
+         * between frames and still match.
+         */
+        real matchDistance;
+
+        /** Returns true if entry a sorts before entry b. */
+        static bool entryBefore(const Entry &a, const Entry &b);
+
+    public:
+        /**
+         * Creates a new empty cache, with the given proportion of the
+         * previous impulse used to warm start each contact, and the
+         * given distance a contact can move and still match.
+         */
+        ContactCache(real warmStartFactor = (real)1.0,
+                     real matchDistance = (real)0.1);
+
+        /**
+         * Sets the accumulated impulse of each of the given contacts
+         * from the matching contact stored last frame, or to zero if
+         * there is none.
+         */
+        void load(Contact *contactArray, unsigned numContacts) const;
+
+        /**
+         * Replaces the stored contacts with the given resolved
+         * contacts.
+         */
+        void store(const Contact *contactArray, unsigned numContacts);
+
+        /**
+         * Forgets all the stored contacts.
+         */
+        void clear();
+
+        /**
+         * Returns the number of contacts stored.
+         */
+        unsigned getSize() const
+        {
+            return (unsigned)entries.size();
+        }
     };
 
     /**
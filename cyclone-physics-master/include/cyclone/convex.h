@@ -0,0 +1,214 @@
+/*
+ * Interface file for convex hull primitives and the general convex
+ * collision tests.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains the convex hull primitive, and the tests that
+ * work on any pair of convex primitives: the GJK algorithm for the
+ * distance between two shapes, and the expanding polytope algorithm
+ * (EPA) for how far two shapes overlap.
+ *
+ * Both algorithms see a shape only through its support function,
+ * which gives the point of the shape furthest along a direction. A
+ * sphere is handled as a point with a margin (its radius) around
+ * it, and a capsule as a segment with a margin, which keeps the
+ * tests exact for round shapes.
+ */
+#ifndef CYCLONE_CONVEX_H
+#define CYCLONE_CONVEX_H
+
+#include <vector>
+#include "collide_fine.h"
+
+namespace cyclone {
+
+    /**
+     * Represents a rigid body that can be treated as the convex hull
+     * of a set of points for collision detection.
+     *
+     * The hull is built once, from points given in the primitive's
+     * own coordinates, by setVertices. Points inside the hull are
+     * dropped. Each vertex keeps a list of its neighbours along the
+     * edges of the hull, so the vertex furthest in a direction can be
+     * found by walking uphill from a nearby vertex rather than by
+     * checking every vertex. Each face keeps its plane and its
+     * vertices in order, which the collision detector uses to build
+     * a manifold of contacts when two hulls rest on each other.
+     */
+    class CollisionConvex : public CollisionPrimitive
+    {
+    protected:
+        /** Holds the vertices of the hull, in its own coordinates. */
+        std::vector<Vector3> vertices;
+
+        /**
+         * Holds the neighbours of each vertex: those of vertex i are
+         * held from neighbourStart[i] up to neighbourStart[i+1].
+         */
+        std::vector<unsigned> neighbours;
+        std::vector<unsigned> neighbourStart;
+
+        /** Holds the outward unit normal of each face. */
+        std::vector<Vector3> faceNormals;
+
+        /** Holds the distance of each face's plane from the origin. */
+        std::vector<real> faceOffsets;
+
+        /**
+         * Holds the vertices of each face, in anticlockwise order
+         * when seen from outside: those of face i are held from
+         * faceStart[i] up to faceStart[i+1].
+         */
+        std::vector<unsigned> faceVertices;
+        std::vector<unsigned> faceStart;
+
+    public:
+        /**
+         * Hulls with at least this many vertices find their support
+         * points by walking uphill. Smaller hulls check every vertex,
+         * which is quicker for so few.
+         */
+        static const unsigned hillClimbVertices = 16;
+
+        CollisionConvex();
+
+        /**
+         * Builds the hull of the given points, which are in the
+         * primitive's own coordinates. Returns false, leaving the
+         * hull empty, if the points do not enclose any volume.
+         */
+        bool setVertices(const Vector3 *points, unsigned count);
+
+        /** Returns the number of vertices of the hull. */
+        unsigned getVertexCount() const
+        {
+            return (unsigned)vertices.size();
+        }
+
+        /** Returns the given vertex, in the hull's own coordinates. */
+        const Vector3& getVertex(unsigned index) const
+        {
+            return vertices[index];
+        }
+
+        /** Returns the number of faces of the hull. */
+        unsigned getFaceCount() const
+        {
+            return (unsigned)faceNormals.size();
+        }
+
+        /**
+         * Returns the number of vertices of the given face.
+         */
+        unsigned getFaceVertexCount(unsigned face) const
+        {
+            return faceStart[face+1] - faceStart[face];
+        }
+
+        /**
+         * Returns the index of the given vertex of the given face.
+         */
+        unsigned getFaceVertex(unsigned face, unsigned index) const
+        {
+            return faceVertices[faceStart[face] + index];
+        }
+
+        /**
+         * Returns the outward normal of the given face, in the
+         * hull's own coordinates.
+         */
+        const Vector3& getFaceNormal(unsigned face) const
+        {
+            return faceNormals[face];
+        }
+
+        /**
+         * Returns the distance of the plane of the given face from
+         * the hull's origin.
+         */
+        real getFaceOffset(unsigned face) const
+        {
+            return faceOffsets[face];
+        }
+
+        /**
+         * Returns the index of the vertex furthest along the given
+         * direction, which is in the hull's own coordinates. Large
+         * hulls walk uphill from the given starting vertex, so
+         * passing the result of a query in a similar direction makes
+         * the walk short.
+         */
+        unsigned getSupportVertex(const Vector3 &direction,
+                                  unsigned start = 0) const;
+
+        /**
+         * Returns the index of the face whose normal is closest to
+         * the given direction, which is in the hull's own coordinates.
+         */
+        unsigned getSupportFace(const Vector3 &direction) const;
+
+        virtual BoundingBox getBoundingBox() const;
+    };
+
+    /**
+     * A wrapper class that holds the general tests between any two
+     * convex primitives: spheres, boxes, capsules and hulls.
+     */
+    class ConvexTests
+    {
+    public:
+        /**
+         * Finds the distance between two primitives with the GJK
+         * algorithm, writing the closest point of each into the
+         * given vectors (either of which may be NULL). Returns zero,
+         * and leaves the points unset, if the primitives overlap.
+         * Primitives less than a millionth of a unit apart count as
+         * touching.
+         */
+        static real distance(
+            const CollisionPrimitive &one,
+            const CollisionPrimitive &two,
+            Vector3 *pointOne = NULL,
+            Vector3 *pointTwo = NULL);
+
+        /**
+         * Checks if two primitives overlap.
+         */
+        static bool intersect(
+            const CollisionPrimitive &one,
+            const CollisionPrimitive &two);
+
+        /**
+         * Finds how two primitives touch or overlap. If they are
+         * closer than the given tolerance, the unit normal pointing
+         * from the first towards the second, the depth they overlap
+         * by (negative for a gap), and a point on the surface of each
+         * are written out, and true is returned.
+         *
+         * Shapes that overlap are separated with the expanding
+         * polytope algorithm, seeded by the simplex GJK finds.
+         */
+        static bool penetration(
+            const CollisionPrimitive &one,
+            const CollisionPrimitive &two,
+            real tolerance,
+            Vector3 *normal,
+            real *depth,
+            Vector3 *pointOne,
+            Vector3 *pointTwo);
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_CONVEX_H
@@ -98,6 +98,7 @@
 #define CYCLONE_CORE_H
 
 #include "precision.h"
+#include "simd.h"
 
 /**
  * The cyclone namespace includes all cyclone functions and
@@ -147,13 +148,14 @@ namespace cyclone {
 
     /**
      * Holds a vector in 3 dimensions. Four data members are allocated
-     * to ensure alignment in an array.
+     * to ensure alignment in an array, and so the vector can be
+     * worked on as a quad by the vector instructions.
      *
      * @note This class contains a lot of inline methods for basic
      * mathematics. The implementations are included in the header
      * file.
      */
-    class Vector3
+    class CYCLONE_QUAD_ALIGN Vector3
     {
     public:
          /** Holds the value along the x axis. */
@@ -166,19 +168,40 @@ namespace cyclone {
         real z;
 
     private:
-        /** Padding to ensure 4 word alignment. */
+        /**
+         * Padding to ensure 4 word alignment. This is kept at zero,
+         * so that it holds a harmless value when the vector is
+         * worked on as a quad.
+         */
         real pad;
 
     public:
         /** The default constructor creates a zero vector. */
-        Vector3() : x(0), y(0), z(0) {}
+        Vector3() : x(0), y(0), z(0), pad(0) {}
 
         /**
          * The explicit constructor creates a vector with the given
          * components.
          */
         Vector3(const real x, const real y, const real z)
-            : x(x), y(y), z(z) {}
+            : x(x), y(y), z(z), pad(0) {}
+
+#ifdef CYCLONE_SIMD
+        /**
+         * Creates a vector from a quad. The fourth component of the
+         * quad becomes the padding, so should be zero.
+         */
+        explicit Vector3(const Quad &quad)
+        {
+            quadStore(&x, quad);
+        }
+
+        /** Returns the vector, with its padding, as a quad. */
+        Quad toQuad() const
+        {
+            return quadLoad(&x);
+        }
+#endif
 
         const static Vector3 GRAVITY;
         const static Vector3 HIGH_GRAVITY;
@@ -209,9 +232,13 @@ namespace cyclone {
         /** Adds the given vector to this. */
         void operator+=(const Vector3& v)
         {
+#ifdef CYCLONE_SIMD
+            *this = Vector3(quadAdd(toQuad(), v.toQuad()));
+#else
             x += v.x;
             y += v.y;
             z += v.z;
+#endif
         }
 
         /**
@@ -219,15 +246,23 @@ namespace cyclone {
          */
         Vector3 operator+(const Vector3& v) const
         {
+#ifdef CYCLONE_SIMD
+            return Vector3(quadAdd(toQuad(), v.toQuad()));
+#else
             return Vector3(x+v.x, y+v.y, z+v.z);
+#endif
         }
 
         /** Subtracts the given vector from this. */
         void operator-=(const Vector3& v)
         {
+#ifdef CYCLONE_SIMD
+            *this = Vector3(quadSub(toQuad(), v.toQuad()));
+#else
             x -= v.x;
             y -= v.y;
             z -= v.z;
+#endif
         }
 
         /**
@@ -235,21 +270,33 @@ namespace cyclone {
          */
         Vector3 operator-(const Vector3& v) const
         {
+#ifdef CYCLONE_SIMD
+            return Vector3(quadSub(toQuad(), v.toQuad()));
+#else
             return Vector3(x-v.x, y-v.y, z-v.z);
+#endif
         }
 
         /** Multiplies this vector by the given scalar. */
         void operator*=(const real value)
         {
+#ifdef CYCLONE_SIMD
+            *this = Vector3(quadMul(toQuad(), quadSplat(value)));
+#else
             x *= value;
             y *= value;
             z *= value;
+#endif
         }
 
         /** Returns a copy of this vector scaled the given value. */
         Vector3 operator*(const real value) const
         {
+#ifdef CYCLONE_SIMD
+            return Vector3(quadMul(toQuad(), quadSplat(value)));
+#else
             return Vector3(x*value, y*value, z*value);
+#endif
         }
 
         /**
@@ -258,7 +305,11 @@ namespace cyclone {
          */
         Vector3 componentProduct(const Vector3 &vector) const
         {
+#ifdef CYCLONE_SIMD
+            return Vector3(quadMul(toQuad(), vector.toQuad()));
+#else
             return Vector3(x * vector.x, y * vector.y, z * vector.z);
+#endif
         }
 
         /**
@@ -267,9 +318,13 @@ namespace cyclone {
          */
         void componentProductUpdate(const Vector3 &vector)
         {
+#ifdef CYCLONE_SIMD
+            *this = Vector3(quadMul(toQuad(), vector.toQuad()));
+#else
             x *= vector.x;
             y *= vector.y;
             z *= vector.z;
+#endif
         }
 
         /**
@@ -278,9 +333,13 @@ namespace cyclone {
          */
         Vector3 vectorProduct(const Vector3 &vector) const
         {
+#ifdef CYCLONE_SIMD
+            return Vector3(quadCross(toQuad(), vector.toQuad()));
+#else
             return Vector3(y*vector.z-z*vector.y,
                            z*vector.x-x*vector.z,
                            x*vector.y-y*vector.x);
+#endif
         }
 
         /**
@@ -298,9 +357,13 @@ namespace cyclone {
          */
         Vector3 operator%(const Vector3 &vector) const
         {
+#ifdef CYCLONE_SIMD
+            return Vector3(quadCross(toQuad(), vector.toQuad()));
+#else
             return Vector3(y*vector.z-z*vector.y,
                            z*vector.x-x*vector.z,
                            x*vector.y-y*vector.x);
+#endif
         }
 
         /**
@@ -309,7 +372,11 @@ namespace cyclone {
          */
         real scalarProduct(const Vector3 &vector) const
         {
+#ifdef CYCLONE_SIMD
+            return quadSum3(quadMul(toQuad(), vector.toQuad()));
+#else
             return x*vector.x + y*vector.y + z*vector.z;
+#endif
         }
 
         /**
@@ -318,7 +385,11 @@ namespace cyclone {
          */
         real operator *(const Vector3 &vector) const
         {
+#ifdef CYCLONE_SIMD
+            return quadSum3(quadMul(toQuad(), vector.toQuad()));
+#else
             return x*vector.x + y*vector.y + z*vector.z;
+#endif
         }
 
         /**
@@ -326,21 +397,30 @@ namespace cyclone {
          */
         void addScaledVector(const Vector3& vector, real scale)
         {
+#ifdef CYCLONE_SIMD
+            *this = Vector3(quadAdd(toQuad(),
+                quadMul(vector.toQuad(), quadSplat(scale))));
+#else
             x += vector.x * scale;
             y += vector.y * scale;
             z += vector.z * scale;
+#endif
         }
 
         /** Gets the magnitude of this vector. */
         real magnitude() const
         {
-            return real_sqrt(x*x+y*y+z*z);
+            return real_sqrt(squareMagnitude());
         }
 
         /** Gets the squared magnitude of this vector. */
         real squareMagnitude() const
         {
+#ifdef CYCLONE_SIMD
+            return quadSum3(quadMul(toQuad(), toQuad()));
+#else
             return x*x+y*y+z*z;
+#endif
         }
 
         /** Limits the size of the vector to the given maximum. */
@@ -468,7 +548,7 @@ namespace cyclone {
      * represented as vectors. Quaternions are only needed for
      * orientation.
      */
-    class Quaternion
+    class CYCLONE_QUAD_ALIGN Quaternion
     {
     public:
         union {
@@ -546,6 +626,20 @@ namespace cyclone {
          */
         void normalise()
         {
+#ifdef CYCLONE_SIMD
+            Quad q = quadLoad(data);
+            real d = quadSum4(quadMul(q, q));
+
+            // Check for zero length quaternion, and use the no-rotation
+            // quaternion in that case.
+            if (d < real_epsilon) {
+                r = 1;
+                return;
+            }
+
+            d = ((real)1.0)/real_sqrt(d);
+            quadStore(data, quadMul(q, quadSplat(d)));
+#else
             real d = r*r+i*i+j*j+k*k;
 
             // Check for zero length quaternion, and use the no-rotation
@@ -560,6 +654,7 @@ namespace cyclone {
             i *= d;
             j *= d;
             k *= d;
+#endif
         }
 
         /**
@@ -569,6 +664,10 @@ namespace cyclone {
          */
         void operator *=(const Quaternion &multiplier)
         {
+#ifdef CYCLONE_SIMD
+            quadStore(data, quadQuaternionProduct(
+                quadLoad(data), quadLoad(multiplier.data)));
+#else
             Quaternion q = *this;
             r = q.r*multiplier.r - q.i*multiplier.i -
                 q.j*multiplier.j - q.k*multiplier.k;
@@ -578,6 +677,7 @@ namespace cyclone {
                 q.k*multiplier.i - q.i*multiplier.k;
             k = q.r*multiplier.k + q.k*multiplier.r +
                 q.i*multiplier.j - q.j*multiplier.i;
+#endif
         }
 
         /**
@@ -591,6 +691,14 @@ namespace cyclone {
          */
         void addScaledVector(const Vector3& vector, real scale)
         {
+#ifdef CYCLONE_SIMD
+            Quad current = quadLoad(data);
+            Quad q = quadQuaternionProduct(
+                quadShiftUp(quadMul(vector.toQuad(), quadSplat(scale))),
+                current);
+            quadStore(data, quadAdd(current,
+                quadMul(q, quadSplat((real)0.5))));
+#else
             Quaternion q(0,
                 vector.x * scale,
                 vector.y * scale,
@@ -600,6 +708,7 @@ namespace cyclone {
             i += q.i * ((real)0.5);
             j += q.j * ((real)0.5);
             k += q.k * ((real)0.5);
+#endif
         }
 
         void rotateByVector(const Vector3& vector)
@@ -614,7 +723,7 @@ namespace cyclone {
      * a position. The matrix has 12 elements, it is assumed that the
      * remaining four are (0,0,0,1); producing a homogenous matrix.
      */
-    class Matrix4
+    class CYCLONE_QUAD_ALIGN Matrix4
     {
     public:
         /**
@@ -652,6 +761,21 @@ namespace cyclone {
         Matrix4 operator*(const Matrix4 &o) const
         {
             Matrix4 result;
+#ifdef CYCLONE_SIMD
+            // Each row of the result combines the rows of o. Adding
+            // negative zero leaves the rotation columns untouched,
+            // while the last column picks up this matrix's position.
+            Quad r0 = quadLoad(o.data);
+            Quad r1 = quadLoad(o.data+4);
+            Quad r2 = quadLoad(o.data+8);
+            for (unsigned row = 0; row < 12; row += 4)
+            {
+                quadStore(result.data+row, quadAdd(
+                    quadCombine(data[row], r0, data[row+1], r1,
+                                data[row+2], r2),
+                    quadSet(-0.0, -0.0, -0.0, data[row+3])));
+            }
+#else
             result.data[0] = (o.data[0]*data[0]) + (o.data[4]*data[1]) + (o.data[8]*data[2]);
             result.data[4] = (o.data[0]*data[4]) + (o.data[4]*data[5]) + (o.data[8]*data[6]);
             result.data[8] = (o.data[0]*data[8]) + (o.data[4]*data[9]) + (o.data[8]*data[10]);
@@ -667,6 +791,7 @@ namespace cyclone {
             result.data[3] = (o.data[3]*data[0]) + (o.data[7]*data[1]) + (o.data[11]*data[2]) + data[3];
             result.data[7] = (o.data[3]*data[4]) + (o.data[7]*data[5]) + (o.data[11]*data[6]) + data[7];
             result.data[11] = (o.data[3]*data[8]) + (o.data[7]*data[9]) + (o.data[11]*data[10]) + data[11];
+#endif
 
             return result;
         }
@@ -678,6 +803,15 @@ namespace cyclone {
          */
         Vector3 operator*(const Vector3 &vector) const
         {
+#ifdef CYCLONE_SIMD
+            Quad c0 = quadLoad(data);
+            Quad c1 = quadLoad(data+4);
+            Quad c2 = quadLoad(data+8);
+            Quad c3 = quadSplat(0);
+            quadTranspose(c0, c1, c2, c3);
+            return Vector3(quadAdd(
+                quadCombine(vector.x, c0, vector.y, c1, vector.z, c2), c3));
+#else
             return Vector3(
                 vector.x * data[0] +
                 vector.y * data[1] +
@@ -691,6 +825,7 @@ namespace cyclone {
                 vector.y * data[9] +
                 vector.z * data[10] + data[11]
             );
+#endif
         }
 
         /**
@@ -741,6 +876,15 @@ namespace cyclone {
          */
         Vector3 transformDirection(const Vector3 &vector) const
         {
+#ifdef CYCLONE_SIMD
+            Quad c0 = quadLoad(data);
+            Quad c1 = quadLoad(data+4);
+            Quad c2 = quadLoad(data+8);
+            Quad c3 = quadSplat(0);
+            quadTranspose(c0, c1, c2, c3);
+            return Vector3(
+                quadCombine(vector.x, c0, vector.y, c1, vector.z, c2));
+#else
             return Vector3(
                 vector.x * data[0] +
                 vector.y * data[1] +
@@ -754,6 +898,7 @@ namespace cyclone {
                 vector.y * data[9] +
                 vector.z * data[10]
             );
+#endif
         }
 
         /**
@@ -774,6 +919,12 @@ namespace cyclone {
          */
         Vector3 transformInverseDirection(const Vector3 &vector) const
         {
+#ifdef CYCLONE_SIMD
+            return Vector3(quadCombine(
+                vector.x, quadLoad3(data),
+                vector.y, quadLoad3(data+4),
+                vector.z, quadLoad3(data+8)));
+#else
             return Vector3(
                 vector.x * data[0] +
                 vector.y * data[4] +
@@ -787,6 +938,7 @@ namespace cyclone {
                 vector.y * data[6] +
                 vector.z * data[10]
             );
+#endif
         }
 
         /**
@@ -808,6 +960,9 @@ namespace cyclone {
             tmp.x -= data[3];
             tmp.y -= data[7];
             tmp.z -= data[11];
+#ifdef CYCLONE_SIMD
+            return transformInverseDirection(tmp);
+#else
             return Vector3(
                 tmp.x * data[0] +
                 tmp.y * data[4] +
@@ -821,6 +976,7 @@ namespace cyclone {
                 tmp.y * data[6] +
                 tmp.z * data[10]
             );
+#endif
         }
 
         /**
@@ -971,6 +1127,35 @@ namespace cyclone {
                 0.3f*mass*(squares.x + squares.y));
         }
 
+        /**
+         * Sets the value of the matrix as an inertia tensor of a
+         * solid capsule lying along the body's Y axis, with the given
+         * radius, half the length of its cylinder and mass. The mass
+         * is shared between the cylinder and the two half-sphere caps
+         * by their volumes.
+         */
+        void setCapsuleInertiaTensor(real radius, real halfHeight, real mass)
+        {
+            real squareRadius = radius * radius;
+            real height = halfHeight * 2;
+            real cylinderVolume = height * squareRadius;
+            real capVolume = ((real)4.0 / (real)3.0) * squareRadius * radius;
+            real cylinderMass = mass * cylinderVolume /
+                (cylinderVolume + capVolume);
+            real capMass = mass - cylinderMass;
+
+            // Each cap's centre of mass is 3/8 of the radius out from
+            // the end of the cylinder.
+            real axial = cylinderMass * squareRadius * (real)0.5 +
+                capMass * squareRadius * (real)0.4;
+            real across = cylinderMass *
+                (height * height / (real)12.0 + squareRadius * (real)0.25) +
+                capMass * (squareRadius * (real)0.4 +
+                           height * height * (real)0.25 +
+                           height * radius * (real)0.375);
+            setInertiaTensorCoeffs(across, axial, across);
+        }
+
         /**
          * Sets the matrix to be a skew symmetric matrix based on
          * the given vector. The skew symmetric matrix is the equivalent
@@ -1014,11 +1199,21 @@ namespace cyclone {
          */
         Vector3 operator*(const Vector3 &vector) const
         {
+#ifdef CYCLONE_SIMD
+            Quad c0 = quadLoad3(data);
+            Quad c1 = quadLoad3(data+3);
+            Quad c2 = quadLoad3(data+6);
+            Quad c3 = quadSplat(0);
+            quadTranspose(c0, c1, c2, c3);
+            return Vector3(
+                quadCombine(vector.x, c0, vector.y, c1, vector.z, c2));
+#else
             return Vector3(
                 vector.x * data[0] + vector.y * data[1] + vector.z * data[2],
                 vector.x * data[3] + vector.y * data[4] + vector.z * data[5],
                 vector.x * data[6] + vector.y * data[7] + vector.z * data[8]
             );
+#endif
         }
 
         /**
@@ -1038,11 +1233,18 @@ namespace cyclone {
          */
         Vector3 transformTranspose(const Vector3 &vector) const
         {
+#ifdef CYCLONE_SIMD
+            return Vector3(quadCombine(
+                vector.x, quadLoad3(data),
+                vector.y, quadLoad3(data+3),
+                vector.z, quadLoad3(data+6)));
+#else
             return Vector3(
                 vector.x * data[0] + vector.y * data[3] + vector.z * data[6],
                 vector.x * data[1] + vector.y * data[4] + vector.z * data[7],
                 vector.x * data[2] + vector.y * data[5] + vector.z * data[8]
             );
+#endif
         }
 
         /**
@@ -1168,6 +1370,18 @@ namespace cyclone {
          */
         void operator*=(const Matrix3 &o)
         {
+#ifdef CYCLONE_SIMD
+            // Each row of the result only needs the same row of this
+            // matrix, so the rows can be replaced one at a time.
+            Quad r0 = quadLoad3(o.data);
+            Quad r1 = quadLoad3(o.data+3);
+            Quad r2 = quadLoad3(o.data+6);
+            for (unsigned row = 0; row < 9; row += 3)
+            {
+                quadStore3(data+row, quadCombine(
+                    data[row], r0, data[row+1], r1, data[row+2], r2));
+            }
+#else
             real t1;
             real t2;
             real t3;
@@ -1192,6 +1406,7 @@ namespace cyclone {
             data[6] = t1;
             data[7] = t2;
             data[8] = t3;
+#endif
         }
 
         /**
@@ -16,7 +16,15 @@
 #include "body.h"
 #include "pcontacts.h"
 #include "pworld.h"
+#include "pgrid.h"
 #include "collide_fine.h"
+#include "convex.h"
+#include "trimesh.h"
+#include "heightfield.h"
+#include "capsule.h"
 #include "contacts.h"
+#include "contactbuffer.h"
 #include "fgen.h"
-#include "joints.h"
\ No newline at end of file
+#include "joints.h"
+#include "tasks.h"
+#include "query.h"
\ No newline at end of file
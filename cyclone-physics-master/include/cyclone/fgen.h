@@ -418,9 +418,42 @@ namespace cyclone {
 
     /**
     * Holds all the force generators and the bodies they apply to.
+    *
+    * The registrations are kept in buckets, one for each of the
+    * generator types the registry knows, and the generators of each
+    * type are run together, calling them directly rather than through
+    * the virtual function. Generators of any other type, including
+    * classes derived from the ones here, are called through the
+    * virtual function after the rest. A body's forces are added up
+    * bucket by bucket, in registration order within each bucket.
     */
     class ForceRegistry
     {
+    public:
+
+        /**
+        * The types of force generator the registry calls directly.
+        * Generators are sorted into them by their exact type.
+        */
+        enum GeneratorType
+        {
+            GENERATOR_GRAVITY,
+            GENERATOR_SPRING,
+            GENERATOR_AERO,
+            GENERATOR_AERO_CONTROL,
+            GENERATOR_BUOYANCY,
+
+            /** Any other generator, called through the virtual function. */
+            GENERATOR_OTHER,
+
+            GENERATOR_TYPE_COUNT
+        };
+
+        /**
+        * Returns the bucket the given generator is registered in.
+        */
+        static GeneratorType getGeneratorType(const ForceGenerator *fg);
+
     protected:
 
         /**
@@ -434,10 +467,10 @@ namespace cyclone {
         };
 
         /**
-        * Holds the list of registrations.
+        * Holds the list of registrations for each type of generator.
         */
         typedef std::vector<ForceRegistration> Registry;
-        Registry registrations;
+        Registry registrations[GENERATOR_TYPE_COUNT];
 
     public:
         /**
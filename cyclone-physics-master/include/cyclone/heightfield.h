@@ -0,0 +1,188 @@
+/*
+ * Interface file for heightfield primitives.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains the heightfield primitive, used for outdoor
+ * terrain.
+ *
+ * A heightfield is a regular grid of heights. The cell under any
+ * point is found directly from its position, so the collision
+ * detector only looks at the cells under the object being tested,
+ * without the tree a triangle mesh needs. The heights can be stored
+ * as 16 bit values, which makes a large terrain a quarter of the
+ * size.
+ */
+#ifndef CYCLONE_HEIGHTFIELD_H
+#define CYCLONE_HEIGHTFIELD_H
+
+#include <vector>
+#include "collide_fine.h"
+
+namespace cyclone {
+
+    /**
+     * Represents terrain made of a regular grid of heights for
+     * collision detection.
+     *
+     * In the heightfield's own coordinates the grid lies in the XZ
+     * plane, starting at the origin, and the heights are along Y.
+     * The samples are held a row at a time: the sample in the given
+     * column and row is at X = column * columnSpacing and Z = row *
+     * rowSpacing. Each cell between four samples is split into two
+     * triangles across the diagonal from its corner at the next
+     * column to its corner at the next row. Triangle 2i and 2i+1 are
+     * the two halves of cell i, counting the cells a row at a time.
+     *
+     * Like a triangle mesh, a heightfield would usually have no body,
+     * and its triangles only push objects up out of the terrain.
+     * Spheres and boxes collide with heightfields, and single points,
+     * such as wheels, can be tested with
+     * CollisionDetector::pointAndHeightfield.
+     */
+    class CollisionHeightfield : public TriangleSurface
+    {
+    protected:
+        /** Holds the number of samples along X and along Z. */
+        unsigned columns;
+        unsigned rows;
+
+        /** Holds the distance between samples along X and along Z. */
+        real columnSpacing;
+        real rowSpacing;
+
+        /** Holds the heights, if they are not quantised. */
+        std::vector<real> heights;
+
+        /**
+         * Holds the heights, if they are quantised, as steps of
+         * heightScale above heightOffset.
+         */
+        std::vector<unsigned short> quantisedHeights;
+        real heightOffset;
+        real heightScale;
+
+        /** Hold the lowest and highest of the heights. */
+        real minHeight;
+        real maxHeight;
+
+        /**
+         * Sets the size of the grid, ready for its heights to be
+         * filled in.
+         */
+        void setGrid(unsigned columns, unsigned rows,
+                     real columnSpacing, real rowSpacing);
+
+        /**
+         * Finds the cell holding the given position in the grid,
+         * clamping it to the grid, and the fraction of the way across
+         * the cell the position is.
+         */
+        void findCell(real x, real z,
+                      unsigned *column, unsigned *row,
+                      real *u, real *v) const;
+
+    public:
+        CollisionHeightfield();
+
+        /**
+         * Sets the heights from the given samples, a row at a time.
+         * If quantise is set, they are stored as 16 bit steps between
+         * the lowest and highest of them, which is accurate to one
+         * part in 65535 of the difference.
+         */
+        void setHeights(unsigned columns, unsigned rows,
+                        real columnSpacing, real rowSpacing,
+                        const real *heights,
+                        bool quantise = false);
+
+        /**
+         * Sets the heights from samples already quantised, a row at a
+         * time: each height is heightOffset + heightScale * sample.
+         */
+        void setQuantisedHeights(unsigned columns, unsigned rows,
+                                 real columnSpacing, real rowSpacing,
+                                 const unsigned short *samples,
+                                 real heightOffset, real heightScale);
+
+        unsigned getColumns() const
+        {
+            return columns;
+        }
+
+        unsigned getRows() const
+        {
+            return rows;
+        }
+
+        /** Returns true if the heights are stored as 16 bit values. */
+        bool isQuantised() const
+        {
+            return !quantisedHeights.empty();
+        }
+
+        /** Returns the height of the given sample. */
+        real getSample(unsigned column, unsigned row) const
+        {
+            unsigned index = row * columns + column;
+            if (isQuantised())
+            {
+                return heightOffset + heightScale * quantisedHeights[index];
+            }
+            return heights[index];
+        }
+
+        /** Returns the number of triangles in the grid. */
+        unsigned getTriangleCount() const
+        {
+            if (columns < 2 || rows < 2) return 0;
+            return (columns - 1) * (rows - 1) * 2;
+        }
+
+        /**
+         * Finds the height of the surface above the given point in
+         * the heightfield's own coordinates. If the point is over the
+         * grid, the height is written out, along with the upward unit
+         * normal of the triangle under it and its index if they are
+         * asked for, and true is returned.
+         */
+        bool getHeight(real x, real z, real *height,
+                       Vector3 *normal = NULL,
+                       unsigned *triangle = NULL) const;
+
+        virtual BoundingBox getBoundingBox() const;
+
+        virtual void getTriangle(unsigned triangle, Vector3 *corners) const;
+
+        /**
+         * Reports the triangles of the cells under the given box,
+         * skipping those wholly above or below it.
+         */
+        virtual void findTriangles(const BoundingBox &box,
+                                   TriangleCallback *callback) const;
+
+        /**
+         * Walks along the cells under the ray in order, so only the
+         * triangles of those cells are tested, and stops at the first
+         * cell the ray hits.
+         */
+        virtual bool raycastTriangles(const Vector3 &origin,
+                                      const Vector3 &direction,
+                                      real maxDistance,
+                                      unsigned *triangle,
+                                      real *distance) const;
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_HEIGHTFIELD_H
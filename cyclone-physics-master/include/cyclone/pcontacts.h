@@ -137,6 +137,15 @@ namespace cyclone {
          */
         void setIterations(unsigned iterations);
 
+        /**
+         * Returns the number of iterations used in the last call to
+         * resolve contacts.
+         */
+        unsigned getIterationsUsed() const
+        {
+            return iterationsUsed;
+        }
+
         /**
          * Resolves a set of particle contacts for both penetration
          * and velocity.
@@ -20,6 +20,7 @@
 
 #include "core.h"
 #include "particle.h"
+#include "tasks.h"
 #include <vector>
 
 namespace cyclone {
@@ -241,11 +242,130 @@ namespace cyclone {
         virtual void updateForce(Particle *particle, real duration);
     };
 
+    /**
+     * A force generator that acts between a pair of particles,
+     * giving them equal and opposite forces. One instance can be used
+     * for any number of pairs.
+     *
+     * A spring registered as a pair has its force worked out once,
+     * where a ParticleSpring at each end works it out twice. Pairs are
+     * registered with ParticleForceRegistry::addPair.
+     */
+    class ParticlePairForceGenerator
+    {
+    public:
+        /**
+         * Overload this in implementations of the interface to return
+         * the force on the first particle of the pair. The second
+         * particle is given the opposite force. This may be called
+         * for different pairs at the same time on different threads.
+         */
+        virtual Vector3 calculateForce(const Particle *first,
+                                       const Particle *second,
+                                       real duration) = 0;
+    };
+
+    /**
+     * A force generator that joins pairs of particles with a spring.
+     */
+    class ParticlePairSpring : public ParticlePairForceGenerator
+    {
+        /** Holds the spring constant. */
+        real springConstant;
+
+        /** Holds the rest length of the spring. */
+        real restLength;
+
+    public:
+
+        /** Creates a new spring with the given parameters. */
+        ParticlePairSpring(real springConstant, real restLength);
+
+        /** Returns the spring force on the first particle. */
+        virtual Vector3 calculateForce(const Particle *first,
+                                       const Particle *second,
+                                       real duration);
+    };
+
+    /**
+     * A force generator that joins pairs of particles with a spring
+     * that only pulls them together when it is stretched.
+     */
+    class ParticlePairBungee : public ParticlePairForceGenerator
+    {
+        /** Holds the spring constant. */
+        real springConstant;
+
+        /**
+         * Holds the length of the bungee at the point it begins to
+         * generate a force.
+         */
+        real restLength;
+
+    public:
+
+        /** Creates a new bungee with the given parameters. */
+        ParticlePairBungee(real springConstant, real restLength);
+
+        /** Returns the bungee force on the first particle. */
+        virtual Vector3 calculateForce(const Particle *first,
+                                       const Particle *second,
+                                       real duration);
+    };
+
     /**
      * Holds all the force generators and the particles they apply to.
+     *
+     * The registrations are kept in buckets, one for each of the
+     * generator types in this file, so that the generators of one type
+     * are run together in a loop that calls them directly rather than
+     * through the virtual function. Generators of any other type,
+     * including classes derived from the ones in this file, go in a
+     * last bucket and are called through the virtual function as
+     * before. This means a particle's forces are added up bucket by
+     * bucket, in the order of GeneratorType, and in registration
+     * order within each bucket.
+     *
+     * With an executor set, the forces are worked out on several
+     * threads. The forces between pairs are worked out first, each
+     * into a slot of its own. Then each particle runs its own force
+     * generators and adds up the forces from its pairs, in the same
+     * order as above. No two threads ever add to the same
+     * particle, and every particle's forces are added up in the same
+     * order as they would be on one thread, so the results don't
+     * depend on how many threads there are.
      */
     class ParticleForceRegistry
     {
+    public:
+
+        /**
+         * The types of force generator the registry calls directly.
+         * Generators are sorted into them by their exact type.
+         */
+        enum GeneratorType
+        {
+            GENERATOR_GRAVITY,
+            GENERATOR_DRAG,
+            GENERATOR_ANCHORED_SPRING,
+            GENERATOR_ANCHORED_BUNGEE,
+            GENERATOR_FAKE_SPRING,
+            GENERATOR_SPRING,
+            GENERATOR_BUNGEE,
+            GENERATOR_BUOYANCY,
+
+            /** Any other generator, called through the virtual function. */
+            GENERATOR_OTHER,
+
+            GENERATOR_TYPE_COUNT
+        };
+
+        /**
+         * Returns the bucket the given generator is registered in.
+         */
+        static GeneratorType getGeneratorType(
+            const ParticleForceGenerator *fg);
+
     protected:
 
         /**
@@ -256,21 +376,151 @@ namespace cyclone {
         {
             Particle *particle;
             ParticleForceGenerator *fg;
+            GeneratorType type;
         };
 
         /**
-         * Holds the list of registrations.
+         * Holds the list of registrations for each type of generator.
          */
         typedef std::vector<ParticleForceRegistration> Registry;
-        Registry registrations;
+        Registry registrations[GENERATOR_TYPE_COUNT];
+
+        /**
+         * Calls the generators of the given registrations, which must
+         * all be of the given type.
+         */
+        static void updateRegistrations(GeneratorType type,
+            const ParticleForceRegistration *registrations,
+            unsigned count, real duration);
+
+        /**
+         * Keeps track of one pair force generator and the pair of
+         * particles it applies to.
+         */
+        struct ParticlePairRegistration
+        {
+            Particle *particle[2];
+            ParticlePairForceGenerator *fg;
+        };
+
+        /**
+         * Holds the list of pair registrations.
+         */
+        typedef std::vector<ParticlePairRegistration> PairRegistry;
+        PairRegistry pairRegistrations;
+
+        /**
+         * @name Parallel Evaluation
+         *
+         * To work out the forces on several threads, the registry
+         * keeps an index of the registrations for each particle. The
+         * index is rebuilt whenever the registrations change.
+         */
+        /*@{*/
+
+        /**
+         * Holds the executor used to work out the forces, or NULL to
+         * work them out on the calling thread.
+         */
+        TaskExecutor *executor;
+
+        /** True if the index matches the registrations. */
+        bool indexValid;
+
+        /**
+         * Holds every particle with a force registered on it, in
+         * address order.
+         */
+        std::vector<Particle*> indexParticles;
+
+        /**
+         * Holds the registrations sorted by particle, and then by
+         * type. The ones for indexParticles[i] start at
+         * registrationStart[i] and end at registrationStart[i+1].
+         */
+        Registry sortedRegistrations;
+        std::vector<unsigned> registrationStart;
+
+        /**
+         * Holds the pair ends sorted by particle, each as twice the
+         * index of the pair, plus one for its second particle. The
+         * ones for indexParticles[i] start at pairEndStart[i] and end
+         * at pairEndStart[i+1].
+         */
+        std::vector<unsigned> pairEnds;
+        std::vector<unsigned> pairEndStart;
+
+        /**
+         * Holds the force each pair gives its first particle this
+         * frame.
+         */
+        std::vector<Vector3> pairForces;
+
+        /**
+         * The parallel task that works out the forces of a range of
+         * pairs.
+         */
+        struct PairForceTask : public ParallelTask
+        {
+            ParticleForceRegistry *registry;
+            real duration;
+
+            virtual void run(unsigned begin, unsigned end);
+        };
+
+        /**
+         * The parallel task that applies the forces to a range of
+         * the particles in the index.
+         */
+        struct ParticleForceTask : public ParallelTask
+        {
+            ParticleForceRegistry *registry;
+            real duration;
+
+            virtual void run(unsigned begin, unsigned end);
+        };
+
+        /**
+         * Rebuilds the index of the registrations for each particle.
+         */
+        void buildIndex();
+
+        /*@}*/
 
     public:
+        ParticleForceRegistry();
+
         /**
          * Registers the given force generator to apply to the
          * given particle.
          */
         void add(Particle* particle, ParticleForceGenerator *fg);
 
+        /**
+         * Registers the given pair force generator to act between
+         * the given particles.
+         */
+        void addPair(Particle *first, Particle *second,
+                     ParticlePairForceGenerator *fg);
+
+        /**
+         * Removes the given registered pair force generator from the
+         * registry. If it is not registered between these particles,
+         * this method will have no effect.
+         */
+        void removePair(Particle *first, Particle *second,
+                        ParticlePairForceGenerator *fg);
+
+        /**
+         * Sets the executor used to work out the forces on several
+         * threads. The registry does not take ownership of the
+         * executor. Passing NULL (the default) works them out on the
+         * calling thread. With an executor, a force generator may be
+         * called for different particles at the same time, so it
+         * must only change the particle it is given.
+         */
+        void setExecutor(TaskExecutor *executor);
+
         /**
          * Removes the given registered pair from the registry.
          * If the pair is not registered, this method will have
@@ -279,9 +529,10 @@ namespace cyclone {
         void remove(Particle* particle, ParticleForceGenerator *fg);
 
         /**
-         * Clears all registrations from the registry. This will
-         * not delete the particles or the force generators
-         * themselves, just the records of their connection.
+         * Clears all registrations from the registry, including the
+         * pairs. This will not delete the particles or the force
+         * generators themselves, just the records of their
+         * connection.
          */
         void clear();
 
@@ -0,0 +1,161 @@
+/*
+ * Interface file for the particle spatial hash grid.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains a uniform grid that sorts particles by the cell
+ * they are in, so that particles near a point can be found without
+ * checking every particle. It is used to generate contacts between
+ * particles, and can also be queried by force generators.
+ */
+#ifndef CYCLONE_PGRID_H
+#define CYCLONE_PGRID_H
+
+#include "pworld.h"
+
+namespace cyclone {
+
+    /**
+     * A contact generator that treats each particle in an STL vector
+     * of particle pointers as a sphere of the same radius, and
+     * collides them against each other.
+     *
+     * Space is divided into cubic cells twice the radius across, and
+     * each cell is mapped to a slot in a fixed size hash table, so the
+     * grid needs no bounds. Each time the grid is updated, the
+     * particles are counting sorted by their slot, which takes time
+     * proportional to the number of particles. Two spheres can only
+     * touch if they are in neighbouring cells, so each particle is
+     * only checked against the particles in the 27 cells around it.
+     *
+     * The grid is rebuilt every time addContact is called. Neighbour
+     * queries use the particle positions from the last update, so
+     * call update first if the particles have moved since then.
+     */
+    class ParticleGrid : public ParticleContactGenerator
+    {
+        /**
+         * Holds the particles to collide.
+         */
+        ParticleWorld::Particles *particles;
+
+        /**
+         * Holds the radius of each particle.
+         */
+        real radius;
+
+        /**
+         * Holds the restitution of the contacts generated.
+         */
+        real restitution;
+
+        /**
+         * Holds the width of each cell.
+         */
+        real cellSize;
+
+        /**
+         * Holds the number of slots in the hash table, minus one. The
+         * number of slots is always a power of two.
+         */
+        unsigned slotMask;
+
+        /**
+         * Holds the index of the first sorted particle in each slot,
+         * plus one final entry for the end.
+         */
+        mutable std::vector<unsigned> slotStart;
+
+        /**
+         * Holds the particles sorted by slot.
+         */
+        mutable std::vector<Particle*> sortedParticles;
+
+        /**
+         * Holds the position of each sorted particle, so the
+         * particles themselves don't need to be visited when looking
+         * for contacts.
+         */
+        mutable std::vector<Vector3> sortedPositions;
+
+        /**
+         * Holds the slot of each particle while the grid is built.
+         */
+        mutable std::vector<unsigned> particleSlots;
+
+        /**
+         * Holds the slots visited by a search, so each is only
+         * visited once.
+         */
+        mutable std::vector<unsigned> searchSlots;
+
+        /**
+         * Returns the cell coordinate that the given coordinate is in.
+         */
+        int getCell(real coordinate) const;
+
+        /**
+         * Returns the hash table slot for the given cell.
+         */
+        unsigned getSlot(int x, int y, int z) const;
+
+        /**
+         * Fills searchSlots with the distinct slots of the cells
+         * between the given cell coordinates (inclusive).
+         */
+        void findSlots(int minX, int minY, int minZ,
+                       int maxX, int maxY, int maxZ) const;
+
+    public:
+        /**
+         * Creates a new grid with the given number of hash table
+         * slots, which is rounded up to a power of two. The table
+         * should have at least as many slots as there are particles.
+         */
+        ParticleGrid(unsigned slots = 4096);
+
+        /**
+         * Sets the particles to collide, the radius of each one, and
+         * the restitution of the contacts between them.
+         */
+        void init(ParticleWorld::Particles *particles,
+                  real radius,
+                  real restitution = (real)0.5);
+
+        /**
+         * Sorts the particles into the grid using their current
+         * positions.
+         */
+        void update() const;
+
+        /**
+         * Updates the grid, then writes a contact for each pair of
+         * particles that overlap.
+         */
+        virtual unsigned addContact(ParticleContact *contact,
+                                    unsigned limit) const;
+
+        /**
+         * Finds the particles within the given distance of the given
+         * point, writing them to the given array (up to the given
+         * limit). Returns the number of particles found.
+         */
+        unsigned findNeighbours(const Vector3 &centre,
+                                real distance,
+                                Particle **neighbours,
+                                unsigned limit) const;
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_PGRID_H
@@ -21,6 +21,8 @@
 
 #include "pfgen.h"
 #include "plinks.h"
+#include "tasks.h"
+#include "contactbuffer.h"
 
 namespace cyclone {
 
@@ -62,35 +64,59 @@ namespace cyclone {
         ContactGenerators contactGenerators;
 
         /**
-         * Holds the list of contacts.
+         * Holds the list of contacts. The buffer grows when a frame
+         * has more contacts than it has room for.
          */
-        ParticleContact *contacts;
+        ContactBuffer<ParticleContact> contacts;
 
         /**
-         * Holds the maximum number of contacts allowed (i.e. the
-         * size of the contacts array).
+         * Holds the executor used to integrate particles in parallel,
+         * or NULL to integrate them on the calling thread.
          */
-        unsigned maxContacts;
+        TaskExecutor *executor;
+
+        /**
+         * The parallel task that integrates a range of particles.
+         */
+        struct Integrator : public ParallelTask
+        {
+            Particles *particles;
+            real duration;
+
+            virtual void run(unsigned begin, unsigned end);
+        };
 
     public:
 
         /**
-         * Creates a new particle simulator that can handle up to the
-         * given number of contacts per frame. You can also optionally
-         * give a number of contact-resolution iterations to use. If you
-         * don't give a number of iterations, then twice the number of
-         * contacts will be used.
+         * Creates a new particle simulator with room for the given
+         * number of contacts per frame. The room grows when a frame
+         * needs more, so no contacts are dropped. You can also
+         * optionally give a number of contact-resolution iterations
+         * to use. If you don't give a number of iterations, then
+         * twice the number of contacts will be used.
          */
-        ParticleWorld(unsigned maxContacts, unsigned iterations=0);
+        ParticleWorld(unsigned contactCapacity, unsigned iterations=0);
 
         /**
          * Deletes the simulator.
          */
         ~ParticleWorld();
 
+        /**
+         * Sets the executor used to work out the forces on the
+         * particles and integrate them in parallel. The world does
+         * not take ownership of the executor. Passing NULL (the
+         * default) does everything on the calling thread.
+         */
+        void setExecutor(TaskExecutor *executor);
+
         /**
          * Calls each of the registered contact generators to report
          * their contacts. Returns the number of generated contacts.
+         * A generator that fills all the room it is given is run
+         * again with more, so it must write the same contacts each
+         * time it is called in a frame.
          */
         unsigned generateContacts();
 
@@ -127,6 +153,13 @@ namespace cyclone {
          * Returns the force registry.
          */
         ParticleForceRegistry& getForceRegistry();
+
+        /**
+         * Returns the buffer holding the contacts of the last frame.
+         * Its high water mark and overflow count show how much room
+         * the world needs to start with.
+         */
+        const ContactBuffer<ParticleContact>& getContactBuffer() const;
     };
 
     /**
@@ -0,0 +1,167 @@
+/*
+ * Interface file for casting rays and shapes into the scene.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains the scene queries: casting rays and spheres
+ * into a set of primitives, and finding the primitives that overlap
+ * a shape. Queries use a broadphase tree to find the primitives
+ * worth checking, then run the exact tests from IntersectionTests
+ * on each of them. Line of sight checks, weapons, the feet of
+ * characters and picking with the mouse are all built from these.
+ */
+#ifndef CYCLONE_QUERY_H
+#define CYCLONE_QUERY_H
+
+#include "collide_fine.h"
+#include "tasks.h"
+
+namespace cyclone {
+
+    /**
+     * Runs queries against the primitives held in a broadphase tree,
+     * such as the one a World keeps for its registered primitives.
+     * The primitives' internals must be up to date, as they are
+     * after each step of the world. Planes are not part of the tree,
+     * so they are never reported.
+     *
+     * Queries do not change the query object or the tree, so
+     * several threads can run queries through the same object at
+     * once.
+     */
+    class SceneQuery
+    {
+    public:
+        /**
+         * Selects which hits a cast reports.
+         */
+        enum Mode
+        {
+            /** Reports only the hit nearest the start of the ray. */
+            CLOSEST_HIT,
+
+            /**
+             * Reports the first hit found, which need not be the
+             * nearest. This is the quickest way to check if anything
+             * is in the way at all.
+             */
+            ANY_HIT,
+
+            /**
+             * Reports every hit, nearest first. If there are more
+             * hits than will fit, the nearest ones are kept.
+             */
+            ALL_HITS
+        };
+
+    protected:
+        /** Holds the tree being queried. */
+        const AABBTree *tree;
+
+        /**
+         * Receives the proxies a cast passes through, tests their
+         * primitives, and keeps the hits the mode asks for.
+         */
+        struct CastCallback : public RayCastCallback
+        {
+            const AABBTree *tree;
+            Ray ray;
+            real radius;
+            Mode mode;
+            RayHit *hits;
+            unsigned limit;
+            unsigned count;
+
+            virtual real reportProxy(unsigned proxy, real maxDistance);
+        };
+
+        /**
+         * Holds a batch of rays being cast in parallel.
+         */
+        struct RayBatch : public ParallelTask
+        {
+            const SceneQuery *query;
+            const Ray *rays;
+            RayHit *hits;
+            Mode mode;
+            real radius;
+
+            virtual void run(unsigned begin, unsigned end);
+        };
+
+        /**
+         * Casts a ray, or a sphere if the radius is not zero, with
+         * the given mode. This is the work behind both raycast and
+         * sphereCast.
+         */
+        unsigned cast(const Ray &ray, real radius, Mode mode,
+                      RayHit *hits, unsigned limit) const;
+
+    public:
+        /**
+         * Creates a query over the given tree. The query does not
+         * take ownership of the tree.
+         */
+        SceneQuery(const AABBTree *tree);
+
+        /**
+         * Casts the given ray, writing the hits into the given array
+         * (up to the given limit) as selected by the mode. Returns
+         * the number of hits written.
+         */
+        unsigned raycast(const Ray &ray, Mode mode,
+                         RayHit *hits, unsigned limit = 1) const;
+
+        /**
+         * Moves a sphere of the given radius along the given ray, and
+         * works as raycast does. The point of each hit is where the
+         * sphere touches the primitive, and the distance is how far
+         * the centre of the sphere moved.
+         */
+        unsigned sphereCast(const Ray &ray, real radius, Mode mode,
+                            RayHit *hits, unsigned limit = 1) const;
+
+        /**
+         * Finds the primitives that overlap the given shape, writing
+         * them into the given array (up to the given limit). Returns
+         * the number of primitives written. The shape need not be
+         * attached to a body, but its internals must have been
+         * calculated. If the shape is in the tree it is not reported,
+         * and nor are primitives its filter excludes (see
+         * CollisionPrimitive::canCollideWith).
+         */
+        unsigned overlapQuery(const CollisionPrimitive &shape,
+                              CollisionPrimitive **primitives,
+                              unsigned limit) const;
+
+        /**
+         * Casts each of the given rays, writing one hit per ray into
+         * the array of hits (the closest hit or any hit, as given by
+         * the mode). Rays that hit nothing have the primitive of their
+         * hit set to NULL. Giving a radius casts spheres rather than
+         * rays. If an executor is given the rays are split across its
+         * threads. Returns the number of rays that hit something.
+         *
+         * ALL_HITS can't be used, as there is room for only one hit
+         * per ray: cast those rays one at a time with raycast. It is
+         * caught by an assertion in debug builds; otherwise no rays
+         * are cast, every hit is set to NULL and zero is returned.
+         */
+        unsigned raycastBatch(const Ray *rays, unsigned count, Mode mode,
+                              RayHit *hits, real radius = 0,
+                              TaskExecutor *executor = NULL) const;
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_QUERY_H
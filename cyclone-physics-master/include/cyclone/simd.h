@@ -0,0 +1,271 @@
+/*
+ * Interface file for the vector instruction backend of the core
+ * mathematics.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file selects, when the code is compiled, whether the core
+ * mathematical types use vector instructions. A quad holds four
+ * reals: the components of a vector (with its padding), of a
+ * quaternion, or one row of a matrix. The functions here give the
+ * arithmetic on quads.
+ *
+ * The vector code is used when CYCLONE_USE_SIMD is defined and the
+ * target has SSE2, in which case CYCLONE_SIMD is defined. Otherwise
+ * the core types use their plain scalar code. It is not on by
+ * default: the rest of the engine often writes single components
+ * of a vector and then uses the whole vector straight away, and
+ * reading back a quad that was just written a component at a time
+ * stalls the processor. Whether it helps depends on the mix of
+ * work, so time both with the benchmark before switching it on.
+ *
+ * A quad is held as a pair of 128 bit registers. These need only
+ * SSE2, and when the code is compiled for AVX the compiler encodes
+ * the same functions with the AVX forms of the instructions. A quad
+ * is not held in one 256 bit register, since moving separate
+ * components in and out of the wide registers costs more than the
+ * arithmetic saves.
+ *
+ * @note Every kernel written with quads performs the same
+ * operations in the same order as the scalar code, so both give
+ * identical results. Horizontal sums, in particular, always add
+ * from the first component to the last.
+ */
+#ifndef CYCLONE_SIMD_H
+#define CYCLONE_SIMD_H
+
+#include "precision.h"
+
+#if defined(CYCLONE_USE_SIMD) && defined(DOUBLE_PRECISION)
+    #if defined(__SSE2__) || defined(_M_X64) || \
+        (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #define CYCLONE_SIMD
+    #endif
+#endif
+
+/**
+ * Aligns the core types that are loaded as quads, so the aligned
+ * loads can be used on them. The scalar build leaves their layout
+ * as it was.
+ */
+#ifdef CYCLONE_SIMD
+    #define CYCLONE_QUAD_ALIGN alignas(16)
+#else
+    #define CYCLONE_QUAD_ALIGN
+#endif
+
+#ifdef CYCLONE_SIMD
+
+#include <emmintrin.h>
+
+namespace cyclone {
+
+    /** Holds four reals in a pair of vector registers. */
+    struct Quad
+    {
+        __m128d lo;
+        __m128d hi;
+    };
+
+    /** Creates a quad from its two halves. */
+    inline Quad quadMake(__m128d lo, __m128d hi)
+    {
+        Quad result;
+        result.lo = lo;
+        result.hi = hi;
+        return result;
+    }
+
+    /** Loads four reals from a 16 byte aligned address. */
+    inline Quad quadLoad(const real *p)
+    {
+        return quadMake(_mm_load_pd(p), _mm_load_pd(p+2));
+    }
+
+    /**
+     * Loads three reals, setting the fourth component to zero. The
+     * address need not be aligned.
+     */
+    inline Quad quadLoad3(const real *p)
+    {
+        return quadMake(_mm_loadu_pd(p), _mm_load_sd(p+2));
+    }
+
+    /** Creates a quad from the given components. */
+    inline Quad quadSet(real a, real b, real c, real d)
+    {
+        return quadMake(_mm_set_pd(b, a), _mm_set_pd(d, c));
+    }
+
+    /** Creates a quad with every component set to the given value. */
+    inline Quad quadSplat(real a)
+    {
+        __m128d s = _mm_set1_pd(a);
+        return quadMake(s, s);
+    }
+
+    /** Stores all four reals of the quad at a 16 byte aligned address. */
+    inline void quadStore(real *p, Quad a)
+    {
+        _mm_store_pd(p, a.lo);
+        _mm_store_pd(p+2, a.hi);
+    }
+
+    /**
+     * Stores the first three reals of the quad. The address need not
+     * be aligned.
+     */
+    inline void quadStore3(real *p, Quad a)
+    {
+        _mm_storeu_pd(p, a.lo);
+        _mm_store_sd(p+2, a.hi);
+    }
+
+    inline Quad quadAdd(Quad a, Quad b)
+    {
+        return quadMake(_mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi));
+    }
+
+    inline Quad quadSub(Quad a, Quad b)
+    {
+        return quadMake(_mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi));
+    }
+
+    inline Quad quadMul(Quad a, Quad b)
+    {
+        return quadMake(_mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi));
+    }
+
+    /**
+     * Transposes four rows into four columns. This is used to turn
+     * a row-major matrix into the columns needed to transform a
+     * vector with vertical arithmetic only.
+     */
+    inline void quadTranspose(Quad &r0, Quad &r1, Quad &r2, Quad &r3)
+    {
+        Quad c0 = quadMake(_mm_unpacklo_pd(r0.lo, r1.lo),
+                           _mm_unpacklo_pd(r2.lo, r3.lo));
+        Quad c1 = quadMake(_mm_unpackhi_pd(r0.lo, r1.lo),
+                           _mm_unpackhi_pd(r2.lo, r3.lo));
+        Quad c2 = quadMake(_mm_unpacklo_pd(r0.hi, r1.hi),
+                           _mm_unpacklo_pd(r2.hi, r3.hi));
+        Quad c3 = quadMake(_mm_unpackhi_pd(r0.hi, r1.hi),
+                           _mm_unpackhi_pd(r2.hi, r3.hi));
+        r0 = c0; r1 = c1; r2 = c2; r3 = c3;
+    }
+
+    /** Returns the sum of the first three components, in order. */
+    inline real quadSum3(Quad a)
+    {
+        __m128d s = _mm_add_sd(a.lo, _mm_unpackhi_pd(a.lo, a.lo));
+        return _mm_cvtsd_f64(_mm_add_sd(s, a.hi));
+    }
+
+    /** Returns the sum of all four components, in order. */
+    inline real quadSum4(Quad a)
+    {
+        __m128d s = _mm_add_sd(a.lo, _mm_unpackhi_pd(a.lo, a.lo));
+        s = _mm_add_sd(s, a.hi);
+        return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(a.hi, a.hi)));
+    }
+
+    /**
+     * Moves each component up one place, dropping the last and
+     * setting the first to zero. This turns a vector into the
+     * matching pure quaternion.
+     */
+    inline Quad quadShiftUp(Quad a)
+    {
+        return quadMake(_mm_unpacklo_pd(_mm_setzero_pd(), a.lo),
+                        _mm_shuffle_pd(a.lo, a.hi, 1));
+    }
+
+    /**
+     * Returns the vector product of the first three components of
+     * each quad, with a zero fourth component.
+     */
+    inline Quad quadCross(Quad a, Quad b)
+    {
+        // (y*z' - z*y', z*x' - x*z')
+        __m128d xy = _mm_sub_pd(
+            _mm_mul_pd(_mm_shuffle_pd(a.lo, a.hi, 1),
+                       _mm_shuffle_pd(b.hi, b.lo, 0)),
+            _mm_mul_pd(_mm_shuffle_pd(a.hi, a.lo, 0),
+                       _mm_shuffle_pd(b.lo, b.hi, 1)));
+
+        // x*y' - y*x'
+        __m128d p = _mm_mul_pd(a.lo, _mm_shuffle_pd(b.lo, b.lo, 1));
+        __m128d z = _mm_sub_sd(p, _mm_unpackhi_pd(p, p));
+
+        return quadMake(xy, _mm_move_sd(_mm_setzero_pd(), z));
+    }
+
+    /**
+     * Returns the product of two quaternions held as quads, in the
+     * order r, i, j, k.
+     */
+    inline Quad quadQuaternionProduct(Quad q, Quad m)
+    {
+        // Each component is a sum of four products. The products are
+        // gathered so that the n-th term of every component is
+        // worked out at once, and the signs of the subtracted terms
+        // are flipped.
+        const __m128d firstNegative = _mm_set_sd(-0.0);
+        const __m128d bothNegative = _mm_set1_pd(-0.0);
+
+        // (r*r', r*i', r*j', r*k')
+        __m128d r = _mm_unpacklo_pd(q.lo, q.lo);
+        Quad first = quadMake(_mm_mul_pd(r, m.lo), _mm_mul_pd(r, m.hi));
+
+        // (-i*i', i*r', j*r', k*r')
+        Quad second = quadMake(
+            _mm_mul_pd(_mm_xor_pd(_mm_unpackhi_pd(q.lo, q.lo),
+                                  firstNegative),
+                       _mm_shuffle_pd(m.lo, m.lo, 1)),
+            _mm_mul_pd(q.hi, _mm_unpacklo_pd(m.lo, m.lo)));
+
+        // (-j*j', j*k', k*i', i*j')
+        Quad third = quadMake(
+            _mm_mul_pd(_mm_xor_pd(_mm_unpacklo_pd(q.hi, q.hi),
+                                  firstNegative),
+                       m.hi),
+            _mm_mul_pd(_mm_shuffle_pd(q.hi, q.lo, 3),
+                       _mm_shuffle_pd(m.lo, m.hi, 1)));
+
+        // (-k*k', -k*j', -i*k', -j*i')
+        Quad fourth = quadMake(
+            _mm_mul_pd(_mm_xor_pd(_mm_unpackhi_pd(q.hi, q.hi),
+                                  bothNegative),
+                       _mm_shuffle_pd(m.hi, m.hi, 1)),
+            _mm_mul_pd(_mm_xor_pd(_mm_shuffle_pd(q.lo, q.hi, 1),
+                                  bothNegative),
+                       _mm_shuffle_pd(m.hi, m.lo, 3)));
+
+        return quadAdd(quadAdd(quadAdd(first, second), third), fourth);
+    }
+
+    /**
+     * Returns the quad x*a + y*b + z*c, summed in that order.
+     */
+    inline Quad quadCombine(real x, Quad a, real y, Quad b, real z, Quad c)
+    {
+        return quadAdd(quadAdd(quadMul(quadSplat(x), a),
+                               quadMul(quadSplat(y), b)),
+                       quadMul(quadSplat(z), c));
+    }
+
+} // namespace cyclone
+
+#endif // CYCLONE_SIMD
+
+#endif // CYCLONE_SIMD_H
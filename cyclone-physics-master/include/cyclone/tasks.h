@@ -0,0 +1,524 @@
+/*
+ * Interface file for running simulation work in parallel.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains the interfaces the simulation uses to split its
+ * work across threads, and two executors that implement them: a
+ * simple thread pool, and a work-stealing job scheduler that can also
+ * run graphs of tasks that depend on each other. Cyclone never
+ * creates threads on its own: an application that wants parallel
+ * simulation creates an executor and hands it to the world.
+ */
+#ifndef CYCLONE_TASKS_H
+#define CYCLONE_TASKS_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace cyclone {
+
+    /**
+     * This is the basic polymorphic interface for a piece of work
+     * that can be split into independent ranges of items.
+     */
+    class ParallelTask
+    {
+    public:
+        /**
+         * Overload this in implementations of the interface to
+         * process the items from begin up to (but not including)
+         * end. Different ranges of the same task may be run at the
+         * same time on different threads.
+         */
+        virtual void run(unsigned begin, unsigned end) = 0;
+    };
+
+    class TaskExecutor;
+
+    /**
+     * Holds a set of parallel tasks, some of which have to wait for
+     * others to finish before they can start. Tasks that don't
+     * depend on each other may be run at the same time.
+     *
+     * A task can only depend on tasks added before it, so running
+     * the tasks in the order they were added always respects their
+     * dependencies. The graph can be run any number of times.
+     */
+    class TaskGraph
+    {
+    protected:
+        /**
+         * Holds a single task in the graph.
+         */
+        struct Node
+        {
+            ParallelTask *task;
+            unsigned count;
+
+            /**
+             * Holds the variable the number of items is read from
+             * when the task starts, or NULL to use count.
+             */
+            const unsigned *countSource;
+
+            unsigned grainSize;
+
+            /** Holds the number of tasks this one waits for. */
+            unsigned dependencies;
+
+            /** Holds the tasks that wait for this one. */
+            std::vector<unsigned> successors;
+        };
+
+        /** Holds the tasks in the order they were added. */
+        std::vector<Node> nodes;
+
+    public:
+        /**
+         * Adds a task to run over the given number of items, in ranges
+         * of at most grainSize items. Returns the index used to refer
+         * to the task.
+         */
+        unsigned addTask(ParallelTask *task,
+                         unsigned count=1,
+                         unsigned grainSize=1);
+
+        /**
+         * Makes the given task read its number of items from the
+         * given variable when it starts, rather than using the count
+         * it was added with. This lets the tasks it depends on work
+         * out how much there is for it to do.
+         */
+        void setCountSource(unsigned task, const unsigned *count);
+
+        /**
+         * Makes the task after wait for the task before to finish.
+         * The task before must have been added first.
+         */
+        void addDependency(unsigned before, unsigned after);
+
+        /**
+         * Removes all the tasks.
+         */
+        void clear();
+
+        /**
+         * Runs all the tasks with the given executor, and returns
+         * when they have all finished. With no executor the tasks
+         * are run one after another on the calling thread.
+         */
+        void run(TaskExecutor *executor);
+
+        /**
+         * Runs the tasks one after another, in the order they were
+         * added, each spread over the given executor (if any) with
+         * parallelFor.
+         */
+        void runInOrder(TaskExecutor *executor);
+
+        /**
+         * @name Graph Inspection
+         *
+         * These let an executor find out what it has to run.
+         */
+        /*@{*/
+
+        /** Returns the number of tasks in the graph. */
+        unsigned getTaskCount() const
+        {
+            return (unsigned)nodes.size();
+        }
+
+        /** Returns the given task. */
+        ParallelTask* getTask(unsigned task) const
+        {
+            return nodes[task].task;
+        }
+
+        /**
+         * Returns the number of items in the given task. This should
+         * only be called once the tasks it depends on have finished.
+         */
+        unsigned getItemCount(unsigned task) const
+        {
+            const Node &node = nodes[task];
+            return node.countSource ? *node.countSource : node.count;
+        }
+
+        /** Returns the grain size of the given task. */
+        unsigned getGrainSize(unsigned task) const
+        {
+            return nodes[task].grainSize;
+        }
+
+        /** Returns the number of tasks the given task waits for. */
+        unsigned getDependencyCount(unsigned task) const
+        {
+            return nodes[task].dependencies;
+        }
+
+        /** Returns the tasks that wait for the given task. */
+        const std::vector<unsigned>& getSuccessors(unsigned task) const
+        {
+            return nodes[task].successors;
+        }
+
+        /*@}*/
+    };
+
+    /**
+     * This is the basic polymorphic interface for something that
+     * can run parallel tasks. Applications that already have their
+     * own job system can implement this to have Cyclone use it.
+     */
+    class TaskExecutor
+    {
+    public:
+        virtual ~TaskExecutor() {}
+
+        /**
+         * Runs the given task over the items from zero up to (but
+         * not including) count, in ranges of at most grainSize items,
+         * and returns when all of them have completed. Each range
+         * starts at a multiple of grainSize, so tasks can keep
+         * results for each range by dividing its start by the grain
+         * size. The calling thread may be used to run some of the
+         * ranges.
+         */
+        virtual void parallelFor(ParallelTask *task,
+                                 unsigned count,
+                                 unsigned grainSize=1) = 0;
+
+        /**
+         * Returns the number of threads (including the calling
+         * thread) that can run tasks at the same time.
+         */
+        virtual unsigned getWorkerCount() const = 0;
+
+        /**
+         * Runs all the tasks in the given graph, and returns when
+         * they have all finished. By default the tasks are run one
+         * after another, each with parallelFor. Executors that can
+         * run independent tasks at the same time should overload
+         * this.
+         */
+        virtual void runGraph(TaskGraph *graph);
+    };
+
+    /**
+     * A simple fixed-size pool of worker threads. Ranges of a task
+     * are handed out from a shared counter, so threads that finish
+     * early pick up more of the work.
+     *
+     * A parallelFor that is started while the pool is already busy
+     * (for example from inside another task) is run on the calling
+     * thread rather than waiting for the pool.
+     */
+    class ThreadPool : public TaskExecutor
+    {
+        /** Holds the worker threads. */
+        std::vector<std::thread> threads;
+
+        /** Protects the job data below. */
+        std::mutex mutex;
+
+        /** Signalled when a new job is available, or on shutdown. */
+        std::condition_variable jobReady;
+
+        /** Signalled when the last worker has finished a job. */
+        std::condition_variable jobFinished;
+
+        /** Holds the task being run. */
+        ParallelTask *task;
+
+        /** Holds the number of items in the current task. */
+        unsigned count;
+
+        /** Holds the number of items handed out at a time. */
+        unsigned grainSize;
+
+        /** Holds the first item that has not been handed out yet. */
+        std::atomic<unsigned> nextItem;
+
+        /** Incremented for each job, so workers can spot new work. */
+        unsigned generation;
+
+        /** Holds the number of workers still running the current job. */
+        unsigned workersRunning;
+
+        /** True while a job is being run. */
+        std::atomic<bool> busy;
+
+        /** True when the pool is being destroyed. */
+        bool quit;
+
+        /** The function run by each worker thread. */
+        void workerLoop();
+
+        /** Runs ranges of the current task until none are left. */
+        void runRanges();
+
+    public:
+        /**
+         * Creates a pool that runs tasks on the given total number of
+         * threads, including the thread that calls parallelFor. If no
+         * number is given, one thread per hardware core is used.
+         */
+        ThreadPool(unsigned threadCount=0);
+
+        /**
+         * Stops and joins the worker threads.
+         */
+        ~ThreadPool();
+
+        virtual void parallelFor(ParallelTask *task,
+                                 unsigned count,
+                                 unsigned grainSize=1);
+
+        virtual unsigned getWorkerCount() const;
+    };
+
+    /**
+     * A pool of worker threads that share out work by stealing it
+     * from each other.
+     *
+     * Each thread has its own double-ended queue of jobs, each job
+     * being a range of items from a parallel task. A thread takes
+     * work from the back of its own queue, splitting large ranges in
+     * two and pushing one half back on as it goes, and threads that
+     * run out of work steal from the front of other threads' queues.
+     * Since the front holds the largest ranges, a steal takes a big
+     * piece of work at once, and threads rarely touch the same end of
+     * a queue. The queues follow the lock-free design of Chase and
+     * Lev.
+     *
+     * Unlike ThreadPool, a parallelFor started from inside a task is
+     * shared out like any other, so nested parallelism (islands
+     * resolved in parallel, each with a parallel solver) uses all the
+     * threads. A thread waiting for its work to finish runs other
+     * jobs rather than blocking. Graphs of tasks are run with each
+     * task starting as soon as the tasks it depends on have finished.
+     *
+     * Threads that aren't part of the scheduler can start work on it
+     * at any time, but only one of them at once: the others wait
+     * their turn.
+     */
+    class JobScheduler : public TaskExecutor
+    {
+    protected:
+        struct GraphRun;
+
+        /**
+         * Holds the progress of a single parallel task: a call to
+         * parallelFor, or a task in a graph.
+         */
+        struct Batch
+        {
+            ParallelTask *task;
+            unsigned grainSize;
+
+            /** Holds the number of items that haven't finished. */
+            std::atomic<unsigned> remaining;
+
+            /**
+             * Holds the number of tasks this one is still waiting
+             * for, when it is part of a graph.
+             */
+            std::atomic<unsigned> dependencies;
+
+            /** Holds the graph this task is part of, or NULL. */
+            GraphRun *graph;
+
+            /** Holds the index of this task in its graph. */
+            unsigned node;
+        };
+
+        /**
+         * Holds the progress of a call to runGraph.
+         */
+        struct GraphRun
+        {
+            TaskGraph *graph;
+            Batch *batches;
+
+            /** Holds the number of tasks that haven't finished. */
+            std::atomic<unsigned> tasksLeft;
+        };
+
+        /**
+         * Holds a single slot of a job queue: a range of items from a
+         * batch. The parts are atomic because a thief may read a slot
+         * while its owner is writing it; the thief then always fails
+         * to claim the job, so the mixed value is never used.
+         */
+        struct Job
+        {
+            std::atomic<Batch*> batch;
+            std::atomic<unsigned> begin;
+            std::atomic<unsigned> end;
+        };
+
+        /**
+         * Holds the job queue of a single thread. Only the owning
+         * thread pushes and pops jobs at the back, while any thread
+         * can steal from the front.
+         */
+        struct Worker
+        {
+            /**
+             * Holds the jobs in a ring whose size is a power of two.
+             * The queue does not grow: when it is full, ranges are
+             * run on the spot rather than being split.
+             */
+            std::vector<Job> jobs;
+
+            /** Holds the position of the front of the queue. */
+            std::atomic<long long> top;
+
+            /** Holds the position just past the back of the queue. */
+            std::atomic<long long> bottom;
+
+            /** Holds the state used to pick threads to steal from. */
+            unsigned random;
+
+            Worker();
+
+            /**
+             * Adds a job to the back of the queue. Returns false if
+             * the queue is full.
+             */
+            bool push(Batch *batch, unsigned begin, unsigned end);
+
+            /**
+             * Takes the job at the back of the queue. Returns false
+             * if the queue is empty.
+             */
+            bool pop(Batch **batch, unsigned *begin, unsigned *end);
+
+            /**
+             * Takes the job at the front of the queue. Returns false
+             * if the queue is empty, or another thread got there
+             * first.
+             */
+            bool steal(Batch **batch, unsigned *begin, unsigned *end);
+
+            /** Checks if the queue looks empty. */
+            bool isEmpty() const
+            {
+                return bottom.load() <= top.load();
+            }
+        };
+
+        /** Holds the number of jobs each queue can hold. */
+        const static unsigned queueSize = 1024;
+
+        /**
+         * Holds the queue of each thread. The first belongs to the
+         * thread that calls into the scheduler from outside.
+         */
+        std::vector<Worker*> workers;
+
+        /** Holds the worker threads. */
+        std::vector<std::thread> threads;
+
+        /**
+         * Held by a thread from outside the scheduler while it is
+         * using the first queue.
+         */
+        std::mutex callerMutex;
+
+        /** Protects going to sleep and waking up. */
+        std::mutex mutex;
+
+        /** Signalled when jobs are pushed while threads sleep. */
+        std::condition_variable wakeUp;
+
+        /** Holds the number of threads that are asleep. */
+        std::atomic<unsigned> sleeping;
+
+        /** True when the scheduler is being destroyed. */
+        std::atomic<bool> quit;
+
+        /** The function run by each worker thread. */
+        void workerLoop(unsigned worker);
+
+        /**
+         * Starts using the scheduler from the calling thread,
+         * returning the queue it should use.
+         */
+        unsigned enter(JobScheduler **previous, unsigned *previousWorker);
+
+        /** Stops using the scheduler from the calling thread. */
+        void leave(JobScheduler *previous, unsigned previousWorker);
+
+        /**
+         * Finds a job, from the given thread's queue or by stealing,
+         * and runs it. Returns false if no job was found.
+         */
+        bool runNextJob(unsigned worker);
+
+        /**
+         * Runs the given range of a batch, pushing the later parts of
+         * it onto the given thread's queue for others to steal.
+         */
+        void runJob(unsigned worker, Batch *batch,
+                    unsigned begin, unsigned end);
+
+        /**
+         * Records that the given number of items of a batch have
+         * finished, starting the tasks that were waiting for it if
+         * that was the last of them.
+         */
+        void finishItems(unsigned worker, Batch *batch, unsigned count);
+
+        /** Starts running a task of a graph. */
+        void startTask(unsigned worker, Batch *batch);
+
+        /** Adds a job to the given thread's queue. */
+        void pushJob(unsigned worker, Batch *batch,
+                     unsigned begin, unsigned end);
+
+        /** Checks if any queue has jobs in it. */
+        bool hasJobs() const;
+
+    public:
+        /**
+         * Creates a scheduler that runs tasks on the given total
+         * number of threads, including the thread that starts the
+         * work. If no number is given, one thread per hardware core
+         * is used.
+         */
+        JobScheduler(unsigned threadCount=0);
+
+        /**
+         * Stops and joins the worker threads. There must be no work
+         * running.
+         */
+        ~JobScheduler();
+
+        virtual void parallelFor(ParallelTask *task,
+                                 unsigned count,
+                                 unsigned grainSize=1);
+
+        virtual unsigned getWorkerCount() const;
+
+        virtual void runGraph(TaskGraph *graph);
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_TASKS_H
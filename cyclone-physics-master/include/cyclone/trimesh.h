@@ -0,0 +1,308 @@
+/*
+ * Interface file for triangle mesh primitives.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/**
+ * @file
+ *
+ * This file contains the triangle mesh primitive, used for fixed
+ * level geometry that is too detailed to build from planes and
+ * boxes.
+ *
+ * The triangles of a mesh are held in a tree of bounding boxes, so
+ * the collision detector only looks at the triangles near the object
+ * being tested. To keep the tree small, its boxes are stored as
+ * 16 bit offsets from a corner of the whole mesh. The tree, the
+ * triangles and the vertices are all held in one flat block of
+ * memory, which can be saved to a file and used again directly from
+ * memory (for example from a memory mapped file), so a large level
+ * does not have to rebuild its tree each time it loads.
+ */
+#ifndef CYCLONE_TRIMESH_H
+#define CYCLONE_TRIMESH_H
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+#include "collide_fine.h"
+
+namespace cyclone {
+
+    /**
+     * Holds the triangles of a mesh and the tree used to find them.
+     * The data is shared by any number of mesh primitives, so a mesh
+     * used many times in a level is only held once. It counts the
+     * references to it, and deletes itself when the last is released.
+     *
+     * Everything is held in the mesh's own coordinates. The data
+     * never changes once it has been created, so it can be searched
+     * from several threads at once.
+     */
+    class TriangleMeshData
+    {
+    public:
+        /**
+         * Holds a node of the tree: the box around the triangles
+         * below it, stored as offsets from the corner of the mesh.
+         * The nodes are stored in depth first order, so the first
+         * child of a node follows it. A leaf holds one triangle,
+         * whose index is stored in the node. A node with children
+         * stores minus the number of nodes in its subtree, which is
+         * how far to jump forward to skip it.
+         */
+        struct Node
+        {
+            unsigned short lower[3];
+            unsigned short upper[3];
+            int index;
+        };
+
+        /**
+         * Holds the start of the block of memory that holds the mesh,
+         * which is laid out as this header, the vertices (three reals
+         * each), the triangles (three vertex indices each) and then
+         * the nodes of the tree. Each part starts at a multiple of
+         * eight bytes.
+         */
+        struct BlobHeader
+        {
+            /** Holds the characters 'CTRM' to identify a mesh blob. */
+            char magic[4];
+
+            /** Holds the version of the layout of the blob. */
+            unsigned version;
+
+            /**
+             * Holds the size of a real in the program that wrote the
+             * blob, since the vertices are stored as reals.
+             */
+            unsigned realSize;
+
+            unsigned vertexCount;
+            unsigned triangleCount;
+            unsigned nodeCount;
+
+            /** Holds the corner the nodes' boxes are offsets from. */
+            real origin[3];
+
+            /** Holds the number of offset steps per unit of length. */
+            real scale[3];
+        };
+
+        /** The version of the blob layout written by this code. */
+        static const unsigned blobVersion = 1;
+
+    protected:
+        /** Holds the number of references to the data. */
+        std::atomic<unsigned> references;
+
+        /**
+         * Holds the blob if it was built by create. It is held as
+         * doubles so it starts at a multiple of eight bytes.
+         */
+        std::vector<double> storage;
+
+        /** Holds the blob, whether built here or given from outside. */
+        const BlobHeader *header;
+        size_t blobSize;
+
+        /** Point into the blob at each of its parts. */
+        const real *vertices;
+        const unsigned *triangles;
+        const Node *nodes;
+
+        TriangleMeshData();
+        TriangleMeshData(const TriangleMeshData &);
+        TriangleMeshData& operator=(const TriangleMeshData &);
+
+        /**
+         * Finds the parts of the blob, which must already have been
+         * checked.
+         */
+        void setBlob(const void *blob, size_t size);
+
+        /**
+         * Works out where each part of a blob with the given number
+         * of vertices, triangles and nodes starts, returning the
+         * total size of the blob.
+         */
+        static size_t getLayout(unsigned vertexCount,
+                                unsigned triangleCount,
+                                unsigned nodeCount,
+                                size_t *triangleOffset,
+                                size_t *nodeOffset);
+
+    public:
+        /**
+         * Creates mesh data from the given vertices, and from the
+         * given triangles as three vertex indices each. The
+         * triangles' vertices are taken anticlockwise when seen from
+         * the side they collide on. The data starts with one
+         * reference, owned by the caller. Returns NULL if there are
+         * no triangles or an index is out of range.
+         */
+        static TriangleMeshData* create(const Vector3 *vertices,
+                                        unsigned vertexCount,
+                                        const unsigned *indices,
+                                        unsigned triangleCount);
+
+        /**
+         * Creates mesh data that uses a blob written out earlier,
+         * without copying it: the blob must stay valid, unchanged and
+         * at the same address until the data is deleted. It must
+         * start at a multiple of eight bytes, as memory mapped files
+         * do. Only the header is checked, so the blob must be one
+         * written by this code, on a machine with the same byte order
+         * and size of real. Returns NULL if the header doesn't match.
+         */
+        static TriangleMeshData* createFromBlob(const void *blob,
+                                                size_t size);
+
+        /** Adds a reference to the data. */
+        void addReference();
+
+        /**
+         * Releases a reference to the data, deleting it when none are
+         * left.
+         */
+        void release();
+
+        /**
+         * Returns the block of memory holding the whole mesh. Writing
+         * these bytes to a file saves the mesh, ready to be given to
+         * createFromBlob.
+         */
+        const void* getBlob() const
+        {
+            return header;
+        }
+
+        /** Returns the size of the blob, in bytes. */
+        size_t getBlobSize() const
+        {
+            return blobSize;
+        }
+
+        unsigned getVertexCount() const
+        {
+            return header->vertexCount;
+        }
+
+        unsigned getTriangleCount() const
+        {
+            return header->triangleCount;
+        }
+
+        /** Returns the given vertex, in the mesh's own coordinates. */
+        Vector3 getVertex(unsigned index) const
+        {
+            const real *v = vertices + index * 3;
+            return Vector3(v[0], v[1], v[2]);
+        }
+
+        /**
+         * Writes the three corners of the given triangle, in the
+         * mesh's own coordinates.
+         */
+        void getTriangle(unsigned triangle, Vector3 *corners) const
+        {
+            const unsigned *t = triangles + triangle * 3;
+            corners[0] = getVertex(t[0]);
+            corners[1] = getVertex(t[1]);
+            corners[2] = getVertex(t[2]);
+        }
+
+        /** Returns the box around the whole mesh. */
+        BoundingBox getBounds() const;
+
+        /**
+         * Reports each triangle whose box overlaps the given box,
+         * which is in the mesh's own coordinates. Each box in the
+         * tree is rounded outwards when it is stored, so a few
+         * triangles just outside the box may be reported too.
+         */
+        void findTriangles(const BoundingBox &box,
+                           TriangleCallback *callback) const;
+
+        /**
+         * Finds the nearest triangle hit by a ray in the mesh's own
+         * coordinates, from either side, before the given distance.
+         * If there is one, its index and the distance to it are
+         * written out and true is returned.
+         */
+        bool raycast(const Vector3 &origin,
+                     const Vector3 &direction,
+                     real maxDistance,
+                     unsigned *triangle,
+                     real *distance) const;
+    };
+
+    /**
+     * Represents fixed geometry made of triangles for collision
+     * detection. Its triangles are held in a TriangleMeshData, which
+     * may be shared with other meshes.
+     *
+     * A mesh would usually have no body, so it stays where its
+     * offset puts it. It may be attached to a body with infinite
+     * mass, such as a platform moved by hand, but it can't be part of
+     * a body that moves under forces, since it has no volume.
+     *
+     * Each triangle only pushes objects out of its front, the side
+     * its vertices are anticlockwise from. Objects whose centre has
+     * passed behind a triangle are not pushed back through it. Spheres
+     * and boxes collide with meshes; other pairs generate no contacts.
+     */
+    class CollisionTriangleMesh : public TriangleSurface
+    {
+    protected:
+        /** Holds the triangles, or NULL if none have been set. */
+        TriangleMeshData *data;
+
+    public:
+        /**
+         * Creates a mesh using the given data, adding a reference to
+         * it.
+         */
+        CollisionTriangleMesh(TriangleMeshData *data = NULL);
+
+        CollisionTriangleMesh(const CollisionTriangleMesh &other);
+        CollisionTriangleMesh& operator=(const CollisionTriangleMesh &other);
+        virtual ~CollisionTriangleMesh();
+
+        /**
+         * Changes the data the mesh uses, releasing its reference to
+         * the old data and adding one to the new.
+         */
+        void setData(TriangleMeshData *data);
+
+        /** Returns the data the mesh uses. */
+        const TriangleMeshData* getData() const
+        {
+            return data;
+        }
+
+        virtual BoundingBox getBoundingBox() const;
+
+        virtual void getTriangle(unsigned triangle, Vector3 *corners) const;
+
+        virtual void findTriangles(const BoundingBox &box,
+                                   TriangleCallback *callback) const;
+
+        virtual bool raycastTriangles(const Vector3 &origin,
+                                      const Vector3 &direction,
+                                      real maxDistance,
+                                      unsigned *triangle,
+                                      real *distance) const;
+    };
+
+} // namespace cyclone
+
+#endif // CYCLONE_TRIMESH_H
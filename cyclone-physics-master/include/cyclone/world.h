@@ -19,8 +19,11 @@
 #ifndef CYCLONE_WORLD_H
 #define CYCLONE_WORLD_H
 
+#include <vector>
 #include "body.h"
 #include "contacts.h"
+#include "collide_fine.h"
+#include "tasks.h"
 
 namespace cyclone {
     /**
@@ -30,6 +33,28 @@ namespace cyclone {
      */
     class World
     {
+    public:
+        /**
+         * Identifies a body, primitive or contact generator registered
+         * with the world. A handle stays valid while the thing it
+         * names is registered, however many other things are added
+         * and removed. Once it has been removed the handle is stale,
+         * and is never mistaken for whatever is registered in its
+         * place.
+         * A default constructed handle names nothing.
+         */
+        struct Handle
+        {
+            /** Holds the slot in the world's table of handles. */
+            unsigned slot;
+
+            /** Holds the generation of the slot the handle was given. */
+            unsigned generation;
+
+            Handle() : slot(0xffffffff), generation(0) {}
+        };
+
+    protected:
         // ... other World data as before ...
         /**
          * True if the world should calculate the number of iterations
@@ -38,18 +63,79 @@ namespace cyclone {
         bool calculateIterations;
 
         /**
-         * Holds a single rigid body in a linked list of bodies.
+         * Maps handles to positions in one of the world's registration
+         * arrays. The arrays are kept packed: removing an entry moves
+         * the last entry into its place, and the table is told so the
+         * moved entry's handle still finds it.
          */
-        struct BodyRegistration
+        class HandleTable
         {
-            RigidBody *body;
-            BodyRegistration * next;
+            /**
+             * Holds one slot a handle can name. A slot in use holds
+             * the position of its entry; a free one holds the next
+             * free slot.
+             */
+            struct Slot
+            {
+                unsigned index;
+                unsigned generation;
+            };
+
+            /** Holds the slots. */
+            std::vector<Slot> slots;
+
+            /** Holds the slot of the entry at each position. */
+            std::vector<unsigned> entrySlots;
+
+            /** Holds the first free slot, or noSlot if there is none. */
+            unsigned freeSlot;
+
+            /** Marks the end of the list of free slots. */
+            static const unsigned noSlot = 0xffffffff;
+
+        public:
+            HandleTable();
+
+            /**
+             * Returns a handle for a new entry, which the caller adds
+             * at the end of its array.
+             */
+            Handle create();
+
+            /**
+             * Returns the position of the entry the given handle
+             * names, or noEntry if the handle is stale.
+             */
+            unsigned find(Handle handle) const;
+
+            /**
+             * Makes the given handle stale, and returns the position
+             * of its entry, or noEntry if it was already stale. The
+             * caller must move the last entry of its array into that
+             * position and drop the last entry.
+             */
+            unsigned destroy(Handle handle);
+
+            /** Returns the handle of the entry at the given position. */
+            Handle getHandle(unsigned index) const;
+
+            /** Makes every handle stale. */
+            void clear();
+
+            /** Returned by find and destroy for a stale handle. */
+            static const unsigned noEntry = 0xffffffff;
         };
 
         /**
-         * Holds the head of the list of registered bodies.
+         * Holds the registered bodies, packed together so each frame
+         * can walk straight through them.
          */
-        BodyRegistration *firstBody;
+        std::vector<RigidBody*> bodies;
+
+        /**
+         * Holds the handles of the registered bodies.
+         */
+        HandleTable bodyHandles;
 
         /**
          * Holds the resolver for sets of contacts.
@@ -57,45 +143,654 @@ namespace cyclone {
         ContactResolver resolver;
 
         /**
-         * Holds one contact generators in a linked list.
+         * Holds the registered contact generators, in the order they
+         * are run.
+         */
+        std::vector<ContactGenerator*> contactGenerators;
+
+        /**
+         * Holds the handles of the registered contact generators.
+         */
+        HandleTable contactGenHandles;
+
+        /**
+         * Holds the contacts for this frame, for filling by the
+         * contact generators and the collision detection. The buffer
+         * grows when a frame has more contacts than it has room for.
+         */
+        ContactBuffer<Contact> contacts;
+
+        /**
+         * @name Collision Detection
+         *
+         * The world runs its own collision detection on the
+         * primitives registered with it. A broadphase tree finds the
+         * pairs of primitives that might be touching, and each pair
+         * is passed to the collision detector routine for its types.
+         * Planes are tested against every primitive.
+         */
+        /*@{*/
+
+        /**
+         * Holds the primitives registered with the world.
+         */
+        std::vector<CollisionPrimitive*> primitives;
+
+        /**
+         * Holds the broadphase proxy of each registered primitive.
+         */
+        std::vector<unsigned> primitiveProxies;
+
+        /**
+         * Holds the handles of the registered primitives.
+         */
+        HandleTable primitiveHandles;
+
+        /**
+         * Holds the bodies being removed by removeBodies, kept to
+         * save allocating it each time.
+         */
+        std::vector<RigidBody*> removedBodies;
+
+        /**
+         * Holds the planes registered with the world.
+         */
+        std::vector<CollisionPlane*> planes;
+
+        /**
+         * Holds the broadphase tree of the primitives' bounding boxes.
+         */
+        AABBTree broadphase;
+
+        /**
+         * Holds the pairs found by the broadphase each frame.
+         */
+        std::vector<PotentialContact> potentialContacts;
+
+        /**
+         * Holds the friction, restitution and tolerance to use for
+         * contacts between primitives, and tracks the contacts
+         * being written.
+         */
+        CollisionData collisionData;
+
+        /**
+         * Holds the axes that kept pairs of boxes apart last frame.
+         */
+        SeparatingAxisCache axisCache;
+
+        /*@}*/
+
+        /**
+         * Checks if the given body needs its contacts generated: it
+         * must exist, be able to move, and be awake.
+         */
+        static bool isActive(const RigidBody *body)
+        {
+            return body && body->getAwake() && body->hasFiniteMass();
+        }
+
+        /**
+         * Runs the collision detection on the registered primitives,
+         * adding the contacts to the end of the contacts buffer.
+         * Returns the number of contacts generated.
+         */
+        unsigned generateCollisions();
+
+        /**
+         * Runs the collision detection for the given range of
+         * collision items, writing the contacts into the given data.
+         * The first numPairs items are the pairs the broadphase found,
+         * and each item after that tests one primitive against all the
+         * planes.
+         */
+        void collideItems(unsigned begin, unsigned end,
+                          unsigned numPairs, CollisionData *data);
+
+        /**
+         * @name Bullets
+         *
+         * The sphere primitives of bodies marked as bullets are swept
+         * from where they start each frame to where they end. A
+         * bullet that would hit something on the way is moved back
+         * to just past the point where it first touches, so the
+         * contact is generated as normal, rather than passing
+         * through. The other objects are treated as staying where
+         * they were at the start of the frame.
+         */
+        /*@{*/
+
+        /**
+         * Holds the index in primitives of each active bullet sphere
+         * this frame.
+         */
+        std::vector<unsigned> bulletPrimitives;
+
+        /**
+         * Holds the proxies found along the path of a bullet.
+         */
+        std::vector<unsigned> sweptProxies;
+
+        /**
+         * Holds how far a bullet is left inside the object it hits,
+         * as a fraction of its radius, so that a contact is generated.
+         */
+        static const real bulletPenetration;
+
+        /*@}*/
+
+        /**
+         * Finds the active bullets, and works out the starting
+         * transforms of their primitives.
+         */
+        void findBullets();
+
+        /**
+         * Sweeps each bullet found by findBullets from its starting
+         * position to where its body has been integrated to, and
+         * moves back any that hit something.
+         */
+        void sweepBullets();
+
+        /**
+         * Sweeps a single bullet sphere by the given displacement
+         * against the planes and the primitives in the broadphase,
+         * returning the time of the first hit, or one if it hits
+         * nothing. Objects the sphere touches at the start are
+         * ignored: they have contacts generated as normal.
+         */
+        real sweepSphere(const CollisionSphere &sphere,
+                         const Vector3 &displacement);
+
+        /**
+         * @name Contact Islands
+         *
+         * Contacts are split into islands: groups of contacts that
+         * are connected through bodies that can move. Bodies with
+         * infinite mass don't connect islands, since resolving a
+         * contact never moves them. Each island can be resolved on
+         * its own, and islands can be resolved at the same time on
+         * different threads.
+         */
+        /*@{*/
+
+        /**
+         * Holds the contacts sorted by island. The contacts for
+         * island i are islandContacts[islandStart[i]] up to (but not
+         * including) islandContacts[islandStart[i+1]]. This array
+         * grows to fit the contacts, and is kept from frame to frame.
+         */
+        std::vector<Contact> islandContacts;
+
+        /**
+         * Holds the offset of each island in the islandContacts
+         * array, plus one final entry for the end.
+         */
+        std::vector<unsigned> islandStart;
+
+        /**
+         * Holds whether each island has at least one awake body.
+         * Islands that are completely asleep are not resolved.
+         */
+        std::vector<bool> islandAwake;
+
+        /**
+         * Holds one resolver per island, so islands can be resolved
+         * in parallel. These are copies of the main resolver, and are
+         * kept from frame to frame so their memory is reused.
+         */
+        std::vector<ContactResolver> islandResolvers;
+
+        /**
+         * Holds the movable bodies taking part in contacts this frame,
+         * sorted so they can be looked up.
+         */
+        std::vector<RigidBody*> islandBodies;
+
+        /**
+         * Holds the union-find parent of each entry in islandBodies.
+         */
+        std::vector<unsigned> islandParent;
+
+        /**
+         * Holds the island of each contact this frame.
+         */
+        std::vector<unsigned> contactIsland;
+
+        /**
+         * Holds the islands that are shared out between threads when
+         * the larger islands are resolved one at a time.
+         */
+        std::vector<unsigned> smallIslands;
+
+        /*@}*/
+
+        /**
+         * Holds the executor used to resolve islands in parallel, or
+         * NULL to resolve them on the calling thread.
+         */
+        TaskExecutor *executor;
+
+        /**
+         * Holds the cache used to warm start contacts, or NULL if
+         * contacts start from nothing each frame.
+         */
+        ContactCache *contactCache;
+
+        /**
+         * The parallel task that resolves a range of islands.
+         */
+        struct IslandSolver : public ParallelTask
+        {
+            World *world;
+
+            /**
+             * Holds the islands to resolve, or NULL to use the item
+             * numbers as the islands.
+             */
+            const unsigned *islands;
+
+            real duration;
+
+            virtual void run(unsigned begin, unsigned end);
+        };
+
+        /**
+         * Returns the union-find node for the given body, or
+         * noIslandBody if the body doesn't connect islands.
+         */
+        unsigned findIslandBody(RigidBody *body) const;
+
+        /**
+         * Returns the root of the union-find tree holding the given
+         * node, compressing the path as it goes.
+         */
+        unsigned findIslandRoot(unsigned node);
+
+        /**
+         * Marks a body that doesn't belong to any island.
+         */
+        static const unsigned noIslandBody = 0xffffffff;
+
+        /**
+         * @name Frame Tasks
+         *
+         * runPhysics works through the frame as a graph of tasks,
+         * which the executor can spread over its threads. Bodies are
+         * integrated and primitives placed in parallel ranges, the
+         * broadphase runs on one thread while the contact generators
+         * run on another, and the narrowphase is split into batches of
+         * pairs. Each batch writes into a buffer of its own, and the
+         * buffers are joined in order, so the contacts come out the
+         * same however many threads there are. Finally the islands
+         * are resolved.
+         */
+        /*@{*/
+
+        /**
+         * The parallel task that runs one stage of the frame.
+         */
+        struct FrameTask : public ParallelTask
+        {
+            World *world;
+            void (World::*stage)(unsigned begin, unsigned end);
+
+            virtual void run(unsigned begin, unsigned end);
+        };
+
+        /**
+         * Holds the contacts found by one batch of the narrowphase.
          */
-        struct ContactGenRegistration
+        struct CollisionBatch
         {
-            ContactGenerator *gen;
-            ContactGenRegistration *next;
+            /**
+             * Holds the contacts. The buffer grows as the batch fills
+             * it, and is kept from frame to frame.
+             */
+            ContactBuffer<Contact> contacts;
+
+            /**
+             * Holds the axes that separated boxes in this batch,
+             * which are merged into the world's cache.
+             */
+            SeparatingAxisCache axes;
         };
 
         /**
-         * Holds the head of the list of contact generators.
+         * Holds the stages of the frame, and the tasks that run them.
+         */
+        TaskGraph frameGraph;
+        FrameTask frameTasks[8];
+
+        /** Holds the duration of the frame being run. */
+        real frameDuration;
+
+        /** Holds the number of bodies integrated this frame. */
+        unsigned frameBodyCount;
+
+        /** Holds the number of registered primitives this frame. */
+        unsigned framePrimitiveCount;
+
+        /** Holds the bounding box of each primitive this frame. */
+        std::vector<BoundingBox> primitiveBoxes;
+
+        /**
+         * Holds how far each primitive is expected to move over the
+         * next frame.
+         */
+        std::vector<Vector3> primitiveDisplacements;
+
+        /**
+         * Holds the bounding box of each primitive laid out for testing
+         * against the planes, or an empty slot if nothing can move it.
+         * The slots are rewritten as the primitives are placed each
+         * frame.
+         */
+        PrimitiveBatch planeBatch;
+
+        /** Holds the number of pairs the broadphase found. */
+        unsigned framePairCount;
+
+        /** Holds the number of collision items to test this frame. */
+        unsigned collisionItemCount;
+
+        /** Holds the results of each batch of the narrowphase. */
+        std::vector<CollisionBatch> collisionBatches;
+
+        /** Holds the number of collision items in each batch. */
+        static const unsigned collisionBatchSize;
+
+        /**
+         * Adds the stages of the frame to frameGraph.
          */
-        ContactGenRegistration *firstContactGen;
+        void buildFrameGraph();
 
         /**
-         * Holds an array of contacts, for filling by the contact
-         * generators.
+         * Counts the bodies and finds the bullets.
          */
-        Contact *contacts;
+        void beginStep(unsigned begin, unsigned end);
 
         /**
-         * Holds the maximum number of contacts allowed (i.e. the size
-         * of the contacts array).
+         * Integrates a range of bodies.
          */
-        unsigned maxContacts;
+        void integrateBodies(unsigned begin, unsigned end);
+
+        /**
+         * Sweeps the bullets once all the bodies have moved.
+         */
+        void finishIntegration(unsigned begin, unsigned end);
+
+        /**
+         * Recalculates the transforms and boxes of a range of
+         * primitives.
+         */
+        void placePrimitives(unsigned begin, unsigned end);
+
+        /**
+         * Moves the primitives in the broadphase, and finds the pairs
+         * that might be touching.
+         */
+        void findPairs(unsigned begin, unsigned end);
+
+        /**
+         * Runs the registered contact generators.
+         */
+        void runContactGenerators(unsigned begin, unsigned end);
+
+        /**
+         * Runs the narrowphase for a range of collision items, which
+         * must be one batch.
+         */
+        void collideBatch(unsigned begin, unsigned end);
+
+        /**
+         * Joins the contacts from all the batches and resolves them.
+         */
+        void resolveFrame(unsigned begin, unsigned end);
+
+        /**
+         * Splits the first numContacts contacts into islands, writing
+         * them in island order into the island contact array. Returns
+         * the number of islands.
+         */
+        unsigned buildIslands(unsigned numContacts);
+
+        /**
+         * Resolves the contacts in each island that has an awake
+         * body, using the executor if one has been set.
+         */
+        void resolveIslands(unsigned numIslands, real duration);
+
+        /**
+         * Removes the primitive at the given position, moving the
+         * last primitive into its place.
+         */
+        void removePrimitiveAt(unsigned index);
+
+        /**
+         * Removes every primitive whose body is one of the given
+         * bodies, which must be sorted by address.
+         */
+        void removeBodyPrimitives(RigidBody *const *sortedBodies,
+                                  unsigned count);
+
+        /**
+         * Counts the registered primitives for this frame, and makes
+         * room for their boxes.
+         */
+        void countPrimitives();
+
+        /**
+         * Moves each primitive's proxy to the box and displacement
+         * worked out by placePrimitives.
+         */
+        void moveProxies();
+
+        /*@}*/
 
     public:
         /**
-         * Creates a new simulator that can handle up to the given
-         * number of contacts per frame. You can also optionally give
-         * a number of contact-resolution iterations to use. If you
-         * don't give a number of iterations, then four times the
-         * number of detected contacts will be used for each frame.
+         * Creates a new simulator with room for the given number of
+         * contacts per frame. The room grows when a frame needs more,
+         * so no contacts are dropped, but starting with enough room
+         * avoids growing it: getContactBuffer reports how much is
+         * needed. You can also optionally give a number of
+         * contact-resolution iterations to use. If you don't give a
+         * number of iterations, then four times the number of
+         * contacts in each island will be used for that island.
          */
-        World(unsigned maxContacts, unsigned iterations=0);
+        World(unsigned contactCapacity, unsigned iterations=0);
         ~World();
 
+        /**
+         * @name Registration
+         *
+         * Bodies, primitives and contact generators are registered
+         * with the world, which does not take ownership of them.
+         * Removing one moves the last one registered into its place,
+         * so it is cheap however many there are, but the order
+         * contact generators are run in can change. Nothing may be added or
+         * removed while runPhysics is running.
+         */
+        /*@{*/
+
+        /**
+         * Registers a body to be simulated, and returns its handle.
+         * Any primitives for the body are registered separately with
+         * addPrimitive, and are removed along with the body.
+         */
+        Handle addBody(RigidBody *body);
+
+        /**
+         * Registers the given number of bodies. If handles is not
+         * NULL, the handle of each body is written into it.
+         */
+        void addBodies(RigidBody *const *bodies, unsigned count,
+                       Handle *handles = NULL);
+
+        /**
+         * Removes the body with the given handle, along with every
+         * primitive registered for it. Returns false if the handle is
+         * stale. Finding the body's primitives means looking through
+         * all of them, so use removeBodies to remove many bodies.
+         */
+        bool removeBody(Handle handle);
+
+        /**
+         * Removes the bodies with the given handles, along with every
+         * primitive registered for them, which are all found in one
+         * pass. Stale handles are skipped.
+         */
+        void removeBodies(const Handle *handles, unsigned count);
+
+        /**
+         * Returns the body with the given handle, or NULL if the
+         * handle is stale.
+         */
+        RigidBody* getBody(Handle handle) const;
+
+        /**
+         * Returns the registered bodies. The order changes as bodies
+         * are removed.
+         */
+        const std::vector<RigidBody*>& getBodies() const
+        {
+            return bodies;
+        }
+
+        /**
+         * Registers a contact generator, which is run each frame
+         * before the contacts between primitives are found. A
+         * generator that fills all the room it is given is run again
+         * with more, so it must write the same contacts each time it
+         * is called in a frame.
+         */
+        Handle addContactGenerator(ContactGenerator *generator);
+
+        /**
+         * Removes the contact generator with the given handle.
+         * Returns false if the handle is stale.
+         */
+        bool removeContactGenerator(Handle handle);
+
+        /**
+         * Returns the contact generator with the given handle, or
+         * NULL if the handle is stale.
+         */
+        ContactGenerator* getContactGenerator(Handle handle) const;
+
+        /**
+         * Removes every body, primitive and contact generator, making
+         * all their handles stale.
+         */
+        void clearRegistrations();
+
+        /*@}*/
+
+        /**
+         * Returns the buffer holding the contacts of the last frame.
+         * Its high water mark and overflow count show how much room
+         * the world needs to start with.
+         */
+        const ContactBuffer<Contact>& getContactBuffer() const
+        {
+            return contacts;
+        }
+
+        /**
+         * Sets the executor used to run each frame in parallel:
+         * integrating bodies, detecting collisions and resolving
+         * contact islands. The world does not take ownership of the
+         * executor. Passing NULL (the default) runs everything on the
+         * calling thread. The frame is run with the executor's
+         * runGraph, so an executor that can run independent tasks at
+         * the same time (such as JobScheduler) gets more done at
+         * once.
+         */
+        void setExecutor(TaskExecutor *executor);
+
+        /**
+         * Sets the cache used to carry contact impulses from one
+         * frame to the next, which lets resting contacts settle in
+         * far fewer iterations. The world does not take ownership of
+         * the cache. Passing NULL (the default) turns warm starting
+         * off.
+         */
+        void setContactCache(ContactCache *contactCache);
+
+        /**
+         * Sets the algorithm the contact resolvers use to resolve
+         * velocities. With the coloured solver and an executor, large
+         * islands are resolved one at a time, each spreading its
+         * contacts over the executor's threads.
+         */
+        void setVelocitySolver(ContactResolver::VelocitySolver velocitySolver,
+                               unsigned sweeps=10);
+
+        /**
+         * Registers a primitive for collision detection. The
+         * primitive must stay valid until it is removed: the world
+         * does not take ownership of it. A primitive with no body,
+         * such as the triangle mesh of a level, stays where its
+         * offset puts it and only collides with primitives that can
+         * move. Returns the primitive's handle.
+         */
+        Handle addPrimitive(CollisionPrimitive *primitive);
+
+        /**
+         * Removes the primitive with the given handle from the world
+         * and its broadphase. Returns false if the handle is stale.
+         */
+        bool removePrimitive(Handle handle);
+
+        /**
+         * Returns the primitive with the given handle, or NULL if the
+         * handle is stale.
+         */
+        CollisionPrimitive* getPrimitive(Handle handle) const;
+
+        /**
+         * Returns the broadphase tree of the registered primitives.
+         * A SceneQuery built over it casts rays into the world.
+         */
+        const AABBTree& getBroadphase() const
+        {
+            return broadphase;
+        }
+
+        /**
+         * Registers a plane to collide the primitives against. The
+         * world does not take ownership of the plane.
+         */
+        void addPlane(CollisionPlane *plane);
+
+        /**
+         * Removes a plane registered with addPlane.
+         */
+        void removePlane(CollisionPlane *plane);
+
+        /**
+         * Sets the friction and restitution given to contacts between
+         * primitives, and the distance within which primitives that
+         * are not quite touching still generate contacts.
+         */
+        void setCollisionProperties(real friction,
+                                    real restitution,
+                                    real tolerance=0);
+
+        /**
+         * Recalculates the transforms of the registered primitives
+         * and moves them in the broadphase. The duration is used to
+         * predict how far each primitive will move in the next frame.
+         * This is called by runPhysics after the bodies have been
+         * integrated.
+         */
+        void updatePrimitives(real duration);
+
         /**
          * Calls each of the registered contact generators to report
-         * their contacts. Returns the number of generated contacts.
+         * their contacts, then adds the contacts between registered
+         * primitives. Returns the number of generated contacts.
          */
         unsigned generateContacts();
 
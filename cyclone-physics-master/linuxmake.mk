@@ -4,7 +4,7 @@
 PLATFORM = $(shell uname)
 
 ifeq ($(PLATFORM), Linux)
-    LDFLAGS = -lGL -lGLU -lglut
+    LDFLAGS = -lGL -lGLU -lglut -pthread
 else
     $(error This OS is not Ubuntu Linux. Aborting)
 endif
@@ -18,15 +18,46 @@ DEMOCOREFILES = $(DEMOPATH)main.cpp $(DEMOPATH)app.cpp $(DEMOPATH)timing.cpp
 # Demo files.
 DEMOLIST = ballistic bigballistic blob bridge explosion fireworks flightsim fracture platform ragdoll sailboat
 
+# Benchmark files path.
+BENCHPATH = ./src/bench/
+
+# Test files path.
+TESTPATH = ./src/tests/
+
+# Test files.
+TESTLIST = convextest
+
+# The vector code test, which is built both with and without the
+# vector code and compares the two.
+SIMDTESTS = simdtest simdtest_scalar
+
 # Cyclone core files.
-CYCLONEFILES = ./src/body.cpp ./src/collide_coarse.cpp ./src/collide_fine.cpp ./src/contacts.cpp ./src/core.cpp ./src/fgen.cpp ./src/joints.cpp ./src/particle.cpp ./src/pcontacts.cpp ./src/pfgen.cpp ./src/plinks.cpp ./src/pworld.cpp ./src/random.cpp ./src/world.cpp
+CYCLONEFILES = ./src/body.cpp ./src/bodystore.cpp ./src/capsule.cpp ./src/collide_coarse.cpp ./src/collide_fine.cpp ./src/contacts.cpp ./src/convex.cpp ./src/core.cpp ./src/fgen.cpp ./src/heightfield.cpp ./src/joints.cpp ./src/particle.cpp ./src/pcontacts.cpp ./src/pfgen.cpp ./src/pgrid.cpp ./src/plinks.cpp ./src/pworld.cpp ./src/query.cpp ./src/random.cpp ./src/tasks.cpp ./src/trimesh.cpp ./src/world.cpp
 
-.PHONY: clean
+.PHONY: clean check
 
-all: $(DEMOLIST)
+all: $(DEMOLIST) bench $(TESTLIST) $(SIMDTESTS)
 
 $(DEMOLIST):
 	g++ -O2 -Iinclude $(DEMOCOREFILES) $(CYCLONEFILES) $(DEMOPATH)$@/$@.cpp -o $@ $(LDFLAGS) 
 
+# The benchmark runs without a window, so doesn't need the GL libraries.
+bench:
+	g++ -O2 -Iinclude $(CYCLONEFILES) $(BENCHPATH)bench.cpp -o $@ -pthread
+
+# The tests run without a window too, and fail with a non-zero status.
+$(TESTLIST):
+	g++ -O2 -Iinclude $(CYCLONEFILES) $(TESTPATH)$@.cpp -o $@ -pthread
+
+simdtest:
+	g++ -O2 -DCYCLONE_USE_SIMD -Iinclude $(CYCLONEFILES) $(TESTPATH)simdtest.cpp -o $@ -pthread
+
+simdtest_scalar:
+	g++ -O2 -Iinclude $(CYCLONEFILES) $(TESTPATH)simdtest.cpp -o $@ -pthread
+
+check: $(TESTLIST) $(SIMDTESTS)
+	for test in $(TESTLIST); do ./$$test || exit 1; done
+	./simdtest_scalar -write | ./simdtest
+
 clean:
-	rm $(DEMOLIST)
+	rm $(DEMOLIST) bench $(TESTLIST) $(SIMDTESTS)
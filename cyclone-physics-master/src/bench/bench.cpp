@@ -0,0 +1,2138 @@
+/*
+ * A headless benchmark of the physics engine.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/*
+ * The benchmark sets up the same simulations as the bigballistic,
+ * fracture, ragdoll, bridge and blob demos (along with larger stress
+ * scenes), and runs each one for a fixed number of fixed length time
+ * steps, without opening a window. Anything the demos take from the
+ * clock or from the user is replaced with a fixed seed or a fixed
+ * schedule, so every run of the same build does the same work.
+ *
+ * Each scene prints one line of JSON, giving the time spent in each
+ * phase of the simulation, the contacts and resolver iterations used,
+ * and a checksum of the final state of every object.
+ *
+ * Usage: bench [-steps N] [-duration T] [-scale S] [-warmstart 1]
+ *              [-coloured N] [-threads N] [scene ...]
+ *
+ * With no scene names the demo scenes are run. The name "all" runs
+ * every scene, and "stress" runs the large scenes, whose size is
+ * multiplied by the scale. Rigid body scenes warm start their
+ * contacts from a ContactCache if warmstart is non-zero. If coloured
+ * is non-zero they resolve velocities with the coloured solver,
+ * sweeping that many times, spread over the given number of threads.
+ * The particle scenes use the threads to work out their forces and
+ * integrate their particles.
+ */
+#include <cyclone/cyclone.h>
+#include <cyclone/world.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using cyclone::real;
+
+/**
+ * True if the rigid body scenes should warm start their contacts.
+ */
+static bool warmStart = false;
+
+/**
+ * The number of sweeps the rigid body scenes' coloured solver makes,
+ * or zero to use the default worst-first solver.
+ */
+static unsigned colouredSweeps = 0;
+
+/**
+ * The executor used by the coloured solver and the particle worlds,
+ * or NULL to use one thread.
+ */
+static cyclone::TaskExecutor *executor = NULL;
+
+/**
+ * Returns a pool with the given number of threads. The pool is made
+ * the first time this is called, and lasts until the program exits.
+ */
+static cyclone::TaskExecutor *getThreadPool(unsigned threads)
+{
+    static cyclone::ThreadPool pool(threads);
+    return &pool;
+}
+
+/**
+ * Returns the current time in seconds, from an arbitrary start.
+ */
+static double getTime()
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Holds the measurements taken while running a scene.
+ */
+struct SceneStats
+{
+    /**
+     * @name Phase Timings
+     *
+     * The total time spent in each phase, in seconds. Particle scenes
+     * resolve their contacts in one phase, so use resolve rather than
+     * the prepare, positions and velocities phases.
+     */
+    /*@{*/
+    double forces;
+    double integrate;
+    double contacts;
+    double prepare;
+    double positions;
+    double velocities;
+    double resolve;
+    /*@}*/
+
+    /** Holds the total number of contacts generated. */
+    unsigned long long contactCount;
+
+    /** Holds the most contacts generated in a single step. */
+    unsigned maxContactCount;
+
+    /** Holds the total velocity iterations used by the resolver. */
+    unsigned long long velocityIterations;
+
+    /** Holds the total position iterations used by the resolver. */
+    unsigned long long positionIterations;
+
+    /** Holds the total iterations used by the particle resolver. */
+    unsigned long long iterations;
+
+    SceneStats()
+    {
+        memset(this, 0, sizeof(SceneStats));
+    }
+
+    /**
+     * Records the number of contacts generated in one step.
+     */
+    void addContacts(unsigned count)
+    {
+        contactCount += count;
+        if (count > maxContactCount) maxContactCount = count;
+    }
+};
+
+/**
+ * Builds a 64 bit FNV-1a hash of the state of the objects in a
+ * scene. Values are hashed exactly, so any change to the results
+ * changes the checksum.
+ */
+class Checksum
+{
+    unsigned long long hash;
+
+public:
+    Checksum() : hash(14695981039346656037ULL) {}
+
+    void add(real value)
+    {
+        const unsigned char *bytes = (const unsigned char *)&value;
+        for (unsigned i = 0; i < sizeof(real); i++)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    void add(const cyclone::Vector3 &vector)
+    {
+        add(vector.x);
+        add(vector.y);
+        add(vector.z);
+    }
+
+    void add(const cyclone::Quaternion &quaternion)
+    {
+        add(quaternion.r);
+        add(quaternion.i);
+        add(quaternion.j);
+        add(quaternion.k);
+    }
+
+    void add(const cyclone::RigidBody *body)
+    {
+        add(body->getPosition());
+        add(body->getOrientation());
+        add(body->getVelocity());
+        add(body->getRotation());
+    }
+
+    void add(const cyclone::Particle *particle)
+    {
+        add(particle->getPosition());
+        add(particle->getVelocity());
+    }
+
+    unsigned long long get() const
+    {
+        return hash;
+    }
+};
+
+/**
+ * A contact resolver that times each of its phases.
+ */
+class TimedResolver : public cyclone::ContactResolver
+{
+public:
+    TimedResolver(unsigned iterations)
+    :
+    cyclone::ContactResolver(iterations)
+    {
+    }
+
+    /**
+     * Resolves the given contacts in the same way as the base class,
+     * adding the time taken and iterations used to the given stats.
+     */
+    void resolveContacts(cyclone::Contact *contactArray,
+                         unsigned numContacts,
+                         real duration,
+                         SceneStats &stats)
+    {
+        if (numContacts == 0) return;
+        if (!isValid()) return;
+
+        double start = getTime();
+        prepareContacts(contactArray, numContacts, duration);
+        double end = getTime();
+        stats.prepare += end - start;
+
+        start = end;
+        adjustPositions(contactArray, numContacts, duration);
+        end = getTime();
+        stats.positions += end - start;
+
+        start = end;
+        adjustVelocities(contactArray, numContacts, duration);
+        end = getTime();
+        stats.velocities += end - start;
+
+        stats.positionIterations += positionIterationsUsed;
+        stats.velocityIterations += velocityIterationsUsed;
+    }
+};
+
+/**
+ * A particle world that times each of its phases.
+ */
+class TimedParticleWorld : public cyclone::ParticleWorld
+{
+public:
+    TimedParticleWorld(unsigned maxContacts, unsigned iterations=0)
+    :
+    cyclone::ParticleWorld(maxContacts, iterations)
+    {
+    }
+
+    /**
+     * Runs one frame in the same way as startFrame followed by
+     * runPhysics, adding the time taken to the given stats.
+     */
+    void step(real duration, SceneStats &stats)
+    {
+        double start = getTime();
+        startFrame();
+        registry.updateForces(duration);
+        double end = getTime();
+        stats.forces += end - start;
+
+        start = end;
+        integrate(duration);
+        end = getTime();
+        stats.integrate += end - start;
+
+        start = end;
+        unsigned usedContacts = generateContacts();
+        end = getTime();
+        stats.contacts += end - start;
+        stats.addContacts(usedContacts);
+
+        if (usedContacts)
+        {
+            start = end;
+            if (calculateIterations) resolver.setIterations(usedContacts * 2);
+            resolver.resolveContacts(contacts.getContacts(), usedContacts,
+                                     duration);
+            end = getTime();
+            stats.resolve += end - start;
+            stats.iterations += resolver.getIterationsUsed();
+        }
+    }
+};
+
+/**
+ * The base class for all the benchmark scenes.
+ */
+class Scene
+{
+public:
+    virtual ~Scene() {}
+
+    /** Returns the number of objects simulated. */
+    virtual unsigned getObjectCount() const = 0;
+
+    /** Runs one time step, adding its measurements to the stats. */
+    virtual void step(real duration, SceneStats &stats) = 0;
+
+    /** Adds the current state of every object to the checksum. */
+    virtual void addChecksum(Checksum &checksum) const = 0;
+};
+
+/**
+ * A scene of rigid bodies, run in the same way as the demos built on
+ * RigidBodyApplication.
+ */
+class RigidBodyScene : public Scene
+{
+protected:
+    /** Holds the contacts generated each step. */
+    std::vector<cyclone::Contact> contacts;
+
+    /** Holds the collision data for the contact generators. */
+    cyclone::CollisionData cData;
+
+    /** Holds the contact resolver. */
+    TimedResolver resolver;
+
+    /** Holds the impulses used to warm start the contacts. */
+    cyclone::ContactCache contactCache;
+
+    /**
+     * True if the resolver should be given four iterations for each
+     * contact, rather than a fixed number.
+     */
+    bool calculateIterations;
+
+    /** Integrates every body and updates its primitives. */
+    virtual void updateObjects(real duration) = 0;
+
+    /** Fills cData with the contacts for this step. */
+    virtual void generateContacts() = 0;
+
+public:
+    RigidBodyScene(unsigned maxContacts, unsigned iterations)
+    :
+    contacts(maxContacts),
+    resolver(iterations),
+    calculateIterations(iterations == 0)
+    {
+        cData.contactArray = &contacts[0];
+        cData.reset((unsigned)contacts.size());
+        resolver.setWarmStarting(warmStart);
+        if (colouredSweeps > 0)
+        {
+            resolver.setVelocitySolver(
+                cyclone::ContactResolver::VELOCITY_COLOURED, colouredSweeps);
+            resolver.setExecutor(executor);
+        }
+    }
+
+    virtual void step(real duration, SceneStats &stats)
+    {
+        double start = getTime();
+        updateObjects(duration);
+        double end = getTime();
+        stats.integrate += end - start;
+
+        start = end;
+        generateContacts();
+        end = getTime();
+        stats.contacts += end - start;
+        stats.addContacts(cData.contactCount);
+
+        if (calculateIterations && cData.contactCount > 0)
+        {
+            resolver.setIterations(cData.contactCount * 4);
+        }
+
+        if (warmStart) contactCache.load(cData.contactArray, cData.contactCount);
+        resolver.resolveContacts(
+            cData.contactArray, cData.contactCount, duration, stats);
+        if (warmStart) contactCache.store(cData.contactArray, cData.contactCount);
+    }
+};
+
+/**
+ * Sets up the ground plane used by the rigid body demos.
+ */
+static cyclone::CollisionPlane makeGroundPlane()
+{
+    cyclone::CollisionPlane plane;
+    plane.direction = cyclone::Vector3(0,1,0);
+    plane.offset = 0;
+    return plane;
+}
+
+/*
+ * The bigballistic demo. The demo fires a round each time the mouse
+ * is clicked: here a round is fired at a fixed interval, working
+ * through each type of round in turn.
+ */
+
+enum ShotType
+{
+    UNUSED = 0,
+    PISTOL,
+    ARTILLERY,
+    FIREBALL,
+    LASER
+};
+
+class AmmoRound : public cyclone::CollisionSphere
+{
+public:
+    ShotType type;
+    real startTime;
+
+    AmmoRound()
+    :
+    type(UNUSED)
+    {
+        body = new cyclone::RigidBody;
+    }
+
+    ~AmmoRound()
+    {
+        delete body;
+    }
+
+    void setState(ShotType shotType, real time)
+    {
+        type = shotType;
+
+        switch(type)
+        {
+        case PISTOL:
+            body->setMass(1.5f);
+            body->setVelocity(0.0f, 0.0f, 20.0f);
+            body->setAcceleration(0.0f, -0.5f, 0.0f);
+            body->setDamping(0.99f, 0.8f);
+            radius = 0.2f;
+            break;
+
+        case ARTILLERY:
+            body->setMass(200.0f);
+            body->setVelocity(0.0f, 30.0f, 40.0f);
+            body->setAcceleration(0.0f, -21.0f, 0.0f);
+            body->setDamping(0.99f, 0.8f);
+            radius = 0.4f;
+            break;
+
+        case FIREBALL:
+            body->setMass(4.0f);
+            body->setVelocity(0.0f, -0.5f, 10.0);
+            body->setAcceleration(0.0f, 0.3f, 0.0f);
+            body->setDamping(0.9f, 0.8f);
+            radius = 0.6f;
+            break;
+
+        case LASER:
+            body->setMass(0.1f);
+            body->setVelocity(0.0f, 0.0f, 100.0f);
+            body->setAcceleration(0.0f, 0.0f, 0.0f);
+            body->setDamping(0.99f, 0.8f);
+            radius = 0.2f;
+            break;
+
+        default:
+            break;
+        }
+
+        body->setCanSleep(false);
+        body->setAwake();
+
+        cyclone::Matrix3 tensor;
+        cyclone::real coeff = 0.4f*body->getMass()*radius*radius;
+        tensor.setInertiaTensorCoeffs(coeff,coeff,coeff);
+        body->setInertiaTensor(tensor);
+
+        body->setPosition(0.0f, 1.5f, 0.0f);
+        body->setOrientation(1,0,0,0);
+        body->setRotation(0,0,0);
+        startTime = time;
+
+        body->clearAccumulators();
+        body->calculateDerivedData();
+        calculateInternals();
+    }
+};
+
+class Box : public cyclone::CollisionBox
+{
+public:
+    Box()
+    {
+        body = new cyclone::RigidBody;
+    }
+
+    ~Box()
+    {
+        delete body;
+    }
+
+    void setState(const cyclone::Vector3 &position,
+                  const cyclone::Vector3 &extents,
+                  bool canSleep)
+    {
+        body->setPosition(position);
+        body->setOrientation(1,0,0,0);
+        body->setVelocity(0,0,0);
+        body->setRotation(cyclone::Vector3(0,0,0));
+        halfSize = extents;
+
+        cyclone::real mass = halfSize.x * halfSize.y * halfSize.z * 8.0f;
+        body->setMass(mass);
+
+        cyclone::Matrix3 tensor;
+        tensor.setBlockInertiaTensor(halfSize, mass);
+        body->setInertiaTensor(tensor);
+
+        body->setLinearDamping(0.95f);
+        body->setAngularDamping(0.8f);
+        body->clearAccumulators();
+        body->setAcceleration(0,-10.0f,0);
+
+        body->setCanSleep(canSleep);
+        body->setAwake();
+
+        body->calculateDerivedData();
+        calculateInternals();
+    }
+};
+
+class BigBallisticScene : public RigidBodyScene
+{
+    const static unsigned ammoRounds = 256;
+    const static unsigned boxes = 2;
+
+    /** Holds the number of steps between each shot. */
+    const static unsigned fireInterval = 10;
+
+    AmmoRound ammo[ammoRounds];
+    Box boxData[boxes];
+
+    ShotType nextShotType;
+    unsigned stepCount;
+    real time;
+
+    void fire()
+    {
+        AmmoRound *shot;
+        for (shot = ammo; shot < ammo+ammoRounds; shot++)
+        {
+            if (shot->type == UNUSED) break;
+        }
+        if (shot >= ammo+ammoRounds) return;
+
+        shot->setState(nextShotType, time);
+        nextShotType = (nextShotType == LASER) ?
+            PISTOL : (ShotType)(nextShotType + 1);
+    }
+
+    virtual void updateObjects(real duration)
+    {
+        time += duration;
+        if (stepCount++ % fireInterval == 0) fire();
+
+        for (AmmoRound *shot = ammo; shot < ammo+ammoRounds; shot++)
+        {
+            if (shot->type != UNUSED)
+            {
+                shot->body->integrate(duration);
+                shot->calculateInternals();
+
+                if (shot->body->getPosition().y < 0.0f ||
+                    shot->startTime+5 < time ||
+                    shot->body->getPosition().z > 200.0f)
+                {
+                    shot->type = UNUSED;
+                }
+            }
+        }
+
+        for (Box *box = boxData; box < boxData+boxes; box++)
+        {
+            box->body->integrate(duration);
+            box->calculateInternals();
+        }
+    }
+
+    virtual void generateContacts()
+    {
+        cyclone::CollisionPlane plane = makeGroundPlane();
+
+        cData.reset((unsigned)contacts.size());
+        cData.friction = (real)0.9;
+        cData.restitution = (real)0.1;
+        cData.tolerance = (real)0.1;
+
+        for (Box *box = boxData; box < boxData+boxes; box++)
+        {
+            if (!cData.hasMoreContacts()) return;
+            cyclone::CollisionDetector::boxAndHalfSpace(*box, plane, &cData);
+
+            for (AmmoRound *shot = ammo; shot < ammo+ammoRounds; shot++)
+            {
+                if (shot->type != UNUSED)
+                {
+                    if (!cData.hasMoreContacts()) return;
+                    if (cyclone::CollisionDetector::boxAndSphere(
+                        *box, *shot, &cData))
+                    {
+                        shot->type = UNUSED;
+                    }
+                }
+            }
+        }
+    }
+
+public:
+    BigBallisticScene()
+    :
+    RigidBodyScene(256, 256*8),
+    nextShotType(PISTOL),
+    stepCount(0),
+    time(0)
+    {
+        real z = 20.0f;
+        for (Box *box = boxData; box < boxData+boxes; box++)
+        {
+            box->setState(cyclone::Vector3(0, 3, z),
+                          cyclone::Vector3(1,1,1), false);
+            z += 90.0f;
+        }
+    }
+
+    virtual unsigned getObjectCount() const
+    {
+        return ammoRounds + boxes;
+    }
+
+    virtual void addChecksum(Checksum &checksum) const
+    {
+        for (const AmmoRound *shot = ammo; shot < ammo+ammoRounds; shot++)
+        {
+            if (shot->type != UNUSED) checksum.add(shot->body);
+        }
+        for (const Box *box = boxData; box < boxData+boxes; box++)
+        {
+            checksum.add(box->body);
+        }
+    }
+};
+
+/*
+ * The fracture demo. The ball's starting velocity comes from a
+ * random number generator with a fixed seed.
+ */
+
+#define MAX_BLOCKS 9
+
+class Block : public cyclone::CollisionBox
+{
+public:
+    bool exists;
+
+    Block()
+    :
+    exists(false)
+    {
+        body = new cyclone::RigidBody();
+    }
+
+    ~Block()
+    {
+        delete body;
+    }
+
+    void calculateMassProperties(real invDensity)
+    {
+        if (invDensity <= 0)
+        {
+            body->setInverseMass(0);
+            body->setInverseInertiaTensor(cyclone::Matrix3());
+        }
+        else
+        {
+            real volume = halfSize.magnitude() * 2.0;
+            real mass = volume / invDensity;
+            body->setMass(mass);
+
+            mass *= 0.333f;
+            cyclone::Matrix3 tensor;
+            tensor.setInertiaTensorCoeffs(
+                mass * halfSize.y*halfSize.y + halfSize.z*halfSize.z,
+                mass * halfSize.y*halfSize.x + halfSize.z*halfSize.z,
+                mass * halfSize.y*halfSize.x + halfSize.z*halfSize.y
+                );
+            body->setInertiaTensor(tensor);
+        }
+    }
+
+    void divideBlock(const cyclone::Contact& contact,
+        Block* target, Block* blocks)
+    {
+        cyclone::Vector3 normal = contact.contactNormal;
+        cyclone::RigidBody *body = contact.body[0];
+        if (body != target->body)
+        {
+            normal.invert();
+            body = contact.body[1];
+        }
+
+        cyclone::Vector3 point =
+            body->getPointInLocalSpace(contact.contactPoint);
+        normal = body->getDirectionInLocalSpace(normal);
+        point = point - normal * (point * normal);
+
+        cyclone::Vector3 size = target->halfSize;
+
+        cyclone::RigidBody tempBody;
+        tempBody.setPosition(body->getPosition());
+        tempBody.setOrientation(body->getOrientation());
+        tempBody.setVelocity(body->getVelocity());
+        tempBody.setRotation(body->getRotation());
+        tempBody.setLinearDamping(body->getLinearDamping());
+        tempBody.setAngularDamping(body->getAngularDamping());
+        tempBody.setInverseInertiaTensor(body->getInverseInertiaTensor());
+        tempBody.calculateDerivedData();
+
+        target->exists = false;
+
+        real invDensity =
+            halfSize.magnitude()*8 * body->getInverseMass();
+
+        for (unsigned i = 0; i < 8; i++)
+        {
+            cyclone::Vector3 min, max;
+            if ((i & 1) == 0) {
+                min.x = -size.x;
+                max.x = point.x;
+            } else {
+                min.x = point.x;
+                max.x = size.x;
+            }
+            if ((i & 2) == 0) {
+                min.y = -size.y;
+                max.y = point.y;
+            } else {
+                min.y = point.y;
+                max.y = size.y;
+            }
+            if ((i & 4) == 0) {
+                min.z = -size.z;
+                max.z = point.z;
+            } else {
+                min.z = point.z;
+                max.z = size.z;
+            }
+
+            cyclone::Vector3 halfSize = (max - min) * 0.5f;
+            cyclone::Vector3 newPos = halfSize + min;
+            newPos = tempBody.getPointInWorldSpace(newPos);
+
+            cyclone::Vector3 direction = newPos - contact.contactPoint;
+            direction.normalise();
+
+            blocks[i].body->setPosition(newPos);
+            blocks[i].body->setVelocity(
+                tempBody.getVelocity() + direction * 10.0f);
+            blocks[i].body->setOrientation(tempBody.getOrientation());
+            blocks[i].body->setRotation(tempBody.getRotation());
+            blocks[i].body->setLinearDamping(tempBody.getLinearDamping());
+            blocks[i].body->setAngularDamping(tempBody.getAngularDamping());
+            blocks[i].body->setAwake(true);
+            blocks[i].body->setAcceleration(cyclone::Vector3::GRAVITY);
+            blocks[i].body->clearAccumulators();
+            blocks[i].body->calculateDerivedData();
+            blocks[i].offset = cyclone::Matrix4();
+            blocks[i].exists = true;
+            blocks[i].halfSize = halfSize;
+
+            blocks[i].calculateMassProperties(invDensity);
+        }
+    }
+};
+
+class FractureScene : public RigidBodyScene
+{
+    bool hit;
+    bool ball_active;
+    unsigned fracture_contact;
+
+    cyclone::Random random;
+    Block blocks[MAX_BLOCKS];
+    cyclone::CollisionSphere ball;
+
+    virtual void updateObjects(real duration)
+    {
+        for (Block *block = blocks; block < blocks+MAX_BLOCKS; block++)
+        {
+            if (block->exists)
+            {
+                block->body->integrate(duration);
+                block->calculateInternals();
+            }
+        }
+
+        if (ball_active)
+        {
+            ball.body->integrate(duration);
+            ball.calculateInternals();
+        }
+    }
+
+    virtual void generateContacts()
+    {
+        hit = false;
+
+        cyclone::CollisionPlane plane = makeGroundPlane();
+
+        cData.reset((unsigned)contacts.size());
+        cData.friction = (real)0.9;
+        cData.restitution = (real)0.2;
+        cData.tolerance = (real)0.1;
+
+        for (Block *block = blocks; block < blocks+MAX_BLOCKS; block++)
+        {
+            if (!block->exists) continue;
+
+            if (!cData.hasMoreContacts()) return;
+            cyclone::CollisionDetector::boxAndHalfSpace(*block, plane, &cData);
+
+            if (ball_active)
+            {
+                if (!cData.hasMoreContacts()) return;
+                if (cyclone::CollisionDetector::boxAndSphere(
+                    *block, ball, &cData))
+                {
+                    hit = true;
+                    fracture_contact = cData.contactCount-1;
+                }
+            }
+
+            for (Block *other = block+1; other < blocks+MAX_BLOCKS; other++)
+            {
+                if (!other->exists) continue;
+
+                if (!cData.hasMoreContacts()) return;
+                cyclone::CollisionDetector::boxAndBox(*block, *other, &cData);
+            }
+        }
+
+        if (ball_active)
+        {
+            if (!cData.hasMoreContacts()) return;
+            cyclone::CollisionDetector::sphereAndHalfSpace(ball, plane, &cData);
+        }
+    }
+
+public:
+    FractureScene()
+    :
+    RigidBodyScene(256, 256*8),
+    hit(false),
+    ball_active(true),
+    fracture_contact(0),
+    random(1)
+    {
+        ball.body = new cyclone::RigidBody();
+        ball.radius = 0.25f;
+        ball.body->setMass(5.0f);
+        ball.body->setDamping(0.9f, 0.9f);
+        cyclone::Matrix3 it;
+        it.setDiagonal(5.0f, 5.0f, 5.0f);
+        ball.body->setInertiaTensor(it);
+        ball.body->setAcceleration(cyclone::Vector3::GRAVITY);
+        ball.body->setCanSleep(false);
+        ball.body->setAwake(true);
+
+        blocks[0].exists = true;
+        blocks[0].halfSize = cyclone::Vector3(4,4,4);
+        blocks[0].body->setPosition(0, 7, 0);
+        blocks[0].body->setOrientation(1,0,0,0);
+        blocks[0].body->setVelocity(0,0,0);
+        blocks[0].body->setRotation(0,0,0);
+        blocks[0].body->setMass(100.0f);
+        cyclone::Matrix3 blockTensor;
+        blockTensor.setBlockInertiaTensor(blocks[0].halfSize, 100.0f);
+        blocks[0].body->setInertiaTensor(blockTensor);
+        blocks[0].body->setDamping(0.9f, 0.9f);
+        blocks[0].body->clearAccumulators();
+        blocks[0].body->calculateDerivedData();
+        blocks[0].calculateInternals();
+        blocks[0].body->setAcceleration(cyclone::Vector3::GRAVITY);
+        blocks[0].body->setAwake(true);
+        blocks[0].body->setCanSleep(true);
+
+        ball.body->setPosition(0,5.0f,20.0f);
+        ball.body->setOrientation(1,0,0,0);
+        ball.body->setVelocity(
+            random.randomBinomial(4.0f),
+            random.randomReal(1.0f, 6.0f),
+            -20.0f
+            );
+        ball.body->setRotation(0,0,0);
+        ball.body->clearAccumulators();
+        ball.body->calculateDerivedData();
+        ball.body->setAwake(true);
+        ball.calculateInternals();
+    }
+
+    ~FractureScene()
+    {
+        delete ball.body;
+    }
+
+    virtual void step(real duration, SceneStats &stats)
+    {
+        RigidBodyScene::step(duration, stats);
+
+        if (hit)
+        {
+            blocks[0].divideBlock(
+                cData.contactArray[fracture_contact],
+                blocks,
+                blocks+1
+                );
+            ball_active = false;
+        }
+    }
+
+    virtual unsigned getObjectCount() const
+    {
+        return MAX_BLOCKS + 1;
+    }
+
+    virtual void addChecksum(Checksum &checksum) const
+    {
+        for (const Block *block = blocks; block < blocks+MAX_BLOCKS; block++)
+        {
+            if (block->exists) checksum.add(block->body);
+        }
+        if (ball_active) checksum.add(ball.body);
+    }
+};
+
+/*
+ * The ragdoll demo. The push given to the ragdoll comes from a random
+ * number generator with a fixed seed.
+ */
+
+#define NUM_BONES 12
+#define NUM_JOINTS 11
+
+class Bone : public cyclone::CollisionBox
+{
+public:
+    Bone()
+    {
+        body = new cyclone::RigidBody();
+    }
+
+    ~Bone()
+    {
+        delete body;
+    }
+
+    cyclone::CollisionSphere getCollisionSphere() const
+    {
+        cyclone::CollisionSphere sphere;
+        sphere.body = body;
+        sphere.radius = halfSize.x;
+        sphere.offset = cyclone::Matrix4();
+        if (halfSize.y < sphere.radius) sphere.radius = halfSize.y;
+        if (halfSize.z < sphere.radius) sphere.radius = halfSize.z;
+        sphere.calculateInternals();
+        return sphere;
+    }
+
+    void setState(const cyclone::Vector3 &position,
+                  const cyclone::Vector3 &extents)
+    {
+        body->setPosition(position);
+        body->setOrientation(cyclone::Quaternion());
+        body->setVelocity(cyclone::Vector3());
+        body->setRotation(cyclone::Vector3());
+        halfSize = extents;
+
+        real mass = halfSize.x * halfSize.y * halfSize.z * 8.0f;
+        body->setMass(mass);
+
+        cyclone::Matrix3 tensor;
+        tensor.setBlockInertiaTensor(halfSize, mass);
+        body->setInertiaTensor(tensor);
+
+        body->setLinearDamping(0.95f);
+        body->setAngularDamping(0.8f);
+        body->clearAccumulators();
+        body->setAcceleration(cyclone::Vector3::GRAVITY);
+
+        body->setCanSleep(false);
+        body->setAwake();
+
+        body->calculateDerivedData();
+        calculateInternals();
+    }
+};
+
+class RagdollScene : public RigidBodyScene
+{
+    cyclone::Random random;
+    Bone bones[NUM_BONES];
+    cyclone::Joint joints[NUM_JOINTS];
+
+    virtual void updateObjects(real duration)
+    {
+        for (Bone *bone = bones; bone < bones+NUM_BONES; bone++)
+        {
+            bone->body->integrate(duration);
+            bone->calculateInternals();
+        }
+    }
+
+    virtual void generateContacts()
+    {
+        cyclone::CollisionPlane plane = makeGroundPlane();
+
+        cData.reset((unsigned)contacts.size());
+        cData.friction = (real)0.9;
+        cData.restitution = (real)0.6;
+        cData.tolerance = (real)0.1;
+
+        for (Bone *bone = bones; bone < bones+NUM_BONES; bone++)
+        {
+            if (!cData.hasMoreContacts()) return;
+            cyclone::CollisionDetector::boxAndHalfSpace(*bone, plane, &cData);
+
+            cyclone::CollisionSphere boneSphere = bone->getCollisionSphere();
+
+            for (Bone *other = bone+1; other < bones+NUM_BONES; other++)
+            {
+                if (!cData.hasMoreContacts()) return;
+
+                cyclone::CollisionSphere otherSphere =
+                    other->getCollisionSphere();
+                cyclone::CollisionDetector::sphereAndSphere(
+                    boneSphere,
+                    otherSphere,
+                    &cData
+                    );
+            }
+        }
+
+        for (cyclone::Joint *joint = joints; joint < joints+NUM_JOINTS; joint++)
+        {
+            if (!cData.hasMoreContacts()) return;
+            unsigned added = joint->addContact(cData.contacts, cData.contactsLeft);
+            cData.addContacts(added);
+        }
+    }
+
+public:
+    RagdollScene()
+    :
+    RigidBodyScene(256, 256*8),
+    random(1)
+    {
+        joints[0].set(
+            bones[0].body, cyclone::Vector3(0, 1.07f, 0),
+            bones[1].body, cyclone::Vector3(0, -1.07f, 0),
+            0.15f
+            );
+        joints[1].set(
+            bones[2].body, cyclone::Vector3(0, 1.07f, 0),
+            bones[3].body, cyclone::Vector3(0, -1.07f, 0),
+            0.15f
+            );
+        joints[2].set(
+            bones[9].body, cyclone::Vector3(0, 0.96f, 0),
+            bones[8].body, cyclone::Vector3(0, -0.96f, 0),
+            0.15f
+            );
+        joints[3].set(
+            bones[11].body, cyclone::Vector3(0, 0.96f, 0),
+            bones[10].body, cyclone::Vector3(0, -0.96f, 0),
+            0.15f
+            );
+        joints[4].set(
+            bones[4].body, cyclone::Vector3(0.054f, 0.50f, 0),
+            bones[5].body, cyclone::Vector3(-0.043f, -0.45f, 0),
+            0.15f
+            );
+        joints[5].set(
+            bones[5].body, cyclone::Vector3(-0.043f, 0.411f, 0),
+            bones[6].body, cyclone::Vector3(0, -0.411f, 0),
+            0.15f
+            );
+        joints[6].set(
+            bones[6].body, cyclone::Vector3(0, 0.521f, 0),
+            bones[7].body, cyclone::Vector3(0, -0.752f, 0),
+            0.15f
+            );
+        joints[7].set(
+            bones[1].body, cyclone::Vector3(0, 1.066f, 0),
+            bones[4].body, cyclone::Vector3(0, -0.458f, -0.5f),
+            0.15f
+            );
+        joints[8].set(
+            bones[3].body, cyclone::Vector3(0, 1.066f, 0),
+            bones[4].body, cyclone::Vector3(0, -0.458f, 0.5f),
+            0.105f
+            );
+        joints[9].set(
+            bones[6].body, cyclone::Vector3(0, 0.367f, -0.8f),
+            bones[8].body, cyclone::Vector3(0, 0.888f, 0.32f),
+            0.15f
+            );
+        joints[10].set(
+            bones[6].body, cyclone::Vector3(0, 0.367f, 0.8f),
+            bones[10].body, cyclone::Vector3(0, 0.888f, -0.32f),
+            0.15f
+            );
+
+        bones[0].setState(
+            cyclone::Vector3(0, 0.993, -0.5),
+            cyclone::Vector3(0.301, 1.0, 0.234));
+        bones[1].setState(
+            cyclone::Vector3(0, 3.159, -0.56),
+            cyclone::Vector3(0.301, 1.0, 0.234));
+        bones[2].setState(
+            cyclone::Vector3(0, 0.993, 0.5),
+            cyclone::Vector3(0.301, 1.0, 0.234));
+        bones[3].setState(
+            cyclone::Vector3(0, 3.15, 0.56),
+            cyclone::Vector3(0.301, 1.0, 0.234));
+        bones[4].setState(
+            cyclone::Vector3(-0.054, 4.683, 0.013),
+            cyclone::Vector3(0.415, 0.392, 0.690));
+        bones[5].setState(
+            cyclone::Vector3(0.043, 5.603, 0.013),
+            cyclone::Vector3(0.301, 0.367, 0.693));
+        bones[6].setState(
+            cyclone::Vector3(0, 6.485, 0.013),
+            cyclone::Vector3(0.435, 0.367, 0.786));
+        bones[7].setState(
+            cyclone::Vector3(0, 7.759, 0.013),
+            cyclone::Vector3(0.45, 0.598, 0.421));
+        bones[8].setState(
+            cyclone::Vector3(0, 5.946, -1.066),
+            cyclone::Vector3(0.267, 0.888, 0.207));
+        bones[9].setState(
+            cyclone::Vector3(0, 4.024, -1.066),
+            cyclone::Vector3(0.267, 0.888, 0.207));
+        bones[10].setState(
+            cyclone::Vector3(0, 5.946, 1.066),
+            cyclone::Vector3(0.267, 0.888, 0.207));
+        bones[11].setState(
+            cyclone::Vector3(0, 4.024, 1.066),
+            cyclone::Vector3(0.267, 0.888, 0.207));
+
+        real strength = -random.randomReal(500.0f, 1000.0f);
+        for (unsigned i = 0; i < NUM_BONES; i++)
+        {
+            bones[i].body->addForceAtBodyPoint(
+                cyclone::Vector3(strength, 0, 0), cyclone::Vector3()
+                );
+        }
+        bones[6].body->addForceAtBodyPoint(
+            cyclone::Vector3(strength, 0, random.randomBinomial(1000.0f)),
+            cyclone::Vector3(random.randomBinomial(4.0f),
+                             random.randomBinomial(3.0f), 0)
+            );
+    }
+
+    virtual unsigned getObjectCount() const
+    {
+        return NUM_BONES;
+    }
+
+    virtual void addChecksum(Checksum &checksum) const
+    {
+        for (const Bone *bone = bones; bone < bones+NUM_BONES; bone++)
+        {
+            checksum.add(bone->body);
+        }
+    }
+};
+
+/*
+ * A stress test of stacked boxes. The boxes stand in columns on the
+ * ground, and are found by the AABB tree rather than by checking every
+ * pair. The resolver is given four iterations per contact, as World
+ * does.
+ */
+class BoxStackScene : public RigidBodyScene
+{
+    /** Holds the number of boxes in each column. */
+    const static unsigned stackHeight = 10;
+
+    std::vector<Box*> boxes;
+    std::vector<unsigned> proxies;
+    cyclone::AABBTree broadphase;
+    std::vector<cyclone::PotentialContact> potentialContacts;
+
+    virtual void updateObjects(real duration)
+    {
+        for (unsigned i = 0; i < boxes.size(); i++)
+        {
+            Box *box = boxes[i];
+            box->body->integrate(duration);
+            box->calculateInternals();
+
+            cyclone::Vector3 displacement;
+            if (box->body->getAwake())
+            {
+                displacement = box->body->getVelocity() * duration;
+            }
+            broadphase.moveProxy(proxies[i], box->getBoundingBox(),
+                                 displacement);
+        }
+    }
+
+    virtual void generateContacts()
+    {
+        cyclone::CollisionPlane plane = makeGroundPlane();
+
+        cData.reset((unsigned)contacts.size());
+        cData.friction = (real)0.9;
+        cData.restitution = (real)0.1;
+        cData.tolerance = (real)0.1;
+
+        unsigned numPairs;
+        for (;;)
+        {
+            numPairs = broadphase.getPotentialContacts(
+                &potentialContacts[0], (unsigned)potentialContacts.size());
+            if (numPairs < potentialContacts.size()) break;
+            potentialContacts.resize(potentialContacts.size() * 2);
+        }
+
+        for (unsigned i = 0; i < numPairs; i++)
+        {
+            const cyclone::PotentialContact &pair = potentialContacts[i];
+            if (!pair.body[0]->getAwake() && !pair.body[1]->getAwake()) continue;
+
+            if (!cData.hasMoreContacts()) return;
+            cyclone::CollisionDetector::collide(
+                *pair.primitive[0], *pair.primitive[1], &cData);
+        }
+
+        for (unsigned i = 0; i < boxes.size(); i++)
+        {
+            if (!boxes[i]->body->getAwake()) continue;
+
+            if (!cData.hasMoreContacts()) return;
+            cyclone::CollisionDetector::boxAndHalfSpace(
+                *boxes[i], plane, &cData);
+        }
+    }
+
+public:
+    BoxStackScene(unsigned count)
+    :
+    RigidBodyScene(count*4 + 256, 0),
+    potentialContacts(count*2 + 256)
+    {
+        cyclone::Random random(1);
+
+        unsigned columns = (count + stackHeight - 1) / stackHeight;
+        unsigned side = 1;
+        while (side * side < columns) side++;
+
+        for (unsigned i = 0; i < count; i++)
+        {
+            unsigned column = i / stackHeight;
+            unsigned level = i % stackHeight;
+
+            // Stagger each box a little, so the stacks aren't perfect.
+            cyclone::Vector3 position(
+                (real)(column % side) * 3 + random.randomBinomial(0.05f),
+                (real)level * 1.0f + 0.5f,
+                (real)(column / side) * 3 + random.randomBinomial(0.05f));
+
+            Box *box = new Box;
+            box->setState(position, cyclone::Vector3(0.5f,0.5f,0.5f), true);
+            boxes.push_back(box);
+            proxies.push_back(broadphase.createProxy(
+                box->getBoundingBox(), box->body, box));
+        }
+    }
+
+    ~BoxStackScene()
+    {
+        for (unsigned i = 0; i < boxes.size(); i++) delete boxes[i];
+    }
+
+    virtual unsigned getObjectCount() const
+    {
+        return (unsigned)boxes.size();
+    }
+
+    virtual void addChecksum(Checksum &checksum) const
+    {
+        for (unsigned i = 0; i < boxes.size(); i++)
+        {
+            checksum.add(boxes[i]->body);
+        }
+    }
+};
+
+/**
+ * A scene run by a World, which does all the work of each step
+ * inside runPhysics.
+ */
+class WorldScene : public Scene
+{
+protected:
+    /** Holds the world that simulates the scene. */
+    cyclone::World world;
+
+    /** Holds the impulses used to warm start the contacts. */
+    cyclone::ContactCache contactCache;
+
+    /** Holds the bodies, which the scene owns. */
+    std::vector<cyclone::RigidBody*> bodies;
+
+    /** Holds the primitives, which the scene owns. */
+    std::vector<cyclone::CollisionPrimitive*> primitives;
+
+    /**
+     * Creates a body at the given position with the given mass and
+     * inertia tensor, and registers it with the world.
+     */
+    cyclone::RigidBody* addBody(const cyclone::Vector3 &position,
+                                real mass,
+                                const cyclone::Matrix3 &inertiaTensor)
+    {
+        cyclone::RigidBody *body = new cyclone::RigidBody;
+        body->setPosition(position);
+        body->setOrientation(1,0,0,0);
+        body->setMass(mass);
+        body->setInertiaTensor(inertiaTensor);
+        body->setDamping(0.95f, 0.8f);
+        body->setAcceleration(0,-10.0f,0);
+        body->setCanSleep(true);
+        body->setAwake();
+        body->calculateDerivedData();
+
+        bodies.push_back(body);
+        world.addBody(body);
+        return body;
+    }
+
+    /**
+     * Registers the given primitive with the world, attached to the
+     * given body, which may be NULL for a primitive that doesn't
+     * move.
+     */
+    void addPrimitive(cyclone::CollisionPrimitive *primitive,
+                      cyclone::RigidBody *body)
+    {
+        primitive->body = body;
+        primitives.push_back(primitive);
+        world.addPrimitive(primitive);
+    }
+
+public:
+    WorldScene(unsigned contactCapacity)
+    :
+    world(contactCapacity)
+    {
+        world.setCollisionProperties((real)0.9, (real)0.1, (real)0.01);
+        if (warmStart) world.setContactCache(&contactCache);
+        if (colouredSweeps > 0)
+        {
+            world.setVelocitySolver(
+                cyclone::ContactResolver::VELOCITY_COLOURED, colouredSweeps);
+        }
+        world.setExecutor(executor);
+    }
+
+    ~WorldScene()
+    {
+        for (unsigned i = 0; i < primitives.size(); i++) delete primitives[i];
+        for (unsigned i = 0; i < bodies.size(); i++) delete bodies[i];
+    }
+
+    /**
+     * Runs one step. The world runs all its phases together, so the
+     * whole step is counted as resolving.
+     */
+    virtual void step(real duration, SceneStats &stats)
+    {
+        double start = getTime();
+        world.startFrame();
+        world.runPhysics(duration);
+        stats.resolve += getTime() - start;
+        stats.addContacts(world.getContactBuffer().getCount());
+    }
+
+    virtual unsigned getObjectCount() const
+    {
+        return (unsigned)bodies.size();
+    }
+
+    virtual void addChecksum(Checksum &checksum) const
+    {
+        for (unsigned i = 0; i < bodies.size(); i++)
+        {
+            checksum.add(bodies[i]);
+        }
+    }
+};
+
+/*
+ * A wide slab, with boxes and spheres dropped on it, resting on a
+ * finely divided triangle mesh. The slab rests on thousands of
+ * triangles, so its pair alone writes more contacts than its batch
+ * starts with room for, and the contact buffer grows in the middle of
+ * the mesh collision. The world itself starts with room for only one
+ * contact.
+ */
+
+class TerrainScene : public WorldScene
+{
+    /** Holds the number of cells along each side of the mesh. */
+    const static unsigned cells = 60;
+
+    /** Holds the mesh's triangles, shared with its primitive. */
+    cyclone::TriangleMeshData *meshData;
+
+public:
+    TerrainScene(unsigned count)
+    :
+    WorldScene(1)
+    {
+        const real size = 10;
+        const real spacing = size / cells;
+
+        // A flat grid, facing up.
+        std::vector<cyclone::Vector3> vertices;
+        for (unsigned z = 0; z <= cells; z++)
+        {
+            for (unsigned x = 0; x <= cells; x++)
+            {
+                vertices.push_back(cyclone::Vector3(
+                    x * spacing - size * 0.5f, 0, z * spacing - size * 0.5f));
+            }
+        }
+        std::vector<unsigned> indices;
+        for (unsigned z = 0; z < cells; z++)
+        {
+            for (unsigned x = 0; x < cells; x++)
+            {
+                unsigned corner = z * (cells + 1) + x;
+                unsigned triangles[6] = {
+                    corner, corner + cells + 1, corner + 1,
+                    corner + 1, corner + cells + 1, corner + cells + 2
+                };
+                indices.insert(indices.end(), triangles, triangles + 6);
+            }
+        }
+        meshData = cyclone::TriangleMeshData::create(
+            &vertices[0], (unsigned)vertices.size(),
+            &indices[0], cells * cells * 2);
+        addPrimitive(new cyclone::CollisionTriangleMesh(meshData), NULL);
+
+        // A slab resting on thousands of triangles from the start.
+        cyclone::Vector3 halfSize(4, 0.25f, 4);
+        real mass = halfSize.x * halfSize.y * halfSize.z * 8.0f;
+        cyclone::Matrix3 tensor;
+        tensor.setBlockInertiaTensor(halfSize, mass);
+
+        cyclone::CollisionBox *slab = new cyclone::CollisionBox;
+        slab->halfSize = halfSize;
+        addPrimitive(slab, addBody(cyclone::Vector3(0, 0.245f, 0),
+            mass, tensor));
+
+        // Boxes and spheres falling onto the slab and the mesh.
+        cyclone::Random random(1);
+        for (unsigned i = 0; i < count; i++)
+        {
+            cyclone::Vector3 position = random.randomVector(
+                cyclone::Vector3(-4.5f, 1.0f, -4.5f),
+                cyclone::Vector3(4.5f, 6.0f, 4.5f));
+            real radius = 0.2f;
+            real mass = 1;
+            cyclone::Matrix3 tensor;
+
+            if (i % 2)
+            {
+                cyclone::Vector3 halfSize(radius, radius, radius);
+                tensor.setBlockInertiaTensor(halfSize, mass);
+                cyclone::CollisionBox *box = new cyclone::CollisionBox;
+                box->halfSize = halfSize;
+                addPrimitive(box, addBody(position, mass, tensor));
+            }
+            else
+            {
+                real moment = 0.4f * mass * radius * radius;
+                tensor.setDiagonal(moment, moment, moment);
+                cyclone::CollisionSphere *sphere = new cyclone::CollisionSphere;
+                sphere->radius = radius;
+                addPrimitive(sphere, addBody(position, mass, tensor));
+            }
+        }
+    }
+
+    ~TerrainScene()
+    {
+        meshData->release();
+    }
+};
+
+/*
+ * The bridge demo, which in this version is a lattice of particles
+ * held together with rods.
+ */
+
+#define ROD_COUNT 104
+#define BASE_MASS 1
+
+class ParticleScene : public Scene
+{
+protected:
+    TimedParticleWorld world;
+    std::vector<cyclone::Particle> particleArray;
+
+public:
+    ParticleScene(unsigned particleCount,
+                  unsigned maxContacts,
+                  unsigned iterations=0)
+    :
+    world(maxContacts, iterations),
+    particleArray(particleCount)
+    {
+        for (unsigned i = 0; i < particleCount; i++)
+        {
+            world.getParticles().push_back(&particleArray[i]);
+        }
+        world.setExecutor(executor);
+    }
+
+    virtual void step(real duration, SceneStats &stats)
+    {
+        world.step(duration, stats);
+    }
+
+    virtual unsigned getObjectCount() const
+    {
+        return (unsigned)particleArray.size();
+    }
+
+    virtual void addChecksum(Checksum &checksum) const
+    {
+        for (unsigned i = 0; i < particleArray.size(); i++)
+        {
+            checksum.add(&particleArray[i]);
+        }
+    }
+};
+
+class BridgeScene : public ParticleScene
+{
+    cyclone::GroundContacts groundContactGenerator;
+    cyclone::ParticleRod rods[ROD_COUNT];
+
+public:
+    BridgeScene()
+    :
+    ParticleScene(48, 48*10)
+    {
+        groundContactGenerator.init(&world.getParticles());
+        world.getContactGenerators().push_back(&groundContactGenerator);
+
+        // Three rows of four by four particles, one behind the other.
+        for (unsigned i = 0; i < 48; i++)
+        {
+            particleArray[i].setPosition(
+                (real)(i % 4),
+                (real)((i / 4) % 4 + 4),
+                -(real)(i / 16)
+                );
+            particleArray[i].setVelocity(0, 0, 0);
+            particleArray[i].setDamping(0.9f);
+            particleArray[i].setAcceleration(cyclone::Vector3::GRAVITY);
+            particleArray[i].setMass(BASE_MASS);
+            particleArray[i].clearAccumulator();
+        }
+
+        for (unsigned i = 0; i < 24; i++)
+        {
+            rods[i].particle[0] = &particleArray[i*2];
+            rods[i].particle[1] = &particleArray[i*2+1];
+        }
+        for (unsigned i = 24; i < 36; i++)
+        {
+            unsigned first = (i - 24) * 4 + 1;
+            rods[i].particle[0] = &particleArray[first];
+            rods[i].particle[1] = &particleArray[first+1];
+        }
+        for (unsigned i = 36; i < 68; i++)
+        {
+            rods[i].particle[0] = &particleArray[i-36];
+            rods[i].particle[1] = &particleArray[i-20];
+        }
+        for (unsigned i = 68; i < 80; i++)
+        {
+            rods[i].particle[0] = &particleArray[i - 68];
+            rods[i].particle[1] = &particleArray[i - 64];
+        }
+        for (unsigned i = 80; i < 92; i++)
+        {
+            rods[i].particle[0] = &particleArray[i - 64];
+            rods[i].particle[1] = &particleArray[i - 60];
+        }
+        for (unsigned i = 92; i < 104; i++)
+        {
+            rods[i].particle[0] = &particleArray[i - 60];
+            rods[i].particle[1] = &particleArray[i - 56];
+        }
+
+        for (unsigned i = 0; i < ROD_COUNT; i++)
+        {
+            rods[i].length = 2;
+            world.getContactGenerators().push_back(&rods[i]);
+        }
+    }
+};
+
+/*
+ * The blob demo. The platforms and blob positions come from a random
+ * number generator with a fixed seed, and nothing steers the blob.
+ */
+
+#define BLOB_COUNT 5
+#define PLATFORM_COUNT 10
+#define BLOB_RADIUS 0.4f
+
+class Platform : public cyclone::ParticleContactGenerator
+{
+public:
+    cyclone::Vector3 start;
+    cyclone::Vector3 end;
+    cyclone::Particle *particles;
+
+    virtual unsigned addContact(
+        cyclone::ParticleContact *contact,
+        unsigned limit
+        ) const;
+};
+
+unsigned Platform::addContact(cyclone::ParticleContact *contact,
+                              unsigned limit) const
+{
+    const static real restitution = 0.0f;
+
+    unsigned used = 0;
+    for (unsigned i = 0; i < BLOB_COUNT; i++)
+    {
+        if (used >= limit) break;
+
+        cyclone::Vector3 toParticle = particles[i].getPosition() - start;
+        cyclone::Vector3 lineDirection = end - start;
+        real projected = toParticle * lineDirection;
+        real platformSqLength = lineDirection.squareMagnitude();
+        if (projected <= 0)
+        {
+            if (toParticle.squareMagnitude() < BLOB_RADIUS*BLOB_RADIUS)
+            {
+                contact->contactNormal = toParticle.unit();
+                contact->contactNormal.z = 0;
+                contact->restitution = restitution;
+                contact->particle[0] = particles + i;
+                contact->particle[1] = 0;
+                contact->penetration = BLOB_RADIUS - toParticle.magnitude();
+                used ++;
+                contact ++;
+            }
+        }
+        else if (projected >= platformSqLength)
+        {
+            toParticle = particles[i].getPosition() - end;
+            if (toParticle.squareMagnitude() < BLOB_RADIUS*BLOB_RADIUS)
+            {
+                contact->contactNormal = toParticle.unit();
+                contact->contactNormal.z = 0;
+                contact->restitution = restitution;
+                contact->particle[0] = particles + i;
+                contact->particle[1] = 0;
+                contact->penetration = BLOB_RADIUS - toParticle.magnitude();
+                used ++;
+                contact ++;
+            }
+        }
+        else
+        {
+            real distanceToPlatform =
+                toParticle.squareMagnitude() -
+                projected*projected / platformSqLength;
+            if (distanceToPlatform < BLOB_RADIUS*BLOB_RADIUS)
+            {
+                cyclone::Vector3 closestPoint =
+                    start + lineDirection*(projected/platformSqLength);
+
+                contact->contactNormal =
+                    (particles[i].getPosition()-closestPoint).unit();
+                contact->contactNormal.z = 0;
+                contact->restitution = restitution;
+                contact->particle[0] = particles + i;
+                contact->particle[1] = 0;
+                contact->penetration =
+                    BLOB_RADIUS - real_sqrt(distanceToPlatform);
+                used ++;
+                contact ++;
+            }
+        }
+    }
+    return used;
+}
+
+class BlobForceGenerator : public cyclone::ParticleForceGenerator
+{
+public:
+    cyclone::Particle *particles;
+    real maxReplusion;
+    real maxAttraction;
+    real minNaturalDistance, maxNaturalDistance;
+    real floatHead;
+    unsigned maxFloat;
+    real maxDistance;
+
+    virtual void updateForce(
+        cyclone::Particle *particle,
+        real duration
+        );
+};
+
+void BlobForceGenerator::updateForce(cyclone::Particle *particle,
+                                      real duration)
+{
+    unsigned joinCount = 0;
+    for (unsigned i = 0; i < BLOB_COUNT; i++)
+    {
+        if (particles + i == particle) continue;
+
+        cyclone::Vector3 separation =
+            particles[i].getPosition() - particle->getPosition();
+        separation.z = 0.0f;
+        real distance = separation.magnitude();
+
+        if (distance < minNaturalDistance)
+        {
+            distance = 1.0f - distance / minNaturalDistance;
+            particle->addForce(
+                separation.unit() * (1.0f - distance) * maxReplusion * -1.0f
+                );
+            joinCount++;
+        }
+        else if (distance > maxNaturalDistance && distance < maxDistance)
+        {
+            distance =
+                (distance - maxNaturalDistance) /
+                (maxDistance - maxNaturalDistance);
+            particle->addForce(
+                separation.unit() * distance * maxAttraction
+                );
+            joinCount++;
+        }
+    }
+
+    if (particle == particles && joinCount > 0 && maxFloat > 0)
+    {
+        real force = real(joinCount / maxFloat) * floatHead;
+        if (force > floatHead) force = floatHead;
+        particle->addForce(cyclone::Vector3(0, force, 0));
+    }
+}
+
+class BlobScene : public ParticleScene
+{
+    Platform platforms[PLATFORM_COUNT];
+    BlobForceGenerator blobForceGenerator;
+
+public:
+    BlobScene()
+    :
+    ParticleScene(BLOB_COUNT, PLATFORM_COUNT+BLOB_COUNT, PLATFORM_COUNT)
+    {
+        cyclone::Random r(1);
+        cyclone::Particle *blobs = &particleArray[0];
+
+        blobForceGenerator.particles = blobs;
+        blobForceGenerator.maxAttraction = 20.0f;
+        blobForceGenerator.maxReplusion = 10.0f;
+        blobForceGenerator.minNaturalDistance = BLOB_RADIUS*0.75f;
+        blobForceGenerator.maxNaturalDistance = BLOB_RADIUS*1.5f;
+        blobForceGenerator.maxDistance = BLOB_RADIUS * 2.5f;
+        blobForceGenerator.maxFloat = 2;
+        blobForceGenerator.floatHead = 8.0f;
+
+        for (unsigned i = 0; i < PLATFORM_COUNT; i++)
+        {
+            platforms[i].start = cyclone::Vector3(
+                real(i%2)*10.0f - 5.0f,
+                real(i)*4.0f + ((i%2)?0.0f:2.0f),
+                0);
+            platforms[i].start.x += r.randomBinomial(2.0f);
+            platforms[i].start.y += r.randomBinomial(2.0f);
+
+            platforms[i].end = cyclone::Vector3(
+                real(i%2)*10.0f + 5.0f,
+                real(i)*4.0f + ((i%2)?2.0f:0.0f),
+                0);
+            platforms[i].end.x += r.randomBinomial(2.0f);
+            platforms[i].end.y += r.randomBinomial(2.0f);
+
+            platforms[i].particles = blobs;
+            world.getContactGenerators().push_back(platforms + i);
+        }
+
+        Platform *p = platforms + (PLATFORM_COUNT-2);
+        real fraction = (real)1.0 / BLOB_COUNT;
+        cyclone::Vector3 delta = p->end - p->start;
+        for (unsigned i = 0; i < BLOB_COUNT; i++)
+        {
+            unsigned me = (i+BLOB_COUNT/2) % BLOB_COUNT;
+            blobs[i].setPosition(
+                p->start + delta * (real(me)*0.8f*fraction+0.1f) +
+                cyclone::Vector3(0, 1.0f+r.randomReal(), 0));
+
+            blobs[i].setVelocity(0,0,0);
+            blobs[i].setDamping(0.2f);
+            blobs[i].setAcceleration(cyclone::Vector3::GRAVITY * 0.4f);
+            blobs[i].setMass(1.0f);
+            blobs[i].clearAccumulator();
+
+            world.getForceRegistry().add(blobs + i, &blobForceGenerator);
+        }
+    }
+
+    virtual void step(real duration, SceneStats &stats)
+    {
+        ParticleScene::step(duration, stats);
+
+        // Bring all the particles back to 2d.
+        cyclone::Vector3 position;
+        for (unsigned i = 0; i < BLOB_COUNT; i++)
+        {
+            particleArray[i].getPosition(&position);
+            position.z = 0.0f;
+            particleArray[i].setPosition(position);
+        }
+    }
+};
+
+/*
+ * A stress test of particles falling in a block onto the ground and
+ * colliding with each other, using the particle grid. The particle
+ * resolver checks every contact on each iteration, so it is given a
+ * fixed number of iterations rather than one per contact.
+ */
+class ParticleHeapScene : public ParticleScene
+{
+    const static unsigned resolverIterations = 256;
+
+    cyclone::GroundContacts groundContactGenerator;
+    cyclone::ParticleGrid grid;
+
+public:
+    ParticleHeapScene(unsigned count)
+    :
+    ParticleScene(count, count*4, resolverIterations),
+    grid(count)
+    {
+        const real radius = 0.2f;
+        cyclone::Random random(1);
+
+        unsigned side = 1;
+        while (side * side * side < count) side++;
+
+        for (unsigned i = 0; i < count; i++)
+        {
+            cyclone::Vector3 position(
+                (real)(i % side) * radius * 2.5f,
+                (real)(i / (side * side)) * radius * 2.5f + 1.0f,
+                (real)((i / side) % side) * radius * 2.5f);
+            position += random.randomVector(radius * 0.1f);
+
+            particleArray[i].setPosition(position);
+            particleArray[i].setVelocity(0, 0, 0);
+            particleArray[i].setDamping(0.99f);
+            particleArray[i].setAcceleration(cyclone::Vector3::GRAVITY);
+            particleArray[i].setMass(1.0f);
+            particleArray[i].clearAccumulator();
+        }
+
+        groundContactGenerator.init(&world.getParticles());
+        world.getContactGenerators().push_back(&groundContactGenerator);
+
+        grid.init(&world.getParticles(), radius, 0.3f);
+        world.getContactGenerators().push_back(&grid);
+    }
+};
+
+/**
+ * A stress scene of a square of cloth pinned at its edges, like the
+ * skin of a drum, which starts moving as if it had been struck in
+ * the middle. Each particle is joined to its neighbours along and
+ * across the grid by springs that are a little stretched, registered
+ * as pairs so each spring's force is worked out once. There are no
+ * contacts: the time goes on the forces.
+ */
+class ClothScene : public ParticleScene
+{
+    cyclone::ParticlePairSpring structuralSpring;
+    cyclone::ParticlePairSpring shearSpring;
+
+public:
+    ClothScene(unsigned side)
+    :
+    ParticleScene(side * side, 1),
+    structuralSpring(20.0f, 0.09f),
+    shearSpring(20.0f, 0.09f * real_sqrt((real)2.0))
+    {
+        const real pi = (real)3.14159265358979;
+
+        for (unsigned i = 0; i < side * side; i++)
+        {
+            unsigned x = i % side, y = i / side;
+            real u = (real)x / (real)(side - 1);
+            real v = (real)y / (real)(side - 1);
+
+            particleArray[i].setPosition((real)x * 0.1f, (real)y * 0.1f, 0);
+            particleArray[i].setVelocity(
+                0, 0, real_sin(u * pi) * real_sin(v * pi));
+            particleArray[i].setDamping(0.2f);
+            particleArray[i].setAcceleration(0, 0, 0);
+            particleArray[i].clearAccumulator();
+
+            // The edges are pinned in place.
+            if (x == 0 || y == 0 || x+1 == side || y+1 == side)
+            {
+                particleArray[i].setInverseMass(0);
+            }
+            else
+            {
+                particleArray[i].setMass(1.0f);
+            }
+        }
+
+        cyclone::ParticleForceRegistry &registry = world.getForceRegistry();
+        for (unsigned i = 0; i < side * side; i++)
+        {
+            unsigned x = i % side, y = i / side;
+            cyclone::Particle *particle = &particleArray[i];
+            if (x+1 < side)
+            {
+                registry.addPair(particle, particle + 1, &structuralSpring);
+            }
+            if (y+1 < side)
+            {
+                registry.addPair(particle, particle + side,
+                                 &structuralSpring);
+            }
+            if (x+1 < side && y+1 < side)
+            {
+                registry.addPair(particle, particle + side + 1, &shearSpring);
+                registry.addPair(particle + 1, particle + side, &shearSpring);
+            }
+        }
+    }
+};
+
+/**
+ * Creates the scene with the given name, scaling the size of the
+ * stress scenes by the given factor. Returns NULL if there is no
+ * such scene.
+ */
+static Scene* createScene(const char *name, real scale)
+{
+    if (strcmp(name, "bigballistic") == 0) return new BigBallisticScene();
+    if (strcmp(name, "fracture") == 0) return new FractureScene();
+    if (strcmp(name, "ragdoll") == 0) return new RagdollScene();
+    if (strcmp(name, "bridge") == 0) return new BridgeScene();
+    if (strcmp(name, "blob") == 0) return new BlobScene();
+    if (strcmp(name, "boxstack") == 0)
+    {
+        return new BoxStackScene((unsigned)(10000 * scale));
+    }
+    if (strcmp(name, "terrain") == 0)
+    {
+        return new TerrainScene((unsigned)(100 * scale));
+    }
+    if (strcmp(name, "particles") == 0)
+    {
+        return new ParticleHeapScene((unsigned)(100000 * scale));
+    }
+    if (strcmp(name, "cloth") == 0)
+    {
+        // Around four springs per particle, so 100000 springs at the
+        // default scale.
+        unsigned side = (unsigned)real_sqrt(25000 * scale);
+        return new ClothScene(side > 2 ? side : 2);
+    }
+    return NULL;
+}
+
+static const char *demoScenes[] = {
+    "bigballistic", "fracture", "ragdoll", "bridge", "blob", NULL
+};
+
+static const char *stressScenes[] = {
+    "boxstack", "terrain", "particles", "cloth", NULL
+};
+
+/**
+ * Runs the named scene and prints its results as one line of JSON.
+ * Returns false if there is no such scene.
+ */
+static bool runScene(const char *name, unsigned steps,
+                     real duration, real scale)
+{
+    Scene *scene = createScene(name, scale);
+    if (!scene) return false;
+
+    SceneStats stats;
+    double start = getTime();
+    for (unsigned i = 0; i < steps; i++)
+    {
+        scene->step(duration, stats);
+    }
+    double total = getTime() - start;
+
+    Checksum checksum;
+    scene->addChecksum(checksum);
+
+    printf("{\"scene\":\"%s\",\"objects\":%u,\"steps\":%u,"
+           "\"duration\":%g,",
+           name, scene->getObjectCount(), steps, (double)duration);
+    printf("\"time\":{\"total\":%.6f,\"forces\":%.6f,\"integrate\":%.6f,"
+           "\"contacts\":%.6f,\"prepare\":%.6f,\"positions\":%.6f,"
+           "\"velocities\":%.6f,\"resolve\":%.6f},",
+           total, stats.forces, stats.integrate, stats.contacts,
+           stats.prepare, stats.positions, stats.velocities, stats.resolve);
+    printf("\"contacts\":%llu,\"maxContacts\":%u,"
+           "\"velocityIterations\":%llu,\"positionIterations\":%llu,"
+           "\"iterations\":%llu,\"checksum\":\"%016llx\"}\n",
+           stats.contactCount, stats.maxContactCount,
+           stats.velocityIterations, stats.positionIterations,
+           stats.iterations, checksum.get());
+    fflush(stdout);
+
+    delete scene;
+    return true;
+}
+
+static bool runScenes(const char **names, unsigned steps,
+                      real duration, real scale)
+{
+    for (const char **name = names; *name; name++)
+    {
+        if (!runScene(*name, steps, duration, scale)) return false;
+    }
+    return true;
+}
+
+static void printUsage()
+{
+    fprintf(stderr,
+        "Usage: bench [-steps N] [-duration T] [-scale S] [-warmstart 1]\n"
+        "             [-coloured N] [-threads N] [scene ...]\n"
+        "Scenes: bigballistic fracture ragdoll bridge blob "
+        "boxstack terrain particles cloth\n"
+        "        demos (the default), stress, all\n");
+}
+
+int main(int argc, char **argv)
+{
+    unsigned steps = 1000;
+    real duration = (real)0.01;
+    real scale = 1;
+    unsigned threads = 1;
+    bool ranScene = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        if (arg[0] == '-')
+        {
+            if (i+1 >= argc)
+            {
+                printUsage();
+                return 1;
+            }
+
+            if (strcmp(arg, "-steps") == 0) steps = (unsigned)atoi(argv[++i]);
+            else if (strcmp(arg, "-duration") == 0) duration = (real)atof(argv[++i]);
+            else if (strcmp(arg, "-scale") == 0) scale = (real)atof(argv[++i]);
+            else if (strcmp(arg, "-warmstart") == 0) warmStart = atoi(argv[++i]) != 0;
+            else if (strcmp(arg, "-coloured") == 0) colouredSweeps = (unsigned)atoi(argv[++i]);
+            else if (strcmp(arg, "-threads") == 0) threads = (unsigned)atoi(argv[++i]);
+            else
+            {
+                printUsage();
+                return 1;
+            }
+            continue;
+        }
+
+        if (threads > 1) executor = getThreadPool(threads);
+
+        bool known;
+        if (strcmp(arg, "demos") == 0)
+        {
+            known = runScenes(demoScenes, steps, duration, scale);
+        }
+        else if (strcmp(arg, "stress") == 0)
+        {
+            known = runScenes(stressScenes, steps, duration, scale);
+        }
+        else if (strcmp(arg, "all") == 0)
+        {
+            known = runScenes(demoScenes, steps, duration, scale) &&
+                runScenes(stressScenes, steps, duration, scale);
+        }
+        else
+        {
+            known = runScene(arg, steps, duration, scale);
+        }
+
+        if (!known)
+        {
+            fprintf(stderr, "Unknown scene: %s\n", arg);
+            printUsage();
+            return 1;
+        }
+        ranScene = true;
+    }
+
+    if (!ranScene)
+    {
+        if (threads > 1) executor = getThreadPool(threads);
+        runScenes(demoScenes, steps, duration, scale);
+    }
+    return 0;
+}
@@ -232,6 +232,16 @@ bool RigidBody::hasFiniteMass() const
     return inverseMass >= 0.0f;
 }
 
+bool RigidBody::isImmovable() const
+{
+    if (inverseMass != 0) return false;
+    for (unsigned i = 0; i < 9; i++)
+    {
+        if (inverseInertiaTensor.data[i] != 0) return false;
+    }
+    return true;
+}
+
 void RigidBody::setInertiaTensor(const Matrix3 &inertiaTensor)
 {
     inverseInertiaTensor.setInverse(inertiaTensor);
@@ -520,6 +530,11 @@ void RigidBody::setCanSleep(const bool canSleep)
     if (!canSleep && !isAwake) setAwake();
 }
 
+void RigidBody::setBullet(const bool bullet)
+{
+    RigidBody::isBullet = bullet;
+}
+
 
 void RigidBody::getLastFrameAcceleration(Vector3 *acceleration) const
 {
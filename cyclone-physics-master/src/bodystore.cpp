@@ -0,0 +1,509 @@
+/*
+ * Implementation file for the structure-of-arrays rigid body store.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cmath>
+#include <cyclone/bodystore.h>
+
+#if defined(DOUBLE_PRECISION) && defined(__AVX__)
+#include <immintrin.h>
+#elif defined(DOUBLE_PRECISION) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace cyclone;
+
+/*
+ * --------------------------------------------------------------------------
+ * INTERNAL OR HELPER FUNCTIONS:
+ * --------------------------------------------------------------------------
+ */
+
+/*
+ * A batch holds one value for each of several bodies. These
+ * functions provide the arithmetic on batches for the vector
+ * instructions available, falling back to one body at a time.
+ */
+#if defined(DOUBLE_PRECISION) && defined(__AVX__)
+
+typedef __m256d Batch;
+typedef __m256d BatchMask;
+static const unsigned batchSize = 4;
+
+static inline Batch batchLoad(const real *p) { return _mm256_loadu_pd(p); }
+static inline void batchStore(real *p, Batch a) { _mm256_storeu_pd(p, a); }
+static inline Batch batchSplat(real a) { return _mm256_set1_pd(a); }
+static inline Batch batchAdd(Batch a, Batch b) { return _mm256_add_pd(a, b); }
+static inline Batch batchSub(Batch a, Batch b) { return _mm256_sub_pd(a, b); }
+static inline Batch batchMul(Batch a, Batch b) { return _mm256_mul_pd(a, b); }
+static inline Batch batchDivide(Batch a, Batch b) { return _mm256_div_pd(a, b); }
+static inline Batch batchSqrt(Batch a) { return _mm256_sqrt_pd(a); }
+static inline BatchMask batchLess(Batch a, Batch b)
+{
+    return _mm256_cmp_pd(a, b, _CMP_LT_OQ);
+}
+static inline BatchMask batchNotZero(Batch a)
+{
+    return _mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_NEQ_UQ);
+}
+static inline Batch batchSelect(BatchMask mask, Batch a, Batch b)
+{
+    return _mm256_blendv_pd(b, a, mask);
+}
+static inline bool batchAny(BatchMask mask)
+{
+    return _mm256_movemask_pd(mask) != 0;
+}
+
+#elif defined(DOUBLE_PRECISION) && defined(__SSE2__)
+
+typedef __m128d Batch;
+typedef __m128d BatchMask;
+static const unsigned batchSize = 2;
+
+static inline Batch batchLoad(const real *p) { return _mm_loadu_pd(p); }
+static inline void batchStore(real *p, Batch a) { _mm_storeu_pd(p, a); }
+static inline Batch batchSplat(real a) { return _mm_set1_pd(a); }
+static inline Batch batchAdd(Batch a, Batch b) { return _mm_add_pd(a, b); }
+static inline Batch batchSub(Batch a, Batch b) { return _mm_sub_pd(a, b); }
+static inline Batch batchMul(Batch a, Batch b) { return _mm_mul_pd(a, b); }
+static inline Batch batchDivide(Batch a, Batch b) { return _mm_div_pd(a, b); }
+static inline Batch batchSqrt(Batch a) { return _mm_sqrt_pd(a); }
+static inline BatchMask batchLess(Batch a, Batch b)
+{
+    return _mm_cmplt_pd(a, b);
+}
+static inline BatchMask batchNotZero(Batch a)
+{
+    return _mm_cmpneq_pd(a, _mm_setzero_pd());
+}
+static inline Batch batchSelect(BatchMask mask, Batch a, Batch b)
+{
+    return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b));
+}
+static inline bool batchAny(BatchMask mask)
+{
+    return _mm_movemask_pd(mask) != 0;
+}
+
+#else
+
+typedef real Batch;
+typedef bool BatchMask;
+static const unsigned batchSize = 1;
+
+static inline Batch batchLoad(const real *p) { return *p; }
+static inline void batchStore(real *p, Batch a) { *p = a; }
+static inline Batch batchSplat(real a) { return a; }
+static inline Batch batchAdd(Batch a, Batch b) { return a + b; }
+static inline Batch batchSub(Batch a, Batch b) { return a - b; }
+static inline Batch batchMul(Batch a, Batch b) { return a * b; }
+static inline Batch batchDivide(Batch a, Batch b) { return a / b; }
+static inline Batch batchSqrt(Batch a) { return real_sqrt(a); }
+static inline BatchMask batchLess(Batch a, Batch b) { return a < b; }
+static inline BatchMask batchNotZero(Batch a) { return a != 0; }
+static inline Batch batchSelect(BatchMask mask, Batch a, Batch b)
+{
+    return mask ? a : b;
+}
+static inline bool batchAny(BatchMask mask)
+{
+    return mask;
+}
+
+#endif
+
+/*
+ * --------------------------------------------------------------------------
+ * FUNCTIONS DECLARED IN HEADER:
+ * --------------------------------------------------------------------------
+ */
+
+RigidBodyStore::RigidBodyStore()
+:
+dragDuration(-1)
+{
+}
+
+unsigned RigidBodyStore::getBatchSize()
+{
+    return batchSize;
+}
+
+real& RigidBodyStore::value(unsigned field, unsigned index)
+{
+    unsigned batch = index / batchSize;
+    return data[(batch * FIELD_COUNT + field) * batchSize + index % batchSize];
+}
+
+void RigidBodyStore::clearEntry(unsigned index)
+{
+    for (unsigned f = 0; f < FIELD_COUNT; f++) value(f, index) = 0;
+    value(ORIENTATION, index) = 1;
+}
+
+void RigidBodyStore::resize()
+{
+    unsigned capacity = (unsigned)data.size() / FIELD_COUNT;
+    if (bodies.size() <= capacity) return;
+
+    // Add a new batch.
+    data.resize(data.size() + FIELD_COUNT * batchSize);
+    for (unsigned i = capacity; i < capacity + batchSize; i++)
+    {
+        clearEntry(i);
+    }
+}
+
+void RigidBodyStore::load(unsigned index)
+{
+    const RigidBody *body = bodies[index];
+
+    for (unsigned c = 0; c < 3; c++)
+    {
+        value(POSITION + c, index) = body->position[c];
+        value(VELOCITY + c, index) = body->velocity[c];
+        value(ROTATION + c, index) = body->rotation[c];
+        value(FORCE_ACCUM + c, index) = body->forceAccum[c];
+        value(TORQUE_ACCUM + c, index) = body->torqueAccum[c];
+        value(ACCELERATION + c, index) = body->acceleration[c];
+        value(LAST_FRAME_ACCELERATION + c, index) =
+            body->lastFrameAcceleration[c];
+    }
+    value(ORIENTATION + 0, index) = body->orientation.r;
+    value(ORIENTATION + 1, index) = body->orientation.i;
+    value(ORIENTATION + 2, index) = body->orientation.j;
+    value(ORIENTATION + 3, index) = body->orientation.k;
+    value(INVERSE_MASS, index) = body->inverseMass;
+
+    for (unsigned c = 0; c < 9; c++)
+    {
+        value(INVERSE_INERTIA_TENSOR + c, index) =
+            body->inverseInertiaTensor.data[c];
+        value(INVERSE_INERTIA_TENSOR_WORLD + c, index) =
+            body->inverseInertiaTensorWorld.data[c];
+    }
+    for (unsigned c = 0; c < 12; c++)
+    {
+        value(TRANSFORM_MATRIX + c, index) = body->transformMatrix.data[c];
+    }
+    value(AWAKE, index) = body->isAwake ? (real)1 : (real)0;
+
+    linearDamping[index] = body->linearDamping;
+    angularDamping[index] = body->angularDamping;
+    motion[index] = body->motion;
+    canSleep[index] = body->canSleep;
+}
+
+void RigidBodyStore::store(unsigned index)
+{
+    RigidBody *body = bodies[index];
+
+    for (unsigned c = 0; c < 3; c++)
+    {
+        body->position[c] = value(POSITION + c, index);
+        body->velocity[c] = value(VELOCITY + c, index);
+        body->rotation[c] = value(ROTATION + c, index);
+        body->forceAccum[c] = value(FORCE_ACCUM + c, index);
+        body->torqueAccum[c] = value(TORQUE_ACCUM + c, index);
+        body->lastFrameAcceleration[c] =
+            value(LAST_FRAME_ACCELERATION + c, index);
+    }
+    body->orientation.r = value(ORIENTATION + 0, index);
+    body->orientation.i = value(ORIENTATION + 1, index);
+    body->orientation.j = value(ORIENTATION + 2, index);
+    body->orientation.k = value(ORIENTATION + 3, index);
+
+    for (unsigned c = 0; c < 9; c++)
+    {
+        body->inverseInertiaTensorWorld.data[c] =
+            value(INVERSE_INERTIA_TENSOR_WORLD + c, index);
+    }
+    for (unsigned c = 0; c < 12; c++)
+    {
+        body->transformMatrix.data[c] = value(TRANSFORM_MATRIX + c, index);
+    }
+    body->isAwake = value(AWAKE, index) != 0;
+    body->motion = motion[index];
+}
+
+unsigned RigidBodyStore::add(RigidBody *body)
+{
+    unsigned index = (unsigned)bodies.size();
+    bodies.push_back(body);
+    linearDamping.push_back(0);
+    angularDamping.push_back(0);
+    motion.push_back(0);
+    canSleep.push_back(false);
+    resize();
+
+    load(index);
+    dragDuration = -1;
+    return index;
+}
+
+void RigidBodyStore::remove(RigidBody *body)
+{
+    unsigned last = (unsigned)bodies.size() - 1;
+    for (unsigned index = 0; index <= last; index++)
+    {
+        if (bodies[index] != body) continue;
+
+        // Move the last body into the gap.
+        for (unsigned f = 0; f < FIELD_COUNT; f++)
+        {
+            value(f, index) = value(f, last);
+        }
+        bodies[index] = bodies[last];
+        linearDamping[index] = linearDamping[last];
+        angularDamping[index] = angularDamping[last];
+        motion[index] = motion[last];
+        canSleep[index] = canSleep[last];
+
+        clearEntry(last);
+        bodies.pop_back();
+        linearDamping.pop_back();
+        angularDamping.pop_back();
+        motion.pop_back();
+        canSleep.pop_back();
+        return;
+    }
+}
+
+void RigidBodyStore::gather()
+{
+    for (unsigned i = 0; i < bodies.size(); i++) load(i);
+
+    // The damping may have changed.
+    dragDuration = -1;
+}
+
+void RigidBodyStore::scatter()
+{
+    for (unsigned i = 0; i < bodies.size(); i++) store(i);
+}
+
+void RigidBodyStore::integrate(real duration)
+{
+    unsigned size = (unsigned)bodies.size();
+    if (size == 0) return;
+
+    // Work out the drag for each body, which is the same from frame
+    // to frame for a fixed time step.
+    if (duration != dragDuration)
+    {
+        for (unsigned i = 0; i < size; i++)
+        {
+            value(LINEAR_DRAG, i) = real_pow(linearDamping[i], duration);
+            value(ANGULAR_DRAG, i) = real_pow(angularDamping[i], duration);
+        }
+        dragDuration = duration;
+    }
+
+    const Batch dt = batchSplat(duration);
+    const Batch zero = batchSplat(0);
+    const Batch half = batchSplat((real)0.5);
+    const Batch one = batchSplat(1);
+    const Batch two = batchSplat(2);
+    const Batch epsilon = batchSplat(real_epsilon);
+
+    // The arithmetic below follows RigidBody::integrate and
+    // RigidBody::calculateDerivedData step by step. Bodies that
+    // are asleep keep their old values.
+    unsigned batches = (size + batchSize - 1) / batchSize;
+    for (unsigned b = 0; b < batches; b++)
+    {
+        real *block = &data[b * FIELD_COUNT * batchSize];
+        #define FIELD(index) (block + (index) * batchSize)
+
+        BatchMask isAwake = batchNotZero(batchLoad(FIELD(AWAKE)));
+        if (!batchAny(isAwake)) continue;
+
+        // Calculate linear acceleration from force inputs.
+        Batch inverseMass = batchLoad(FIELD(INVERSE_MASS));
+        Batch lastFrameAcceleration[3];
+        for (unsigned c = 0; c < 3; c++)
+        {
+            lastFrameAcceleration[c] = batchAdd(
+                batchLoad(FIELD(ACCELERATION + c)),
+                batchMul(batchLoad(FIELD(FORCE_ACCUM + c)), inverseMass));
+        }
+
+        // Calculate angular acceleration from torque inputs.
+        Batch torque[3];
+        for (unsigned c = 0; c < 3; c++)
+        {
+            torque[c] = batchLoad(FIELD(TORQUE_ACCUM + c));
+        }
+        Batch angularAcceleration[3];
+        for (unsigned r = 0; r < 3; r++)
+        {
+            const real *row = FIELD(INVERSE_INERTIA_TENSOR_WORLD + r*3);
+            angularAcceleration[r] = batchAdd(batchAdd(
+                batchMul(torque[0], batchLoad(row)),
+                batchMul(torque[1], batchLoad(row + batchSize))),
+                batchMul(torque[2], batchLoad(row + 2*batchSize)));
+        }
+
+        // Update velocities, impose drag and update the position.
+        Batch linearDrag = batchLoad(FIELD(LINEAR_DRAG));
+        Batch angularDrag = batchLoad(FIELD(ANGULAR_DRAG));
+        Batch velocity[3], rotation[3], position[3];
+        for (unsigned c = 0; c < 3; c++)
+        {
+            velocity[c] = batchMul(batchAdd(
+                batchLoad(FIELD(VELOCITY + c)),
+                batchMul(lastFrameAcceleration[c], dt)), linearDrag);
+            rotation[c] = batchMul(batchAdd(
+                batchLoad(FIELD(ROTATION + c)),
+                batchMul(angularAcceleration[c], dt)), angularDrag);
+            position[c] = batchAdd(
+                batchLoad(FIELD(POSITION + c)),
+                batchMul(velocity[c], dt));
+        }
+
+        // Update the orientation.
+        Batch qr = batchLoad(FIELD(ORIENTATION + 0));
+        Batch qi = batchLoad(FIELD(ORIENTATION + 1));
+        Batch qj = batchLoad(FIELD(ORIENTATION + 2));
+        Batch qk = batchLoad(FIELD(ORIENTATION + 3));
+        Batch sx = batchMul(rotation[0], dt);
+        Batch sy = batchMul(rotation[1], dt);
+        Batch sz = batchMul(rotation[2], dt);
+        Batch dr = batchSub(batchSub(batchSub(batchMul(zero, qr),
+            batchMul(sx, qi)), batchMul(sy, qj)), batchMul(sz, qk));
+        Batch di = batchSub(batchAdd(batchAdd(batchMul(zero, qi),
+            batchMul(sx, qr)), batchMul(sy, qk)), batchMul(sz, qj));
+        Batch dj = batchSub(batchAdd(batchAdd(batchMul(zero, qj),
+            batchMul(sy, qr)), batchMul(sz, qi)), batchMul(sx, qk));
+        Batch dk = batchSub(batchAdd(batchAdd(batchMul(zero, qk),
+            batchMul(sz, qr)), batchMul(sx, qj)), batchMul(sy, qi));
+        qr = batchAdd(qr, batchMul(dr, half));
+        qi = batchAdd(qi, batchMul(di, half));
+        qj = batchAdd(qj, batchMul(dj, half));
+        qk = batchAdd(qk, batchMul(dk, half));
+
+        // Normalise the orientation.
+        Batch d = batchAdd(batchAdd(batchAdd(batchMul(qr, qr),
+            batchMul(qi, qi)), batchMul(qj, qj)), batchMul(qk, qk));
+        BatchMask degenerate = batchLess(d, epsilon);
+        d = batchDivide(one, batchSqrt(d));
+        qr = batchSelect(degenerate, one, batchMul(qr, d));
+        qi = batchSelect(degenerate, qi, batchMul(qi, d));
+        qj = batchSelect(degenerate, qj, batchMul(qj, d));
+        qk = batchSelect(degenerate, qk, batchMul(qk, d));
+
+        // Calculate the transform matrix.
+        Batch ti = batchMul(two, qi), tj = batchMul(two, qj);
+        Batch tk = batchMul(two, qk), tr = batchMul(two, qr);
+        Batch m[12];
+        m[0] = batchSub(batchSub(one, batchMul(tj, qj)), batchMul(tk, qk));
+        m[1] = batchSub(batchMul(ti, qj), batchMul(tr, qk));
+        m[2] = batchAdd(batchMul(ti, qk), batchMul(tr, qj));
+        m[3] = position[0];
+        m[4] = batchAdd(batchMul(ti, qj), batchMul(tr, qk));
+        m[5] = batchSub(batchSub(one, batchMul(ti, qi)), batchMul(tk, qk));
+        m[6] = batchSub(batchMul(tj, qk), batchMul(tr, qi));
+        m[7] = position[1];
+        m[8] = batchSub(batchMul(ti, qk), batchMul(tr, qj));
+        m[9] = batchAdd(batchMul(tj, qk), batchMul(tr, qi));
+        m[10] = batchSub(batchSub(one, batchMul(ti, qi)), batchMul(tj, qj));
+        m[11] = position[2];
+
+        // Calculate the inertia tensor in world space.
+        Batch temp[9];
+        for (unsigned r = 0; r < 3; r++)
+        {
+            for (unsigned c = 0; c < 3; c++)
+            {
+                const real *column = FIELD(INVERSE_INERTIA_TENSOR + c);
+                temp[r*3+c] = batchAdd(batchAdd(
+                    batchMul(m[r*4], batchLoad(column)),
+                    batchMul(m[r*4+1], batchLoad(column + 3*batchSize))),
+                    batchMul(m[r*4+2], batchLoad(column + 6*batchSize)));
+            }
+        }
+        Batch inverseInertiaTensorWorld[9];
+        for (unsigned r = 0; r < 3; r++)
+        {
+            for (unsigned c = 0; c < 3; c++)
+            {
+                inverseInertiaTensorWorld[r*3+c] = batchAdd(batchAdd(
+                    batchMul(temp[r*3], m[c*4]),
+                    batchMul(temp[r*3+1], m[c*4+1])),
+                    batchMul(temp[r*3+2], m[c*4+2]));
+            }
+        }
+
+        // Write back the results for the awake bodies, clearing their
+        // accumulators.
+        #define WRITE(index, result) batchStore(FIELD(index), \
+            batchSelect(isAwake, (result), batchLoad(FIELD(index))))
+
+        for (unsigned c = 0; c < 3; c++)
+        {
+            WRITE(POSITION + c, position[c]);
+            WRITE(VELOCITY + c, velocity[c]);
+            WRITE(ROTATION + c, rotation[c]);
+            WRITE(LAST_FRAME_ACCELERATION + c, lastFrameAcceleration[c]);
+            WRITE(FORCE_ACCUM + c, zero);
+            WRITE(TORQUE_ACCUM + c, zero);
+        }
+        WRITE(ORIENTATION + 0, qr);
+        WRITE(ORIENTATION + 1, qi);
+        WRITE(ORIENTATION + 2, qj);
+        WRITE(ORIENTATION + 3, qk);
+        for (unsigned c = 0; c < 9; c++)
+        {
+            WRITE(INVERSE_INERTIA_TENSOR_WORLD + c,
+                inverseInertiaTensorWorld[c]);
+        }
+        for (unsigned c = 0; c < 12; c++)
+        {
+            WRITE(TRANSFORM_MATRIX + c, m[c]);
+        }
+
+        #undef WRITE
+        #undef FIELD
+    }
+
+    // Update the kinetic energy store, and possibly put bodies to
+    // sleep.
+    real bias = real_pow(0.5, duration);
+    for (unsigned i = 0; i < size; i++)
+    {
+        if (value(AWAKE, i) == 0 || !canSleep[i]) continue;
+
+        Vector3 velocity, rotation;
+        for (unsigned c = 0; c < 3; c++)
+        {
+            velocity[c] = value(VELOCITY + c, i);
+            rotation[c] = value(ROTATION + c, i);
+        }
+        real currentMotion = velocity.scalarProduct(velocity) +
+            rotation.scalarProduct(rotation);
+        motion[i] = bias*motion[i] + (1-bias)*currentMotion;
+
+        if (motion[i] < sleepEpsilon)
+        {
+            value(AWAKE, i) = 0;
+            for (unsigned c = 0; c < 3; c++)
+            {
+                value(VELOCITY + c, i) = 0;
+                value(ROTATION + c, i) = 0;
+            }
+        }
+        else if (motion[i] > 10 * sleepEpsilon)
+        {
+            motion[i] = 10 * sleepEpsilon;
+        }
+    }
+}
@@ -0,0 +1,599 @@
+/*
+ * Implementation file for capsule primitives.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/capsule.h>
+#include <algorithm>
+
+using namespace cyclone;
+
+BoundingBox CollisionCapsule::getBoundingBox() const
+{
+    Vector3 start, end;
+    getSegment(&start, &end);
+    Vector3 extent(radius, radius, radius);
+    return BoundingBox(BoundingBox(start - extent, start + extent),
+                       BoundingBox(end - extent, end + extent));
+}
+
+/**
+ * Clamps a fraction to lie between zero and one.
+ */
+static inline real clampFraction(real fraction)
+{
+    if (fraction < 0) return 0;
+    if (fraction > 1) return 1;
+    return fraction;
+}
+
+/**
+ * Returns how far along the segment from start to end the point
+ * closest to the given point is, as a fraction of its length.
+ */
+static real closestOnSegment(const Vector3 &start,
+                             const Vector3 &end,
+                             const Vector3 &point)
+{
+    Vector3 segment = end - start;
+    real lengthSquared = segment.squareMagnitude();
+    if (lengthSquared <= 0) return 0;
+    return clampFraction(((point - start) * segment) / lengthSquared);
+}
+
+/**
+ * Finds the closest points between two segments, writing how far
+ * along each they are as a fraction of its length.
+ */
+static void closestBetweenSegments(const Vector3 &startOne,
+                                   const Vector3 &endOne,
+                                   const Vector3 &startTwo,
+                                   const Vector3 &endTwo,
+                                   real *s,
+                                   real *t)
+{
+    Vector3 directionOne = endOne - startOne;
+    Vector3 directionTwo = endTwo - startTwo;
+    Vector3 offset = startOne - startTwo;
+    real lengthOne = directionOne.squareMagnitude();
+    real lengthTwo = directionTwo.squareMagnitude();
+    real f = directionTwo * offset;
+
+    // Either segment may be a single point.
+    if (lengthOne <= 0)
+    {
+        *s = 0;
+        *t = lengthTwo > 0 ? clampFraction(f / lengthTwo) : 0;
+        return;
+    }
+    real c = directionOne * offset;
+    if (lengthTwo <= 0)
+    {
+        *t = 0;
+        *s = clampFraction(-c / lengthOne);
+        return;
+    }
+
+    // Find the closest points of the two lines, keeping the first
+    // on its segment, then bring the second onto its segment and
+    // find the first again from there if it had to move.
+    real b = directionOne * directionTwo;
+    real denominator = lengthOne * lengthTwo - b*b;
+    *s = denominator > 0 ?
+        clampFraction((b*f - c*lengthTwo) / denominator) : 0;
+    *t = (b * *s + f) / lengthTwo;
+    if (*t < 0)
+    {
+        *t = 0;
+        *s = clampFraction(-c / lengthOne);
+    }
+    else if (*t > 1)
+    {
+        *t = 1;
+        *s = clampFraction((b - c) / lengthOne);
+    }
+}
+
+/**
+ * Writes a contact, if there is room for one, and returns the number
+ * written.
+ */
+static unsigned writeContact(RigidBody *one,
+                             RigidBody *two,
+                             const Vector3 &normal,
+                             const Vector3 &point,
+                             real penetration,
+                             unsigned feature,
+                             CollisionData *data)
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    Contact* contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->contactPoint = point;
+    contact->penetration = penetration;
+    contact->setBodyData(one, two, data->friction, data->restitution);
+    contact->feature = feature;
+    data->addContacts(1);
+    return 1;
+}
+
+/**
+ * Writes the contact between two spheres with the given centres and
+ * radii, which belong to the given primitives, if they are close
+ * enough. The contact point is midway between their surfaces.
+ */
+static unsigned sphereContact(const CollisionPrimitive &one,
+                              const Vector3 &centreOne,
+                              real radiusOne,
+                              const CollisionPrimitive &two,
+                              const Vector3 &centreTwo,
+                              real radiusTwo,
+                              unsigned feature,
+                              CollisionData *data)
+{
+    Vector3 midline = centreOne - centreTwo;
+    real size = midline.magnitude();
+    if (size <= 0 || size > radiusOne + radiusTwo + data->tolerance)
+    {
+        return 0;
+    }
+
+    Vector3 normal = midline * (((real)1.0) / size);
+    real penetration = radiusOne + radiusTwo - size;
+    return writeContact(one.body, two.body, normal,
+        centreTwo + normal * (radiusTwo - penetration * (real)0.5),
+        penetration, feature, data);
+}
+
+unsigned CollisionDetector::capsuleAndHalfSpace(
+    const CollisionCapsule &capsule,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    // Each cap touching the plane makes a contact, so a capsule lying
+    // on the plane rests on both.
+    Vector3 ends[2];
+    capsule.getSegment(&ends[0], &ends[1]);
+    unsigned written = 0;
+    for (unsigned i = 0; i < 2; i++)
+    {
+        real distance = plane.direction * ends[i] -
+            capsule.radius - plane.offset;
+        if (distance > data->tolerance) continue;
+
+        written += writeContact(capsule.body, NULL, plane.direction,
+            ends[i] - plane.direction * (distance + capsule.radius),
+            -distance, i, data);
+    }
+    return written;
+}
+
+unsigned CollisionDetector::capsuleAndSphere(
+    const CollisionCapsule &capsule,
+    const CollisionSphere &sphere,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 start, end;
+    capsule.getSegment(&start, &end);
+    Vector3 centre = sphere.getAxis(3);
+    Vector3 core = start + (end - start) * closestOnSegment(start, end, centre);
+
+    return sphereContact(capsule, core, capsule.radius,
+                         sphere, centre, sphere.radius, 0, data);
+}
+
+/**
+ * Capsules closer than this to parallel, as the sine of the angle
+ * between them, are treated as lying along each other.
+ */
+const static real parallelSine = (real)0.001;
+
+unsigned CollisionDetector::capsuleAndCapsule(
+    const CollisionCapsule &one,
+    const CollisionCapsule &two,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 startOne, endOne, startTwo, endTwo;
+    one.getSegment(&startOne, &endOne);
+    two.getSegment(&startTwo, &endTwo);
+    Vector3 directionOne = endOne - startOne;
+    Vector3 directionTwo = endTwo - startTwo;
+    real lengthOne = directionOne.squareMagnitude();
+    real lengthTwo = directionTwo.squareMagnitude();
+
+    // Parallel capsules that overlap along their length touch along
+    // a line, so take a contact at each end of the overlap.
+    Vector3 cross = directionOne % directionTwo;
+    if (lengthOne > 0 && lengthTwo > 0 &&
+        cross.squareMagnitude() <=
+            parallelSine * parallelSine * lengthOne * lengthTwo)
+    {
+        real first = ((startTwo - startOne) * directionOne) / lengthOne;
+        real last = ((endTwo - startOne) * directionOne) / lengthOne;
+        if (first > last) std::swap(first, last);
+        first = clampFraction(first);
+        last = clampFraction(last);
+
+        if (first < last)
+        {
+            unsigned written = 0;
+            real ends[2] = { first, last };
+            for (unsigned i = 0; i < 2; i++)
+            {
+                Vector3 coreOne = startOne + directionOne * ends[i];
+                Vector3 coreTwo = startTwo + directionTwo *
+                    closestOnSegment(startTwo, endTwo, coreOne);
+                written += sphereContact(one, coreOne, one.radius,
+                                         two, coreTwo, two.radius,
+                                         i, data);
+            }
+            return written;
+        }
+    }
+
+    real s, t;
+    closestBetweenSegments(startOne, endOne, startTwo, endTwo, &s, &t);
+    return sphereContact(one, startOne + directionOne * s, one.radius,
+                         two, startTwo + directionTwo * t, two.radius,
+                         2, data);
+}
+
+/**
+ * Returns the point of a box centred on the origin closest to the
+ * given point.
+ */
+static Vector3 clampToBox(const Vector3 &point, const Vector3 &halfSize)
+{
+    Vector3 result = point;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (result[i] > halfSize[i]) result[i] = halfSize[i];
+        else if (result[i] < -halfSize[i]) result[i] = -halfSize[i];
+    }
+    return result;
+}
+
+/**
+ * Returns how far along the segment from start to end the point
+ * closest to a box centred on the origin is, as a fraction of its
+ * length, and writes out the square of its distance from the box.
+ *
+ * Between the places where the segment crosses the planes of the
+ * box's faces, its squared distance from the box is a sum of squares
+ * for the axes it is outside the box on, which is a quadratic whose
+ * lowest point can be solved for directly. The nearest of these
+ * lowest points is the closest point of the whole segment.
+ */
+static real closestToBox(const Vector3 &start,
+                         const Vector3 &end,
+                         const Vector3 &halfSize,
+                         real *squareDistance)
+{
+    Vector3 direction = end - start;
+    real breaks[8];
+    unsigned count = 0;
+    breaks[count++] = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (direction[i] == 0) continue;
+        for (int sign = -1; sign <= 1; sign += 2)
+        {
+            real fraction = (sign * halfSize[i] - start[i]) / direction[i];
+            if (fraction <= 0 || fraction >= 1) continue;
+
+            // Keep the breaks in order as they are added.
+            unsigned k = count++;
+            while (breaks[k-1] > fraction)
+            {
+                breaks[k] = breaks[k-1];
+                k--;
+            }
+            breaks[k] = fraction;
+        }
+    }
+    breaks[count++] = 1;
+
+    real best = 0;
+    real bestDistance = REAL_MAX;
+    for (unsigned k = 0; k + 1 < count; k++)
+    {
+        real lower = breaks[k];
+        real upper = breaks[k+1];
+
+        // Find which faces the middle of this stretch is outside.
+        Vector3 middle = start + direction * ((lower + upper) * (real)0.5);
+        Vector3 faces;
+        bool outside[3];
+        real numerator = 0;
+        real denominator = 0;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            outside[i] = true;
+            if (middle[i] > halfSize[i]) faces[i] = halfSize[i];
+            else if (middle[i] < -halfSize[i]) faces[i] = -halfSize[i];
+            else
+            {
+                outside[i] = false;
+                continue;
+            }
+
+            numerator -= (start[i] - faces[i]) * direction[i];
+            denominator += direction[i] * direction[i];
+        }
+
+        real fraction = lower;
+        if (denominator > 0)
+        {
+            fraction = numerator / denominator;
+            if (fraction < lower) fraction = lower;
+            if (fraction > upper) fraction = upper;
+        }
+
+        // Measure with the same faces, so a stretch inside the box
+        // is exactly touching it.
+        Vector3 point = start + direction * fraction;
+        real distance = 0;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            if (!outside[i]) continue;
+            real gap = point[i] - faces[i];
+            distance += gap * gap;
+        }
+        if (distance < bestDistance)
+        {
+            bestDistance = distance;
+            best = fraction;
+        }
+    }
+    *squareDistance = bestDistance;
+    return best;
+}
+
+/**
+ * Writes the contact between a box and the sphere of a capsule around
+ * the given point of its segment, in the box's coordinates, if the
+ * point is outside the box and close enough. The normal used is
+ * written out.
+ */
+static unsigned capsulePointAndBox(const CollisionCapsule &capsule,
+                                   const CollisionBox &box,
+                                   const Vector3 &core,
+                                   unsigned feature,
+                                   Vector3 *normal,
+                                   CollisionData *data)
+{
+    Vector3 closest = clampToBox(core, box.halfSize);
+    Vector3 separation = core - closest;
+    real distance = separation.magnitude();
+    if (distance <= 0 || distance > capsule.radius + data->tolerance)
+    {
+        return 0;
+    }
+
+    const Matrix4 &transform = box.getTransform();
+    *normal = transform.transformDirection(
+        separation * (((real)1.0) / distance));
+    return writeContact(capsule.body, box.body, *normal,
+        transform.transform(closest), capsule.radius - distance,
+        feature, data);
+}
+
+/**
+ * Contacts at both caps whose normals are closer than this to each
+ * other, as the cosine of the angle between them, are taken to be
+ * resting on the same face.
+ */
+const static real flatAlignment = (real)0.999;
+
+/**
+ * A closest point nearer than this to either end of a segment, as a
+ * fraction of its length, is taken to be at that end.
+ */
+const static real endFraction = (real)0.001;
+
+unsigned CollisionDetector::capsuleAndBox(
+    const CollisionCapsule &capsule,
+    const CollisionBox &box,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    // Work in the box's coordinates, where it is aligned.
+    const Matrix4 &transform = box.getTransform();
+    Vector3 start, end;
+    capsule.getSegment(&start, &end);
+    Vector3 ends[2] = {
+        transform.transformInverse(start),
+        transform.transformInverse(end)
+    };
+    const Vector3 &halfSize = box.halfSize;
+
+    // Early out check on the box around the capsule.
+    real reach = capsule.radius + data->tolerance;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real lower = ends[0][i] < ends[1][i] ? ends[0][i] : ends[1][i];
+        real upper = ends[0][i] < ends[1][i] ? ends[1][i] : ends[0][i];
+        if (lower - reach > halfSize[i] || upper + reach < -halfSize[i])
+        {
+            return 0;
+        }
+    }
+
+    real squareDistance;
+    real fraction = closestToBox(ends[0], ends[1], halfSize, &squareDistance);
+    Vector3 core = ends[0] + (ends[1] - ends[0]) * fraction;
+
+    if (squareDistance > 0)
+    {
+        // The segment is outside the box. Each cap near the box makes
+        // a contact, and the closest point adds one where the capsule
+        // lies across an edge or a corner rather than along a face.
+        Vector3 normals[2], normal;
+        unsigned touching[2];
+        for (unsigned i = 0; i < 2; i++)
+        {
+            touching[i] = capsulePointAndBox(capsule, box, ends[i], i,
+                                             &normals[i], data);
+        }
+
+        bool flat = touching[0] && touching[1] &&
+            normals[0] * normals[1] > flatAlignment;
+        unsigned written = touching[0] + touching[1];
+        if (!flat && fraction > endFraction && fraction < 1 - endFraction)
+        {
+            written += capsulePointAndBox(capsule, box, core, 2,
+                                          &normal, data);
+        }
+        return written;
+    }
+
+    // The segment passes into the box, so push the capsule out
+    // through the face it overlaps least.
+    unsigned axis = 0;
+    real sign = 1;
+    real least = REAL_MAX;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real lower = ends[0][i] < ends[1][i] ? ends[0][i] : ends[1][i];
+        real upper = ends[0][i] < ends[1][i] ? ends[1][i] : ends[0][i];
+        real up = halfSize[i] + capsule.radius - lower;
+        real down = upper + capsule.radius + halfSize[i];
+        if (up < least)
+        {
+            least = up;
+            axis = i;
+            sign = 1;
+        }
+        if (down < least)
+        {
+            least = down;
+            axis = i;
+            sign = -1;
+        }
+    }
+
+    Vector3 localNormal;
+    localNormal[axis] = sign;
+    Vector3 normal = transform.transformDirection(localNormal);
+
+    // Each cap below the face makes a contact on it, and if neither
+    // is, the deepest point does.
+    Vector3 points[3] = { ends[0], ends[1], core };
+    unsigned written = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (i == 2 && written > 0) break;
+
+        real depth = halfSize[axis] + capsule.radius - sign * points[i][axis];
+        if (depth < -data->tolerance && i < 2) continue;
+
+        Vector3 facePoint = clampToBox(points[i], halfSize);
+        facePoint[axis] = sign * halfSize[axis];
+        written += writeContact(capsule.body, box.body, normal,
+            transform.transform(facePoint), depth, 3 + i, data);
+    }
+    return written;
+}
+
+bool IntersectionTests::rayAndCapsule(
+    const Ray &ray,
+    real radius,
+    const CollisionCapsule &capsule,
+    RayHit *hit)
+{
+    Vector3 start, end;
+    capsule.getSegment(&start, &end);
+    Vector3 axis = end - start;
+    real radii = capsule.radius + radius;
+
+    // A ray that starts inside the capsule hits it straight away.
+    Vector3 nearest = start + axis * closestOnSegment(start, end, ray.origin);
+    if ((ray.origin - nearest).squareMagnitude() <= radii * radii)
+    {
+        hit->primitive = &capsule;
+        hit->point = ray.origin;
+        hit->normal = ray.direction * -1;
+        hit->distance = 0;
+        return true;
+    }
+
+    // The capsule is the cylinder and the two caps together, so the
+    // first of them the ray enters is where it enters the capsule.
+    bool found = false;
+    real best = ray.maxDistance;
+    Vector3 bestCore;
+
+    // Solve for where the ray is the radius away from the line of
+    // the axis, and keep it if it is between the caps.
+    real axisSquared = axis * axis;
+    real axisDirection = axis * ray.direction;
+    Vector3 offset = ray.origin - start;
+    real axisOffset = axis * offset;
+    real a = axisSquared - axisDirection * axisDirection;
+    if (a > 0)
+    {
+        real b = axisSquared * (offset * ray.direction) -
+            axisOffset * axisDirection;
+        real c = axisSquared * (offset * offset) -
+            axisOffset * axisOffset - radii * radii * axisSquared;
+        real discriminant = b*b - a*c;
+        if (discriminant >= 0)
+        {
+            real distance = (-b - real_sqrt(discriminant)) / a;
+            real along = axisOffset + distance * axisDirection;
+            if (distance >= 0 && distance <= best &&
+                along > 0 && along < axisSquared)
+            {
+                best = distance;
+                bestCore = start + axis * (along / axisSquared);
+                found = true;
+            }
+        }
+    }
+
+    // Then each cap, in the same way as rayAndSphere.
+    const Vector3 *centres[2] = { &start, &end };
+    for (unsigned i = 0; i < 2; i++)
+    {
+        Vector3 capOffset = ray.origin - *centres[i];
+        real b = capOffset * ray.direction;
+        if (b >= 0) continue;
+
+        real discriminant = b*b - (capOffset.squareMagnitude() - radii*radii);
+        if (discriminant < 0) continue;
+
+        real distance = -b - real_sqrt(discriminant);
+        if (distance > best) continue;
+
+        best = distance;
+        bestCore = *centres[i];
+        found = true;
+    }
+    if (!found) return false;
+
+    Vector3 position = ray.origin + ray.direction * best;
+    hit->primitive = &capsule;
+    hit->normal = (position - bestCore) * (((real)1.0) / radii);
+    hit->point = bestCore + hit->normal * capsule.radius;
+    hit->distance = best;
+    return true;
+}
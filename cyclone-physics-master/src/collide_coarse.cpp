@@ -11,6 +11,7 @@
  */
 
 #include <cyclone/collide_coarse.h>
+#include <cyclone/collide_fine.h>
 
 using namespace cyclone;
 
@@ -74,4 +75,522 @@ real BoundingSphere::getGrowth(const BoundingSphere &other) const
     // We return a value proportional to the change in surface
     // area of the sphere.
     return newSphere.radius*newSphere.radius - radius*radius;
-}
\ No newline at end of file
+}
+
+BoundingBox::BoundingBox(const Vector3 &lower, const Vector3 &upper)
+{
+    BoundingBox::lower = lower;
+    BoundingBox::upper = upper;
+}
+
+BoundingBox::BoundingBox(const BoundingBox &one, const BoundingBox &two)
+{
+    for (unsigned i = 0; i < 3; i++)
+    {
+        lower[i] = one.lower[i] < two.lower[i] ? one.lower[i] : two.lower[i];
+        upper[i] = one.upper[i] > two.upper[i] ? one.upper[i] : two.upper[i];
+    }
+}
+
+bool BoundingBox::overlaps(const BoundingBox *other) const
+{
+    if (upper.x < other->lower.x || other->upper.x < lower.x) return false;
+    if (upper.y < other->lower.y || other->upper.y < lower.y) return false;
+    if (upper.z < other->lower.z || other->upper.z < lower.z) return false;
+    return true;
+}
+
+bool BoundingBox::contains(const BoundingBox &other) const
+{
+    return
+        lower.x <= other.lower.x && lower.y <= other.lower.y &&
+        lower.z <= other.lower.z && other.upper.x <= upper.x &&
+        other.upper.y <= upper.y && other.upper.z <= upper.z;
+}
+
+real BoundingBox::getGrowth(const BoundingBox &other) const
+{
+    BoundingBox newBox(*this, other);
+    return newBox.getSurfaceArea() - getSurfaceArea();
+}
+
+const unsigned AABBTree::nullNode;
+
+AABBTree::AABBTree(real margin)
+:
+root(nullNode), freeList(nullNode), proxyCount(0), margin(margin)
+{
+}
+
+unsigned AABBTree::allocateNode()
+{
+    unsigned node;
+    if (freeList == nullNode)
+    {
+        node = (unsigned)nodes.size();
+        nodes.push_back(Node());
+    }
+    else
+    {
+        node = freeList;
+        freeList = nodes[node].parent;
+    }
+
+    Node &n = nodes[node];
+    n.body = NULL;
+    n.primitive = NULL;
+    n.parent = nullNode;
+    n.children[0] = n.children[1] = nullNode;
+    n.height = 0;
+    return node;
+}
+
+void AABBTree::freeNode(unsigned node)
+{
+    nodes[node].parent = freeList;
+    nodes[node].height = -1;
+    freeList = node;
+}
+
+unsigned AABBTree::createProxy(const BoundingBox &box,
+                               RigidBody *body,
+                               CollisionPrimitive *primitive)
+{
+    unsigned proxy = allocateNode();
+    Node &leaf = nodes[proxy];
+
+    Vector3 enlarge(margin, margin, margin);
+    leaf.box = BoundingBox(box.lower - enlarge, box.upper + enlarge);
+    leaf.body = body;
+    leaf.primitive = primitive;
+
+    insertLeaf(proxy);
+    proxyCount++;
+    return proxy;
+}
+
+void AABBTree::destroyProxy(unsigned proxy)
+{
+    removeLeaf(proxy);
+    freeNode(proxy);
+    proxyCount--;
+}
+
+bool AABBTree::moveProxy(unsigned proxy,
+                         const BoundingBox &box,
+                         const Vector3 &displacement)
+{
+    // Objects that are still inside their fat box need no work.
+    if (nodes[proxy].box.contains(box)) return false;
+
+    removeLeaf(proxy);
+
+    // Enlarge the box, and stretch it in the direction of travel.
+    Vector3 enlarge(margin, margin, margin);
+    BoundingBox fat(box.lower - enlarge, box.upper + enlarge);
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (displacement[i] < 0) fat.lower[i] += displacement[i];
+        else fat.upper[i] += displacement[i];
+    }
+    nodes[proxy].box = fat;
+
+    insertLeaf(proxy);
+    return true;
+}
+
+unsigned AABBTree::getHeight() const
+{
+    if (root == nullNode) return 0;
+    return (unsigned)nodes[root].height;
+}
+
+void AABBTree::insertLeaf(unsigned leaf)
+{
+    if (root == nullNode)
+    {
+        root = leaf;
+        nodes[root].parent = nullNode;
+        return;
+    }
+
+    // Work down the tree to find the best sibling for the new leaf.
+    // At each node we compare the cost of pairing the leaf with this
+    // node against the cost of pushing it further down either child,
+    // where cost is the total surface area of the boxes we create
+    // or enlarge.
+    BoundingBox leafBox = nodes[leaf].box;
+    unsigned index = root;
+    while (!nodes[index].isLeaf())
+    {
+        const Node &node = nodes[index];
+        real area = node.box.getSurfaceArea();
+        real combinedArea = BoundingBox(node.box, leafBox).getSurfaceArea();
+
+        // The cost of creating a new parent for this node and the leaf.
+        real cost = ((real)2.0) * combinedArea;
+
+        // The cost every node below here pays for enlarging this one.
+        real inheritedCost = ((real)2.0) * (combinedArea - area);
+
+        real childCost[2];
+        for (unsigned i = 0; i < 2; i++)
+        {
+            const Node &child = nodes[node.children[i]];
+            if (child.isLeaf())
+            {
+                childCost[i] = BoundingBox(child.box, leafBox).
+                    getSurfaceArea() + inheritedCost;
+            }
+            else
+            {
+                childCost[i] = child.box.getGrowth(leafBox) + inheritedCost;
+            }
+        }
+
+        if (cost < childCost[0] && cost < childCost[1]) break;
+        index = node.children[childCost[0] < childCost[1] ? 0 : 1];
+    }
+    unsigned sibling = index;
+
+    // Create a new parent for the sibling and the leaf.
+    unsigned oldParent = nodes[sibling].parent;
+    unsigned newParent = allocateNode();
+    Node &parent = nodes[newParent];
+    parent.parent = oldParent;
+    parent.box = BoundingBox(leafBox, nodes[sibling].box);
+    parent.height = nodes[sibling].height + 1;
+    parent.children[0] = sibling;
+    parent.children[1] = leaf;
+
+    if (oldParent != nullNode)
+    {
+        Node &old = nodes[oldParent];
+        if (old.children[0] == sibling) old.children[0] = newParent;
+        else old.children[1] = newParent;
+    }
+    else
+    {
+        root = newParent;
+    }
+    nodes[sibling].parent = newParent;
+    nodes[leaf].parent = newParent;
+
+    refit(newParent);
+}
+
+void AABBTree::removeLeaf(unsigned leaf)
+{
+    if (leaf == root)
+    {
+        root = nullNode;
+        return;
+    }
+
+    // The leaf's sibling takes the place of their parent.
+    unsigned parent = nodes[leaf].parent;
+    unsigned grandParent = nodes[parent].parent;
+    unsigned sibling = nodes[parent].children[0] == leaf ?
+        nodes[parent].children[1] : nodes[parent].children[0];
+
+    if (grandParent != nullNode)
+    {
+        Node &grand = nodes[grandParent];
+        if (grand.children[0] == parent) grand.children[0] = sibling;
+        else grand.children[1] = sibling;
+        nodes[sibling].parent = grandParent;
+        freeNode(parent);
+
+        refit(grandParent);
+    }
+    else
+    {
+        root = sibling;
+        nodes[sibling].parent = nullNode;
+        freeNode(parent);
+    }
+}
+
+void AABBTree::refit(unsigned index)
+{
+    while (index != nullNode)
+    {
+        index = balance(index);
+
+        Node &node = nodes[index];
+        const Node &one = nodes[node.children[0]];
+        const Node &two = nodes[node.children[1]];
+        node.height = 1 + (one.height > two.height ? one.height : two.height);
+        node.box = BoundingBox(one.box, two.box);
+
+        index = node.parent;
+    }
+}
+
+unsigned AABBTree::balance(unsigned a)
+{
+    Node &nodeA = nodes[a];
+    if (nodeA.isLeaf() || nodeA.height < 2) return a;
+
+    // Find the taller of the two children: it will be rotated up to
+    // take our place.
+    int difference =
+        nodes[nodeA.children[1]].height - nodes[nodeA.children[0]].height;
+    if (difference >= -1 && difference <= 1) return a;
+
+    unsigned tall = difference > 1 ? 1 : 0;
+    unsigned b = nodeA.children[tall];
+    unsigned c = nodeA.children[1-tall];
+    Node &nodeB = nodes[b];
+
+    // B takes A's place in the tree, and A becomes a child of B.
+    nodeB.parent = nodeA.parent;
+    nodeA.parent = b;
+    if (nodeB.parent != nullNode)
+    {
+        Node &parent = nodes[nodeB.parent];
+        if (parent.children[0] == a) parent.children[0] = b;
+        else parent.children[1] = b;
+    }
+    else
+    {
+        root = b;
+    }
+
+    // B keeps its taller child, and gives its shorter one to A in
+    // the slot B used to occupy.
+    unsigned d = nodeB.children[0];
+    unsigned e = nodeB.children[1];
+    if (nodes[e].height > nodes[d].height)
+    {
+        unsigned swap = d; d = e; e = swap;
+    }
+    nodeB.children[0] = a;
+    nodeB.children[1] = d;
+    nodeA.children[tall] = e;
+    nodes[e].parent = a;
+
+    const Node &nodeC = nodes[c];
+    const Node &nodeD = nodes[d];
+    const Node &nodeE = nodes[e];
+    nodeA.box = BoundingBox(nodeC.box, nodeE.box);
+    nodeA.height = 1 +
+        (nodeC.height > nodeE.height ? nodeC.height : nodeE.height);
+    nodeB.box = BoundingBox(nodeA.box, nodeD.box);
+    nodeB.height = 1 +
+        (nodeA.height > nodeD.height ? nodeA.height : nodeD.height);
+
+    return b;
+}
+
+unsigned AABBTree::getPotentialContacts(PotentialContact* contacts,
+                                        unsigned limit) const
+{
+    if (root == nullNode || limit == 0) return 0;
+
+    // We work through pairs of subtrees whose contents might touch.
+    // A pair of the same node stands for the contacts within that
+    // subtree.
+    unsigned count = 0;
+    pairStack.clear();
+    pairStack.push_back(root);
+    pairStack.push_back(root);
+
+    while (!pairStack.empty() && count < limit)
+    {
+        unsigned two = pairStack.back(); pairStack.pop_back();
+        unsigned one = pairStack.back(); pairStack.pop_back();
+        const Node &nodeOne = nodes[one];
+        const Node &nodeTwo = nodes[two];
+
+        if (one == two)
+        {
+            if (nodeOne.isLeaf()) continue;
+
+            unsigned left = nodeOne.children[0];
+            unsigned right = nodeOne.children[1];
+            pairStack.push_back(left); pairStack.push_back(right);
+            pairStack.push_back(right); pairStack.push_back(right);
+            pairStack.push_back(left); pairStack.push_back(left);
+            continue;
+        }
+
+        if (!nodeOne.box.overlaps(&nodeTwo.box)) continue;
+
+        if (nodeOne.isLeaf() && nodeTwo.isLeaf())
+        {
+            // Primitives on the same body never collide.
+            if (nodeOne.body != NULL && nodeOne.body == nodeTwo.body)
+            {
+                continue;
+            }
+
+            // Nor do primitives whose filters exclude each other.
+            if (nodeOne.primitive != NULL && nodeTwo.primitive != NULL &&
+                !nodeOne.primitive->canCollideWith(*nodeTwo.primitive))
+            {
+                continue;
+            }
+
+            contacts->body[0] = nodeOne.body;
+            contacts->body[1] = nodeTwo.body;
+            contacts->primitive[0] = nodeOne.primitive;
+            contacts->primitive[1] = nodeTwo.primitive;
+            contacts++;
+            count++;
+            continue;
+        }
+
+        // Descend into the larger of the two nodes, unless it is a
+        // leaf.
+        if (nodeTwo.isLeaf() ||
+            (!nodeOne.isLeaf() &&
+             nodeOne.box.getSize() >= nodeTwo.box.getSize()))
+        {
+            pairStack.push_back(nodeOne.children[1]); pairStack.push_back(two);
+            pairStack.push_back(nodeOne.children[0]); pairStack.push_back(two);
+        }
+        else
+        {
+            pairStack.push_back(one); pairStack.push_back(nodeTwo.children[1]);
+            pairStack.push_back(one); pairStack.push_back(nodeTwo.children[0]);
+        }
+    }
+
+    return count;
+}
+
+unsigned AABBTree::query(const BoundingBox &box,
+                         unsigned *proxies,
+                         unsigned limit) const
+{
+    if (root == nullNode || limit == 0) return 0;
+
+    // The stack is kept here rather than in the tree, as raycast's
+    // is, so that several threads can query at once.
+    const static unsigned localStackSize = 64;
+    unsigned localStack[localStackSize];
+    std::vector<unsigned> largeStack;
+    unsigned *stack = localStack;
+    unsigned height = getHeight();
+    if (height >= localStackSize)
+    {
+        largeStack.resize(height + 1);
+        stack = &largeStack[0];
+    }
+
+    unsigned count = 0;
+    unsigned size = 0;
+    stack[size++] = root;
+    while (size > 0 && count < limit)
+    {
+        unsigned index = stack[--size];
+        const Node &node = nodes[index];
+        if (!node.box.overlaps(&box)) continue;
+
+        if (node.isLeaf())
+        {
+            proxies[count++] = index;
+        }
+        else
+        {
+            stack[size++] = node.children[1];
+            stack[size++] = node.children[0];
+        }
+    }
+    return count;
+}
+
+/**
+ * Checks if a ray passes through the given box, enlarged by the
+ * given radius, before it reaches maxDistance. The inverse holds the
+ * reciprocal of each component of the direction, or zero for
+ * components that are zero.
+ */
+static bool rayEntersBox(const BoundingBox &box,
+                         real radius,
+                         const Vector3 &origin,
+                         const Vector3 &direction,
+                         const Vector3 &inverse,
+                         real maxDistance)
+{
+    // Clip the ray against the slab between each pair of faces.
+    real entry = 0;
+    real leave = maxDistance;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real lower = box.lower[i] - radius;
+        real upper = box.upper[i] + radius;
+
+        // A ray parallel to the slab is either always in it or never.
+        if (direction[i] == 0)
+        {
+            if (origin[i] < lower || origin[i] > upper) return false;
+            continue;
+        }
+
+        real one = (lower - origin[i]) * inverse[i];
+        real two = (upper - origin[i]) * inverse[i];
+        if (one > two)
+        {
+            real swap = one; one = two; two = swap;
+        }
+        if (one > entry) entry = one;
+        if (two < leave) leave = two;
+        if (entry > leave) return false;
+    }
+    return true;
+}
+
+void AABBTree::raycast(const Vector3 &origin,
+                       const Vector3 &direction,
+                       real maxDistance,
+                       real radius,
+                       RayCastCallback *callback) const
+{
+    if (root == nullNode || maxDistance <= 0) return;
+
+    Vector3 inverse;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (direction[i] != 0) inverse[i] = ((real)1.0) / direction[i];
+    }
+
+    // Going down the tree one node at a time never holds more than
+    // one node per level, plus the last pair of children. Most trees
+    // fit in a small array; taller ones get a larger stack.
+    const static unsigned localStackSize = 64;
+    unsigned localStack[localStackSize];
+    std::vector<unsigned> largeStack;
+    unsigned *stack = localStack;
+    unsigned height = getHeight();
+    if (height >= localStackSize)
+    {
+        largeStack.resize(height + 1);
+        stack = &largeStack[0];
+    }
+
+    unsigned size = 0;
+    stack[size++] = root;
+    while (size > 0)
+    {
+        unsigned index = stack[--size];
+        const Node &node = nodes[index];
+        if (!rayEntersBox(node.box, radius,
+                          origin, direction, inverse, maxDistance))
+        {
+            continue;
+        }
+
+        if (node.isLeaf())
+        {
+            maxDistance = callback->reportProxy(index, maxDistance);
+            if (maxDistance <= 0) return;
+        }
+        else
+        {
+            stack[size++] = node.children[1];
+            stack[size++] = node.children[0];
+        }
+    }
+}
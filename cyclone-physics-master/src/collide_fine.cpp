@@ -11,16 +11,48 @@
  */
 
 #include <cyclone/collide_fine.h>
+#include <cyclone/convex.h>
+#include <cyclone/capsule.h>
 #include <memory.h>
 #include <assert.h>
 #include <cstdlib>
 #include <cstdio>
+#include <algorithm>
 
 using namespace cyclone;
 
 void CollisionPrimitive::calculateInternals()
 {
-    transform = body->getTransform() * offset;
+    if (body) transform = body->getTransform() * offset;
+    else transform = offset;
+}
+
+BoundingBox CollisionPrimitive::getBoundingBox() const
+{
+    Vector3 position = getAxis(3);
+    return BoundingBox(position, position);
+}
+
+BoundingBox CollisionSphere::getBoundingBox() const
+{
+    Vector3 centre = getAxis(3);
+    Vector3 extent(radius, radius, radius);
+    return BoundingBox(centre - extent, centre + extent);
+}
+
+BoundingBox CollisionBox::getBoundingBox() const
+{
+    // Each axis of the box adds its projection onto the world axes.
+    Vector3 centre = getAxis(3);
+    Vector3 extent;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 axis = getAxis(i) * halfSize[i];
+        extent.x += real_abs(axis.x);
+        extent.y += real_abs(axis.y);
+        extent.z += real_abs(axis.z);
+    }
+    return BoundingBox(centre - extent, centre + extent);
 }
 
 bool IntersectionTests::sphereAndHalfSpace(
@@ -61,65 +93,124 @@ static inline real transformToAxis(
 }
 
 /**
- * This function checks if the two boxes overlap
- * along the given axis. The final parameter toCentre
- * is used to pass in the vector between the boxes centre
- * points, to avoid having to recalculate it each time.
+ * Holds what the separating axis tests between two boxes need: the
+ * axes of box two and the vector between their centres, in box one's
+ * coordinates. Each axis is then tested with a handful of products,
+ * rather than projecting both boxes in world coordinates and
+ * normalising a cross product for each edge pair.
  */
-static inline bool overlapOnAxis(
+struct BoxPair
+{
+    /** Holds the dot product of each axis of one with each of two. */
+    real rotation[3][3];
+
+    /** Holds the magnitudes of the dot products. */
+    real absRotation[3][3];
+
+    /** Holds the vector from one's centre to two's, along one's axes. */
+    real centre[3];
+
+    const Vector3 &oneHalf;
+    const Vector3 &twoHalf;
+
+    BoxPair(const CollisionBox &one, const CollisionBox &two)
+        : oneHalf(one.halfSize), twoHalf(two.halfSize)
+    {
+        Vector3 toCentre = two.getAxis(3) - one.getAxis(3);
+        for (unsigned i = 0; i < 3; i++)
+        {
+            Vector3 oneAxis = one.getAxis(i);
+            for (unsigned j = 0; j < 3; j++)
+            {
+                rotation[i][j] = oneAxis * two.getAxis(j);
+                absRotation[i][j] = real_abs(rotation[i][j]);
+            }
+            centre[i] = oneAxis * toCentre;
+        }
+    }
+
+    /**
+     * Returns how much the boxes overlap along the given axis:
+     * 0-2 are one's axes, 3-5 are two's, and 6-14 are the cross
+     * products of one axis of each, with one's axis major. A negative
+     * result means the axis separates them. Cross products of nearly
+     * parallel axes aren't tested, and give REAL_MAX.
+     */
+    real overlap(unsigned index) const
+    {
+        if (index < 3)
+        {
+            return oneHalf[index] + twoHalf.x * absRotation[index][0] +
+                twoHalf.y * absRotation[index][1] +
+                twoHalf.z * absRotation[index][2] -
+                real_abs(centre[index]);
+        }
+        if (index < 6)
+        {
+            unsigned j = index - 3;
+            return oneHalf.x * absRotation[0][j] +
+                oneHalf.y * absRotation[1][j] +
+                oneHalf.z * absRotation[2][j] + twoHalf[j] -
+                real_abs(centre[0] * rotation[0][j] +
+                         centre[1] * rotation[1][j] +
+                         centre[2] * rotation[2][j]);
+        }
+
+        unsigned i = (index - 6) / 3, j = (index - 6) % 3;
+        real squareLength = 1 - rotation[i][j] * rotation[i][j];
+        if (squareLength < (real)0.0001) return REAL_MAX;
+
+        unsigned i1 = (i+1) % 3, i2 = (i+2) % 3;
+        unsigned j1 = (j+1) % 3, j2 = (j+2) % 3;
+        real oneProject = oneHalf[i1] * absRotation[i2][j] +
+            oneHalf[i2] * absRotation[i1][j];
+        real twoProject = twoHalf[j1] * absRotation[i][j2] +
+            twoHalf[j2] * absRotation[i][j1];
+        real distance = real_abs(centre[i2] * rotation[i1][j] -
+                                 centre[i1] * rotation[i2][j]);
+        return (oneProject + twoProject - distance) / real_sqrt(squareLength);
+    }
+};
+
+/**
+ * Returns how much two boxes overlap along a single axis, numbered as
+ * in BoxPair::overlap. This projects the boxes directly, which is
+ * quicker than setting up a BoxPair to test one axis.
+ */
+static real overlapOnAxis(
     const CollisionBox &one,
     const CollisionBox &two,
-    const Vector3 &axis,
-    const Vector3 &toCentre
+    unsigned index
     )
 {
-    // Project the half-size of one onto axis
-    real oneProject = transformToAxis(one, axis);
-    real twoProject = transformToAxis(two, axis);
-
-    // Project this onto the axis
-    real distance = real_abs(toCentre * axis);
+    Vector3 axis;
+    if (index < 3) axis = one.getAxis(index);
+    else if (index < 6) axis = two.getAxis(index - 3);
+    else
+    {
+        axis = one.getAxis((index - 6) / 3) % two.getAxis((index - 6) % 3);
+        real squareLength = axis.squareMagnitude();
+        if (squareLength < (real)0.0001) return REAL_MAX;
+        axis *= ((real)1.0) / real_sqrt(squareLength);
+    }
 
-    // Check for overlap
-    return (distance < oneProject + twoProject);
+    Vector3 toCentre = two.getAxis(3) - one.getAxis(3);
+    return transformToAxis(one, axis) + transformToAxis(two, axis) -
+        real_abs(toCentre * axis);
 }
 
-// This preprocessor definition is only used as a convenience
-// in the boxAndBox intersection  method.
-#define TEST_OVERLAP(axis) overlapOnAxis(one, two, (axis), toCentre)
-
 bool IntersectionTests::boxAndBox(
     const CollisionBox &one,
     const CollisionBox &two
     )
 {
-    // Find the vector between the two centres
-    Vector3 toCentre = two.getAxis(3) - one.getAxis(3);
-
-    return (
-        // Check on box one's axes first
-        TEST_OVERLAP(one.getAxis(0)) &&
-        TEST_OVERLAP(one.getAxis(1)) &&
-        TEST_OVERLAP(one.getAxis(2)) &&
-
-        // And on two's
-        TEST_OVERLAP(two.getAxis(0)) &&
-        TEST_OVERLAP(two.getAxis(1)) &&
-        TEST_OVERLAP(two.getAxis(2)) &&
-
-        // Now on the cross products
-        TEST_OVERLAP(one.getAxis(0) % two.getAxis(0)) &&
-        TEST_OVERLAP(one.getAxis(0) % two.getAxis(1)) &&
-        TEST_OVERLAP(one.getAxis(0) % two.getAxis(2)) &&
-        TEST_OVERLAP(one.getAxis(1) % two.getAxis(0)) &&
-        TEST_OVERLAP(one.getAxis(1) % two.getAxis(1)) &&
-        TEST_OVERLAP(one.getAxis(1) % two.getAxis(2)) &&
-        TEST_OVERLAP(one.getAxis(2) % two.getAxis(0)) &&
-        TEST_OVERLAP(one.getAxis(2) % two.getAxis(1)) &&
-        TEST_OVERLAP(one.getAxis(2) % two.getAxis(2))
-    );
-}
-#undef TEST_OVERLAP
+    BoxPair pair(one, two);
+    for (unsigned index = 0; index < 15; index++)
+    {
+        if (pair.overlap(index) <= 0) return false;
+    }
+    return true;
+}
 
 bool IntersectionTests::boxAndHalfSpace(
     const CollisionBox &box,
@@ -139,6 +230,282 @@ bool IntersectionTests::boxAndHalfSpace(
     return boxDistance <= plane.offset;
 }
 
+bool IntersectionTests::boxAndSphere(
+    const CollisionBox &box,
+    const CollisionSphere &sphere
+    )
+{
+    // Find the closest point of the box in its own coordinates.
+    Vector3 centre = box.transform.transformInverse(sphere.getAxis(3));
+    Vector3 closest = centre;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (closest[i] > box.halfSize[i]) closest[i] = box.halfSize[i];
+        if (closest[i] < -box.halfSize[i]) closest[i] = -box.halfSize[i];
+    }
+
+    return (centre - closest).squareMagnitude() <
+        sphere.radius*sphere.radius;
+}
+
+bool IntersectionTests::sweptSphereAndHalfSpace(
+    const CollisionSphere &sphere,
+    const Vector3 &displacement,
+    const CollisionPlane &plane,
+    real *time)
+{
+    // Find the distance from the plane at the start.
+    real distance =
+        plane.direction * sphere.getAxis(3) -
+        sphere.radius - plane.offset;
+    if (distance <= 0)
+    {
+        *time = 0;
+        return true;
+    }
+
+    // Check the sphere moves far enough towards the plane.
+    real closing = -(plane.direction * displacement);
+    if (closing <= distance) return false;
+
+    *time = distance / closing;
+    return true;
+}
+
+bool IntersectionTests::sweptSphereAndSphere(
+    const CollisionSphere &sphere,
+    const Vector3 &displacement,
+    const CollisionSphere &other,
+    real *time)
+{
+    // Solve |midline + displacement*t| = radii for the first t.
+    Vector3 midline = sphere.getAxis(3) - other.getAxis(3);
+    real radii = sphere.radius + other.radius;
+    real c = midline.squareMagnitude() - radii*radii;
+    if (c <= 0)
+    {
+        *time = 0;
+        return true;
+    }
+
+    // The spheres must be getting closer.
+    real b = midline * displacement;
+    if (b >= 0) return false;
+
+    real a = displacement.squareMagnitude();
+    real discriminant = b*b - a*c;
+    if (discriminant < 0) return false;
+
+    real t = (-b - real_sqrt(discriminant)) / a;
+    if (t > 1) return false;
+
+    *time = t;
+    return true;
+}
+
+/**
+ * Moves a sphere in a straight line in the coordinates of a box,
+ * from the given start by the given displacement, and finds the
+ * first time it comes within the stop distance of the box. The time
+ * and the closest point of the box at that time are written out.
+ */
+static bool sweepSphereInBox(
+    const Vector3 &halfSize,
+    const Vector3 &start,
+    const Vector3 &direction,
+    real radius,
+    real stopDistance,
+    real *time,
+    Vector3 *closestPoint)
+{
+    // The distance from a point moving in a straight line to a box
+    // changes as a convex function of time, so stepping by the
+    // distance divided by the closing speed lands on or before the
+    // first touch.
+    const static unsigned maxSteps = 32;
+    real t = 0;
+    for (unsigned step = 0; step < maxSteps; step++)
+    {
+        Vector3 centre = start;
+        centre.addScaledVector(direction, t);
+
+        Vector3 closest = centre;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            if (closest[i] > halfSize[i]) closest[i] = halfSize[i];
+            if (closest[i] < -halfSize[i]) closest[i] = -halfSize[i];
+        }
+
+        Vector3 separation = centre - closest;
+        real length = separation.magnitude();
+        real distance = length - radius;
+        if (distance <= stopDistance)
+        {
+            *time = t;
+            *closestPoint = closest;
+            return true;
+        }
+
+        // Once the sphere stops getting closer it never will.
+        real closing = -(separation * direction) / length;
+        if (closing <= 0) return false;
+
+        t += distance / closing;
+        if (t > 1) return false;
+    }
+
+    // The steps only stay short for paths that just graze the box,
+    // which are left to the normal contact generation.
+    return false;
+}
+
+bool IntersectionTests::sweptSphereAndBox(
+    const CollisionSphere &sphere,
+    const Vector3 &displacement,
+    const CollisionBox &box,
+    real *time,
+    real tolerance)
+{
+    // Work in the box's coordinates, where it is aligned.
+    Vector3 start = box.transform.transformInverse(sphere.getAxis(3));
+    Vector3 direction = box.transform.transformInverseDirection(displacement);
+
+    Vector3 closest;
+    return sweepSphereInBox(box.halfSize, start, direction,
+                            sphere.radius, sphere.radius * tolerance,
+                            time, &closest);
+}
+
+/**
+ * Fills in the hit for a ray that starts inside a primitive.
+ */
+static inline bool rayStartsInside(
+    const Ray &ray,
+    const CollisionPrimitive &primitive,
+    RayHit *hit)
+{
+    hit->primitive = &primitive;
+    hit->point = ray.origin;
+    hit->normal = ray.direction * -1;
+    hit->distance = 0;
+    return true;
+}
+
+bool IntersectionTests::rayAndSphere(
+    const Ray &ray,
+    real radius,
+    const CollisionSphere &sphere,
+    RayHit *hit)
+{
+    // Solve |offset + direction*t| = radii for the first t.
+    Vector3 centre = sphere.getAxis(3);
+    Vector3 offset = ray.origin - centre;
+    real radii = sphere.radius + radius;
+    real c = offset.squareMagnitude() - radii*radii;
+    if (c <= 0) return rayStartsInside(ray, sphere, hit);
+
+    // The ray must be heading towards the sphere.
+    real b = offset * ray.direction;
+    if (b >= 0) return false;
+
+    real discriminant = b*b - c;
+    if (discriminant < 0) return false;
+
+    real distance = -b - real_sqrt(discriminant);
+    if (distance > ray.maxDistance) return false;
+
+    offset.addScaledVector(ray.direction, distance);
+    hit->primitive = &sphere;
+    hit->normal = offset * (((real)1.0) / radii);
+    hit->point = centre + hit->normal * sphere.radius;
+    hit->distance = distance;
+    return true;
+}
+
+bool IntersectionTests::rayAndBox(
+    const Ray &ray,
+    real radius,
+    const CollisionBox &box,
+    RayHit *hit,
+    real tolerance)
+{
+    // Work in the box's coordinates, where it is aligned.
+    Vector3 origin = box.transform.transformInverse(ray.origin);
+    Vector3 direction = box.transform.transformInverseDirection(ray.direction);
+
+    if (radius > 0)
+    {
+        real time;
+        Vector3 closest;
+        if (!sweepSphereInBox(box.halfSize, origin,
+                              direction * ray.maxDistance,
+                              radius, radius * tolerance,
+                              &time, &closest))
+        {
+            return false;
+        }
+
+        // A sphere that starts overlapping the box is inside it.
+        origin.addScaledVector(direction, time * ray.maxDistance);
+        Vector3 separation = origin - closest;
+        real length = separation.magnitude();
+        if (time <= 0 && length < radius)
+        {
+            return rayStartsInside(ray, box, hit);
+        }
+
+        hit->primitive = &box;
+        hit->point = box.transform.transform(closest);
+        hit->normal = box.transform.transformDirection(separation) *
+            (((real)1.0) / length);
+        hit->distance = time * ray.maxDistance;
+        return true;
+    }
+
+    // Clip the ray against the slab between each pair of faces,
+    // remembering the face it last entered through.
+    real entry = 0;
+    real leave = ray.maxDistance;
+    int entryAxis = -1;
+    real entrySign = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real halfSize = box.halfSize[i];
+
+        // A ray parallel to the slab is either always in it or never.
+        if (direction[i] == 0)
+        {
+            if (origin[i] < -halfSize || origin[i] > halfSize) return false;
+            continue;
+        }
+
+        real one = (-halfSize - origin[i]) / direction[i];
+        real two = (halfSize - origin[i]) / direction[i];
+        real sign = -1;
+        if (one > two)
+        {
+            real swap = one; one = two; two = swap;
+            sign = 1;
+        }
+        if (one > entry)
+        {
+            entry = one;
+            entryAxis = i;
+            entrySign = sign;
+        }
+        if (two < leave) leave = two;
+        if (entry > leave) return false;
+    }
+    if (entryAxis < 0) return rayStartsInside(ray, box, hit);
+
+    hit->primitive = &box;
+    hit->point = ray.origin;
+    hit->point.addScaledVector(ray.direction, entry);
+    hit->normal = box.getAxis(entryAxis) * entrySign;
+    hit->distance = entry;
+    return true;
+}
+
 unsigned CollisionDetector::sphereAndTruePlane(
     const CollisionSphere &sphere,
     const CollisionPlane &plane,
@@ -255,59 +622,6 @@ unsigned CollisionDetector::sphereAndSphere(
 
 
 
-/*
- * This function checks if the two boxes overlap
- * along the given axis, returning the ammount of overlap.
- * The final parameter toCentre
- * is used to pass in the vector between the boxes centre
- * points, to avoid having to recalculate it each time.
- */
-static inline real penetrationOnAxis(
-    const CollisionBox &one,
-    const CollisionBox &two,
-    const Vector3 &axis,
-    const Vector3 &toCentre
-    )
-{
-    // Project the half-size of one onto axis
-    real oneProject = transformToAxis(one, axis);
-    real twoProject = transformToAxis(two, axis);
-
-    // Project this onto the axis
-    real distance = real_abs(toCentre * axis);
-
-    // Return the overlap (i.e. positive indicates
-    // overlap, negative indicates separation).
-    return oneProject + twoProject - distance;
-}
-
-
-static inline bool tryAxis(
-    const CollisionBox &one,
-    const CollisionBox &two,
-    Vector3 axis,
-    const Vector3& toCentre,
-    unsigned index,
-
-    // These values may be updated
-    real& smallestPenetration,
-    unsigned &smallestCase
-    )
-{
-    // Make sure we have a normalized axis, and don't check almost parallel axes
-    if (axis.squareMagnitude() < 0.0001) return true;
-    axis.normalise();
-
-    real penetration = penetrationOnAxis(one, two, axis, toCentre);
-
-    if (penetration < 0) return false;
-    if (penetration < smallestPenetration) {
-        smallestPenetration = penetration;
-        smallestCase = index;
-    }
-    return true;
-}
-
 void fillPointFaceBoxBox(
     const CollisionBox &one,
     const CollisionBox &two,
@@ -346,6 +660,107 @@ void fillPointFaceBoxBox(
         data->friction, data->restitution);
 }
 
+/**
+ * Writes the contacts where a face of box one rests on box two. The
+ * face of two that most nearly faces it is clipped to the sides of
+ * one's face, and the clipped points below one's face are kept, up to
+ * four of them, so a box lying on another is held up at its corners
+ * instead of rocking between them. Returns zero, writing nothing, if
+ * no points are kept.
+ */
+static unsigned fillFaceFaceBoxBox(
+    const CollisionBox &one,
+    const CollisionBox &two,
+    const Vector3 &toCentre,
+    CollisionData *data,
+    unsigned best
+    )
+{
+    // The normal points from two towards one, as in
+    // fillPointFaceBoxBox, so one's face that two touches faces the
+    // other way.
+    Vector3 normal = one.getAxis(best);
+    if (normal * toCentre > 0) normal = normal * -1.0f;
+    Vector3 faceNormal = normal * -1.0f;
+    real faceOffset = faceNormal * one.getAxis(3) + one.halfSize[best];
+
+    // Find two's face that points back most directly at one.
+    unsigned incident = 0;
+    real incidentDot = 0;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real dot = two.getAxis(i) * normal;
+        if (real_abs(dot) > real_abs(incidentDot))
+        {
+            incidentDot = dot;
+            incident = i;
+        }
+    }
+    unsigned j = (incident + 1) % 3;
+    unsigned k = (incident + 2) % 3;
+    Vector3 faceCentre = two.getAxis(3) + two.getAxis(incident) *
+        (incidentDot > 0 ? two.halfSize[incident] : -two.halfSize[incident]);
+    Vector3 alongJ = two.getAxis(j) * two.halfSize[j];
+    Vector3 alongK = two.getAxis(k) * two.halfSize[k];
+
+    // Clipping a quad to four planes leaves at most eight corners.
+    Vector3 clipped[2][8];
+    clipped[0][0] = faceCentre + alongJ + alongK;
+    clipped[0][1] = faceCentre - alongJ + alongK;
+    clipped[0][2] = faceCentre - alongJ - alongK;
+    clipped[0][3] = faceCentre + alongJ - alongK;
+
+    // Clip it to the planes of the sides of one's face.
+    unsigned count = 4;
+    unsigned current = 0;
+    for (unsigned i = 1; i < 3 && count > 0; i++)
+    {
+        unsigned axis = (best + i) % 3;
+        Vector3 side = one.getAxis(axis);
+        real centre = side * one.getAxis(3);
+        for (int sign = -1; sign <= 1 && count > 0; sign += 2)
+        {
+            count = CollisionDetector::clipPolygon(
+                clipped[current], count, side * (real)sign,
+                sign * centre + one.halfSize[axis], clipped[1-current]);
+            current = 1 - current;
+        }
+    }
+
+    // Keep the points that are below the face.
+    Vector3 points[8];
+    real depths[8];
+    unsigned kept = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        real depth = faceOffset - faceNormal * clipped[current][i];
+        if (depth < -data->tolerance) continue;
+        points[kept] = clipped[current][i];
+        depths[kept] = depth;
+        kept++;
+    }
+    if (kept == 0) return 0;
+
+    unsigned selected[4];
+    unsigned selectedCount = CollisionDetector::selectContacts(
+        points, depths, kept, faceNormal, selected);
+
+    Contact *contact = data->contacts;
+    unsigned written = 0;
+    for (unsigned i = 0; i < selectedCount; i++)
+    {
+        if (written == (unsigned)data->contactsLeft) break;
+        contact->contactNormal = normal;
+        contact->contactPoint = points[selected[i]];
+        contact->penetration = depths[selected[i]];
+        contact->setBodyData(one.body, two.body,
+            data->friction, data->restitution);
+        contact++;
+        written++;
+    }
+    return written;
+}
+
 static inline Vector3 contactPoint(
     const Vector3 &pOne,
     const Vector3 &dOne,
@@ -401,10 +816,13 @@ static inline Vector3 contactPoint(
     }
 }
 
-// This preprocessor definition is only used as a convenience
-// in the boxAndBox contact generation method.
-#define CHECK_OVERLAP(axis, index) \
-    if (!tryAxis(one, two, (axis), toCentre, (index), pen, best)) return 0;
+/**
+ * A face axis is used in preference to an edge-edge axis unless the
+ * edges overlap by less than the face divided by this proportion,
+ * less this distance.
+ */
+const static real edgeAxisRelative = (real)1.05;
+const static real edgeAxisAbsolute = (real)0.001;
 
 unsigned CollisionDetector::boxAndBox(
     const CollisionBox &one,
@@ -412,7 +830,23 @@ unsigned CollisionDetector::boxAndBox(
     CollisionData *data
     )
 {
-    //if (!IntersectionTests::boxAndBox(one, two)) return 0;
+    if (data->contactsLeft <= 0) return 0;
+
+    // A pair that was apart last frame is nearly always still apart
+    // along the same axis.
+    SeparatingAxisCache *cache = data->axisCache;
+    if (cache)
+    {
+        unsigned axis = cache->find(&one, &two);
+        if (axis != SeparatingAxisCache::noAxis &&
+            overlapOnAxis(one, two, axis) < 0)
+        {
+            cache->store(&one, &two, axis);
+            return 0;
+        }
+    }
+
+    BoxPair pair(one, two);
 
     // Find the vector between the two centres
     Vector3 toCentre = two.getAxis(3) - one.getAxis(3);
@@ -420,55 +854,81 @@ unsigned CollisionDetector::boxAndBox(
     // We start assuming there is no contact
     real pen = REAL_MAX;
     unsigned best = 0xffffff;
+    unsigned bestSingleAxis = best;
+    real bestSinglePen = pen;
 
     // Now we check each axes, returning if it gives us
     // a separating axis, and keeping track of the axis with
     // the smallest penetration otherwise.
-    CHECK_OVERLAP(one.getAxis(0), 0);
-    CHECK_OVERLAP(one.getAxis(1), 1);
-    CHECK_OVERLAP(one.getAxis(2), 2);
-
-    CHECK_OVERLAP(two.getAxis(0), 3);
-    CHECK_OVERLAP(two.getAxis(1), 4);
-    CHECK_OVERLAP(two.getAxis(2), 5);
-
-    // Store the best axis-major, in case we run into almost
-    // parallel edge collisions later
-    unsigned bestSingleAxis = best;
+    for (unsigned index = 0; index < 15; index++)
+    {
+        real overlap = pair.overlap(index);
+        if (overlap < 0)
+        {
+            if (cache) cache->store(&one, &two, index);
+            return 0;
+        }
+        if (overlap < pen)
+        {
+            pen = overlap;
+            best = index;
+        }
 
-    CHECK_OVERLAP(one.getAxis(0) % two.getAxis(0), 6);
-    CHECK_OVERLAP(one.getAxis(0) % two.getAxis(1), 7);
-    CHECK_OVERLAP(one.getAxis(0) % two.getAxis(2), 8);
-    CHECK_OVERLAP(one.getAxis(1) % two.getAxis(0), 9);
-    CHECK_OVERLAP(one.getAxis(1) % two.getAxis(1), 10);
-    CHECK_OVERLAP(one.getAxis(1) % two.getAxis(2), 11);
-    CHECK_OVERLAP(one.getAxis(2) % two.getAxis(0), 12);
-    CHECK_OVERLAP(one.getAxis(2) % two.getAxis(1), 13);
-    CHECK_OVERLAP(one.getAxis(2) % two.getAxis(2), 14);
+        // Store the best axis-major, in case we run into almost
+        // parallel edge collisions later
+        if (index == 5)
+        {
+            bestSingleAxis = best;
+            bestSinglePen = pen;
+        }
+    }
 
     // Make sure we've got a result.
     assert(best != 0xffffff);
 
+    // Edges that cross in the plane of a face give an axis along the
+    // face normal that overlaps by the same amount, give or take
+    // rounding. Prefer the face unless the edges are clearly closer,
+    // so resting boxes get a full manifold.
+    if (best >= 6 &&
+        bestSinglePen <= pen * edgeAxisRelative + edgeAxisAbsolute)
+    {
+        best = bestSingleAxis;
+        pen = bestSinglePen;
+    }
+
     // We now know there's a collision, and we know which
     // of the axes gave the smallest penetration. We now
     // can deal with it in different ways depending on
     // the case.
-    if (best < 3)
-    {
-        // We've got a vertex of box two on a face of box one.
-        fillPointFaceBoxBox(one, two, toCentre, data, best, pen);
-        data->addContacts(1);
-        return 1;
-    }
-    else if (best < 6)
+    if (best < 6)
     {
-        // We've got a vertex of box one on a face of box two.
-        // We use the same algorithm as above, but swap around
-        // one and two (and therefore also the vector between their
-        // centres).
-        fillPointFaceBoxBox(two, one, toCentre*-1.0f, data, best-3, pen);
-        data->addContacts(1);
-        return 1;
+        // We've got box two on a face of box one, or box one on a
+        // face of box two, in which case we swap around one and two
+        // (and therefore also the vector between their centres).
+        bool swapped = best >= 3;
+        const CollisionBox &reference = swapped ? two : one;
+        const CollisionBox &incident = swapped ? one : two;
+        Vector3 referenceToCentre = swapped ? toCentre*-1.0f : toCentre;
+        unsigned axis = swapped ? best-3 : best;
+
+        unsigned written = fillFaceFaceBoxBox(
+            reference, incident, referenceToCentre, data, axis);
+
+        // If clipping left nothing, fall back on the vertex of the
+        // other box deepest in the face.
+        if (written == 0)
+        {
+            fillPointFaceBoxBox(
+                reference, incident, referenceToCentre, data, axis, pen);
+            written = 1;
+        }
+        for (unsigned i = 0; i < written; i++)
+        {
+            data->contacts[i].feature = best;
+        }
+        data->addContacts(written);
+        return written;
     }
     else
     {
@@ -523,12 +983,146 @@ unsigned CollisionDetector::boxAndBox(
         contact->contactPoint = vertex;
         contact->setBodyData(one.body, two.body,
             data->friction, data->restitution);
+        contact->feature = best + 6;
         data->addContacts(1);
         return 1;
     }
     return 0;
 }
-#undef CHECK_OVERLAP
+
+/**
+ * Returns the number of the given box-box axis as seen from the other
+ * box: its face axes swap with the first box's, and the cross product
+ * of one's i-th axis with two's j-th is the same line as two's i-th
+ * with one's j-th.
+ */
+static unsigned swapAxisOrder(unsigned axis)
+{
+    if (axis < 3) return axis + 3;
+    if (axis < 6) return axis - 3;
+    axis -= 6;
+    return 6 + (axis % 3) * 3 + axis / 3;
+}
+
+SeparatingAxisCache::SeparatingAxisCache()
+: size(0), foundSize(0), source(NULL)
+{
+    resetTable(entries, 0);
+    resetTable(found, 0);
+}
+
+unsigned SeparatingAxisCache::findSlot(const std::vector<Entry> &table,
+                                       const CollisionPrimitive *one,
+                                       const CollisionPrimitive *two)
+{
+    // Primitives are at least word aligned, so the low bits of their
+    // addresses are dropped before mixing them.
+    size_t key = ((size_t)one >> 3) * 0x9e3779b1u ^ ((size_t)two >> 3);
+    unsigned mask = (unsigned)table.size() - 1;
+    unsigned slot = (unsigned)(key ^ (key >> 15)) & mask;
+    while (table[slot].primitive[0] &&
+           (table[slot].primitive[0] != one ||
+            table[slot].primitive[1] != two))
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void SeparatingAxisCache::resetTable(std::vector<Entry> &table,
+                                     unsigned count)
+{
+    // Keep the table at most half full, so probes stay short.
+    unsigned capacity = 16;
+    while (capacity < count * 2) capacity *= 2;
+
+    Entry empty;
+    empty.primitive[0] = empty.primitive[1] = NULL;
+    empty.axis = noAxis;
+    table.assign(capacity, empty);
+}
+
+unsigned SeparatingAxisCache::find(const CollisionPrimitive *one,
+                                   const CollisionPrimitive *two) const
+{
+    bool swapped = two < one;
+    if (swapped) std::swap(one, two);
+
+    const std::vector<Entry> &table = source ? source->entries : entries;
+    const Entry &entry = table[findSlot(table, one, two)];
+    if (!entry.primitive[0]) return noAxis;
+    return swapped ? swapAxisOrder(entry.axis) : entry.axis;
+}
+
+void SeparatingAxisCache::store(const CollisionPrimitive *one,
+                                const CollisionPrimitive *two,
+                                unsigned axis)
+{
+    bool swapped = two < one;
+    if (swapped)
+    {
+        std::swap(one, two);
+        axis = swapAxisOrder(axis);
+    }
+
+    // Grow the table when it is half full, putting back what it held.
+    if ((foundSize + 1) * 2 > found.size())
+    {
+        std::vector<Entry> old;
+        old.swap(found);
+        resetTable(found, foundSize + 1);
+        for (unsigned i = 0; i < old.size(); i++)
+        {
+            if (!old[i].primitive[0]) continue;
+            found[findSlot(found, old[i].primitive[0],
+                           old[i].primitive[1])] = old[i];
+        }
+    }
+
+    Entry &entry = found[findSlot(found, one, two)];
+    if (!entry.primitive[0]) foundSize++;
+    entry.primitive[0] = one;
+    entry.primitive[1] = two;
+    entry.axis = axis;
+}
+
+void SeparatingAxisCache::update()
+{
+    entries.swap(found);
+    size = foundSize;
+    resetTable(found, size);
+    foundSize = 0;
+}
+
+void SeparatingAxisCache::clear()
+{
+    resetTable(entries, 0);
+    resetTable(found, 0);
+    size = foundSize = 0;
+}
+
+void SeparatingAxisCache::setSource(const SeparatingAxisCache *source)
+{
+    SeparatingAxisCache::source = source;
+}
+
+void SeparatingAxisCache::merge(SeparatingAxisCache &other)
+{
+    if (other.foundSize == 0) return;
+
+    for (unsigned i = 0; i < other.found.size(); i++)
+    {
+        const Entry &entry = other.found[i];
+        if (entry.primitive[0])
+        {
+            store(entry.primitive[0], entry.primitive[1], entry.axis);
+        }
+    }
+
+    // Keep the other table about the same size for next frame.
+    resetTable(other.found, other.foundSize);
+    other.foundSize = 0;
+}
 
 
 
@@ -690,6 +1284,7 @@ unsigned CollisionDetector::boxAndHalfSpace(
             // Write the appropriate data
             contact->setBodyData(box.body, NULL,
                 data->friction, data->restitution);
+            contact->feature = i;
 
             // Move onto the next contact
             contact++;
@@ -701,3 +1296,382 @@ unsigned CollisionDetector::boxAndHalfSpace(
     data->addContacts(contactsUsed);
     return contactsUsed;
 }
+
+static unsigned collideSphereAndSphere(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::sphereAndSphere(
+        (const CollisionSphere &)one, (const CollisionSphere &)two, data);
+}
+
+static unsigned collideBoxAndBox(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::boxAndBox(
+        (const CollisionBox &)one, (const CollisionBox &)two, data);
+}
+
+static unsigned collideBoxAndSphere(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::boxAndSphere(
+        (const CollisionBox &)one, (const CollisionSphere &)two, data);
+}
+
+static unsigned collideSphereAndBox(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::boxAndSphere(
+        (const CollisionBox &)two, (const CollisionSphere &)one, data);
+}
+
+static unsigned collideSphereAndPlane(
+    const CollisionPrimitive &primitive,
+    const CollisionPlane &plane,
+    CollisionData *data)
+{
+    return CollisionDetector::sphereAndHalfSpace(
+        (const CollisionSphere &)primitive, plane, data);
+}
+
+static unsigned collideBoxAndPlane(
+    const CollisionPrimitive &primitive,
+    const CollisionPlane &plane,
+    CollisionData *data)
+{
+    return CollisionDetector::boxAndHalfSpace(
+        (const CollisionBox &)primitive, plane, data);
+}
+
+static unsigned collideConvexAndSphere(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::convexAndSphere(
+        (const CollisionConvex &)one, (const CollisionSphere &)two, data);
+}
+
+static unsigned collideSphereAndConvex(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::convexAndSphere(
+        (const CollisionConvex &)two, (const CollisionSphere &)one, data);
+}
+
+static unsigned collideConvexAndBox(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::convexAndBox(
+        (const CollisionConvex &)one, (const CollisionBox &)two, data);
+}
+
+static unsigned collideBoxAndConvex(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::convexAndBox(
+        (const CollisionConvex &)two, (const CollisionBox &)one, data);
+}
+
+static unsigned collideConvexAndConvex(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::convexAndConvex(
+        (const CollisionConvex &)one, (const CollisionConvex &)two, data);
+}
+
+static unsigned collideConvexAndPlane(
+    const CollisionPrimitive &primitive,
+    const CollisionPlane &plane,
+    CollisionData *data)
+{
+    return CollisionDetector::convexAndHalfSpace(
+        (const CollisionConvex &)primitive, plane, data);
+}
+
+static unsigned collideSphereAndTriangles(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::sphereAndTriangles(
+        (const CollisionSphere &)one, (const TriangleSurface &)two, data);
+}
+
+static unsigned collideTrianglesAndSphere(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::sphereAndTriangles(
+        (const CollisionSphere &)two, (const TriangleSurface &)one, data);
+}
+
+static unsigned collideBoxAndTriangles(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::boxAndTriangles(
+        (const CollisionBox &)one, (const TriangleSurface &)two, data);
+}
+
+static unsigned collideTrianglesAndBox(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::boxAndTriangles(
+        (const CollisionBox &)two, (const TriangleSurface &)one, data);
+}
+
+static unsigned collideCapsuleAndCapsule(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::capsuleAndCapsule(
+        (const CollisionCapsule &)one, (const CollisionCapsule &)two, data);
+}
+
+static unsigned collideCapsuleAndSphere(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::capsuleAndSphere(
+        (const CollisionCapsule &)one, (const CollisionSphere &)two, data);
+}
+
+static unsigned collideSphereAndCapsule(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::capsuleAndSphere(
+        (const CollisionCapsule &)two, (const CollisionSphere &)one, data);
+}
+
+static unsigned collideCapsuleAndBox(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::capsuleAndBox(
+        (const CollisionCapsule &)one, (const CollisionBox &)two, data);
+}
+
+static unsigned collideBoxAndCapsule(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::capsuleAndBox(
+        (const CollisionCapsule &)two, (const CollisionBox &)one, data);
+}
+
+static unsigned collideConvexAndCapsule(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::convexAndCapsule(
+        (const CollisionConvex &)one, (const CollisionCapsule &)two, data);
+}
+
+static unsigned collideCapsuleAndConvex(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data)
+{
+    return CollisionDetector::convexAndCapsule(
+        (const CollisionConvex &)two, (const CollisionCapsule &)one, data);
+}
+
+static unsigned collideCapsuleAndPlane(
+    const CollisionPrimitive &primitive,
+    const CollisionPlane &plane,
+    CollisionData *data)
+{
+    return CollisionDetector::capsuleAndHalfSpace(
+        (const CollisionCapsule &)primitive, plane, data);
+}
+
+// The dispatch tables, indexed by primitive type.
+static const CollisionDetector::PairFunction
+pairFunctions[CollisionPrimitive::TYPE_COUNT][CollisionPrimitive::TYPE_COUNT] =
+{
+    // TYPE_SPHERE
+    { collideSphereAndSphere, collideSphereAndBox, collideSphereAndConvex,
+      collideSphereAndTriangles, collideSphereAndTriangles,
+      collideSphereAndCapsule },
+    // TYPE_BOX
+    { collideBoxAndSphere, collideBoxAndBox, collideBoxAndConvex,
+      collideBoxAndTriangles, collideBoxAndTriangles,
+      collideBoxAndCapsule },
+    // TYPE_CONVEX
+    { collideConvexAndSphere, collideConvexAndBox, collideConvexAndConvex,
+      NULL, NULL, collideConvexAndCapsule },
+    // TYPE_TRIANGLE_MESH
+    { collideTrianglesAndSphere, collideTrianglesAndBox, NULL, NULL, NULL,
+      NULL },
+    // TYPE_HEIGHTFIELD
+    { collideTrianglesAndSphere, collideTrianglesAndBox, NULL, NULL, NULL,
+      NULL },
+    // TYPE_CAPSULE
+    { collideCapsuleAndSphere, collideCapsuleAndBox, collideCapsuleAndConvex,
+      NULL, NULL, collideCapsuleAndCapsule }
+};
+
+static const CollisionDetector::PlaneFunction
+planeFunctions[CollisionPrimitive::TYPE_COUNT] =
+{
+    collideSphereAndPlane,
+    collideBoxAndPlane,
+    collideConvexAndPlane,
+    NULL,
+    NULL,
+    collideCapsuleAndPlane
+};
+
+unsigned CollisionDetector::collide(
+    const CollisionPrimitive &one,
+    const CollisionPrimitive &two,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    PairFunction function = pairFunctions[one.getType()][two.getType()];
+    if (!function) return 0;
+    return function(one, two, data);
+}
+
+unsigned CollisionDetector::collideWithPlane(
+    const CollisionPrimitive &primitive,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    PlaneFunction function = planeFunctions[primitive.getType()];
+    if (!function) return 0;
+    return function(primitive, plane, data);
+}
+
+// Batch implementation
+
+const unsigned CollisionDetector::batchWidth;
+
+// The number of values held for each primitive in a batch: the
+// centre of its bounding box, then its half-size.
+static const unsigned batchFields = 6;
+
+void PrimitiveBatch::resize(unsigned size)
+{
+    const unsigned width = CollisionDetector::batchWidth;
+    primitives.resize(size, NULL);
+    blocks.resize((size + width - 1) / width * batchFields * width);
+}
+
+void PrimitiveBatch::set(unsigned index,
+                         const CollisionPrimitive *primitive,
+                         const BoundingBox &box)
+{
+    const unsigned width = CollisionDetector::batchWidth;
+    primitives[index] = primitive;
+
+    real *block = &blocks[index / width * batchFields * width];
+    unsigned k = index % width;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        block[i*width + k] = (box.lower[i] + box.upper[i]) * (real)0.5;
+        block[(i + 3)*width + k] = (box.upper[i] - box.lower[i]) * (real)0.5;
+    }
+}
+
+unsigned CollisionDetector::collideWithPlanes(
+    const PrimitiveBatch &batch,
+    unsigned begin,
+    unsigned end,
+    const CollisionPlane *const *planes,
+    unsigned numPlanes,
+    CollisionData *data
+    )
+{
+    // The cull doesn't work the distances out the same way as the
+    // exact tests, so it allows a little more, in proportion to the
+    // sizes involved, so that rounding can't cull a primitive the
+    // exact test would touch.
+    const static real slack = (real)1e-9;
+    const unsigned w = batchWidth;
+
+    real tolerance = data->tolerance > 0 ? data->tolerance : 0;
+    real distance[batchWidth];
+    real limit[batchWidth];
+    unsigned contactsUsed = 0;
+    for (unsigned base = begin - begin % w; base < end; base += w)
+    {
+        const real *centre = &batch.blocks[base * batchFields];
+        const real *halfSize = centre + 3*w;
+
+        // Find the primitives in the block whose boxes come near any
+        // plane.
+        unsigned near = 0;
+        for (unsigned j = 0; j < numPlanes; j++)
+        {
+            const Vector3 &d = planes[j]->direction;
+            real offset = planes[j]->offset;
+            real ax = real_abs(d.x), ay = real_abs(d.y), az = real_abs(d.z);
+            for (unsigned k = 0; k < w; k++)
+            {
+                real middle = d.x*centre[k] + d.y*centre[w+k] +
+                    d.z*centre[2*w+k];
+                real reach = ax*halfSize[k] + ay*halfSize[w+k] +
+                    az*halfSize[2*w+k];
+                distance[k] = middle - reach - offset;
+                limit[k] = tolerance + slack *
+                    (real_abs(middle) + reach + real_abs(offset));
+            }
+            for (unsigned k = 0; k < w; k++)
+            {
+                if (distance[k] <= limit[k]) near |= 1u << k;
+            }
+        }
+        if (base < begin) near &= ~((1u << (begin - base)) - 1);
+        if (end - base < w) near &= (1u << (end - base)) - 1;
+
+        // Give those that came near to their exact tests, in order.
+        for (unsigned k = 0; near != 0; k++, near >>= 1)
+        {
+            if (!(near & 1)) continue;
+            const CollisionPrimitive *primitive = batch.primitives[base + k];
+            if (!primitive) continue;
+
+            for (unsigned j = 0; j < numPlanes; j++)
+            {
+                if (data->contactsLeft <= 0) return contactsUsed;
+                if (!planes[j]->canCollideWith(*primitive)) continue;
+                contactsUsed += collideWithPlane(*primitive, *planes[j], data);
+            }
+        }
+    }
+    return contactsUsed;
+}
@@ -13,9 +13,17 @@
 #include <cyclone/contacts.h>
 #include <memory.h>
 #include <assert.h>
+#include <algorithm>
+#include <functional>
 
 using namespace cyclone;
 
+/*
+ * Contacts closing slower than this are treated as resting: they
+ * don't bounce, and can be warm started.
+ */
+static const real velocityLimit = (real)0.25f;
+
 // Contact implementation
 
 void Contact::setBodyData(RigidBody* one, RigidBody *two,
@@ -25,6 +33,7 @@ void Contact::setBodyData(RigidBody* one, RigidBody *two,
     Contact::body[1] = two;
     Contact::friction = friction;
     Contact::restitution = restitution;
+    Contact::feature = 0;
 }
 
 void Contact::matchAwakeState()
@@ -35,10 +44,12 @@ void Contact::matchAwakeState()
     bool body0awake = body[0]->getAwake();
     bool body1awake = body[1]->getAwake();
 
-    // Wake up only the sleeping one
+    // Wake up only the sleeping one, unless it can't move. Bodies
+    // that can't move may be shared between islands resolved on
+    // different threads, so they are never woken here.
     if (body0awake ^ body1awake) {
-        if (body0awake) body[1]->setAwake();
-        else body[0]->setAwake();
+        RigidBody *sleeper = body[body0awake ? 1 : 0];
+        if (sleeper->getInverseMass() > 0) sleeper->setAwake();
     }
 }
 
@@ -147,8 +158,6 @@ Vector3 Contact::calculateLocalVelocity(unsigned bodyIndex, real duration)
 
 void Contact::calculateDesiredDeltaVelocity(real duration)
 {
-    const static real velocityLimit = (real)0.25f;
-
     // Calculate the acceleration induced velocity accumulated this frame
     real velocityFromAcc = 0;
 
@@ -166,7 +175,7 @@ void Contact::calculateDesiredDeltaVelocity(real duration)
 
     // If the velocity is very slow, limit the restitution
     real thisRestitution = restitution;
-    if (real_abs(contactVelocity.x) < velocityLimit)
+    if (isResting())
     {
         thisRestitution = (real)0.0f;
     }
@@ -204,6 +213,11 @@ void Contact::calculateInternals(real duration)
     calculateDesiredDeltaVelocity(duration);
 }
 
+bool Contact::isResting() const
+{
+    return real_abs(contactVelocity.x) < velocityLimit;
+}
+
 void Contact::applyVelocityChange(Vector3 velocityChange[2],
                                   Vector3 rotationChange[2])
 {
@@ -229,6 +243,28 @@ void Contact::applyVelocityChange(Vector3 velocityChange[2],
         impulseContact = calculateFrictionImpulse(inverseInertiaTensor);
     }
 
+    accumulatedImpulse += impulseContact;
+    applyContactImpulse(impulseContact, inverseInertiaTensor,
+                        velocityChange, rotationChange);
+}
+
+void Contact::applyWarmStart()
+{
+    Matrix3 inverseInertiaTensor[2];
+    body[0]->getInverseInertiaTensorWorld(&inverseInertiaTensor[0]);
+    if (body[1])
+        body[1]->getInverseInertiaTensorWorld(&inverseInertiaTensor[1]);
+
+    Vector3 velocityChange[2], rotationChange[2];
+    applyContactImpulse(accumulatedImpulse, inverseInertiaTensor,
+                        velocityChange, rotationChange);
+}
+
+void Contact::applyContactImpulse(const Vector3 &impulseContact,
+                                  const Matrix3 inverseInertiaTensor[2],
+                                  Vector3 velocityChange[2],
+                                  Vector3 rotationChange[2])
+{
     // Convert impulse to world coordinates
     Vector3 impulse = contactToWorld.transform(impulseContact);
 
@@ -238,9 +274,14 @@ void Contact::applyVelocityChange(Vector3 velocityChange[2],
     velocityChange[0].clear();
     velocityChange[0].addScaledVector(impulse, body[0]->getInverseMass());
 
-    // Apply the changes
-    body[0]->addVelocity(velocityChange[0]);
-    body[0]->addRotation(rotationChange[0]);
+    // Apply the changes. Bodies that can't be moved are left
+    // untouched, so contacts resolved on different threads never
+    // write to the same immovable body.
+    if (velocityChange[0] != Vector3() || rotationChange[0] != Vector3())
+    {
+        body[0]->addVelocity(velocityChange[0]);
+        body[0]->addRotation(rotationChange[0]);
+    }
 
     if (body[1])
     {
@@ -251,8 +292,11 @@ void Contact::applyVelocityChange(Vector3 velocityChange[2],
         velocityChange[1].addScaledVector(impulse, -body[1]->getInverseMass());
 
         // And apply them.
-        body[1]->addVelocity(velocityChange[1]);
-        body[1]->addRotation(rotationChange[1]);
+        if (velocityChange[1] != Vector3() || rotationChange[1] != Vector3())
+        {
+            body[1]->addVelocity(velocityChange[1]);
+            body[1]->addRotation(rotationChange[1]);
+        }
     }
 }
 
@@ -481,6 +525,9 @@ void Contact::applyPositionChange(Vector3 linearChange[2],
         // along the contact normal.
         linearChange[i] = contactNormal * linearMove[i];
 
+        // Bodies that can't be moved are left untouched.
+        if (linearMove[i] == 0 && angularMove[i] == 0) continue;
+
         // Now we can start to apply the values we've calculated.
         // Apply the linear movement
         Vector3 pos;
@@ -509,12 +556,18 @@ void Contact::applyPositionChange(Vector3 linearChange[2],
 
 // Contact resolver implementation
 
+const unsigned ContactResolver::noBodyGroup;
+const unsigned ContactResolver::noColour;
+
 ContactResolver::ContactResolver(unsigned iterations,
                                  real velocityEpsilon,
                                  real positionEpsilon)
 {
     setIterations(iterations, iterations);
     setEpsilon(velocityEpsilon, positionEpsilon);
+    warmStarting = false;
+    setVelocitySolver(VELOCITY_WORST_FIRST);
+    executor = NULL;
 }
 
 ContactResolver::ContactResolver(unsigned velocityIterations,
@@ -524,6 +577,9 @@ ContactResolver::ContactResolver(unsigned velocityIterations,
 {
     setIterations(velocityIterations);
     setEpsilon(velocityEpsilon, positionEpsilon);
+    warmStarting = false;
+    setVelocitySolver(VELOCITY_WORST_FIRST);
+    executor = NULL;
 }
 
 void ContactResolver::setIterations(unsigned iterations)
@@ -545,6 +601,23 @@ void ContactResolver::setEpsilon(real velocityEpsilon,
     ContactResolver::positionEpsilon = positionEpsilon;
 }
 
+void ContactResolver::setWarmStarting(bool warmStarting)
+{
+    ContactResolver::warmStarting = warmStarting;
+}
+
+void ContactResolver::setVelocitySolver(VelocitySolver velocitySolver,
+                                        unsigned sweeps)
+{
+    ContactResolver::velocitySolver = velocitySolver;
+    ContactResolver::velocitySweeps = sweeps;
+}
+
+void ContactResolver::setExecutor(TaskExecutor *executor)
+{
+    ContactResolver::executor = executor;
+}
+
 void ContactResolver::resolveContacts(Contact *contacts,
                                       unsigned numContacts,
                                       real duration)
@@ -573,32 +646,172 @@ void ContactResolver::prepareContacts(Contact* contacts,
     {
         // Calculate the internal contact data (inertia, basis, etc).
         contact->calculateInternals(duration);
+
+        // Without warm starting, every contact starts from nothing.
+        if (!warmStarting) contact->accumulatedImpulse.clear();
+    }
+
+    // Find out which contacts share bodies.
+    buildContactAdjacency(contacts, numContacts);
+}
+
+/*
+ * Orders (body, contact slot) pairs by body, then by slot. Slots are
+ * contact*2+bodyIndex, so each body's contacts come out in increasing
+ * contact order.
+ */
+static bool bodyContactPairBefore(const std::pair<RigidBody*, unsigned> &a,
+                                  const std::pair<RigidBody*, unsigned> &b)
+{
+    if (a.first != b.first) return std::less<RigidBody*>()(a.first, b.first);
+    return a.second < b.second;
+}
+
+void ContactResolver::buildContactAdjacency(Contact *c,
+                                            unsigned numContacts)
+{
+    // List every body reference in the contacts, and sort them so
+    // that all the references to the same body are together.
+    bodyContactPairs.clear();
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
+        {
+            bodyContactPairs.push_back(
+                std::make_pair(c[i].body[b], i*2 + b));
+        }
+    }
+    std::sort(bodyContactPairs.begin(), bodyContactPairs.end(),
+        bodyContactPairBefore);
+
+    // Walk the sorted list, starting a new row for each new body.
+    contactBodyGroup.assign(numContacts*2, noBodyGroup);
+    bodyContactStart.clear();
+    bodyContacts.clear();
+
+    RigidBody *current = NULL;
+    for (unsigned k = 0; k < bodyContactPairs.size(); k++)
+    {
+        RigidBody *body = bodyContactPairs[k].first;
+        unsigned slot = bodyContactPairs[k].second;
+        unsigned contact = slot / 2;
+
+        if (k == 0 || body != current)
+        {
+            current = body;
+            bodyContactStart.push_back((unsigned)bodyContacts.size());
+        }
+        contactBodyGroup[slot] = (unsigned)bodyContactStart.size() - 1;
+
+        // A contact between a body and itself would otherwise be
+        // listed twice in the same row.
+        if (bodyContacts.size() == bodyContactStart.back() ||
+            bodyContacts.back() != contact)
+        {
+            bodyContacts.push_back(contact);
+        }
+    }
+    bodyContactStart.push_back((unsigned)bodyContacts.size());
+}
+
+void ContactResolver::buildHeap(unsigned numContacts, real epsilon)
+{
+    // The keys have already been written to heapKey; anything at or
+    // below the epsilon is pushed to the bottom.
+    heap.resize(numContacts);
+    heapPosition.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        if (!(heapKey[i] > epsilon)) heapKey[i] = -REAL_MAX;
+        heap[i] = i;
+        heapPosition[i] = i;
+    }
+
+    // Heapify bottom up.
+    for (unsigned i = numContacts / 2; i > 0; i--)
+    {
+        siftDown(i - 1);
+    }
+}
+
+void ContactResolver::updateHeap(unsigned index, real key, real epsilon)
+{
+    if (!(key > epsilon)) key = -REAL_MAX;
+
+    real oldKey = heapKey[index];
+    heapKey[index] = key;
+    if (key > oldKey) siftUp(heapPosition[index]);
+    else if (key < oldKey) siftDown(heapPosition[index]);
+}
+
+void ContactResolver::siftUp(unsigned position)
+{
+    unsigned index = heap[position];
+    while (position > 0)
+    {
+        unsigned parent = (position - 1) / 2;
+        if (!heapBefore(index, heap[parent])) break;
+
+        heap[position] = heap[parent];
+        heapPosition[heap[position]] = position;
+        position = parent;
+    }
+    heap[position] = index;
+    heapPosition[index] = position;
+}
+
+void ContactResolver::siftDown(unsigned position)
+{
+    unsigned size = (unsigned)heap.size();
+    unsigned index = heap[position];
+    for (;;)
+    {
+        unsigned child = position * 2 + 1;
+        if (child >= size) break;
+        if (child + 1 < size && heapBefore(heap[child + 1], heap[child]))
+        {
+            child++;
+        }
+        if (!heapBefore(heap[child], index)) break;
+
+        heap[position] = heap[child];
+        heapPosition[heap[position]] = position;
+        position = child;
     }
+    heap[position] = index;
+    heapPosition[index] = position;
 }
 
 void ContactResolver::adjustVelocities(Contact *c,
                                        unsigned numContacts,
                                        real duration)
 {
+    if (velocitySolver == VELOCITY_COLOURED)
+    {
+        adjustVelocitiesColoured(c, numContacts, duration);
+        return;
+    }
+
     Vector3 velocityChange[2], rotationChange[2];
     Vector3 deltaVel;
 
+    if (warmStarting) warmStartContacts(c, numContacts, duration);
+
+    // Sort the contacts by the size of their desired velocity change.
+    heapKey.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        heapKey[i] = c[i].desiredDeltaVelocity;
+    }
+    buildHeap(numContacts, velocityEpsilon);
+
     // iteratively handle impacts in order of severity.
     velocityIterationsUsed = 0;
     while (velocityIterationsUsed < velocityIterations)
     {
         // Find contact with maximum magnitude of probable velocity change.
-        real max = velocityEpsilon;
-        unsigned index = numContacts;
-        for (unsigned i = 0; i < numContacts; i++)
-        {
-            if (c[i].desiredDeltaVelocity > max)
-            {
-                max = c[i].desiredDeltaVelocity;
-                index = i;
-            }
-        }
-        if (index == numContacts) break;
+        unsigned index = heap[0];
+        if (!(heapKey[index] > velocityEpsilon)) break;
 
         // Match the awake state at the contact
         c[index].matchAwakeState();
@@ -608,34 +821,261 @@ void ContactResolver::adjustVelocities(Contact *c,
 
         // With the change in velocity of the two bodies, the update of
         // contact velocities means that some of the relative closing
-        // velocities need recomputing.
-        for (unsigned i = 0; i < numContacts; i++)
+        // velocities need recomputing. Only contacts that share a body
+        // with the resolved contact can have changed.
+        for (unsigned side = 0; side < 2; side++)
         {
-            // Check each body in the contact
-            for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
+            unsigned group = contactBodyGroup[index*2 + side];
+            if (group == noBodyGroup) continue;
+
+            for (unsigned k = bodyContactStart[group];
+                 k < bodyContactStart[group+1]; k++)
             {
-                // Check for a match with each body in the newly
-                // resolved contact
-                for (unsigned d = 0; d < 2; d++)
+                unsigned i = bodyContacts[k];
+
+                // Contacts that also touch the first body were
+                // handled in the first row.
+                if (side == 1 &&
+                    (c[i].body[0] == c[index].body[0] ||
+                     c[i].body[1] == c[index].body[0])) continue;
+
+                // Check each body in the contact
+                for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
                 {
-                    if (c[i].body[b] == c[index].body[d])
+                    // Check for a match with each body in the newly
+                    // resolved contact
+                    for (unsigned d = 0; d < 2; d++)
                     {
-                        deltaVel = velocityChange[d] +
-                            rotationChange[d].vectorProduct(
-                                c[i].relativeContactPosition[b]);
-
-                        // The sign of the change is negative if we're dealing
-                        // with the second body in a contact.
-                        c[i].contactVelocity +=
-                            c[i].contactToWorld.transformTranspose(deltaVel)
-                            * (b?-1:1);
-                        c[i].calculateDesiredDeltaVelocity(duration);
+                        if (c[i].body[b] == c[index].body[d])
+                        {
+                            deltaVel = velocityChange[d] +
+                                rotationChange[d].vectorProduct(
+                                    c[i].relativeContactPosition[b]);
+
+                            // The sign of the change is negative if we're
+                            // dealing with the second body in a contact.
+                            c[i].contactVelocity +=
+                                c[i].contactToWorld.transformTranspose(deltaVel)
+                                * (b?-1:1);
+                            c[i].calculateDesiredDeltaVelocity(duration);
+                        }
                     }
                 }
+                updateHeap(i, c[i].desiredDeltaVelocity, velocityEpsilon);
             }
         }
         velocityIterationsUsed++;
     }
+
+    if (warmStarting) discardImpacts(c, numContacts);
+}
+
+void ContactResolver::discardImpacts(Contact *c, unsigned numContacts)
+{
+    // Impacts aren't carried into the next frame.
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        if (!contactResting[i]) c[i].accumulatedImpulse.clear();
+    }
+}
+
+void ContactResolver::buildContactColours(Contact *c,
+                                          unsigned numContacts)
+{
+    // Each body group has a bit for each of 32 colours. A contact
+    // takes the lowest colour that none of its movable bodies has
+    // yet. Contacts that find all 32 taken wait for the next block
+    // of 32 colours.
+    contactColour.assign(numContacts, noColour);
+    unsigned numGroups = (unsigned)bodyContactStart.size() - 1;
+    unsigned numColours = 0;
+    unsigned remaining = numContacts;
+    for (unsigned base = 0; remaining > 0; base += 32)
+    {
+        groupColours.assign(numGroups, 0);
+        for (unsigned i = 0; i < numContacts; i++)
+        {
+            if (contactColour[i] != noColour) continue;
+
+            // Bodies that can't move are never written to, so any
+            // number of contacts in a colour can share them.
+            unsigned used = 0;
+            for (unsigned b = 0; b < 2; b++)
+            {
+                unsigned group = contactBodyGroup[i*2 + b];
+                if (group == noBodyGroup) continue;
+                if (c[i].body[b]->isImmovable()) continue;
+                used |= groupColours[group];
+            }
+            if (used == 0xffffffff) continue;
+
+            unsigned bit = 0;
+            while (used & (1u << bit)) bit++;
+
+            for (unsigned b = 0; b < 2; b++)
+            {
+                unsigned group = contactBodyGroup[i*2 + b];
+                if (group == noBodyGroup) continue;
+                if (c[i].body[b]->isImmovable()) continue;
+                groupColours[group] |= 1u << bit;
+            }
+
+            contactColour[i] = base + bit;
+            if (base + bit + 1 > numColours) numColours = base + bit + 1;
+            remaining--;
+        }
+    }
+
+    // Sort the contacts by colour, keeping them in contact order
+    // within each colour.
+    colourStart.assign(numColours + 1, 0);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        colourStart[contactColour[i] + 1]++;
+    }
+    for (unsigned k = 0; k < numColours; k++)
+    {
+        colourStart[k+1] += colourStart[k];
+    }
+    colourContacts.resize(numContacts);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        colourContacts[colourStart[contactColour[i]]++] = i;
+    }
+
+    // Filling in has moved each start to the end of its colour,
+    // which is the start of the next one.
+    for (unsigned k = numColours; k > 0; k--)
+    {
+        colourStart[k] = colourStart[k-1];
+    }
+    colourStart[0] = 0;
+}
+
+bool ContactResolver::resolveContactVelocity(Contact &contact,
+                                             real duration)
+{
+    // Other contacts on the same bodies may have changed their
+    // velocities since this contact was last seen.
+    contact.contactVelocity = contact.calculateLocalVelocity(0, duration);
+    if (contact.body[1])
+    {
+        contact.contactVelocity -= contact.calculateLocalVelocity(1, duration);
+    }
+    contact.calculateDesiredDeltaVelocity(duration);
+    if (!(contact.desiredDeltaVelocity > velocityEpsilon)) return false;
+
+    // Match the awake state at the contact.
+    contact.matchAwakeState();
+
+    Vector3 velocityChange[2], rotationChange[2];
+    contact.applyVelocityChange(velocityChange, rotationChange);
+    return true;
+}
+
+void ContactResolver::ColourSolver::run(unsigned begin, unsigned end)
+{
+    unsigned count = 0;
+    for (unsigned k = begin; k < end; k++)
+    {
+        if (resolver->resolveContactVelocity(contacts[indices[k]], duration))
+        {
+            count++;
+        }
+    }
+    resolved += count;
+}
+
+void ContactResolver::adjustVelocitiesColoured(Contact *c,
+                                               unsigned numContacts,
+                                               real duration)
+{
+    // Colours smaller than this aren't worth handing to the executor.
+    const static unsigned minParallelContacts = 64;
+    const static unsigned grainSize = 32;
+
+    if (warmStarting) warmStartContacts(c, numContacts, duration);
+
+    buildContactColours(c, numContacts);
+    unsigned numColours = (unsigned)colourStart.size() - 1;
+
+    ColourSolver solver;
+    solver.resolver = this;
+    solver.contacts = c;
+    solver.duration = duration;
+
+    // Sweep through the colours in order. No two contacts in a colour
+    // share a body that can move, so the order in which the contacts
+    // of one colour are resolved makes no difference to the result.
+    velocityIterationsUsed = 0;
+    for (unsigned sweep = 0; sweep < velocitySweeps; sweep++)
+    {
+        solver.resolved = 0;
+        for (unsigned k = 0; k < numColours; k++)
+        {
+            unsigned count = colourStart[k+1] - colourStart[k];
+            solver.indices = &colourContacts[colourStart[k]];
+            if (executor && count >= minParallelContacts)
+            {
+                executor->parallelFor(&solver, count, grainSize);
+            }
+            else
+            {
+                solver.run(0, count);
+            }
+        }
+
+        // Stop once a whole sweep has nothing left to do.
+        velocityIterationsUsed += solver.resolved;
+        if (solver.resolved == 0) break;
+    }
+
+    if (warmStarting) discardImpacts(c, numContacts);
+}
+
+void ContactResolver::warmStartContacts(Contact *c,
+                                        unsigned numContacts,
+                                        real duration)
+{
+    contactResting.resize(numContacts);
+
+    bool applied = false;
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        contactResting[i] = c[i].isResting();
+        if (!contactResting[i])
+        {
+            c[i].accumulatedImpulse.clear();
+            continue;
+        }
+        if (c[i].accumulatedImpulse == Vector3()) continue;
+
+        // Bodies that are asleep keep their impulse for when they
+        // wake, but don't have it applied.
+        bool asleep = false;
+        for (unsigned b = 0; b < 2; b++)
+        {
+            RigidBody *body = c[i].body[b];
+            if (body && body->hasFiniteMass() && !body->getAwake()) asleep = true;
+        }
+        if (asleep) continue;
+
+        c[i].applyWarmStart();
+        applied = true;
+    }
+    if (!applied) return;
+
+    // Any contact can share a body with a warm started one, so work
+    // out every closing velocity again.
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        c[i].contactVelocity = c[i].calculateLocalVelocity(0, duration);
+        if (c[i].body[1])
+        {
+            c[i].contactVelocity -= c[i].calculateLocalVelocity(1, duration);
+        }
+        c[i].calculateDesiredDeltaVelocity(duration);
+    }
 }
 
 void ContactResolver::adjustPositions(Contact *c,
@@ -647,22 +1087,22 @@ void ContactResolver::adjustPositions(Contact *c,
     real max;
     Vector3 deltaPosition;
 
+    // Sort the contacts by their penetration.
+    heapKey.resize(numContacts);
+    for (i = 0; i < numContacts; i++)
+    {
+        heapKey[i] = c[i].penetration;
+    }
+    buildHeap(numContacts, positionEpsilon);
+
     // iteratively resolve interpenetrations in order of severity.
     positionIterationsUsed = 0;
     while (positionIterationsUsed < positionIterations)
     {
         // Find biggest penetration
-        max = positionEpsilon;
-        index = numContacts;
-        for (i=0; i<numContacts; i++)
-        {
-            if (c[i].penetration > max)
-            {
-                max = c[i].penetration;
-                index = i;
-            }
-        }
-        if (index == numContacts) break;
+        index = heap[0];
+        max = c[index].penetration;
+        if (!(heapKey[index] > positionEpsilon)) break;
 
         // Match the awake state at the contact
         c[index].matchAwakeState();
@@ -674,33 +1114,141 @@ void ContactResolver::adjustPositions(Contact *c,
             max);
 
         // Again this action may have changed the penetration of other
-        // bodies, so we update contacts.
-        for (i = 0; i < numContacts; i++)
+        // bodies, so we update the contacts that share a body with
+        // the one we resolved.
+        for (unsigned side = 0; side < 2; side++)
         {
-            // Check each body in the contact
-            for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
+            unsigned group = contactBodyGroup[index*2 + side];
+            if (group == noBodyGroup) continue;
+
+            for (unsigned k = bodyContactStart[group];
+                 k < bodyContactStart[group+1]; k++)
             {
-                // Check for a match with each body in the newly
-                // resolved contact
-                for (unsigned d = 0; d < 2; d++)
+                i = bodyContacts[k];
+
+                // Contacts that also touch the first body were
+                // handled in the first row.
+                if (side == 1 &&
+                    (c[i].body[0] == c[index].body[0] ||
+                     c[i].body[1] == c[index].body[0])) continue;
+
+                // Check each body in the contact
+                for (unsigned b = 0; b < 2; b++) if (c[i].body[b])
                 {
-                    if (c[i].body[b] == c[index].body[d])
+                    // Check for a match with each body in the newly
+                    // resolved contact
+                    for (unsigned d = 0; d < 2; d++)
                     {
-                        deltaPosition = linearChange[d] +
-                            angularChange[d].vectorProduct(
-                                c[i].relativeContactPosition[b]);
-
-                        // The sign of the change is positive if we're
-                        // dealing with the second body in a contact
-                        // and negative otherwise (because we're
-                        // subtracting the resolution)..
-                        c[i].penetration +=
-                            deltaPosition.scalarProduct(c[i].contactNormal)
-                            * (b?1:-1);
+                        if (c[i].body[b] == c[index].body[d])
+                        {
+                            deltaPosition = linearChange[d] +
+                                angularChange[d].vectorProduct(
+                                    c[i].relativeContactPosition[b]);
+
+                            // The sign of the change is positive if we're
+                            // dealing with the second body in a contact
+                            // and negative otherwise (because we're
+                            // subtracting the resolution)..
+                            c[i].penetration +=
+                                deltaPosition.scalarProduct(c[i].contactNormal)
+                                * (b?1:-1);
+                        }
                     }
                 }
+                updateHeap(i, c[i].penetration, positionEpsilon);
             }
         }
         positionIterationsUsed++;
     }
 }
+
+// Contact cache implementation
+
+ContactCache::ContactCache(real warmStartFactor, real matchDistance)
+:
+warmStartFactor(warmStartFactor),
+matchDistance(matchDistance)
+{
+}
+
+bool ContactCache::entryBefore(const Entry &a, const Entry &b)
+{
+    std::less<RigidBody*> before;
+    if (a.body[0] != b.body[0]) return before(a.body[0], b.body[0]);
+    if (a.body[1] != b.body[1]) return before(a.body[1], b.body[1]);
+    return a.feature < b.feature;
+}
+
+void ContactCache::load(Contact *contacts, unsigned numContacts) const
+{
+    // Normals further apart than this don't match: the impulse is in
+    // contact coordinates, so would point the wrong way.
+    const static real minNormalCosine = (real)0.95;
+
+    Entry key;
+    for (Contact *contact = contacts; contact < contacts+numContacts; contact++)
+    {
+        contact->accumulatedImpulse.clear();
+        if (!contact->body[0] || entries.empty()) continue;
+
+        key.body[0] = contact->body[0];
+        key.body[1] = contact->body[1];
+        key.feature = contact->feature;
+
+        std::vector<Entry>::const_iterator first =
+            std::lower_bound(entries.begin(), entries.end(), key, entryBefore);
+        if (first == entries.end() || entryBefore(key, *first)) continue;
+
+        // Several contacts can share bodies and feature: use the
+        // closest one.
+        Vector3 localPoint =
+            contact->body[0]->getPointInLocalSpace(contact->contactPoint);
+        const Entry *match = NULL;
+        real bestDistance = matchDistance * matchDistance;
+        for (std::vector<Entry>::const_iterator entry = first;
+             entry != entries.end() && !entryBefore(key, *entry); entry++)
+        {
+            if (entry->contactNormal * contact->contactNormal < minNormalCosine)
+            {
+                continue;
+            }
+
+            real distance = (entry->localPoint - localPoint).squareMagnitude();
+            if (distance <= bestDistance)
+            {
+                bestDistance = distance;
+                match = &*entry;
+            }
+        }
+
+        if (match) contact->accumulatedImpulse.x = match->impulse * warmStartFactor;
+    }
+}
+
+void ContactCache::store(const Contact *contacts, unsigned numContacts)
+{
+    entries.clear();
+
+    Entry entry;
+    for (const Contact *contact = contacts; contact < contacts+numContacts; contact++)
+    {
+        // Only contacts that were pushed apart are worth keeping.
+        if (!contact->body[0] || contact->accumulatedImpulse.x <= 0) continue;
+
+        entry.body[0] = contact->body[0];
+        entry.body[1] = contact->body[1];
+        entry.feature = contact->feature;
+        entry.localPoint =
+            contact->body[0]->getPointInLocalSpace(contact->contactPoint);
+        entry.contactNormal = contact->contactNormal;
+        entry.impulse = contact->accumulatedImpulse.x;
+        entries.push_back(entry);
+    }
+
+    std::sort(entries.begin(), entries.end(), entryBefore);
+}
+
+void ContactCache::clear()
+{
+    entries.clear();
+}
@@ -0,0 +1,1564 @@
+/*
+ * Implementation file for convex hull primitives and the general
+ * convex collision tests.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/convex.h>
+#include <cyclone/capsule.h>
+#include <algorithm>
+#include <math.h>
+
+using namespace cyclone;
+
+/**
+ * Holds a triangle of a hull while the hull is being built.
+ */
+struct HullTriangle
+{
+    unsigned vertex[3];
+    Vector3 normal;
+    real offset;
+};
+
+/**
+ * Adds the triangle through the given points, anticlockwise when
+ * seen from outside, to the hull being built.
+ */
+static void addHullTriangle(std::vector<HullTriangle> &triangles,
+                            const Vector3 *points,
+                            unsigned a, unsigned b, unsigned c)
+{
+    HullTriangle triangle;
+    triangle.vertex[0] = a;
+    triangle.vertex[1] = b;
+    triangle.vertex[2] = c;
+    triangle.normal = (points[b] - points[a]) % (points[c] - points[a]);
+    triangle.normal.normalise();
+    triangle.offset = triangle.normal * points[a];
+    triangles.push_back(triangle);
+}
+
+CollisionConvex::CollisionConvex()
+    : CollisionPrimitive(TYPE_CONVEX)
+{
+}
+
+bool CollisionConvex::setVertices(const Vector3 *points, unsigned count)
+{
+    vertices.clear();
+    neighbours.clear();
+    neighbourStart.clear();
+    faceNormals.clear();
+    faceOffsets.clear();
+    faceVertices.clear();
+    faceStart.clear();
+    if (count < 4) return false;
+
+    // Points closer than this to a plane are treated as on it. It
+    // scales with the size of the hull.
+    Vector3 lower = points[0], upper = points[0];
+    for (unsigned i = 1; i < count; i++)
+    {
+        for (unsigned j = 0; j < 3; j++)
+        {
+            if (points[i][j] < lower[j]) lower[j] = points[i][j];
+            if (points[i][j] > upper[j]) upper[j] = points[i][j];
+        }
+    }
+    Vector3 extent = upper - lower;
+    unsigned longest = 0;
+    if (extent.y > extent[longest]) longest = 1;
+    if (extent.z > extent[longest]) longest = 2;
+    real tolerance = extent.magnitude() * ((real)1e-6);
+    if (tolerance <= 0) return false;
+
+    // Start with the largest tetrahedron we can easily find: the
+    // points at each end of the longest side of the bounds, the
+    // point furthest from the line between them, and the point
+    // furthest from the plane through all three.
+    unsigned a = 0, b = 0;
+    for (unsigned i = 1; i < count; i++)
+    {
+        if (points[i][longest] < points[a][longest]) a = i;
+        if (points[i][longest] > points[b][longest]) b = i;
+    }
+    Vector3 line = points[b] - points[a];
+    line.normalise();
+
+    unsigned c = a;
+    real furthest = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        real distance = ((points[i] - points[a]) % line).magnitude();
+        if (distance > furthest)
+        {
+            furthest = distance;
+            c = i;
+        }
+    }
+    if (furthest <= tolerance) return false;
+
+    Vector3 normal = (points[b] - points[a]) % (points[c] - points[a]);
+    normal.normalise();
+    unsigned d = a;
+    furthest = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        real distance = real_abs(normal * (points[i] - points[a]));
+        if (distance > furthest)
+        {
+            furthest = distance;
+            d = i;
+        }
+    }
+    if (furthest <= tolerance) return false;
+
+    // Wind the first triangle so it faces away from the fourth point,
+    // and the others to share its edges the other way round.
+    if (normal * (points[d] - points[a]) > 0)
+    {
+        unsigned swap = b; b = c; c = swap;
+    }
+    std::vector<HullTriangle> triangles;
+    addHullTriangle(triangles, points, a, b, c);
+    addHullTriangle(triangles, points, b, a, d);
+    addHullTriangle(triangles, points, c, b, d);
+    addHullTriangle(triangles, points, a, c, d);
+
+    // Add each point outside the hull so far, replacing the triangles
+    // it can see with a fan joining it to their outline.
+    std::vector<unsigned> edges;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (i == a || i == b || i == c || i == d) continue;
+
+        edges.clear();
+        unsigned kept = 0;
+        for (unsigned t = 0; t < triangles.size(); t++)
+        {
+            const HullTriangle &triangle = triangles[t];
+            if (triangle.normal * points[i] - triangle.offset <= tolerance)
+            {
+                triangles[kept++] = triangle;
+                continue;
+            }
+
+            // An edge shared by two visible triangles is inside the
+            // patch being removed, so it is dropped when it is seen
+            // the second time, going the other way.
+            for (unsigned k = 0; k < 3; k++)
+            {
+                unsigned from = triangle.vertex[k];
+                unsigned to = triangle.vertex[(k+1) % 3];
+                unsigned e = 0;
+                while (e < edges.size() &&
+                       !(edges[e] == to && edges[e+1] == from)) e += 2;
+                if (e < edges.size())
+                {
+                    edges[e] = edges[edges.size()-2];
+                    edges[e+1] = edges[edges.size()-1];
+                    edges.resize(edges.size()-2);
+                }
+                else
+                {
+                    edges.push_back(from);
+                    edges.push_back(to);
+                }
+            }
+        }
+        if (kept == triangles.size()) continue;
+
+        triangles.resize(kept);
+        for (unsigned e = 0; e < edges.size(); e += 2)
+        {
+            addHullTriangle(triangles, points, edges[e], edges[e+1], i);
+        }
+    }
+
+    // Keep only the points used by the hull, numbered in the order
+    // they were given.
+    std::vector<unsigned> index(count, 0xffffffff);
+    for (unsigned t = 0; t < triangles.size(); t++)
+    {
+        for (unsigned k = 0; k < 3; k++) index[triangles[t].vertex[k]] = 0;
+    }
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (index[i] == 0xffffffff) continue;
+        index[i] = (unsigned)vertices.size();
+        vertices.push_back(points[i]);
+    }
+    for (unsigned t = 0; t < triangles.size(); t++)
+    {
+        for (unsigned k = 0; k < 3; k++)
+        {
+            triangles[t].vertex[k] = index[triangles[t].vertex[k]];
+        }
+    }
+
+    // Each vertex's neighbours are the other ends of its edges.
+    std::vector<unsigned> pairs;
+    for (unsigned t = 0; t < triangles.size(); t++)
+    {
+        for (unsigned k = 0; k < 3; k++)
+        {
+            unsigned from = triangles[t].vertex[k];
+            unsigned to = triangles[t].vertex[(k+1) % 3];
+            pairs.push_back(from * (unsigned)vertices.size() + to);
+        }
+    }
+    std::sort(pairs.begin(), pairs.end());
+    neighbourStart.assign(vertices.size() + 1, 0);
+    for (unsigned p = 0; p < pairs.size(); p++)
+    {
+        neighbourStart[pairs[p] / vertices.size() + 1]++;
+    }
+    for (unsigned v = 0; v < vertices.size(); v++)
+    {
+        neighbourStart[v+1] += neighbourStart[v];
+    }
+    for (unsigned p = 0; p < pairs.size(); p++)
+    {
+        neighbours.push_back(pairs[p] % (unsigned)vertices.size());
+    }
+
+    // Triangles facing the same way lie in the same face of the hull.
+    // Each face is given the vertices of all its triangles, sorted by
+    // their angle around the face's centre.
+    const static real sameFace = (real)1e-6;
+    std::vector<unsigned> triangleFace(triangles.size());
+    for (unsigned t = 0; t < triangles.size(); t++)
+    {
+        unsigned face = 0;
+        while (face < faceNormals.size() &&
+               faceNormals[face] * triangles[t].normal < 1 - sameFace)
+        {
+            face++;
+        }
+        if (face == faceNormals.size())
+        {
+            faceNormals.push_back(triangles[t].normal);
+            faceOffsets.push_back(triangles[t].offset);
+        }
+        triangleFace[t] = face;
+    }
+
+    std::vector<unsigned> faceSet;
+    std::vector< std::pair<real, unsigned> > ring;
+    faceStart.push_back(0);
+    for (unsigned face = 0; face < faceNormals.size(); face++)
+    {
+        faceSet.clear();
+        for (unsigned t = 0; t < triangles.size(); t++)
+        {
+            if (triangleFace[t] != face) continue;
+            for (unsigned k = 0; k < 3; k++)
+            {
+                faceSet.push_back(triangles[t].vertex[k]);
+            }
+        }
+        std::sort(faceSet.begin(), faceSet.end());
+        faceSet.erase(std::unique(faceSet.begin(), faceSet.end()),
+                      faceSet.end());
+
+        Vector3 centre;
+        for (unsigned k = 0; k < faceSet.size(); k++)
+        {
+            centre += vertices[faceSet[k]];
+        }
+        centre *= ((real)1.0) / faceSet.size();
+
+        const Vector3 &faceNormal = faceNormals[face];
+        Vector3 across = vertices[faceSet[0]] - centre;
+        Vector3 up = faceNormal % across;
+        ring.clear();
+        real offset = faceOffsets[face];
+        for (unsigned k = 0; k < faceSet.size(); k++)
+        {
+            const Vector3 &vertex = vertices[faceSet[k]];
+            Vector3 relative = vertex - centre;
+            ring.push_back(std::make_pair(
+                (real)atan2(relative * up, relative * across), faceSet[k]));
+
+            // Keep the plane touching the furthest of the vertices.
+            if (faceNormal * vertex > offset) offset = faceNormal * vertex;
+        }
+        std::sort(ring.begin(), ring.end());
+        faceOffsets[face] = offset;
+
+        for (unsigned k = 0; k < ring.size(); k++)
+        {
+            faceVertices.push_back(ring[k].second);
+        }
+        faceStart.push_back((unsigned)faceVertices.size());
+    }
+
+    return true;
+}
+
+unsigned CollisionConvex::getSupportVertex(const Vector3 &direction,
+                                           unsigned start) const
+{
+    unsigned count = (unsigned)vertices.size();
+    if (count < hillClimbVertices)
+    {
+        unsigned best = 0;
+        real bestDistance = vertices[0] * direction;
+        for (unsigned i = 1; i < count; i++)
+        {
+            real distance = vertices[i] * direction;
+            if (distance > bestDistance)
+            {
+                bestDistance = distance;
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    // Move to the best neighbour until none is better. On a convex
+    // hull the first vertex with no better neighbour is the best.
+    unsigned best = (start < count) ? start : 0;
+    real bestDistance = vertices[best] * direction;
+    for (;;)
+    {
+        unsigned next = best;
+        for (unsigned n = neighbourStart[best];
+             n < neighbourStart[best+1]; n++)
+        {
+            real distance = vertices[neighbours[n]] * direction;
+            if (distance > bestDistance)
+            {
+                bestDistance = distance;
+                next = neighbours[n];
+            }
+        }
+        if (next == best) return best;
+        best = next;
+    }
+}
+
+unsigned CollisionConvex::getSupportFace(const Vector3 &direction) const
+{
+    unsigned best = 0;
+    real bestAlignment = faceNormals[0] * direction;
+    for (unsigned i = 1; i < faceNormals.size(); i++)
+    {
+        real alignment = faceNormals[i] * direction;
+        if (alignment > bestAlignment)
+        {
+            bestAlignment = alignment;
+            best = i;
+        }
+    }
+    return best;
+}
+
+BoundingBox CollisionConvex::getBoundingBox() const
+{
+    // The extent along each world axis comes from the vertices
+    // furthest each way along it.
+    BoundingBox result;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 axis;
+        axis[i] = 1;
+        Vector3 local = transform.transformInverseDirection(axis);
+        unsigned upper = getSupportVertex(local);
+        unsigned lower = getSupportVertex(local * -1);
+        result.upper[i] = transform.transform(vertices[upper])[i];
+        result.lower[i] = transform.transform(vertices[lower])[i];
+    }
+    return result;
+}
+
+/**
+ * Returns the point of the core of the given primitive furthest
+ * along the given direction, in world coordinates. The core is the
+ * shape with its margin taken off: a sphere's core is its centre.
+ * Hulls start their search from the hinted vertex, and the hint is
+ * updated with the vertex found.
+ */
+static Vector3 coreSupport(const CollisionPrimitive &primitive,
+                           const Vector3 &direction,
+                           unsigned *hint)
+{
+    const Matrix4 &transform = primitive.getTransform();
+    switch (primitive.getType())
+    {
+    case CollisionPrimitive::TYPE_BOX:
+        {
+            const CollisionBox &box = (const CollisionBox &)primitive;
+            Vector3 local = transform.transformInverseDirection(direction);
+            Vector3 corner = box.halfSize;
+            if (local.x < 0) corner.x = -corner.x;
+            if (local.y < 0) corner.y = -corner.y;
+            if (local.z < 0) corner.z = -corner.z;
+            return transform.transform(corner);
+        }
+
+    case CollisionPrimitive::TYPE_CONVEX:
+        {
+            const CollisionConvex &convex =
+                (const CollisionConvex &)primitive;
+            Vector3 local = transform.transformInverseDirection(direction);
+            *hint = convex.getSupportVertex(local, *hint);
+            return transform.transform(convex.getVertex(*hint));
+        }
+
+    case CollisionPrimitive::TYPE_CAPSULE:
+        {
+            const CollisionCapsule &capsule =
+                (const CollisionCapsule &)primitive;
+            Vector3 axis = primitive.getAxis(1) * capsule.halfHeight;
+            if (axis * direction < 0) axis.invert();
+            return primitive.getAxis(3) + axis;
+        }
+
+    default:
+        return primitive.getAxis(3);
+    }
+}
+
+/**
+ * Returns the margin around the core of the given primitive.
+ */
+static real coreMargin(const CollisionPrimitive &primitive)
+{
+    switch (primitive.getType())
+    {
+    case CollisionPrimitive::TYPE_SPHERE:
+        return ((const CollisionSphere &)primitive).radius;
+
+    case CollisionPrimitive::TYPE_CAPSULE:
+        return ((const CollisionCapsule &)primitive).radius;
+
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Holds a point of the Minkowski difference of two cores, with the
+ * points of each core it came from.
+ */
+struct SimplexVertex
+{
+    Vector3 point;
+    Vector3 one;
+    Vector3 two;
+};
+
+/**
+ * Holds the simplex GJK builds, with the weight of each vertex in
+ * the point of the simplex closest to the origin.
+ */
+struct Simplex
+{
+    SimplexVertex vertex[4];
+    real weight[4];
+    unsigned size;
+
+    /** Returns the point of the simplex closest to the origin. */
+    Vector3 closest() const
+    {
+        Vector3 result;
+        for (unsigned i = 0; i < size; i++)
+        {
+            result.addScaledVector(vertex[i].point, weight[i]);
+        }
+        return result;
+    }
+
+    /** Returns the matching points of each core. */
+    void witnesses(Vector3 *one, Vector3 *two) const
+    {
+        *one = Vector3();
+        *two = Vector3();
+        for (unsigned i = 0; i < size; i++)
+        {
+            one->addScaledVector(vertex[i].one, weight[i]);
+            two->addScaledVector(vertex[i].two, weight[i]);
+        }
+    }
+
+    /** Keeps only the given vertex. */
+    void keep(unsigned a)
+    {
+        vertex[0] = vertex[a];
+        weight[0] = 1;
+        size = 1;
+    }
+
+    /** Keeps only the given pair of vertices, with the given weights. */
+    void keep(unsigned a, unsigned b, real weightA, real weightB)
+    {
+        SimplexVertex second = vertex[b];
+        vertex[0] = vertex[a];
+        vertex[1] = second;
+        weight[0] = weightA;
+        weight[1] = weightB;
+        size = 2;
+    }
+};
+
+/**
+ * Reduces a simplex of two vertices to the part closest to the
+ * origin.
+ */
+static void solveSegment(Simplex *simplex)
+{
+    const Vector3 &a = simplex->vertex[0].point;
+    Vector3 ab = simplex->vertex[1].point - a;
+    real t = -(a * ab);
+    if (t <= 0) { simplex->keep(0); return; }
+
+    real length = ab * ab;
+    if (t >= length) { simplex->keep(1); return; }
+
+    t /= length;
+    simplex->keep(0, 1, 1 - t, t);
+}
+
+/**
+ * Reduces a simplex of three vertices to the part closest to the
+ * origin, checking the regions of the triangle's vertices and edges
+ * in turn.
+ */
+static void solveTriangle(Simplex *simplex)
+{
+    const Vector3 &a = simplex->vertex[0].point;
+    const Vector3 &b = simplex->vertex[1].point;
+    const Vector3 &c = simplex->vertex[2].point;
+    Vector3 ab = b - a;
+    Vector3 ac = c - a;
+
+    real d1 = -(ab * a);
+    real d2 = -(ac * a);
+    if (d1 <= 0 && d2 <= 0) { simplex->keep(0); return; }
+
+    real d3 = -(ab * b);
+    real d4 = -(ac * b);
+    if (d3 >= 0 && d4 <= d3) { simplex->keep(1); return; }
+
+    real vc = d1*d4 - d3*d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0)
+    {
+        real t = d1 / (d1 - d3);
+        simplex->keep(0, 1, 1 - t, t);
+        return;
+    }
+
+    real d5 = -(ab * c);
+    real d6 = -(ac * c);
+    if (d6 >= 0 && d5 <= d6) { simplex->keep(2); return; }
+
+    real vb = d5*d2 - d1*d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0)
+    {
+        real t = d2 / (d2 - d6);
+        simplex->keep(0, 2, 1 - t, t);
+        return;
+    }
+
+    real va = d3*d6 - d5*d4;
+    if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0)
+    {
+        real t = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+        simplex->keep(1, 2, 1 - t, t);
+        return;
+    }
+
+    real scale = ((real)1.0) / (va + vb + vc);
+    simplex->weight[1] = vb * scale;
+    simplex->weight[2] = vc * scale;
+    simplex->weight[0] = 1 - simplex->weight[1] - simplex->weight[2];
+    simplex->size = 3;
+}
+
+/**
+ * Reduces a simplex of four vertices to the face closest to the
+ * origin, or leaves it whole if the origin is inside it.
+ */
+static void solveTetrahedron(Simplex *simplex)
+{
+    // Each face, and the vertex opposite it.
+    const static unsigned faces[4][4] = {
+        {0,1,2,3}, {0,2,3,1}, {0,3,1,2}, {1,3,2,0}
+    };
+
+    Simplex best;
+    real bestDistance = REAL_MAX;
+    bool inside = true;
+    for (unsigned f = 0; f < 4; f++)
+    {
+        const Vector3 &a = simplex->vertex[faces[f][0]].point;
+        const Vector3 &b = simplex->vertex[faces[f][1]].point;
+        const Vector3 &c = simplex->vertex[faces[f][2]].point;
+        const Vector3 &d = simplex->vertex[faces[f][3]].point;
+        Vector3 normal = (b - a) % (c - a);
+
+        // The origin is outside a face if it is on the other side
+        // from the opposite vertex. A flat simplex has no inside.
+        real originSide = -(normal * a);
+        real vertexSide = normal * (d - a);
+        if (vertexSide != 0 && originSide * vertexSide >= 0) continue;
+        inside = false;
+
+        Simplex face;
+        face.vertex[0] = simplex->vertex[faces[f][0]];
+        face.vertex[1] = simplex->vertex[faces[f][1]];
+        face.vertex[2] = simplex->vertex[faces[f][2]];
+        face.size = 3;
+        solveTriangle(&face);
+
+        real distance = face.closest().squareMagnitude();
+        if (distance < bestDistance)
+        {
+            bestDistance = distance;
+            best = face;
+        }
+    }
+
+    if (!inside) *simplex = best;
+}
+
+/**
+ * The most iterations GJK will take. Shapes with curved cores
+ * could otherwise creep towards the answer for ever.
+ */
+const static unsigned gjkIterations = 64;
+
+/**
+ * Cores whose squared distance is less than this are treated as
+ * touching.
+ */
+const static real gjkTouching = (real)1e-12;
+
+/**
+ * Runs GJK on the cores of two primitives, leaving the simplex of
+ * their Minkowski difference (the first core less the second) that
+ * is closest to the origin. Returns true if the cores overlap.
+ */
+static bool runGJK(const CollisionPrimitive &one,
+                   const CollisionPrimitive &two,
+                   Simplex *simplex)
+{
+    unsigned hintOne = 0, hintTwo = 0;
+    Vector3 closest = one.getAxis(3) - two.getAxis(3);
+    if (closest.squareMagnitude() < gjkTouching) closest = Vector3(1, 0, 0);
+    simplex->size = 0;
+
+    for (unsigned iteration = 0; iteration < gjkIterations; iteration++)
+    {
+        // Find the point of the difference furthest towards the
+        // origin from the current closest point.
+        SimplexVertex vertex;
+        vertex.one = coreSupport(one, closest * -1, &hintOne);
+        vertex.two = coreSupport(two, closest, &hintTwo);
+        vertex.point = vertex.one - vertex.two;
+
+        // Stop once the new point gets no closer than the old.
+        real distance = closest.squareMagnitude();
+        if (simplex->size > 0 &&
+            distance - closest * vertex.point <= distance * ((real)1e-10))
+        {
+            return false;
+        }
+
+        Simplex previous = *simplex;
+        simplex->vertex[simplex->size] = vertex;
+        simplex->weight[simplex->size] = 0;
+        simplex->size++;
+        switch (simplex->size)
+        {
+        case 1: simplex->weight[0] = 1; break;
+        case 2: solveSegment(simplex); break;
+        case 3: solveTriangle(simplex); break;
+        default: solveTetrahedron(simplex); break;
+        }
+        // Every point of the difference is at least as far along the
+        // closest direction as the new point, so if that is past the
+        // origin the cores are apart. Checked here, a tetrahedron made
+        // flat by rounding can't pass for one holding the origin.
+        if (simplex->size == 4)
+        {
+            if (closest * vertex.point > 0)
+            {
+                *simplex = previous;
+                return false;
+            }
+            return true;
+        }
+
+        Vector3 next = simplex->closest();
+        real nextDistance = next.squareMagnitude();
+        if (nextDistance < gjkTouching) return true;
+        // A step that gets no closer is undone, so that the simplex
+        // left behind gives the closest points found.
+        if (iteration > 0 && nextDistance >= distance)
+        {
+            *simplex = previous;
+            return false;
+        }
+        closest = next;
+    }
+    return false;
+}
+
+/** The most points the expanding polytope can hold. */
+const static unsigned epaPoints = 64;
+
+/** The most faces the expanding polytope can hold. */
+const static unsigned epaFaces = 128;
+
+/**
+ * The expanding polytope stops once a new point would move its
+ * closest face out by less than this.
+ */
+const static real epaTolerance = (real)1e-6;
+
+/**
+ * Holds a face of the expanding polytope.
+ */
+struct PolytopeFace
+{
+    unsigned vertex[3];
+    Vector3 normal;
+    real distance;
+};
+
+/**
+ * Fills in the plane of a face of the expanding polytope, returning
+ * false if the face has no area.
+ */
+static bool setPolytopeFace(PolytopeFace *face,
+                            const SimplexVertex *points,
+                            unsigned a, unsigned b, unsigned c)
+{
+    face->vertex[0] = a;
+    face->vertex[1] = b;
+    face->vertex[2] = c;
+    face->normal = (points[b].point - points[a].point) %
+        (points[c].point - points[a].point);
+    real length = face->normal.magnitude();
+    if (length <= 0) return false;
+    face->normal *= ((real)1.0) / length;
+    face->distance = face->normal * points[a].point;
+    return true;
+}
+
+/**
+ * Finds the support point of the Minkowski difference of two cores
+ * in the given direction.
+ */
+static SimplexVertex differenceSupport(const CollisionPrimitive &one,
+                                       const CollisionPrimitive &two,
+                                       const Vector3 &direction)
+{
+    unsigned hint = 0;
+    SimplexVertex result;
+    result.one = coreSupport(one, direction, &hint);
+    hint = 0;
+    result.two = coreSupport(two, direction * -1, &hint);
+    result.point = result.one - result.two;
+    return result;
+}
+
+/**
+ * Grows the simplex from GJK into a tetrahedron, by adding the
+ * support points in directions away from it. Returns false if the
+ * Minkowski difference is too flat to hold one.
+ */
+static bool fillSimplex(const CollisionPrimitive &one,
+                        const CollisionPrimitive &two,
+                        Simplex *simplex)
+{
+    const static real minimumGain = (real)1e-9;
+
+    if (simplex->size == 1)
+    {
+        for (unsigned i = 0; i < 6 && simplex->size == 1; i++)
+        {
+            Vector3 direction;
+            direction[i / 2] = (i % 2) ? -1 : 1;
+            SimplexVertex vertex = differenceSupport(one, two, direction);
+            if ((vertex.point - simplex->vertex[0].point).squareMagnitude()
+                > minimumGain)
+            {
+                simplex->vertex[simplex->size++] = vertex;
+            }
+        }
+        if (simplex->size == 1) return false;
+    }
+
+    if (simplex->size == 2)
+    {
+        // Try directions at right angles to the segment.
+        Vector3 line = simplex->vertex[1].point - simplex->vertex[0].point;
+        unsigned least = 0;
+        if (real_abs(line.y) < real_abs(line[least])) least = 1;
+        if (real_abs(line.z) < real_abs(line[least])) least = 2;
+        Vector3 axis;
+        axis[least] = 1;
+        Vector3 across = line % axis;
+        Vector3 directions[4] = {across, across * -1, line % across, across % line};
+        for (unsigned i = 0; i < 4 && simplex->size == 2; i++)
+        {
+            SimplexVertex vertex = differenceSupport(one, two, directions[i]);
+            Vector3 offset = vertex.point - simplex->vertex[0].point;
+            if ((offset % line).squareMagnitude() >
+                minimumGain * line.squareMagnitude())
+            {
+                simplex->vertex[simplex->size++] = vertex;
+            }
+        }
+        if (simplex->size == 2) return false;
+    }
+
+    if (simplex->size == 3)
+    {
+        const Vector3 &a = simplex->vertex[0].point;
+        Vector3 normal = (simplex->vertex[1].point - a) %
+            (simplex->vertex[2].point - a);
+        normal.normalise();
+        SimplexVertex vertex = differenceSupport(one, two, normal);
+        if (real_abs(normal * (vertex.point - a)) <= epaTolerance)
+        {
+            vertex = differenceSupport(one, two, normal * -1);
+            if (real_abs(normal * (vertex.point - a)) <= epaTolerance)
+            {
+                return false;
+            }
+        }
+        simplex->vertex[simplex->size++] = vertex;
+    }
+    return true;
+}
+
+/**
+ * Runs the expanding polytope algorithm from a simplex that holds
+ * the origin, to find the shortest way out of the Minkowski
+ * difference of two overlapping cores. Writes the direction (from
+ * the first core towards the second), the depth and the matching
+ * points of each core. Returns false if the cores are too flat to
+ * separate this way.
+ */
+static bool runEPA(const CollisionPrimitive &one,
+                   const CollisionPrimitive &two,
+                   Simplex simplex,
+                   Vector3 *normal,
+                   real *depth,
+                   Vector3 *pointOne,
+                   Vector3 *pointTwo)
+{
+    if (!fillSimplex(one, two, &simplex)) return false;
+
+    SimplexVertex points[epaPoints];
+    PolytopeFace faces[epaFaces];
+    unsigned edges[epaFaces * 3 * 2];
+    unsigned pointCount = 4, faceCount = 0;
+    for (unsigned i = 0; i < 4; i++) points[i] = simplex.vertex[i];
+
+    // Wind each face of the tetrahedron to face away from the vertex
+    // opposite it.
+    const static unsigned tetrahedron[4][4] = {
+        {0,1,2,3}, {0,3,1,2}, {0,2,3,1}, {1,3,2,0}
+    };
+    for (unsigned f = 0; f < 4; f++)
+    {
+        unsigned a = tetrahedron[f][0];
+        unsigned b = tetrahedron[f][1];
+        unsigned c = tetrahedron[f][2];
+        const Vector3 &opposite = points[tetrahedron[f][3]].point;
+        Vector3 side = (points[b].point - points[a].point) %
+            (points[c].point - points[a].point);
+        if (side * (opposite - points[a].point) > 0)
+        {
+            unsigned swap = b; b = c; c = swap;
+        }
+        if (!setPolytopeFace(&faces[faceCount++], points, a, b, c)) return false;
+    }
+
+    unsigned closest = 0;
+    for (;;)
+    {
+        closest = 0;
+        for (unsigned f = 1; f < faceCount; f++)
+        {
+            if (faces[f].distance < faces[closest].distance) closest = f;
+        }
+
+        // Stop if the closest face is on the surface, or there is no
+        // room to grow.
+        const PolytopeFace &face = faces[closest];
+        SimplexVertex vertex = differenceSupport(one, two, face.normal);
+        if (vertex.point * face.normal - face.distance <= epaTolerance ||
+            pointCount == epaPoints)
+        {
+            break;
+        }
+
+        // Remove the faces that can see the new point, keeping the
+        // edges around the hole they leave.
+        unsigned edgeCount = 0;
+        unsigned f = 0;
+        while (f < faceCount)
+        {
+            PolytopeFace &current = faces[f];
+            if (current.normal *
+                (vertex.point - points[current.vertex[0]].point) <= 0)
+            {
+                f++;
+                continue;
+            }
+
+            for (unsigned k = 0; k < 3; k++)
+            {
+                unsigned from = current.vertex[k];
+                unsigned to = current.vertex[(k+1) % 3];
+                unsigned e = 0;
+                while (e < edgeCount &&
+                       !(edges[e*2] == to && edges[e*2+1] == from)) e++;
+                if (e < edgeCount)
+                {
+                    edgeCount--;
+                    edges[e*2] = edges[edgeCount*2];
+                    edges[e*2+1] = edges[edgeCount*2+1];
+                }
+                else
+                {
+                    edges[edgeCount*2] = from;
+                    edges[edgeCount*2+1] = to;
+                    edgeCount++;
+                }
+            }
+            faces[f] = faces[--faceCount];
+        }
+
+        if (faceCount + edgeCount > epaFaces) return false;
+        points[pointCount] = vertex;
+        for (unsigned e = 0; e < edgeCount; e++)
+        {
+            if (!setPolytopeFace(&faces[faceCount++], points,
+                                 edges[e*2], edges[e*2+1], pointCount))
+            {
+                return false;
+            }
+        }
+        pointCount++;
+    }
+
+    // Find where the origin projects onto the closest face, and the
+    // matching points of each core.
+    const PolytopeFace &face = faces[closest];
+    const SimplexVertex &a = points[face.vertex[0]];
+    const SimplexVertex &b = points[face.vertex[1]];
+    const SimplexVertex &c = points[face.vertex[2]];
+    Vector3 projection = face.normal * face.distance;
+    Vector3 ab = b.point - a.point;
+    Vector3 ac = c.point - a.point;
+    Vector3 ap = projection - a.point;
+    real abab = ab * ab, abac = ab * ac, acac = ac * ac;
+    real apab = ap * ab, apac = ap * ac;
+    real denominator = abab * acac - abac * abac;
+    real v = 0, w = 0;
+    if (denominator > 0)
+    {
+        v = (acac * apab - abac * apac) / denominator;
+        w = (abab * apac - abac * apab) / denominator;
+    }
+    real u = 1 - v - w;
+
+    *normal = face.normal;
+    *depth = face.distance;
+    *pointOne = a.one * u + b.one * v + c.one * w;
+    *pointTwo = a.two * u + b.two * v + c.two * w;
+    return true;
+}
+
+real ConvexTests::distance(const CollisionPrimitive &one,
+                           const CollisionPrimitive &two,
+                           Vector3 *pointOne,
+                           Vector3 *pointTwo)
+{
+    Simplex simplex;
+    if (runGJK(one, two, &simplex)) return 0;
+
+    Vector3 closest = simplex.closest();
+    real separation = closest.magnitude();
+    real result = separation - coreMargin(one) - coreMargin(two);
+    if (result <= 0) return 0;
+
+    Vector3 coreOne, coreTwo;
+    simplex.witnesses(&coreOne, &coreTwo);
+    Vector3 direction = closest * (((real)-1.0) / separation);
+    if (pointOne) *pointOne = coreOne + direction * coreMargin(one);
+    if (pointTwo) *pointTwo = coreTwo - direction * coreMargin(two);
+    return result;
+}
+
+bool ConvexTests::intersect(const CollisionPrimitive &one,
+                            const CollisionPrimitive &two)
+{
+    return distance(one, two) <= 0;
+}
+
+bool ConvexTests::penetration(const CollisionPrimitive &one,
+                              const CollisionPrimitive &two,
+                              real tolerance,
+                              Vector3 *normal,
+                              real *depth,
+                              Vector3 *pointOne,
+                              Vector3 *pointTwo)
+{
+    real marginOne = coreMargin(one);
+    real marginTwo = coreMargin(two);
+
+    Simplex simplex;
+    Vector3 coreOne, coreTwo;
+    if (!runGJK(one, two, &simplex))
+    {
+        // The cores are apart, so only the margins can touch.
+        Vector3 closest = simplex.closest();
+        real separation = closest.magnitude();
+        if (separation - marginOne - marginTwo > tolerance) return false;
+
+        simplex.witnesses(&coreOne, &coreTwo);
+        *normal = closest * (((real)-1.0) / separation);
+        *depth = marginOne + marginTwo - separation;
+    }
+    else if (runEPA(one, two, simplex, normal, depth, &coreOne, &coreTwo))
+    {
+        *depth += marginOne + marginTwo;
+    }
+    else
+    {
+        // The cores are too flat to separate, such as two spheres
+        // with the same centre. Push them apart along the line
+        // between the primitives, or upwards if there is none.
+        simplex.witnesses(&coreOne, &coreTwo);
+        *normal = two.getAxis(3) - one.getAxis(3);
+        if (normal->squareMagnitude() < gjkTouching) *normal = Vector3(0, 1, 0);
+        normal->normalise();
+        *depth = marginOne + marginTwo;
+    }
+
+    *pointOne = coreOne + *normal * marginOne;
+    *pointTwo = coreTwo - *normal * marginTwo;
+    return true;
+}
+
+/**
+ * The most vertices of a face used to build a manifold. Larger faces
+ * use only their first few vertices, which still outline part of the
+ * face.
+ */
+const static unsigned manifoldFaceVertices = 32;
+
+/**
+ * The room needed to clip a face to another: each plane a polygon
+ * is clipped by can add at most one vertex to it.
+ */
+const static unsigned manifoldPoints = manifoldFaceVertices * 2 + 2;
+
+/**
+ * A face is only used to build a manifold if its normal is within
+ * this cosine of the direction the shapes are pushed apart in.
+ */
+const static real faceAlignment = (real)0.95;
+
+/**
+ * The face of the first shape is used as the reference face unless
+ * the second is better aligned by more than this, so the contacts
+ * do not swap between the faces from one frame to the next.
+ */
+const static real referenceBias = (real)0.001;
+
+/**
+ * Writes the vertices of the face of a box or hull whose normal is
+ * closest to the given direction, in world coordinates and
+ * anticlockwise when seen from outside. Returns the number of
+ * vertices, and writes the face's normal and a number identifying it.
+ */
+static unsigned findFace(const CollisionPrimitive &primitive,
+                         const Vector3 &direction,
+                         Vector3 *polygon,
+                         Vector3 *normal,
+                         unsigned *face)
+{
+    const Matrix4 &transform = primitive.getTransform();
+    Vector3 local = transform.transformInverseDirection(direction);
+
+    if (primitive.getType() == CollisionPrimitive::TYPE_BOX)
+    {
+        const CollisionBox &box = (const CollisionBox &)primitive;
+        unsigned axis = 0;
+        if (real_abs(local.y) > real_abs(local[axis])) axis = 1;
+        if (real_abs(local.z) > real_abs(local[axis])) axis = 2;
+        bool positive = local[axis] >= 0;
+        unsigned j = (axis + 1) % 3;
+        unsigned k = (axis + 2) % 3;
+
+        // The corners go anticlockwise around the positive axis, so
+        // the other face takes them in reverse.
+        const static real corners[4][2] = {{1,1},{-1,1},{-1,-1},{1,-1}};
+        for (unsigned i = 0; i < 4; i++)
+        {
+            unsigned c = positive ? i : 3 - i;
+            Vector3 corner;
+            corner[axis] = positive ? box.halfSize[axis] : -box.halfSize[axis];
+            corner[j] = corners[c][0] * box.halfSize[j];
+            corner[k] = corners[c][1] * box.halfSize[k];
+            polygon[i] = transform.transform(corner);
+        }
+
+        Vector3 localNormal;
+        localNormal[axis] = positive ? 1 : -1;
+        *normal = transform.transformDirection(localNormal);
+        *face = axis * 2 + (positive ? 0 : 1);
+        return 4;
+    }
+
+    const CollisionConvex &convex = (const CollisionConvex &)primitive;
+    *face = convex.getSupportFace(local);
+    *normal = transform.transformDirection(convex.getFaceNormal(*face));
+    unsigned count = convex.getFaceVertexCount(*face);
+    if (count > manifoldFaceVertices) count = manifoldFaceVertices;
+    for (unsigned i = 0; i < count; i++)
+    {
+        polygon[i] = transform.transform(
+            convex.getVertex(convex.getFaceVertex(*face, i)));
+    }
+    return count;
+}
+
+unsigned CollisionDetector::clipPolygon(const Vector3 *input,
+                                       unsigned count,
+                                       const Vector3 &normal,
+                                       real offset,
+                                       Vector3 *output)
+{
+    unsigned result = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        const Vector3 &from = input[i];
+        const Vector3 &to = input[(i+1) % count];
+        real fromDistance = normal * from - offset;
+        real toDistance = normal * to - offset;
+
+        if (fromDistance <= 0) output[result++] = from;
+        if ((fromDistance < 0 && toDistance > 0) ||
+            (fromDistance > 0 && toDistance < 0))
+        {
+            real t = fromDistance / (fromDistance - toDistance);
+            output[result++] = from + (to - from) * t;
+        }
+    }
+    return result;
+}
+
+unsigned CollisionDetector::selectContacts(const Vector3 *points,
+                                          const real *depths,
+                                          unsigned count,
+                                          const Vector3 &normal,
+                                          unsigned *selected)
+{
+    if (count <= 4)
+    {
+        for (unsigned i = 0; i < count; i++) selected[i] = i;
+        return count;
+    }
+
+    unsigned deepest = 0;
+    for (unsigned i = 1; i < count; i++)
+    {
+        if (depths[i] > depths[deepest]) deepest = i;
+    }
+
+    unsigned furthest = deepest;
+    real furthestDistance = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        real distance = (points[i] - points[deepest]).squareMagnitude();
+        if (distance > furthestDistance)
+        {
+            furthestDistance = distance;
+            furthest = i;
+        }
+    }
+
+    unsigned left = deepest, right = deepest;
+    real leftArea = 0, rightArea = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        real area = ((points[deepest] - points[i]) %
+                     (points[furthest] - points[i])) * normal;
+        if (area > leftArea) { leftArea = area; left = i; }
+        if (area < rightArea) { rightArea = area; right = i; }
+    }
+
+    unsigned result = 0;
+    selected[result++] = deepest;
+    if (furthest != deepest) selected[result++] = furthest;
+    if (left != deepest) selected[result++] = left;
+    if (right != deepest) selected[result++] = right;
+    return result;
+}
+
+/**
+ * Writes a single contact between two primitives, with the normal
+ * pointing from the first towards the second.
+ */
+static unsigned singleContact(const CollisionPrimitive &one,
+                              const CollisionPrimitive &two,
+                              const Vector3 &normal,
+                              real depth,
+                              const Vector3 &point,
+                              CollisionData *data)
+{
+    Contact *contact = data->contacts;
+    contact->contactNormal = normal * -1;
+    contact->contactPoint = point;
+    contact->penetration = depth;
+    contact->setBodyData(one.body, two.body,
+        data->friction, data->restitution);
+    data->addContacts(1);
+    return 1;
+}
+
+/**
+ * Writes the contacts between two boxes or hulls. Where a face of
+ * one rests on the other, the face of the other nearest to facing it
+ * is clipped to its sides, and the clipped points below it become the
+ * contacts. Otherwise the shapes touch at a point or along crossing
+ * edges, and make a single contact.
+ */
+static unsigned polytopeContacts(const CollisionPrimitive &one,
+                                 const CollisionPrimitive &two,
+                                 CollisionData *data)
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 normal, pointOne, pointTwo;
+    real depth;
+    if (!ConvexTests::penetration(one, two, data->tolerance,
+                                  &normal, &depth, &pointOne, &pointTwo))
+    {
+        return 0;
+    }
+    Vector3 middle = (pointOne + pointTwo) * ((real)0.5);
+
+    // Find the face of each shape that faces the other.
+    Vector3 faceOne[manifoldFaceVertices], faceTwo[manifoldFaceVertices];
+    Vector3 normalOne, normalTwo;
+    unsigned indexOne, indexTwo;
+    unsigned countOne = findFace(one, normal, faceOne, &normalOne, &indexOne);
+    unsigned countTwo = findFace(two, normal * -1, faceTwo, &normalTwo, &indexTwo);
+    real alignOne = normalOne * normal;
+    real alignTwo = -(normalTwo * normal);
+    if (alignOne < faceAlignment && alignTwo < faceAlignment)
+    {
+        return singleContact(one, two, normal, depth, middle, data);
+    }
+
+    // The better aligned face is the reference, and the face of the
+    // other shape most nearly opposite it is clipped to it.
+    bool flip = alignTwo > alignOne + referenceBias;
+    const Vector3 *reference = flip ? faceTwo : faceOne;
+    unsigned referenceCount = flip ? countTwo : countOne;
+    Vector3 referenceNormal = flip ? normalTwo : normalOne;
+    unsigned referenceFace = flip ? indexTwo : indexOne;
+    real referenceOffset = referenceNormal * reference[0];
+
+    Vector3 clipped[2][manifoldPoints];
+    Vector3 incidentNormal;
+    unsigned incidentFace;
+    unsigned count = findFace(flip ? one : two, referenceNormal * -1,
+                              clipped[0], &incidentNormal, &incidentFace);
+
+    // Clip to the plane through each edge of the reference face.
+    unsigned current = 0;
+    for (unsigned i = 0; i < referenceCount && count > 0; i++)
+    {
+        const Vector3 &from = reference[i];
+        const Vector3 &to = reference[(i+1) % referenceCount];
+        Vector3 side = (to - from) % referenceNormal;
+        count = CollisionDetector::clipPolygon(
+            clipped[current], count, side, side * from, clipped[1-current]);
+        current = 1 - current;
+    }
+
+    // Keep the points that are below the reference face.
+    Vector3 points[manifoldPoints];
+    real depths[manifoldPoints];
+    unsigned kept = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        real pointDepth = referenceOffset - referenceNormal * clipped[current][i];
+        if (pointDepth < -data->tolerance) continue;
+        points[kept] = clipped[current][i];
+        depths[kept] = pointDepth;
+        kept++;
+    }
+    if (kept == 0)
+    {
+        return singleContact(one, two, normal, depth, middle, data);
+    }
+
+    unsigned selected[4];
+    unsigned selectedCount = CollisionDetector::selectContacts(
+        points, depths, kept, referenceNormal, selected);
+
+    // The normal points towards the first shape.
+    Vector3 contactNormal = flip ? referenceNormal : referenceNormal * -1;
+    Contact *contact = data->contacts;
+    unsigned written = 0;
+    for (unsigned i = 0; i < selectedCount; i++)
+    {
+        if (written == (unsigned)data->contactsLeft) break;
+        contact->contactNormal = contactNormal;
+        contact->contactPoint = points[selected[i]];
+        contact->penetration = depths[selected[i]];
+        contact->setBodyData(one.body, two.body,
+            data->friction, data->restitution);
+        contact->feature = (referenceFace << 3) | (flip ? 4 : 0) | i;
+        contact++;
+        written++;
+    }
+    data->addContacts(written);
+    return written;
+}
+
+unsigned CollisionDetector::convexAndHalfSpace(
+    const CollisionConvex &convex,
+    const CollisionPlane &plane,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    // Check the lowest vertex first, to skip hulls above the plane.
+    const Matrix4 &transform = convex.getTransform();
+    unsigned lowest = convex.getSupportVertex(
+        transform.transformInverseDirection(plane.direction * -1));
+    if (transform.transform(convex.getVertex(lowest)) * plane.direction >
+        plane.offset)
+    {
+        return 0;
+    }
+
+    // Gather the vertices below the plane.
+    Vector3 points[manifoldPoints];
+    real depths[manifoldPoints];
+    unsigned features[manifoldPoints];
+    unsigned count = 0;
+    for (unsigned i = 0; i < convex.getVertexCount() &&
+             count < manifoldPoints; i++)
+    {
+        Vector3 vertex = transform.transform(convex.getVertex(i));
+        real vertexDistance = vertex * plane.direction;
+        if (vertexDistance > plane.offset) continue;
+
+        points[count] = vertex;
+        depths[count] = plane.offset - vertexDistance;
+        features[count] = i;
+        count++;
+    }
+
+    unsigned selected[4];
+    unsigned selectedCount = CollisionDetector::selectContacts(
+        points, depths, count, plane.direction, selected);
+
+    Contact *contact = data->contacts;
+    unsigned written = 0;
+    for (unsigned i = 0; i < selectedCount; i++)
+    {
+        if (written == (unsigned)data->contactsLeft) break;
+        contact->contactNormal = plane.direction;
+        contact->contactPoint = points[selected[i]];
+        contact->penetration = depths[selected[i]];
+        contact->setBodyData(convex.body, NULL,
+            data->friction, data->restitution);
+        contact->feature = features[selected[i]];
+        contact++;
+        written++;
+    }
+    data->addContacts(written);
+    return written;
+}
+
+unsigned CollisionDetector::convexAndSphere(
+    const CollisionConvex &convex,
+    const CollisionSphere &sphere,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 normal, pointConvex, pointSphere;
+    real depth;
+    if (!ConvexTests::penetration(convex, sphere, data->tolerance,
+                                  &normal, &depth, &pointConvex, &pointSphere))
+    {
+        return 0;
+    }
+    return singleContact(convex, sphere, normal, depth, pointConvex, data);
+}
+
+unsigned CollisionDetector::convexAndBox(
+    const CollisionConvex &convex,
+    const CollisionBox &box,
+    CollisionData *data
+    )
+{
+    return polytopeContacts(convex, box, data);
+}
+
+unsigned CollisionDetector::convexAndConvex(
+    const CollisionConvex &one,
+    const CollisionConvex &two,
+    CollisionData *data
+    )
+{
+    return polytopeContacts(one, two, data);
+}
+
+unsigned CollisionDetector::convexAndCapsule(
+    const CollisionConvex &convex,
+    const CollisionCapsule &capsule,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    Vector3 normal, pointConvex, pointCapsule;
+    real depth;
+    if (!ConvexTests::penetration(convex, capsule, data->tolerance,
+                                  &normal, &depth, &pointConvex, &pointCapsule))
+    {
+        return 0;
+    }
+    return singleContact(convex, capsule, normal, depth, pointConvex, data);
+}
+
+bool IntersectionTests::rayAndConvex(
+    const Ray &ray,
+    real radius,
+    const CollisionConvex &convex,
+    RayHit *hit,
+    real tolerance)
+{
+    const Matrix4 &transform = convex.getTransform();
+
+    if (radius > 0)
+    {
+        // Step a sphere along the ray by its distance from the hull,
+        // which can never step past the first touch.
+        CollisionSphere sphere;
+        sphere.radius = radius;
+        const static unsigned maxSteps = 32;
+        real travelled = 0;
+        for (unsigned step = 0; step < maxSteps; step++)
+        {
+            Vector3 centre = ray.origin;
+            centre.addScaledVector(ray.direction, travelled);
+            sphere.offset.setOrientationAndPos(Quaternion(), centre);
+            sphere.calculateInternals();
+
+            // A sphere that starts overlapping the hull is inside it.
+            Vector3 pointConvex;
+            real distance = ConvexTests::distance(convex, sphere, &pointConvex);
+            if (distance <= 0)
+            {
+                hit->primitive = &convex;
+                hit->point = centre;
+                hit->normal = ray.direction * -1;
+                hit->distance = travelled;
+                return true;
+            }
+
+            Vector3 normal = centre - pointConvex;
+            normal.normalise();
+            if (distance <= radius * tolerance)
+            {
+                hit->primitive = &convex;
+                hit->point = pointConvex;
+                hit->normal = normal;
+                hit->distance = travelled;
+                return true;
+            }
+
+            // Once the sphere stops getting closer it never will.
+            real closing = -(normal * ray.direction);
+            if (closing <= 0) return false;
+
+            travelled += distance / closing;
+            if (travelled > ray.maxDistance) return false;
+        }
+
+        // The steps only stay short for paths that just graze the
+        // hull.
+        return false;
+    }
+
+    // Clip the ray against the plane of each face, remembering the
+    // face it last entered through.
+    Vector3 origin = transform.transformInverse(ray.origin);
+    Vector3 direction = transform.transformInverseDirection(ray.direction);
+    real entry = 0;
+    real leave = ray.maxDistance;
+    int entryFace = -1;
+    for (unsigned f = 0; f < convex.getFaceCount(); f++)
+    {
+        const Vector3 &normal = convex.getFaceNormal(f);
+        real inside = convex.getFaceOffset(f) - normal * origin;
+        real approach = normal * direction;
+
+        // A ray parallel to the face is either always behind it or
+        // never.
+        if (approach == 0)
+        {
+            if (inside < 0) return false;
+            continue;
+        }
+
+        real t = inside / approach;
+        if (approach < 0)
+        {
+            if (t > entry)
+            {
+                entry = t;
+                entryFace = f;
+            }
+        }
+        else if (t < leave)
+        {
+            leave = t;
+        }
+        if (entry > leave) return false;
+    }
+
+    hit->primitive = &convex;
+    if (entryFace < 0)
+    {
+        hit->point = ray.origin;
+        hit->normal = ray.direction * -1;
+        hit->distance = 0;
+        return true;
+    }
+
+    hit->point = ray.origin;
+    hit->point.addScaledVector(ray.direction, entry);
+    hit->normal = transform.transformDirection(convex.getFaceNormal(entryFace));
+    hit->distance = entry;
+    return true;
+}
@@ -193,13 +193,14 @@ RigidBodyApplication::RigidBodyApplication()
 :
     theta(0.0f),
     phi(15.0f),
-    resolver(maxContacts*8),
+    contacts(initialContacts),
+    resolver(initialContacts*4),
 
     renderDebugInfo(false),
     pauseSimulation(true),
     autoPauseSimulation(false)
 {
-    cData.contactArray = contacts;
+    cData.setBuffer(&contacts);
 }
 
 void RigidBodyApplication::update()
@@ -227,6 +228,10 @@ void RigidBodyApplication::update()
     // Perform the contact generation
     generateContacts();
 
+    // The buffer grows to fit every contact, so the resolver is given
+    // enough iterations for however many were found.
+    if (cData.contactCount > 0) resolver.setIterations(cData.contactCount * 4);
+
     // Resolve detected contacts
     resolver.resolveContacts(
         cData.contactArray,
@@ -260,16 +265,17 @@ void RigidBodyApplication::drawDebug()
     for (unsigned i = 0; i < cData.contactCount; i++)
     {
         // Interbody contacts are in green, floor contacts are red.
-        if (contacts[i].body[1]) {
+        const cyclone::Contact &contact = cData.contactArray[i];
+        if (contact.body[1]) {
             glColor3f(0,1,0);
         } else {
             glColor3f(1,0,0);
         }
 
-        cyclone::Vector3 vec = contacts[i].contactPoint;
+        cyclone::Vector3 vec = contact.contactPoint;
         glVertex3f(vec.x, vec.y, vec.z);
 
-        vec += contacts[i].contactNormal;
+        vec += contact.contactNormal;
         glVertex3f(vec.x, vec.y, vec.z);
     }
 
@@ -186,11 +186,14 @@ public:
  class RigidBodyApplication : public Application
  {
  protected:
-    /** Holds the maximum number of contacts. */
-    const static unsigned maxContacts = 256;
+    /**
+     * Holds the number of contacts there is room for to start with.
+     * The buffer grows if a frame needs more.
+     */
+    const static unsigned initialContacts = 256;
 
-    /** Holds the array of contacts. */
-    cyclone::Contact contacts[maxContacts];
+    /** Holds the buffer of contacts. */
+    cyclone::ContactBuffer<cyclone::Contact> contacts;
 
     /** Holds the collision data structure for collision detection. */
     cyclone::CollisionData cData;
@@ -11,6 +11,7 @@
  */
 
 #include <cyclone/cyclone.h>
+#include <cyclone/world.h>
 #include "../ogl_headers.h"
 #include "../app.h"
 #include "../timing.h"
@@ -32,9 +33,17 @@ public:
     ShotType type;
     unsigned startTime;
 
+    /** Holds the handle of the round's body while it is in flight. */
+    cyclone::World::Handle handle;
+
     AmmoRound()
     {
         body = new cyclone::RigidBody;
+
+        // Rounds pass through each other, and are in a category of
+        // their own so the ground doesn't stop them.
+        group = -1;
+        category = 2;
     }
 
     ~AmmoRound()
@@ -99,6 +108,7 @@ public:
         }
 
         body->setCanSleep(false);
+        body->setBullet();
         body->setAwake();
 
         cyclone::Matrix3 tensor;
@@ -195,18 +205,33 @@ class BigBallisticDemo : public RigidBodyApplication
     /** Holds the box data. */
     Box boxData[boxes];
 
+    /** Holds the world that simulates the boxes and rounds. */
+    cyclone::World world;
+
+    /** Holds the ground, which only the boxes collide with. */
+    cyclone::CollisionPlane ground;
+
     /** Holds the current shot type. */
     ShotType currentShotType;
 
     /** Resets the position of all the boxes and primes the explosion. */
     virtual void reset();
 
-    /** Build the contacts for the current situation. */
+    /**
+     * Leaves the contact buffer empty, since the world finds and
+     * resolves its own contacts.
+     */
     virtual void generateContacts();
 
     /** Processes the objects in the simulation forward in time. */
     virtual void updateObjects(cyclone::real duration);
 
+    /** Returns true if the world found a contact on the given round. */
+    bool hasContact(const AmmoRound *shot) const;
+
+    /** Takes a round out of the world so it can be fired again. */
+    void removeShot(AmmoRound *shot);
+
     /** Dispatches a round. */
     void fire();
 
@@ -234,9 +259,24 @@ public:
 BigBallisticDemo::BigBallisticDemo()
 :
 RigidBodyApplication(),
+world(initialContacts),
 currentShotType(LASER)
 {
     pauseSimulation = false;
+
+    ground.direction = cyclone::Vector3(0,1,0);
+    ground.offset = 0;
+    ground.mask = 1;
+    world.addPlane(&ground);
+    world.setCollisionProperties(
+        (cyclone::real)0.9, (cyclone::real)0.1, (cyclone::real)0.1);
+
+    for (Box *box = boxData; box < boxData+boxes; box++)
+    {
+        world.addBody(box->body);
+        world.addPrimitive(box);
+    }
+
     reset();
 }
 
@@ -259,7 +299,7 @@ void BigBallisticDemo::reset()
     // Make all shots unused
     for (AmmoRound *shot = ammo; shot < ammo+ammoRounds; shot++)
     {
-        shot->type = UNUSED;
+        if (shot->type != UNUSED) removeShot(shot);
     }
 
     // Initialise the box
@@ -288,41 +328,55 @@ void BigBallisticDemo::fire()
     // If we didn't find a round, then exit - we can't fire.
     if (shot >= ammo+ammoRounds) return;
 
-    // Set the shot
+    // Set the shot, and add it to the world. The world sweeps it as
+    // a bullet, so fast shots can't pass straight through a box.
     shot->setState(currentShotType);
-
+    shot->handle = world.addBody(shot->body);
+    world.addPrimitive(shot);
 }
 
 void BigBallisticDemo::updateObjects(cyclone::real duration)
 {
-    // Update the physics of each particle in turn
+    world.startFrame();
+    world.runPhysics(duration);
+
     for (AmmoRound *shot = ammo; shot < ammo+ammoRounds; shot++)
     {
-        if (shot->type != UNUSED)
+        if (shot->type == UNUSED) continue;
+
+        // Remove the shot once it hits a box, or is no longer valid.
+        // The contact has already pushed the box this frame.
+        if (hasContact(shot) ||
+            shot->body->getPosition().y < 0.0f ||
+            shot->startTime+5000 < TimingData::get().lastFrameTimestamp ||
+            shot->body->getPosition().z > 200.0f)
         {
-            // Run the physics
-            shot->body->integrate(duration);
-            shot->calculateInternals();
-
-            // Check if the particle is now invalid
-            if (shot->body->getPosition().y < 0.0f ||
-                shot->startTime+5000 < TimingData::get().lastFrameTimestamp ||
-                shot->body->getPosition().z > 200.0f)
-            {
-                // We simply set the shot type to be unused, so the
-                // memory it occupies can be reused by another shot.
-                shot->type = UNUSED;
-            }
+            removeShot(shot);
         }
     }
+}
 
-    // Update the boxes
-    for (Box *box = boxData; box < boxData+boxes; box++)
+bool BigBallisticDemo::hasContact(const AmmoRound *shot) const
+{
+    const cyclone::ContactBuffer<cyclone::Contact> &buffer =
+        world.getContactBuffer();
+    const cyclone::Contact *contact = buffer.getContacts();
+    for (unsigned i = 0; i < buffer.getCount(); i++, contact++)
     {
-        // Run the physics
-        box->body->integrate(duration);
-        box->calculateInternals();
+        if (contact->body[0] == shot->body || contact->body[1] == shot->body)
+        {
+            return true;
+        }
     }
+    return false;
+}
+
+void BigBallisticDemo::removeShot(AmmoRound *shot)
+{
+    // We simply set the shot type to be unused, so the memory it
+    // occupies can be reused by another shot.
+    world.removeBody(shot->handle);
+    shot->type = UNUSED;
 }
 
 void BigBallisticDemo::display()
@@ -397,41 +451,8 @@ void BigBallisticDemo::display()
 
 void BigBallisticDemo::generateContacts()
 {
-    // Create the ground plane data
-    cyclone::CollisionPlane plane;
-    plane.direction = cyclone::Vector3(0,1,0);
-    plane.offset = 0;
-
-    // Set up the collision data structure
-    cData.reset(maxContacts);
-    cData.friction = (cyclone::real)0.9;
-    cData.restitution = (cyclone::real)0.1;
-    cData.tolerance = (cyclone::real)0.1;
-
-    // Check ground plane collisions
-    for (Box *box = boxData; box < boxData+boxes; box++)
-    {
-        if (!cData.hasMoreContacts()) return;
-        cyclone::CollisionDetector::boxAndHalfSpace(*box, plane, &cData);
-
-
-        // Check for collisions with each shot
-        for (AmmoRound *shot = ammo; shot < ammo+ammoRounds; shot++)
-        {
-            if (shot->type != UNUSED)
-            {
-                if (!cData.hasMoreContacts()) return;
-
-                // When we get a collision, remove the shot
-                if (cyclone::CollisionDetector::boxAndSphere(*box, *shot, &cData))
-                {
-                    shot->type = UNUSED;
-                }
-            }
-        }
-    }
-
-    // NB We aren't checking box-box collisions.
+    contacts.clear();
+    cData.setBuffer(&contacts);
 }
 
 void BigBallisticDemo::mouse(int button, int state, int x, int y)
@@ -311,7 +311,8 @@ void FractureDemo::generateContacts()
     plane.offset = 0;
 
     // Set up the collision data structure
-    cData.reset(maxContacts);
+    contacts.clear();
+    cData.setBuffer(&contacts);
     cData.friction = (cyclone::real)0.9;
     cData.restitution = (cyclone::real)0.2;
     cData.tolerance = (cyclone::real)0.1;
@@ -232,7 +232,8 @@ void RagdollDemo::generateContacts()
     plane.offset = 0;
 
     // Set up the collision data structure
-    cData.reset(maxContacts);
+    contacts.clear();
+    cData.setBuffer(&contacts);
     cData.friction = (cyclone::real)0.9;
     cData.restitution = (cyclone::real)0.6;
     cData.tolerance = (cyclone::real)0.1;
@@ -10,14 +10,51 @@
  * software license.
  */
 
+#include <typeinfo>
 #include <cyclone/fgen.h>
 
 using namespace cyclone;
 
+/**
+ * Runs a list of registrations whose generators are all exactly of
+ * the given type. The call names the type's own updateForce, so it
+ * skips the virtual call and can be inlined into the loop.
+ */
+template<class Generator, class Registration>
+static inline void updateEach(const std::vector<Registration> &registrations,
+                              real duration)
+{
+    for (unsigned i = 0; i < registrations.size(); i++)
+    {
+        Generator *fg = static_cast<Generator*>(registrations[i].fg);
+        fg->Generator::updateForce(registrations[i].body, duration);
+    }
+}
+
+ForceRegistry::GeneratorType
+ForceRegistry::getGeneratorType(const ForceGenerator *fg)
+{
+    // Derived classes may override updateForce, so only the exact
+    // types can be called directly.
+    const std::type_info &type = typeid(*fg);
+    if (type == typeid(Gravity)) return GENERATOR_GRAVITY;
+    if (type == typeid(Spring)) return GENERATOR_SPRING;
+    if (type == typeid(Aero)) return GENERATOR_AERO;
+    if (type == typeid(AeroControl)) return GENERATOR_AERO_CONTROL;
+    if (type == typeid(Buoyancy)) return GENERATOR_BUOYANCY;
+    return GENERATOR_OTHER;
+}
+
 void ForceRegistry::updateForces(real duration)
 {
-    Registry::iterator i = registrations.begin();
-    for (; i != registrations.end(); i++)
+    updateEach<Gravity>(registrations[GENERATOR_GRAVITY], duration);
+    updateEach<Spring>(registrations[GENERATOR_SPRING], duration);
+    updateEach<Aero>(registrations[GENERATOR_AERO], duration);
+    updateEach<AeroControl>(registrations[GENERATOR_AERO_CONTROL], duration);
+    updateEach<Buoyancy>(registrations[GENERATOR_BUOYANCY], duration);
+
+    Registry::iterator i = registrations[GENERATOR_OTHER].begin();
+    for (; i != registrations[GENERATOR_OTHER].end(); i++)
     {
         i->fg->updateForce(i->body, duration);
     }
@@ -28,7 +65,28 @@ void ForceRegistry::add(RigidBody *body, ForceGenerator *fg)
     ForceRegistry::ForceRegistration registration;
     registration.body = body;
     registration.fg = fg;
-    registrations.push_back(registration);
+    registrations[getGeneratorType(fg)].push_back(registration);
+}
+
+void ForceRegistry::remove(RigidBody *body, ForceGenerator *fg)
+{
+    Registry &bucket = registrations[getGeneratorType(fg)];
+    for (Registry::iterator i = bucket.begin(); i != bucket.end(); i++)
+    {
+        if (i->body == body && i->fg == fg)
+        {
+            bucket.erase(i);
+            return;
+        }
+    }
+}
+
+void ForceRegistry::clear()
+{
+    for (unsigned type = 0; type < GENERATOR_TYPE_COUNT; type++)
+    {
+        registrations[type].clear();
+    }
 }
 
 Buoyancy::Buoyancy(const Vector3 &cOfB, real maxDepth, real volume,
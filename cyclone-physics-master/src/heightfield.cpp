@@ -0,0 +1,457 @@
+/*
+ * Implementation file for heightfield primitives.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/heightfield.h>
+
+using namespace cyclone;
+
+/**
+ * The largest step a quantised height can be stored with.
+ */
+const static real quantisedRange = (real)65535;
+
+CollisionHeightfield::CollisionHeightfield()
+:
+TriangleSurface(TYPE_HEIGHTFIELD),
+columns(0),
+rows(0),
+columnSpacing(1),
+rowSpacing(1),
+heightOffset(0),
+heightScale(0),
+minHeight(0),
+maxHeight(0)
+{
+}
+
+void CollisionHeightfield::setGrid(unsigned columns, unsigned rows,
+                                   real columnSpacing, real rowSpacing)
+{
+    CollisionHeightfield::columns = columns;
+    CollisionHeightfield::rows = rows;
+    CollisionHeightfield::columnSpacing = columnSpacing;
+    CollisionHeightfield::rowSpacing = rowSpacing;
+    heights.clear();
+    quantisedHeights.clear();
+    heightOffset = 0;
+    heightScale = 0;
+    minHeight = 0;
+    maxHeight = 0;
+}
+
+void CollisionHeightfield::setHeights(unsigned columns, unsigned rows,
+                                      real columnSpacing, real rowSpacing,
+                                      const real *samples,
+                                      bool quantise)
+{
+    setGrid(columns, rows, columnSpacing, rowSpacing);
+    unsigned count = columns * rows;
+    if (count == 0) return;
+
+    minHeight = maxHeight = samples[0];
+    for (unsigned i = 1; i < count; i++)
+    {
+        if (samples[i] < minHeight) minHeight = samples[i];
+        if (samples[i] > maxHeight) maxHeight = samples[i];
+    }
+
+    if (!quantise)
+    {
+        heights.assign(samples, samples + count);
+        return;
+    }
+
+    // Round each height to the nearest step between the lowest and
+    // highest, so the lowest and highest are kept exactly.
+    heightOffset = minHeight;
+    heightScale = (maxHeight - minHeight) / quantisedRange;
+    quantisedHeights.resize(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        real step = 0;
+        if (heightScale > 0)
+        {
+            step = (samples[i] - heightOffset) / heightScale + (real)0.5;
+        }
+        if (step > quantisedRange) step = quantisedRange;
+        quantisedHeights[i] = (unsigned short)step;
+    }
+}
+
+void CollisionHeightfield::setQuantisedHeights(unsigned columns,
+                                               unsigned rows,
+                                               real columnSpacing,
+                                               real rowSpacing,
+                                               const unsigned short *samples,
+                                               real heightOffset,
+                                               real heightScale)
+{
+    setGrid(columns, rows, columnSpacing, rowSpacing);
+    unsigned count = columns * rows;
+    if (count == 0) return;
+
+    quantisedHeights.assign(samples, samples + count);
+    CollisionHeightfield::heightOffset = heightOffset;
+    CollisionHeightfield::heightScale = heightScale;
+
+    minHeight = maxHeight = getSample(0, 0);
+    for (unsigned i = 1; i < count; i++)
+    {
+        real height = heightOffset + heightScale * samples[i];
+        if (height < minHeight) minHeight = height;
+        if (height > maxHeight) maxHeight = height;
+    }
+}
+
+void CollisionHeightfield::findCell(real x, real z,
+                                    unsigned *column, unsigned *row,
+                                    real *u, real *v) const
+{
+    real across = x / columnSpacing;
+    real along = z / rowSpacing;
+    if (across < 0) across = 0;
+    if (along < 0) along = 0;
+
+    *column = across < (real)(columns - 2) ? (unsigned)across : columns - 2;
+    *row = along < (real)(rows - 2) ? (unsigned)along : rows - 2;
+
+    *u = across - (real)*column;
+    *v = along - (real)*row;
+    if (*u > 1) *u = 1;
+    if (*v > 1) *v = 1;
+}
+
+bool CollisionHeightfield::getHeight(real x, real z, real *height,
+                                     Vector3 *normal,
+                                     unsigned *triangle) const
+{
+    if (columns < 2 || rows < 2) return false;
+    if (x < 0 || x > columnSpacing * (columns - 1)) return false;
+    if (z < 0 || z > rowSpacing * (rows - 1)) return false;
+
+    unsigned column, row;
+    real u, v;
+    findCell(x, z, &column, &row, &u, &v);
+    real h00 = getSample(column, row);
+    real h10 = getSample(column + 1, row);
+    real h01 = getSample(column, row + 1);
+    real h11 = getSample(column + 1, row + 1);
+
+    // Work out the height and the slope along X and Z of the half of
+    // the cell the point is over.
+    bool secondHalf = u + v > 1;
+    real slopeX, slopeZ;
+    if (!secondHalf)
+    {
+        *height = h00 + (h10 - h00) * u + (h01 - h00) * v;
+        slopeX = (h10 - h00) / columnSpacing;
+        slopeZ = (h01 - h00) / rowSpacing;
+    }
+    else
+    {
+        *height = h11 + (h01 - h11) * (1 - u) + (h10 - h11) * (1 - v);
+        slopeX = (h11 - h01) / columnSpacing;
+        slopeZ = (h11 - h10) / rowSpacing;
+    }
+
+    if (normal)
+    {
+        *normal = Vector3(-slopeX, 1, -slopeZ);
+        normal->normalise();
+    }
+    if (triangle)
+    {
+        *triangle = ((row * (columns - 1) + column) << 1) |
+            (secondHalf ? 1 : 0);
+    }
+    return true;
+}
+
+BoundingBox CollisionHeightfield::getBoundingBox() const
+{
+    // Each axis of the heightfield adds its projection of the grid's
+    // box onto the world axes.
+    Vector3 halfSize(
+        columns > 1 ? columnSpacing * (columns - 1) * (real)0.5 : 0,
+        (maxHeight - minHeight) * (real)0.5,
+        rows > 1 ? rowSpacing * (rows - 1) * (real)0.5 : 0);
+    Vector3 centre = transform.transform(
+        Vector3(halfSize.x, minHeight + halfSize.y, halfSize.z));
+    Vector3 extent;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 axis = getAxis(i) * halfSize[i];
+        extent.x += real_abs(axis.x);
+        extent.y += real_abs(axis.y);
+        extent.z += real_abs(axis.z);
+    }
+    return BoundingBox(centre - extent, centre + extent);
+}
+
+void CollisionHeightfield::getTriangle(unsigned triangle,
+                                       Vector3 *corners) const
+{
+    unsigned cell = triangle >> 1;
+    unsigned column = cell % (columns - 1);
+    unsigned row = cell / (columns - 1);
+
+    // Both halves share the diagonal from the next column to the
+    // next row, and are anticlockwise when seen from above.
+    unsigned first = (triangle & 1) ? column + 1 : column;
+    corners[0] = Vector3(columnSpacing * first,
+                         getSample(first, row),
+                         rowSpacing * row);
+    corners[1] = Vector3(columnSpacing * column,
+                         getSample(column, row + 1),
+                         rowSpacing * (row + 1));
+    if (triangle & 1)
+    {
+        corners[2] = Vector3(columnSpacing * (column + 1),
+                             getSample(column + 1, row + 1),
+                             rowSpacing * (row + 1));
+    }
+    else
+    {
+        corners[2] = Vector3(columnSpacing * (column + 1),
+                             getSample(column + 1, row),
+                             rowSpacing * row);
+    }
+}
+
+void CollisionHeightfield::findTriangles(const BoundingBox &box,
+                                         TriangleCallback *callback) const
+{
+    if (columns < 2 || rows < 2) return;
+    if (box.upper.x < 0 || box.lower.x > columnSpacing * (columns - 1) ||
+        box.upper.z < 0 || box.lower.z > rowSpacing * (rows - 1) ||
+        box.upper.y < minHeight || box.lower.y > maxHeight)
+    {
+        return;
+    }
+
+    unsigned firstColumn, firstRow, lastColumn, lastRow;
+    real u, v;
+    findCell(box.lower.x, box.lower.z, &firstColumn, &firstRow, &u, &v);
+    findCell(box.upper.x, box.upper.z, &lastColumn, &lastRow, &u, &v);
+
+    for (unsigned row = firstRow; row <= lastRow; row++)
+    {
+        for (unsigned column = firstColumn; column <= lastColumn; column++)
+        {
+            real h00 = getSample(column, row);
+            real h10 = getSample(column + 1, row);
+            real h01 = getSample(column, row + 1);
+            real h11 = getSample(column + 1, row + 1);
+
+            // Skip each half the box is wholly above or below.
+            real low = h10 < h01 ? h10 : h01;
+            real high = h10 < h01 ? h01 : h10;
+            unsigned triangle = (row * (columns - 1) + column) << 1;
+
+            if (box.upper.y >= (h00 < low ? h00 : low) &&
+                box.lower.y <= (h00 > high ? h00 : high))
+            {
+                callback->reportTriangle(triangle);
+            }
+            if (box.upper.y >= (h11 < low ? h11 : low) &&
+                box.lower.y <= (h11 > high ? h11 : high))
+            {
+                callback->reportTriangle(triangle | 1);
+            }
+        }
+    }
+}
+
+bool CollisionHeightfield::raycastTriangles(const Vector3 &origin,
+                                            const Vector3 &direction,
+                                            real maxDistance,
+                                            unsigned *triangle,
+                                            real *distance) const
+{
+    if (columns < 2 || rows < 2) return false;
+
+    // Clip the ray against the slab between each pair of faces of the
+    // box around the grid.
+    Vector3 lower(0, minHeight, 0);
+    Vector3 upper(columnSpacing * (columns - 1), maxHeight,
+                  rowSpacing * (rows - 1));
+    real entry = 0;
+    real leave = maxDistance;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        if (direction[i] == 0)
+        {
+            if (origin[i] < lower[i] || origin[i] > upper[i]) return false;
+            continue;
+        }
+
+        real one = (lower[i] - origin[i]) / direction[i];
+        real two = (upper[i] - origin[i]) / direction[i];
+        if (one > two)
+        {
+            real swap = one; one = two; two = swap;
+        }
+        if (one > entry) entry = one;
+        if (two < leave) leave = two;
+        if (entry > leave) return false;
+    }
+
+    // Walk the cells under the ray in the order it passes over them,
+    // keeping the distance along the ray to the next column and the
+    // next row it crosses.
+    Vector3 start = origin;
+    start.addScaledVector(direction, entry);
+    unsigned column, row;
+    real u, v;
+    findCell(start.x, start.z, &column, &row, &u, &v);
+
+    int columnStep = 0;
+    real columnNext = REAL_MAX;
+    real columnDelta = REAL_MAX;
+    if (direction.x > 0)
+    {
+        columnStep = 1;
+        columnNext = (columnSpacing * (column + 1) - origin.x) / direction.x;
+        columnDelta = columnSpacing / direction.x;
+    }
+    else if (direction.x < 0)
+    {
+        columnStep = -1;
+        columnNext = (columnSpacing * column - origin.x) / direction.x;
+        columnDelta = -columnSpacing / direction.x;
+    }
+
+    int rowStep = 0;
+    real rowNext = REAL_MAX;
+    real rowDelta = REAL_MAX;
+    if (direction.z > 0)
+    {
+        rowStep = 1;
+        rowNext = (rowSpacing * (row + 1) - origin.z) / direction.z;
+        rowDelta = rowSpacing / direction.z;
+    }
+    else if (direction.z < 0)
+    {
+        rowStep = -1;
+        rowNext = (rowSpacing * row - origin.z) / direction.z;
+        rowDelta = -rowSpacing / direction.z;
+    }
+
+    real cellEntry = entry;
+    for (;;)
+    {
+        real cellLeave = columnNext < rowNext ? columnNext : rowNext;
+        if (cellLeave > leave) cellLeave = leave;
+
+        // Skip cells the ray passes wholly above or below.
+        real h00 = getSample(column, row);
+        real h10 = getSample(column + 1, row);
+        real h01 = getSample(column, row + 1);
+        real h11 = getSample(column + 1, row + 1);
+        real low = h00;
+        real high = h00;
+        if (h10 < low) low = h10;
+        if (h10 > high) high = h10;
+        if (h01 < low) low = h01;
+        if (h01 > high) high = h01;
+        if (h11 < low) low = h11;
+        if (h11 > high) high = h11;
+
+        real yOne = origin.y + direction.y * cellEntry;
+        real yTwo = origin.y + direction.y * cellLeave;
+        if ((yOne >= low || yTwo >= low) && (yOne <= high || yTwo <= high))
+        {
+            // The cells are visited in order, so a hit in this cell is
+            // nearer than any in the cells after it.
+            unsigned cell = (row * (columns - 1) + column) << 1;
+            real nearest = maxDistance;
+            bool found = false;
+            for (unsigned half = 0; half < 2; half++)
+            {
+                Vector3 corners[3];
+                real t;
+                getTriangle(cell | half, corners);
+                if (IntersectionTests::rayAndTriangle(
+                        origin, direction, corners, nearest, &t))
+                {
+                    nearest = t;
+                    *triangle = cell | half;
+                    found = true;
+                }
+            }
+            if (found)
+            {
+                *distance = nearest;
+                return true;
+            }
+        }
+
+        if (cellLeave >= leave) return false;
+        cellEntry = cellLeave;
+
+        if (columnNext < rowNext)
+        {
+            if (columnStep > 0 ? column + 2 >= columns : column == 0)
+            {
+                return false;
+            }
+            column += columnStep;
+            columnNext += columnDelta;
+        }
+        else
+        {
+            if (rowStep > 0 ? row + 2 >= rows : row == 0) return false;
+            row += rowStep;
+            rowNext += rowDelta;
+        }
+    }
+}
+
+unsigned CollisionDetector::pointAndHeightfield(
+    const Vector3 &point,
+    RigidBody *body,
+    const CollisionHeightfield &heightfield,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    // Find the triangle under the point in the heightfield's
+    // coordinates.
+    const Matrix4 &transform = heightfield.getTransform();
+    Vector3 relPt = transform.transformInverse(point);
+    real height;
+    Vector3 normal;
+    unsigned triangle;
+    if (!heightfield.getHeight(relPt.x, relPt.z, &height, &normal, &triangle))
+    {
+        return 0;
+    }
+
+    // The depth along the normal is the depth below the surface
+    // scaled by how much the surface faces up.
+    real depth = (height - relPt.y) * normal.y;
+    if (depth < -data->tolerance) return 0;
+
+    // The contact point is on the surface, above the point.
+    Contact* contact = data->contacts;
+    contact->contactNormal = transform.transformDirection(normal);
+    contact->contactPoint = point;
+    contact->contactPoint.addScaledVector(contact->contactNormal, depth);
+    contact->penetration = depth;
+    contact->setBodyData(body, heightfield.body,
+        data->friction, data->restitution);
+    contact->feature = triangle;
+
+    data->addContacts(1);
+    return 1;
+}
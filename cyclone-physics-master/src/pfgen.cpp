@@ -10,18 +10,272 @@
  * software licence.
  */
 
+#include <cstddef>
+#include <algorithm>
+#include <typeinfo>
 #include <cyclone/pfgen.h>
 
 using namespace cyclone;
 
+/**
+ * Adds the force of a pair to one of its particles, given the pair
+ * end as stored in the registry's index: the first particle gets the
+ * force, and the second the opposite.
+ */
+static inline void addPairForce(Particle *particle,
+                                const Vector3 &force,
+                                unsigned end)
+{
+    if (end == 0) particle->addForce(force);
+    else particle->addForce(force * (real)-1);
+}
+
+/**
+ * Runs a list of registrations whose generators are all exactly of
+ * the given type. The call names the type's own updateForce, so it
+ * skips the virtual call and can be inlined into the loop.
+ */
+template<class Generator, class Registration>
+static inline void updateEach(const Registration *registrations,
+                              unsigned count, real duration)
+{
+    for (unsigned i = 0; i < count; i++)
+    {
+        Generator *fg = static_cast<Generator*>(registrations[i].fg);
+        fg->Generator::updateForce(registrations[i].particle, duration);
+    }
+}
+
+ParticleForceRegistry::GeneratorType
+ParticleForceRegistry::getGeneratorType(const ParticleForceGenerator *fg)
+{
+    // Derived classes may override updateForce, so only the exact
+    // types can be called directly.
+    const std::type_info &type = typeid(*fg);
+    if (type == typeid(ParticleGravity)) return GENERATOR_GRAVITY;
+    if (type == typeid(ParticleDrag)) return GENERATOR_DRAG;
+    if (type == typeid(ParticleAnchoredSpring)) return GENERATOR_ANCHORED_SPRING;
+    if (type == typeid(ParticleAnchoredBungee)) return GENERATOR_ANCHORED_BUNGEE;
+    if (type == typeid(ParticleFakeSpring)) return GENERATOR_FAKE_SPRING;
+    if (type == typeid(ParticleSpring)) return GENERATOR_SPRING;
+    if (type == typeid(ParticleBungee)) return GENERATOR_BUNGEE;
+    if (type == typeid(ParticleBuoyancy)) return GENERATOR_BUOYANCY;
+    return GENERATOR_OTHER;
+}
+
+void ParticleForceRegistry::updateRegistrations(GeneratorType type,
+    const ParticleForceRegistration *registrations,
+    unsigned count, real duration)
+{
+    switch (type)
+    {
+    case GENERATOR_GRAVITY:
+        updateEach<ParticleGravity>(registrations, count, duration);
+        break;
+    case GENERATOR_DRAG:
+        updateEach<ParticleDrag>(registrations, count, duration);
+        break;
+    case GENERATOR_ANCHORED_SPRING:
+        updateEach<ParticleAnchoredSpring>(registrations, count, duration);
+        break;
+    case GENERATOR_ANCHORED_BUNGEE:
+        updateEach<ParticleAnchoredBungee>(registrations, count, duration);
+        break;
+    case GENERATOR_FAKE_SPRING:
+        updateEach<ParticleFakeSpring>(registrations, count, duration);
+        break;
+    case GENERATOR_SPRING:
+        updateEach<ParticleSpring>(registrations, count, duration);
+        break;
+    case GENERATOR_BUNGEE:
+        updateEach<ParticleBungee>(registrations, count, duration);
+        break;
+    case GENERATOR_BUOYANCY:
+        updateEach<ParticleBuoyancy>(registrations, count, duration);
+        break;
+    default:
+        for (unsigned i = 0; i < count; i++)
+        {
+            registrations[i].fg->updateForce(
+                registrations[i].particle, duration);
+        }
+        break;
+    }
+}
+
+ParticleForceRegistry::ParticleForceRegistry()
+:
+executor(NULL),
+indexValid(false)
+{
+}
+
+void ParticleForceRegistry::setExecutor(TaskExecutor *executor)
+{
+    ParticleForceRegistry::executor = executor;
+}
 
 void ParticleForceRegistry::updateForces(real duration)
 {
-    Registry::iterator i = registrations.begin();
-    for (; i != registrations.end(); i++)
+    // Pairs are worth sharing out in larger runs than particles, as
+    // each takes less work.
+    const static unsigned pairGrainSize = 1024;
+    const static unsigned particleGrainSize = 256;
+
+    if (!executor || executor->getWorkerCount() <= 1)
+    {
+        // Each particle's forces are added bucket by bucket, the same
+        // as in the parallel version.
+        for (unsigned type = 0; type < GENERATOR_TYPE_COUNT; type++)
+        {
+            if (registrations[type].empty()) continue;
+            updateRegistrations((GeneratorType)type,
+                &registrations[type][0],
+                (unsigned)registrations[type].size(), duration);
+        }
+
+        PairRegistry::iterator p = pairRegistrations.begin();
+        for (; p != pairRegistrations.end(); p++)
+        {
+            Vector3 force = p->fg->calculateForce(
+                p->particle[0], p->particle[1], duration);
+            addPairForce(p->particle[0], force, 0);
+            addPairForce(p->particle[1], force, 1);
+        }
+        return;
+    }
+
+    if (!indexValid) buildIndex();
+
+    PairForceTask pairTask;
+    pairTask.registry = this;
+    pairTask.duration = duration;
+    executor->parallelFor(&pairTask,
+        (unsigned)pairRegistrations.size(), pairGrainSize);
+
+    ParticleForceTask particleTask;
+    particleTask.registry = this;
+    particleTask.duration = duration;
+    executor->parallelFor(&particleTask,
+        (unsigned)indexParticles.size(), particleGrainSize);
+}
+
+void ParticleForceRegistry::PairForceTask::run(unsigned begin, unsigned end)
+{
+    for (unsigned i = begin; i < end; i++)
+    {
+        const ParticlePairRegistration &pair = registry->pairRegistrations[i];
+        registry->pairForces[i] = pair.fg->calculateForce(
+            pair.particle[0], pair.particle[1], duration);
+    }
+}
+
+void ParticleForceRegistry::ParticleForceTask::run(unsigned begin,
+                                                   unsigned end)
+{
+    for (unsigned i = begin; i < end; i++)
+    {
+        Particle *particle = registry->indexParticles[i];
+
+        // Run the particle's registrations a type at a time.
+        unsigned last = registry->registrationStart[i+1];
+        unsigned j = registry->registrationStart[i];
+        while (j < last)
+        {
+            const ParticleForceRegistration *first =
+                &registry->sortedRegistrations[j];
+            unsigned run = 1;
+            while (j + run < last && first[run].type == first->type) run++;
+
+            updateRegistrations(first->type, first, run, duration);
+            j += run;
+        }
+
+        last = registry->pairEndStart[i+1];
+        for (unsigned j = registry->pairEndStart[i]; j < last; j++)
+        {
+            unsigned pairEnd = registry->pairEnds[j];
+            addPairForce(particle,
+                registry->pairForces[pairEnd >> 1], pairEnd & 1);
+        }
+    }
+}
+
+void ParticleForceRegistry::buildIndex()
+{
+    // Line the buckets up end to end, so that placing them in order
+    // below sorts each particle's registrations by type.
+    Registry all;
+    for (unsigned type = 0; type < GENERATOR_TYPE_COUNT; type++)
+    {
+        all.insert(all.end(),
+            registrations[type].begin(), registrations[type].end());
+    }
+
+    // Find every particle with something registered on it.
+    indexParticles.clear();
+    for (unsigned i = 0; i < all.size(); i++)
+    {
+        indexParticles.push_back(all[i].particle);
+    }
+    for (unsigned i = 0; i < pairRegistrations.size(); i++)
+    {
+        indexParticles.push_back(pairRegistrations[i].particle[0]);
+        indexParticles.push_back(pairRegistrations[i].particle[1]);
+    }
+    std::sort(indexParticles.begin(), indexParticles.end());
+    indexParticles.erase(
+        std::unique(indexParticles.begin(), indexParticles.end()),
+        indexParticles.end());
+
+    // Count the registrations and pair ends for each particle.
+    unsigned count = (unsigned)indexParticles.size();
+    std::vector<unsigned> registrationSlot(all.size());
+    std::vector<unsigned> pairSlot(pairRegistrations.size() * 2);
+    registrationStart.assign(count + 1, 0);
+    pairEndStart.assign(count + 1, 0);
+
+    for (unsigned i = 0; i < all.size(); i++)
+    {
+        unsigned slot = (unsigned)(std::lower_bound(
+            indexParticles.begin(), indexParticles.end(),
+            all[i].particle) - indexParticles.begin());
+        registrationSlot[i] = slot;
+        registrationStart[slot+1]++;
+    }
+    for (unsigned i = 0; i < pairSlot.size(); i++)
+    {
+        unsigned slot = (unsigned)(std::lower_bound(
+            indexParticles.begin(), indexParticles.end(),
+            pairRegistrations[i >> 1].particle[i & 1]) -
+            indexParticles.begin());
+        pairSlot[i] = slot;
+        pairEndStart[slot+1]++;
+    }
+    for (unsigned i = 0; i < count; i++)
     {
-        i->fg->updateForce(i->particle, duration);
+        registrationStart[i+1] += registrationStart[i];
+        pairEndStart[i+1] += pairEndStart[i];
     }
+
+    // Place them, keeping the order of the buckets.
+    std::vector<unsigned> next(registrationStart.begin(),
+                               registrationStart.end() - 1);
+    sortedRegistrations.resize(all.size());
+    for (unsigned i = 0; i < all.size(); i++)
+    {
+        sortedRegistrations[next[registrationSlot[i]]++] = all[i];
+    }
+
+    next.assign(pairEndStart.begin(), pairEndStart.end() - 1);
+    pairEnds.resize(pairSlot.size());
+    for (unsigned i = 0; i < pairSlot.size(); i++)
+    {
+        pairEnds[next[pairSlot[i]]++] = i;
+    }
+
+    pairForces.resize(pairRegistrations.size());
+    indexValid = true;
 }
 
 void ParticleForceRegistry::add(Particle* particle, ParticleForceGenerator *fg)
@@ -29,7 +283,61 @@ void ParticleForceRegistry::add(Particle* particle, ParticleForceGenerator *fg)
     ParticleForceRegistry::ParticleForceRegistration registration;
     registration.particle = particle;
     registration.fg = fg;
-    registrations.push_back(registration);
+    registration.type = getGeneratorType(fg);
+    registrations[registration.type].push_back(registration);
+    indexValid = false;
+}
+
+void ParticleForceRegistry::remove(Particle* particle,
+                                   ParticleForceGenerator *fg)
+{
+    Registry &bucket = registrations[getGeneratorType(fg)];
+    for (Registry::iterator i = bucket.begin(); i != bucket.end(); i++)
+    {
+        if (i->particle == particle && i->fg == fg)
+        {
+            bucket.erase(i);
+            indexValid = false;
+            return;
+        }
+    }
+}
+
+void ParticleForceRegistry::addPair(Particle *first, Particle *second,
+                                    ParticlePairForceGenerator *fg)
+{
+    ParticlePairRegistration registration;
+    registration.particle[0] = first;
+    registration.particle[1] = second;
+    registration.fg = fg;
+    pairRegistrations.push_back(registration);
+    indexValid = false;
+}
+
+void ParticleForceRegistry::removePair(Particle *first, Particle *second,
+                                       ParticlePairForceGenerator *fg)
+{
+    for (PairRegistry::iterator i = pairRegistrations.begin();
+         i != pairRegistrations.end(); i++)
+    {
+        if (i->particle[0] == first && i->particle[1] == second &&
+            i->fg == fg)
+        {
+            pairRegistrations.erase(i);
+            indexValid = false;
+            return;
+        }
+    }
+}
+
+void ParticleForceRegistry::clear()
+{
+    for (unsigned type = 0; type < GENERATOR_TYPE_COUNT; type++)
+    {
+        registrations[type].clear();
+    }
+    pairRegistrations.clear();
+    indexValid = false;
 }
 
 ParticleGravity::ParticleGravity(const Vector3& gravity)
@@ -233,3 +541,50 @@ void ParticleAnchoredSpring::updateForce(Particle* particle, real duration)
     force *= magnitude;
     particle->addForce(force);
 }
+
+ParticlePairSpring::ParticlePairSpring(real sc, real rl)
+: springConstant(sc), restLength(rl)
+{
+}
+
+Vector3 ParticlePairSpring::calculateForce(const Particle *first,
+                                           const Particle *second,
+                                           real duration)
+{
+    // Calculate the vector of the spring
+    Vector3 force = first->getPosition() - second->getPosition();
+
+    // Calculate the magnitude of the force
+    real magnitude = force.magnitude();
+    magnitude = (restLength - magnitude) * springConstant;
+
+    // Calculate the final force
+    force.normalise();
+    force *= magnitude;
+    return force;
+}
+
+ParticlePairBungee::ParticlePairBungee(real sc, real rl)
+: springConstant(sc), restLength(rl)
+{
+}
+
+Vector3 ParticlePairBungee::calculateForce(const Particle *first,
+                                           const Particle *second,
+                                           real duration)
+{
+    // Calculate the vector of the bungee
+    Vector3 force = first->getPosition() - second->getPosition();
+
+    // Check if the bungee is compressed
+    real magnitude = force.magnitude();
+    if (magnitude <= restLength) return Vector3();
+
+    // Calculate the magnitude of the force
+    magnitude = springConstant * (restLength - magnitude);
+
+    // Calculate the final force
+    force.normalise();
+    force *= magnitude;
+    return force;
+}
@@ -0,0 +1,211 @@
+/*
+ * Implementation file for the particle spatial hash grid.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <cyclone/pgrid.h>
+
+using namespace cyclone;
+
+ParticleGrid::ParticleGrid(unsigned slots)
+:
+particles(NULL),
+radius(0),
+restitution(0),
+cellSize(1)
+{
+    unsigned size = 1;
+    while (size < slots) size <<= 1;
+    slotMask = size - 1;
+    slotStart.assign(size + 1, 0);
+}
+
+void ParticleGrid::init(ParticleWorld::Particles *particles,
+                        real radius,
+                        real restitution)
+{
+    ParticleGrid::particles = particles;
+    ParticleGrid::radius = radius;
+    ParticleGrid::restitution = restitution;
+
+    // Spheres in contact are never more than one cell apart.
+    cellSize = radius * 2;
+}
+
+int ParticleGrid::getCell(real coordinate) const
+{
+    return (int)floor(coordinate / cellSize);
+}
+
+unsigned ParticleGrid::getSlot(int x, int y, int z) const
+{
+    return ((unsigned)x * 73856093u ^
+            (unsigned)y * 19349663u ^
+            (unsigned)z * 83492791u) & slotMask;
+}
+
+void ParticleGrid::findSlots(int minX, int minY, int minZ,
+                             int maxX, int maxY, int maxZ) const
+{
+    searchSlots.clear();
+
+    // If there are more cells than slots, every slot is searched.
+    real cells = (real)(maxX - minX + 1) * (real)(maxY - minY + 1) *
+        (real)(maxZ - minZ + 1);
+    if (cells > (real)slotMask)
+    {
+        for (unsigned slot = 0; slot <= slotMask; slot++)
+        {
+            searchSlots.push_back(slot);
+        }
+        return;
+    }
+
+    for (int x = minX; x <= maxX; x++)
+    {
+        for (int y = minY; y <= maxY; y++)
+        {
+            for (int z = minZ; z <= maxZ; z++)
+            {
+                searchSlots.push_back(getSlot(x, y, z));
+            }
+        }
+    }
+
+    // Different cells can share a slot, but it should only be
+    // searched once.
+    std::sort(searchSlots.begin(), searchSlots.end());
+    searchSlots.erase(
+        std::unique(searchSlots.begin(), searchSlots.end()),
+        searchSlots.end());
+}
+
+void ParticleGrid::update() const
+{
+    unsigned count = particles ? (unsigned)particles->size() : 0;
+    unsigned slots = slotMask + 1;
+
+    // Count the particles in each slot.
+    slotStart.assign(slots + 1, 0);
+    particleSlots.resize(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        Vector3 position = (*particles)[i]->getPosition();
+        unsigned slot = getSlot(
+            getCell(position.x), getCell(position.y), getCell(position.z));
+        particleSlots[i] = slot;
+        slotStart[slot]++;
+    }
+
+    // Work out where each slot ends.
+    for (unsigned s = 1; s <= slots; s++) slotStart[s] += slotStart[s-1];
+
+    // Place the particles, working backwards so each slot keeps the
+    // particles in their original order, and leaving slotStart at
+    // the start of each slot.
+    sortedParticles.resize(count);
+    sortedPositions.resize(count);
+    for (unsigned i = count; i > 0; i--)
+    {
+        Particle *particle = (*particles)[i-1];
+        unsigned index = --slotStart[particleSlots[i-1]];
+        sortedParticles[index] = particle;
+        sortedPositions[index] = particle->getPosition();
+    }
+}
+
+unsigned ParticleGrid::addContact(ParticleContact *contact,
+                                  unsigned limit) const
+{
+    update();
+
+    real diameter = radius * 2;
+    unsigned used = 0;
+    int lastX = 0, lastY = 0, lastZ = 0;
+    for (unsigned i = 0; i < sortedPositions.size(); i++)
+    {
+        const Vector3 &position = sortedPositions[i];
+        int x = getCell(position.x);
+        int y = getCell(position.y);
+        int z = getCell(position.z);
+
+        // Particles in the same cell are usually next to each other,
+        // and share the same slots to search.
+        if (i == 0 || x != lastX || y != lastY || z != lastZ)
+        {
+            findSlots(x-1, y-1, z-1, x+1, y+1, z+1);
+            lastX = x; lastY = y; lastZ = z;
+        }
+
+        for (unsigned s = 0; s < searchSlots.size(); s++)
+        {
+            unsigned slot = searchSlots[s];
+            unsigned end = slotStart[slot+1];
+
+            // Each pair is only generated from its first particle.
+            unsigned j = slotStart[slot];
+            if (j <= i) j = i + 1;
+
+            for (; j < end; j++)
+            {
+                Vector3 normal = position - sortedPositions[j];
+                real distance = normal.squareMagnitude();
+                if (distance >= diameter * diameter) continue;
+
+                distance = real_sqrt(distance);
+                if (distance > 0) normal *= ((real)1.0)/distance;
+                else normal = Vector3::UP;
+
+                contact->particle[0] = sortedParticles[i];
+                contact->particle[1] = sortedParticles[j];
+                contact->contactNormal = normal;
+                contact->penetration = diameter - distance;
+                contact->restitution = restitution;
+                contact++;
+
+                used++;
+                if (used >= limit) return used;
+            }
+        }
+    }
+    return used;
+}
+
+unsigned ParticleGrid::findNeighbours(const Vector3 &centre,
+                                      real distance,
+                                      Particle **neighbours,
+                                      unsigned limit) const
+{
+    if (limit == 0) return 0;
+
+    findSlots(getCell(centre.x - distance),
+              getCell(centre.y - distance),
+              getCell(centre.z - distance),
+              getCell(centre.x + distance),
+              getCell(centre.y + distance),
+              getCell(centre.z + distance));
+
+    unsigned found = 0;
+    for (unsigned s = 0; s < searchSlots.size(); s++)
+    {
+        unsigned slot = searchSlots[s];
+        for (unsigned j = slotStart[slot]; j < slotStart[slot+1]; j++)
+        {
+            Vector3 offset = sortedPositions[j] - centre;
+            if (offset.squareMagnitude() > distance * distance) continue;
+
+            neighbours[found++] = sortedParticles[j];
+            if (found >= limit) return found;
+        }
+    }
+    return found;
+}
@@ -15,19 +15,24 @@
 
 using namespace cyclone;
 
-ParticleWorld::ParticleWorld(unsigned maxContacts, unsigned iterations)
+ParticleWorld::ParticleWorld(unsigned contactCapacity, unsigned iterations)
 :
 resolver(iterations),
-maxContacts(maxContacts)
+contacts(contactCapacity),
+executor(NULL)
 {
-    contacts = new ParticleContact[maxContacts];
     calculateIterations = (iterations == 0);
 
 }
 
 ParticleWorld::~ParticleWorld()
 {
-    delete[] contacts;
+}
+
+void ParticleWorld::setExecutor(TaskExecutor *executor)
+{
+    ParticleWorld::executor = executor;
+    registry.setExecutor(executor);
 }
 
 void ParticleWorld::startFrame()
@@ -43,37 +48,55 @@ void ParticleWorld::startFrame()
 
 unsigned ParticleWorld::generateContacts()
 {
-    unsigned limit = maxContacts;
-    ParticleContact *nextContact = contacts;
+    contacts.clear();
 
     for (ContactGenerators::iterator g = contactGenerators.begin();
         g != contactGenerators.end();
         g++)
     {
-        unsigned used =(*g)->addContact(nextContact, limit);
-        limit -= used;
-        nextContact += used;
-
-        // We've run out of contacts to fill. This means we're missing
-        // contacts.
-        if (limit <= 0) break;
+        // A generator that fills the room it is given may have had
+        // more contacts to write, so it is run again with more room.
+        unsigned space = 1;
+        for (;;)
+        {
+            ParticleContact *nextContact = contacts.reserve(space);
+            space = contacts.getSpace();
+            unsigned used = (*g)->addContact(nextContact, space);
+            if (used < space)
+            {
+                contacts.add(used);
+                break;
+            }
+            space *= 2;
+        }
     }
 
     // Return the number of contacts used.
-    return maxContacts - limit;
+    return contacts.getCount();
 }
 
-void ParticleWorld::integrate(real duration)
+void ParticleWorld::Integrator::run(unsigned begin, unsigned end)
 {
-    for (Particles::iterator p = particles.begin();
-        p != particles.end();
-        p++)
+    for (unsigned i = begin; i < end; i++)
     {
-        // Remove all forces from the accumulator
-        (*p)->integrate(duration);
+        (*particles)[i]->integrate(duration);
     }
 }
 
+void ParticleWorld::integrate(real duration)
+{
+    // The number of particles each thread takes at a time.
+    const static unsigned grainSize = 256;
+
+    Integrator integrator;
+    integrator.particles = &particles;
+    integrator.duration = duration;
+
+    unsigned count = (unsigned)particles.size();
+    if (executor) executor->parallelFor(&integrator, count, grainSize);
+    else integrator.run(0, count);
+}
+
 void ParticleWorld::runPhysics(real duration)
 {
     // First apply the force generators
@@ -89,7 +112,7 @@ void ParticleWorld::runPhysics(real duration)
     if (usedContacts)
     {
         if (calculateIterations) resolver.setIterations(usedContacts * 2);
-        resolver.resolveContacts(contacts, usedContacts, duration);
+        resolver.resolveContacts(contacts.getContacts(), usedContacts, duration);
     }
 }
 
@@ -108,6 +131,11 @@ ParticleForceRegistry& ParticleWorld::getForceRegistry()
     return registry;
 }
 
+const ContactBuffer<ParticleContact>& ParticleWorld::getContactBuffer() const
+{
+    return contacts;
+}
+
 void GroundContacts::init(cyclone::ParticleWorld::Particles *particles)
 {
     GroundContacts::particles = particles;
@@ -0,0 +1,356 @@
+/*
+ * Implementation file for the scene queries.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/query.h>
+#include <cyclone/convex.h>
+#include <cyclone/capsule.h>
+#include <algorithm>
+#include <assert.h>
+#include <vector>
+
+using namespace cyclone;
+
+/**
+ * Casts a ray, or a sphere, into the given primitive using the
+ * intersection test for its type. Types without a ray test are
+ * never hit.
+ */
+static bool castPrimitive(const Ray &ray,
+                          real radius,
+                          const CollisionPrimitive &primitive,
+                          RayHit *hit)
+{
+    switch (primitive.getType())
+    {
+    case CollisionPrimitive::TYPE_SPHERE:
+        return IntersectionTests::rayAndSphere(
+            ray, radius, static_cast<const CollisionSphere&>(primitive), hit);
+
+    case CollisionPrimitive::TYPE_BOX:
+        return IntersectionTests::rayAndBox(
+            ray, radius, static_cast<const CollisionBox&>(primitive), hit);
+
+    case CollisionPrimitive::TYPE_CONVEX:
+        return IntersectionTests::rayAndConvex(
+            ray, radius, static_cast<const CollisionConvex&>(primitive), hit);
+
+    case CollisionPrimitive::TYPE_CAPSULE:
+        return IntersectionTests::rayAndCapsule(
+            ray, radius, static_cast<const CollisionCapsule&>(primitive), hit);
+
+    case CollisionPrimitive::TYPE_TRIANGLE_MESH:
+    case CollisionPrimitive::TYPE_HEIGHTFIELD:
+        return IntersectionTests::rayAndTriangles(
+            ray, radius, static_cast<const TriangleSurface&>(primitive), hit);
+
+    default:
+        return false;
+    }
+}
+
+/**
+ * Checks if the given type is made of triangles.
+ */
+static bool isTriangleSurface(CollisionPrimitive::Type type)
+{
+    return type == CollisionPrimitive::TYPE_TRIANGLE_MESH ||
+        type == CollisionPrimitive::TYPE_HEIGHTFIELD;
+}
+
+/**
+ * Checks if a primitive touches a triangle surface, by checking if
+ * the collision detector finds a contact between them. Types without
+ * a routine against triangles are compared by their bounding boxes.
+ */
+static bool touchesSurface(const CollisionPrimitive &primitive,
+                           const TriangleSurface &surface)
+{
+    Contact contact;
+    CollisionData data;
+    data.contactArray = &contact;
+    data.friction = 0;
+    data.restitution = 0;
+    data.tolerance = 0;
+    data.reset(1);
+
+    switch (primitive.getType())
+    {
+    case CollisionPrimitive::TYPE_SPHERE:
+        return CollisionDetector::sphereAndTriangles(
+            static_cast<const CollisionSphere&>(primitive), surface,
+            &data) > 0;
+
+    case CollisionPrimitive::TYPE_BOX:
+        return CollisionDetector::boxAndTriangles(
+            static_cast<const CollisionBox&>(primitive), surface,
+            &data) > 0;
+
+    default:
+        {
+            BoundingBox box = primitive.getBoundingBox();
+            BoundingBox surfaceBox = surface.getBoundingBox();
+            return box.overlaps(&surfaceBox);
+        }
+    }
+}
+
+/**
+ * Checks if two primitives overlap using the intersection test for
+ * their types. Types without an exact test are compared by their
+ * bounding boxes.
+ */
+static bool primitivesOverlap(const CollisionPrimitive &one,
+                              const CollisionPrimitive &two)
+{
+    CollisionPrimitive::Type typeOne = one.getType();
+    CollisionPrimitive::Type typeTwo = two.getType();
+
+    if (typeOne == CollisionPrimitive::TYPE_SPHERE &&
+        typeTwo == CollisionPrimitive::TYPE_SPHERE)
+    {
+        return IntersectionTests::sphereAndSphere(
+            static_cast<const CollisionSphere&>(one),
+            static_cast<const CollisionSphere&>(two));
+    }
+    if (typeOne == CollisionPrimitive::TYPE_BOX &&
+        typeTwo == CollisionPrimitive::TYPE_BOX)
+    {
+        return IntersectionTests::boxAndBox(
+            static_cast<const CollisionBox&>(one),
+            static_cast<const CollisionBox&>(two));
+    }
+    if (typeOne == CollisionPrimitive::TYPE_BOX &&
+        typeTwo == CollisionPrimitive::TYPE_SPHERE)
+    {
+        return IntersectionTests::boxAndSphere(
+            static_cast<const CollisionBox&>(one),
+            static_cast<const CollisionSphere&>(two));
+    }
+    if (typeOne == CollisionPrimitive::TYPE_SPHERE &&
+        typeTwo == CollisionPrimitive::TYPE_BOX)
+    {
+        return IntersectionTests::boxAndSphere(
+            static_cast<const CollisionBox&>(two),
+            static_cast<const CollisionSphere&>(one));
+    }
+
+    if (isTriangleSurface(typeTwo))
+    {
+        return touchesSurface(
+            one, static_cast<const TriangleSurface&>(two));
+    }
+    if (isTriangleSurface(typeOne))
+    {
+        return touchesSurface(
+            two, static_cast<const TriangleSurface&>(one));
+    }
+
+    // Everything else has a support function for the hull tests.
+    if (typeOne == CollisionPrimitive::TYPE_CONVEX ||
+        typeTwo == CollisionPrimitive::TYPE_CONVEX ||
+        typeOne == CollisionPrimitive::TYPE_CAPSULE ||
+        typeTwo == CollisionPrimitive::TYPE_CAPSULE)
+    {
+        return ConvexTests::intersect(one, two);
+    }
+
+    BoundingBox boxOne = one.getBoundingBox();
+    BoundingBox boxTwo = two.getBoundingBox();
+    return boxOne.overlaps(&boxTwo);
+}
+
+/**
+ * Orders hits from the nearest to the farthest.
+ */
+static bool hitIsNearer(const RayHit &one, const RayHit &two)
+{
+    return one.distance < two.distance;
+}
+
+/**
+ * Returns the index of the farthest of the given hits.
+ */
+static unsigned farthestHit(const RayHit *hits, unsigned count)
+{
+    unsigned farthest = 0;
+    for (unsigned i = 1; i < count; i++)
+    {
+        if (hits[i].distance > hits[farthest].distance) farthest = i;
+    }
+    return farthest;
+}
+
+real SceneQuery::CastCallback::reportProxy(unsigned proxy,
+                                           real maxDistance)
+{
+    const CollisionPrimitive *primitive = tree->getPrimitive(proxy);
+    if (!primitive) return maxDistance;
+
+    // Only hits nearer than the current end of the ray are wanted.
+    ray.maxDistance = maxDistance;
+    RayHit hit;
+    if (!castPrimitive(ray, radius, *primitive, &hit)) return maxDistance;
+
+    switch (mode)
+    {
+    case ANY_HIT:
+        hits[0] = hit;
+        count = 1;
+        return 0;
+
+    case CLOSEST_HIT:
+        hits[0] = hit;
+        count = 1;
+        return hit.distance;
+
+    default:
+        break;
+    }
+
+    // Collect every hit until the array is full, then only replace
+    // the farthest, with the ray clipped so the rest of the tree
+    // is only searched for hits that could still get in.
+    if (count < limit)
+    {
+        hits[count++] = hit;
+        if (count < limit) return maxDistance;
+    }
+    else
+    {
+        hits[farthestHit(hits, count)] = hit;
+    }
+    return hits[farthestHit(hits, count)].distance;
+}
+
+void SceneQuery::RayBatch::run(unsigned begin, unsigned end)
+{
+    for (unsigned i = begin; i < end; i++)
+    {
+        if (query->cast(rays[i], radius, mode, hits + i, 1) == 0)
+        {
+            hits[i].primitive = NULL;
+        }
+    }
+}
+
+SceneQuery::SceneQuery(const AABBTree *tree)
+    : tree(tree)
+{
+}
+
+unsigned SceneQuery::cast(const Ray &ray, real radius, Mode mode,
+                          RayHit *hits, unsigned limit) const
+{
+    if (limit == 0) return 0;
+
+    CastCallback callback;
+    callback.tree = tree;
+    callback.ray = ray;
+    callback.radius = radius;
+    callback.mode = mode;
+    callback.hits = hits;
+    callback.limit = limit;
+    callback.count = 0;
+    tree->raycast(ray.origin, ray.direction, ray.maxDistance, radius,
+                  &callback);
+
+    if (mode == ALL_HITS)
+    {
+        std::sort(hits, hits + callback.count, hitIsNearer);
+    }
+    return callback.count;
+}
+
+unsigned SceneQuery::raycast(const Ray &ray, Mode mode,
+                             RayHit *hits, unsigned limit) const
+{
+    return cast(ray, 0, mode, hits, limit);
+}
+
+unsigned SceneQuery::sphereCast(const Ray &ray, real radius, Mode mode,
+                                RayHit *hits, unsigned limit) const
+{
+    return cast(ray, radius, mode, hits, limit);
+}
+
+unsigned SceneQuery::overlapQuery(const CollisionPrimitive &shape,
+                                  CollisionPrimitive **primitives,
+                                  unsigned limit) const
+{
+    if (limit == 0 || tree->getProxyCount() == 0) return 0;
+
+    // Most shapes overlap only a few boxes, so the proxies are found
+    // into a small array, moving to a larger one if it fills. Nothing
+    // is kept in the query, so several threads can run queries at
+    // once.
+    const static unsigned localProxyCount = 64;
+    unsigned localProxies[localProxyCount];
+    std::vector<unsigned> largeProxies;
+    unsigned *proxies = localProxies;
+    unsigned capacity = localProxyCount;
+    unsigned found;
+    BoundingBox box = shape.getBoundingBox();
+    for (;;)
+    {
+        found = tree->query(box, proxies, capacity);
+        if (found < capacity || capacity >= tree->getProxyCount()) break;
+        capacity *= 2;
+        largeProxies.resize(capacity);
+        proxies = &largeProxies[0];
+    }
+
+    unsigned count = 0;
+    for (unsigned i = 0; i < found && count < limit; i++)
+    {
+        CollisionPrimitive *primitive = tree->getPrimitive(proxies[i]);
+        if (!primitive || primitive == &shape) continue;
+        if (!shape.canCollideWith(*primitive)) continue;
+
+        if (primitivesOverlap(shape, *primitive))
+        {
+            primitives[count++] = primitive;
+        }
+    }
+    return count;
+}
+
+unsigned SceneQuery::raycastBatch(const Ray *rays, unsigned count, Mode mode,
+                                  RayHit *hits, real radius,
+                                  TaskExecutor *executor) const
+{
+    // Each ray is cheap, so threads take them in runs.
+    const static unsigned rayGrain = 64;
+
+    // A batch writes one hit per ray, which can't hold all the hits.
+    assert(mode != ALL_HITS);
+    if (mode == ALL_HITS)
+    {
+        for (unsigned i = 0; i < count; i++) hits[i].primitive = NULL;
+        return 0;
+    }
+
+    RayBatch batch;
+    batch.query = this;
+    batch.rays = rays;
+    batch.hits = hits;
+    batch.mode = mode;
+    batch.radius = radius;
+    if (executor) executor->parallelFor(&batch, count, rayGrain);
+    else batch.run(0, count);
+
+    unsigned hitCount = 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (hits[i].primitive) hitCount++;
+    }
+    return hitCount;
+}
@@ -0,0 +1,574 @@
+/*
+ * Implementation file for the thread pool and job scheduler.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cstddef>
+#include <cassert>
+#include <cyclone/tasks.h>
+
+using namespace cyclone;
+
+unsigned TaskGraph::addTask(ParallelTask *task,
+                            unsigned count,
+                            unsigned grainSize)
+{
+    Node node;
+    node.task = task;
+    node.count = count;
+    node.countSource = NULL;
+    node.grainSize = grainSize > 0 ? grainSize : 1;
+    node.dependencies = 0;
+    nodes.push_back(node);
+    return (unsigned)nodes.size() - 1;
+}
+
+void TaskGraph::setCountSource(unsigned task, const unsigned *count)
+{
+    nodes[task].countSource = count;
+}
+
+void TaskGraph::addDependency(unsigned before, unsigned after)
+{
+    assert(before < after && after < nodes.size());
+    nodes[before].successors.push_back(after);
+    nodes[after].dependencies++;
+}
+
+void TaskGraph::clear()
+{
+    nodes.clear();
+}
+
+void TaskGraph::run(TaskExecutor *executor)
+{
+    if (executor) executor->runGraph(this);
+    else runInOrder(NULL);
+}
+
+void TaskGraph::runInOrder(TaskExecutor *executor)
+{
+    for (unsigned i = 0; i < nodes.size(); i++)
+    {
+        unsigned count = getItemCount(i);
+        if (count == 0) continue;
+
+        if (executor)
+        {
+            executor->parallelFor(nodes[i].task, count, nodes[i].grainSize);
+        }
+        else
+        {
+            nodes[i].task->run(0, count);
+        }
+    }
+}
+
+void TaskExecutor::runGraph(TaskGraph *graph)
+{
+    graph->runInOrder(this);
+}
+
+ThreadPool::ThreadPool(unsigned threadCount)
+:
+task(NULL),
+count(0),
+grainSize(1),
+nextItem(0),
+generation(0),
+workersRunning(0),
+busy(false),
+quit(false)
+{
+    if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+    if (threadCount == 0) threadCount = 1;
+
+    // The calling thread is one of the workers.
+    for (unsigned i = 1; i < threadCount; i++)
+    {
+        threads.push_back(std::thread(&ThreadPool::workerLoop, this));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    jobReady.notify_all();
+
+    for (unsigned i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+}
+
+unsigned ThreadPool::getWorkerCount() const
+{
+    return (unsigned)threads.size() + 1;
+}
+
+void ThreadPool::runRanges()
+{
+    for (;;)
+    {
+        unsigned begin = nextItem.fetch_add(grainSize);
+        if (begin >= count) return;
+
+        unsigned end = begin + grainSize;
+        if (end > count || end < begin) end = count;
+        task->run(begin, end);
+    }
+}
+
+void ThreadPool::workerLoop()
+{
+    unsigned seenGeneration = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!quit && generation == seenGeneration)
+            {
+                jobReady.wait(lock);
+            }
+            if (quit) return;
+            seenGeneration = generation;
+        }
+
+        runRanges();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--workersRunning == 0) jobFinished.notify_all();
+        }
+    }
+}
+
+void ThreadPool::parallelFor(ParallelTask *task,
+                             unsigned count,
+                             unsigned grainSize)
+{
+    if (count == 0) return;
+    if (grainSize == 0) grainSize = 1;
+
+    // Small jobs, single-threaded pools and jobs started from inside
+    // another job are run straight away on this thread.
+    if (threads.empty() || count <= grainSize || busy.exchange(true))
+    {
+        for (unsigned begin = 0; begin < count; begin += grainSize)
+        {
+            unsigned end = begin + grainSize;
+            if (end > count || end < begin) end = count;
+            task->run(begin, end);
+        }
+        return;
+    }
+
+    // Publish the job and wake the workers.
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ThreadPool::task = task;
+        ThreadPool::count = count;
+        ThreadPool::grainSize = grainSize;
+        nextItem.store(0);
+        workersRunning = (unsigned)threads.size();
+        generation++;
+    }
+    jobReady.notify_all();
+
+    // Help out, then wait for everyone else to finish.
+    runRanges();
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (workersRunning > 0) jobFinished.wait(lock);
+        ThreadPool::task = NULL;
+    }
+    busy.store(false);
+}
+
+/**
+ * Holds the scheduler the current thread is working for, if any, and
+ * the queue it uses there.
+ */
+static thread_local JobScheduler *currentScheduler = NULL;
+static thread_local unsigned currentWorker = 0;
+
+const unsigned JobScheduler::queueSize;
+
+JobScheduler::Worker::Worker()
+:
+jobs(queueSize),
+top(0),
+bottom(0),
+random(0)
+{
+}
+
+bool JobScheduler::Worker::push(Batch *batch, unsigned begin, unsigned end)
+{
+    long long back = bottom.load(std::memory_order_relaxed);
+    if (back - top.load() >= (long long)jobs.size()) return false;
+
+    Job &job = jobs[back & (jobs.size() - 1)];
+    job.batch.store(batch, std::memory_order_relaxed);
+    job.begin.store(begin, std::memory_order_relaxed);
+    job.end.store(end, std::memory_order_relaxed);
+    bottom.store(back + 1);
+    return true;
+}
+
+bool JobScheduler::Worker::pop(Batch **batch, unsigned *begin, unsigned *end)
+{
+    // Claim the back slot before looking at the front, so a thief
+    // can't take the same job without us seeing it.
+    long long back = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(back);
+    long long front = top.load();
+    if (front > back)
+    {
+        bottom.store(back + 1);
+        return false;
+    }
+
+    const Job &job = jobs[back & (jobs.size() - 1)];
+    *batch = job.batch.load(std::memory_order_relaxed);
+    *begin = job.begin.load(std::memory_order_relaxed);
+    *end = job.end.load(std::memory_order_relaxed);
+    if (front < back) return true;
+
+    // This is the last job, so we race the thieves for it.
+    bool won = top.compare_exchange_strong(front, front + 1);
+    bottom.store(back + 1);
+    return won;
+}
+
+bool JobScheduler::Worker::steal(Batch **batch, unsigned *begin, unsigned *end)
+{
+    long long front = top.load();
+    long long back = bottom.load();
+    if (front >= back) return false;
+
+    const Job &job = jobs[front & (jobs.size() - 1)];
+    *batch = job.batch.load(std::memory_order_relaxed);
+    *begin = job.begin.load(std::memory_order_relaxed);
+    *end = job.end.load(std::memory_order_relaxed);
+    return top.compare_exchange_strong(front, front + 1);
+}
+
+JobScheduler::JobScheduler(unsigned threadCount)
+:
+sleeping(0),
+quit(false)
+{
+    if (threadCount == 0) threadCount = std::thread::hardware_concurrency();
+    if (threadCount == 0) threadCount = 1;
+
+    for (unsigned i = 0; i < threadCount; i++)
+    {
+        workers.push_back(new Worker());
+        workers[i]->random = i * 0x9e3779b9u + 1;
+    }
+
+    // The first queue belongs to the thread that starts the work.
+    for (unsigned i = 1; i < threadCount; i++)
+    {
+        threads.push_back(std::thread(&JobScheduler::workerLoop, this, i));
+    }
+}
+
+JobScheduler::~JobScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit.store(true);
+    }
+    wakeUp.notify_all();
+
+    for (unsigned i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    for (unsigned i = 0; i < workers.size(); i++)
+    {
+        delete workers[i];
+    }
+}
+
+unsigned JobScheduler::getWorkerCount() const
+{
+    return (unsigned)workers.size();
+}
+
+bool JobScheduler::hasJobs() const
+{
+    for (unsigned i = 0; i < workers.size(); i++)
+    {
+        if (!workers[i]->isEmpty()) return true;
+    }
+    return false;
+}
+
+void JobScheduler::workerLoop(unsigned worker)
+{
+    currentScheduler = this;
+    currentWorker = worker;
+
+    // Threads that find nothing to do try a few more times before
+    // going to sleep, since work often turns up again quickly.
+    const static unsigned idleRounds = 64;
+
+    unsigned idle = 0;
+    while (!quit.load())
+    {
+        if (runNextJob(worker))
+        {
+            idle = 0;
+            continue;
+        }
+        if (++idle < idleRounds)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        idle = 0;
+
+        // Anyone pushing a job after we have checked the queues sees
+        // that we are asleep, and takes the lock to wake us.
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.fetch_add(1);
+        while (!quit.load() && !hasJobs()) wakeUp.wait(lock);
+        sleeping.fetch_sub(1);
+    }
+}
+
+unsigned JobScheduler::enter(JobScheduler **previous,
+                             unsigned *previousWorker)
+{
+    *previous = currentScheduler;
+    *previousWorker = currentWorker;
+    if (currentScheduler == this) return currentWorker;
+
+    callerMutex.lock();
+    currentScheduler = this;
+    currentWorker = 0;
+    return 0;
+}
+
+void JobScheduler::leave(JobScheduler *previous, unsigned previousWorker)
+{
+    if (previous == this) return;
+
+    currentScheduler = previous;
+    currentWorker = previousWorker;
+    callerMutex.unlock();
+}
+
+void JobScheduler::pushJob(unsigned worker, Batch *batch,
+                           unsigned begin, unsigned end)
+{
+    if (!workers[worker]->push(batch, begin, end))
+    {
+        // The queue is full, so there is plenty for others to steal.
+        runJob(worker, batch, begin, end);
+        return;
+    }
+
+    if (sleeping.load() > 0)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        wakeUp.notify_one();
+    }
+}
+
+bool JobScheduler::runNextJob(unsigned worker)
+{
+    Batch *batch;
+    unsigned begin, end;
+
+    if (!workers[worker]->pop(&batch, &begin, &end))
+    {
+        // Try each other thread once, starting from a random one.
+        unsigned count = (unsigned)workers.size();
+        unsigned &random = workers[worker]->random;
+        random = random * 1664525u + 1013904223u;
+        unsigned first = (random >> 16) % count;
+
+        bool found = false;
+        for (unsigned i = 0; i < count && !found; i++)
+        {
+            unsigned victim = (first + i) % count;
+            if (victim == worker) continue;
+            found = workers[victim]->steal(&batch, &begin, &end);
+        }
+        if (!found) return false;
+    }
+
+    runJob(worker, batch, begin, end);
+    return true;
+}
+
+void JobScheduler::runJob(unsigned worker, Batch *batch,
+                          unsigned begin, unsigned end)
+{
+    // Split off the second half for others to steal until we are
+    // left with a single range. Splits are made on whole ranges, so
+    // every range starts at a multiple of the grain size.
+    unsigned grainSize = batch->grainSize;
+    while (end - begin > grainSize)
+    {
+        unsigned ranges = (end - begin - 1) / grainSize + 1;
+        unsigned middle = begin + (ranges / 2) * grainSize;
+        if (!workers[worker]->push(batch, middle, end)) break;
+        if (sleeping.load() > 0)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            wakeUp.notify_one();
+        }
+        end = middle;
+    }
+
+    // Run what is left, which is only more than one range if the
+    // queue was full.
+    for (unsigned first = begin; first < end; first += grainSize)
+    {
+        unsigned last = first + grainSize;
+        if (last > end || last < first) last = end;
+        batch->task->run(first, last);
+    }
+
+    finishItems(worker, batch, end - begin);
+}
+
+void JobScheduler::finishItems(unsigned worker, Batch *batch, unsigned count)
+{
+    // Once the last items are counted off, the thread waiting for
+    // a parallelFor can return and take its batch with it, so
+    // anything we need from the batch is read first.
+    GraphRun *graph = batch->graph;
+    unsigned node = batch->node;
+    if (batch->remaining.fetch_sub(count) != count) return;
+
+    // That was the last of this batch. If it is part of a graph, the
+    // tasks waiting for it may now be able to start. The graph's
+    // count is dropped last, since the batches belong to whoever is
+    // waiting for it to reach zero.
+    if (!graph) return;
+
+    const std::vector<unsigned> &successors =
+        graph->graph->getSuccessors(node);
+    for (unsigned i = 0; i < successors.size(); i++)
+    {
+        Batch *next = &graph->batches[successors[i]];
+        if (next->dependencies.fetch_sub(1) == 1) startTask(worker, next);
+    }
+    graph->tasksLeft.fetch_sub(1);
+}
+
+void JobScheduler::startTask(unsigned worker, Batch *batch)
+{
+    unsigned count = batch->graph->graph->getItemCount(batch->node);
+    if (count == 0)
+    {
+        // There is nothing to run, but the tasks after this one
+        // still need to hear that it has finished.
+        batch->remaining.store(1);
+        finishItems(worker, batch, 1);
+        return;
+    }
+
+    batch->remaining.store(count);
+    pushJob(worker, batch, 0, count);
+}
+
+void JobScheduler::parallelFor(ParallelTask *task,
+                               unsigned count,
+                               unsigned grainSize)
+{
+    if (count == 0) return;
+    if (grainSize == 0) grainSize = 1;
+
+    // Small jobs are run straight away on this thread.
+    if (workers.size() == 1 || count <= grainSize)
+    {
+        for (unsigned begin = 0; begin < count; begin += grainSize)
+        {
+            unsigned end = begin + grainSize;
+            if (end > count || end < begin) end = count;
+            task->run(begin, end);
+        }
+        return;
+    }
+
+    JobScheduler *previous;
+    unsigned previousWorker;
+    unsigned worker = enter(&previous, &previousWorker);
+
+    Batch batch;
+    batch.task = task;
+    batch.grainSize = grainSize;
+    batch.remaining.store(count);
+    batch.dependencies.store(0);
+    batch.graph = NULL;
+    batch.node = 0;
+
+    // Start on the work ourselves, then help with whatever is around
+    // until the rest of it has been done.
+    runJob(worker, &batch, 0, count);
+    while (batch.remaining.load() > 0)
+    {
+        if (!runNextJob(worker)) std::this_thread::yield();
+    }
+
+    leave(previous, previousWorker);
+}
+
+void JobScheduler::runGraph(TaskGraph *graph)
+{
+    unsigned count = graph->getTaskCount();
+    if (count == 0) return;
+
+    JobScheduler *previous;
+    unsigned previousWorker;
+    unsigned worker = enter(&previous, &previousWorker);
+
+    GraphRun run;
+    run.graph = graph;
+    run.batches = new Batch[count];
+    run.tasksLeft.store(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        Batch &batch = run.batches[i];
+        batch.task = graph->getTask(i);
+        batch.grainSize = graph->getGrainSize(i);
+        batch.remaining.store(0);
+        batch.dependencies.store(graph->getDependencyCount(i));
+        batch.graph = &run;
+        batch.node = i;
+    }
+
+    // Start the tasks that don't wait for anything, then help until
+    // every task has finished.
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (graph->getDependencyCount(i) == 0)
+        {
+            startTask(worker, &run.batches[i]);
+        }
+    }
+    while (run.tasksLeft.load() > 0)
+    {
+        if (!runNextJob(worker)) std::this_thread::yield();
+    }
+
+    delete[] run.batches;
+    leave(previous, previousWorker);
+}
@@ -0,0 +1,225 @@
+/*
+ * Checks of the general convex tests against analytic answers.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/*
+ * Each check places a pair of primitives so that the answer is known
+ * exactly: a sphere whose centre is a little way either side of a
+ * face of a hull, or a box lying face to face with a hull or another
+ * box. The pairs are placed at random, from a fixed seed, and the
+ * results of ConvexTests compared with the known depth or distance,
+ * and with the separating axis test for boxes.
+ *
+ * The pairs that sit closest to the faces are the ones that matter:
+ * GJK and the expanding polytope are least reliable when the cores
+ * only just touch.
+ *
+ * Usage: convextest
+ *
+ * Prints each failed check, then the number of checks that failed.
+ * Exits with a non-zero status if any did.
+ */
+#include <cyclone/cyclone.h>
+#include <cmath>
+#include <cstdio>
+
+using cyclone::real;
+using cyclone::Vector3;
+
+/** The number of random pairs each check tries. */
+static const unsigned trials = 20000;
+
+/** The furthest the result of a check may be from the answer. */
+static const real allowedError = (real)1e-5;
+
+/** Holds the number of failed checks. */
+static unsigned failures = 0;
+
+/**
+ * Counts a failed check, printing the first few.
+ */
+static void fail(const char *check, unsigned trial,
+                 real expected, real found)
+{
+    const static unsigned printed = 10;
+    if (failures < printed)
+    {
+        printf("%s: trial %u expected %g found %g\n",
+            check, trial, expected, found);
+    }
+    failures++;
+}
+
+/**
+ * Sets the body's position and orientation, and attaches the
+ * primitive to it.
+ */
+static void place(cyclone::CollisionPrimitive *primitive,
+                  cyclone::RigidBody *body,
+                  const Vector3 &position,
+                  const cyclone::Quaternion &orientation)
+{
+    body->setPosition(position);
+    body->setOrientation(orientation);
+    body->calculateDerivedData();
+    primitive->body = body;
+    primitive->calculateInternals();
+}
+
+/**
+ * Returns a gap between one ten-thousandth and one hundredth, or
+ * between one billionth and one hundredth if tiny is set, either
+ * side of zero.
+ */
+static real randomGap(cyclone::Random *random, bool tiny)
+{
+    real exponent = random->randomReal(tiny ? -9 : -4, -2);
+    real gap = (real)pow((real)10, exponent);
+    return random->randomBinomial(1) > 0 ? gap : -gap;
+}
+
+/**
+ * Places spheres with their centres just outside and just inside a
+ * face of a hull, checking the depth is the radius less the gap.
+ */
+static void checkSphereAndHull()
+{
+    Vector3 corners[8];
+    for (unsigned i = 0; i < 8; i++)
+    {
+        corners[i] = Vector3(
+            (i & 1) ? 1 : -1, (i & 2) ? 0.6f : -0.6f, (i & 4) ? 0.8f : -0.8f);
+    }
+    cyclone::CollisionConvex hull;
+    hull.setVertices(corners, 8);
+
+    cyclone::Random random(1);
+    for (unsigned trial = 0; trial < trials; trial++)
+    {
+        cyclone::RigidBody hullBody;
+        place(&hull, &hullBody,
+            random.randomVector(Vector3(-2,-2,-2), Vector3(2,2,2)),
+            random.randomQuaternion());
+
+        // A point well inside the face whose normal is the x axis.
+        real gap = randomGap(&random, trial % 2 == 0);
+        Vector3 local(1 + gap,
+            random.randomReal(-0.55f, 0.55f), random.randomReal(-0.75f, 0.75f));
+
+        cyclone::CollisionSphere sphere;
+        sphere.radius = random.randomReal(0.05f, 0.95f);
+        cyclone::RigidBody sphereBody;
+        place(&sphere, &sphereBody,
+            hull.getTransform().transform(local),
+            cyclone::Quaternion(1, 0, 0, 0));
+
+        Vector3 normal, pointOne, pointTwo;
+        real depth;
+        real expected = sphere.radius - gap;
+        if (!cyclone::ConvexTests::penetration(hull, sphere, 0.01f,
+                &normal, &depth, &pointOne, &pointTwo))
+        {
+            fail("sphere and hull penetration", trial, expected, 0);
+        }
+        else if (real_abs(depth - expected) > allowedError)
+        {
+            fail("sphere and hull depth", trial, expected, depth);
+        }
+    }
+}
+
+/**
+ * Places boxes face to face with a hull, and with a box of the same
+ * shape as the hull, checking the depth and distance are the gap
+ * between the faces.
+ */
+static void checkBoxAndHull()
+{
+    Vector3 halfSize(1, 0.6f, 0.8f);
+    Vector3 corners[8];
+    for (unsigned i = 0; i < 8; i++)
+    {
+        corners[i] = Vector3(
+            (i & 1) ? halfSize.x : -halfSize.x,
+            (i & 2) ? halfSize.y : -halfSize.y,
+            (i & 4) ? halfSize.z : -halfSize.z);
+    }
+    cyclone::CollisionConvex hull;
+    hull.setVertices(corners, 8);
+    cyclone::CollisionBox hullBox;
+    hullBox.halfSize = halfSize;
+
+    cyclone::Random random(2);
+    for (unsigned trial = 0; trial < trials; trial++)
+    {
+        cyclone::RigidBody hullBody, hullBoxBody;
+        Vector3 position =
+            random.randomVector(Vector3(-2,-2,-2), Vector3(2,2,2));
+        cyclone::Quaternion orientation = random.randomQuaternion();
+        place(&hull, &hullBody, position, orientation);
+        place(&hullBox, &hullBoxBody, position, orientation);
+
+        // A smaller box lined up with the hull, across the face whose
+        // normal is the x axis. Half of them are spun about that axis,
+        // which leaves the gap the same.
+        cyclone::CollisionBox box;
+        box.halfSize = Vector3(0.3f, 0.3f, 0.3f);
+        real gap = randomGap(&random, false);
+        Vector3 local(halfSize.x + box.halfSize.x + gap,
+            random.randomReal(-0.2f, 0.2f), random.randomReal(-0.4f, 0.4f));
+        cyclone::Quaternion boxOrientation = orientation;
+        if (trial % 2)
+        {
+            boxOrientation *= cyclone::Quaternion(
+                (real)cos(0.3f), (real)sin(0.3f), 0, 0);
+        }
+        cyclone::RigidBody boxBody;
+        place(&box, &boxBody,
+            hull.getTransform().transform(local), boxOrientation);
+
+        Vector3 normal, pointOne, pointTwo;
+        real depth;
+        if (!cyclone::ConvexTests::penetration(hull, box, 0.01f,
+                &normal, &depth, &pointOne, &pointTwo))
+        {
+            fail("box and hull penetration", trial, -gap, 0);
+        }
+        else if (real_abs(depth + gap) > allowedError)
+        {
+            fail("box and hull depth", trial, -gap, depth);
+        }
+
+        if (gap <= 0) continue;
+        real distance = cyclone::ConvexTests::distance(hull, box);
+        if (real_abs(distance - gap) > allowedError)
+        {
+            fail("box and hull distance", trial, gap, distance);
+        }
+        distance = cyclone::ConvexTests::distance(hullBox, box);
+        if (real_abs(distance - gap) > allowedError)
+        {
+            fail("box and box distance", trial, gap, distance);
+        }
+        if (cyclone::IntersectionTests::boxAndBox(hullBox, box))
+        {
+            fail("box and box separating axis", trial, gap, 0);
+        }
+    }
+}
+
+int main()
+{
+    checkSphereAndHull();
+    checkBoxAndHull();
+
+    printf("%u failed\n", failures);
+    return failures > 0 ? 1 : 0;
+}
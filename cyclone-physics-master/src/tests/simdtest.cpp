@@ -0,0 +1,465 @@
+/*
+ * Checks of the vector instruction core mathematics against the
+ * scalar code.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+/*
+ * The core types choose between their vector and scalar code when
+ * they are compiled, so the two can't be run in the same program.
+ * Instead this file is built twice: once as it stands, and once with
+ * CYCLONE_USE_SIMD defined. The scalar build writes out the result of
+ * every operation, and the vector build works the same operations on
+ * the same inputs and compares its results with them.
+ *
+ * The inputs are drawn at random, from a fixed seed, over a wide range
+ * of sizes, and are followed by the awkward cases: zero and tiny
+ * vectors, zero quaternions, and matrices that are singular or very
+ * nearly so.
+ *
+ * Usage: simdtest_scalar -write | simdtest
+ *
+ * With -write, prints the results exactly, one to a line, each with
+ * the trial and check it came from. Otherwise reads those lines and
+ * prints each result that is more than a few units in the last place
+ * from the scalar one, then the number that were. Exits with a
+ * non-zero status if any were, or if the lines don't match the
+ * operations.
+ */
+#include <cyclone/cyclone.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using cyclone::real;
+using cyclone::Vector3;
+using cyclone::Quaternion;
+using cyclone::Matrix3;
+using cyclone::Matrix4;
+
+/** The number of random inputs each check tries. */
+static const unsigned trials = 2000;
+
+/**
+ * The most units in the last place a result may be from the scalar
+ * one. The vector code does the same operations in the same order,
+ * so they should agree exactly; a few units are allowed in case the
+ * compiler rounds an intermediate differently.
+ */
+static const unsigned long long allowedUlps = 4;
+
+/** Set when the results are being written rather than compared. */
+static bool writing = false;
+
+/** Holds the number of results that differ too much. */
+static unsigned failures = 0;
+
+/** Holds the number of results compared. */
+static unsigned compared = 0;
+
+/** Holds the largest difference seen, in units in the last place. */
+static unsigned long long largestUlps = 0;
+
+/**
+ * Maps a real onto an integer, so that neighbouring reals map to
+ * neighbouring integers. Both zeros map to zero.
+ */
+static long long ordered(double value)
+{
+    long long bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits < 0 ? -(bits & 0x7fffffffffffffffLL) : bits;
+}
+
+/**
+ * Returns the number of units in the last place between two reals.
+ * Two NaNs count as equal, a NaN and a number as far apart.
+ */
+static unsigned long long ulpsBetween(double a, double b)
+{
+    if (a != a || b != b) return (a != a && b != b) ? 0 : ~0ULL;
+    long long x = ordered(a);
+    long long y = ordered(b);
+    return x > y ? (unsigned long long)(x - y) : (unsigned long long)(y - x);
+}
+
+/**
+ * Writes out or checks one result. Each result is tagged with the
+ * check and trial it came from, so that the two builds can't drift
+ * apart unnoticed.
+ */
+static void result(const char *check, unsigned trial, real value)
+{
+    if (writing)
+    {
+        printf("%u %a %s\n", trial, (double)value, check);
+        return;
+    }
+
+    // The check's name has spaces in it, so it comes last, and runs
+    // to the end of the line.
+    char line[256];
+    unsigned scalarTrial;
+    char number[64];
+    int nameStart = 0;
+    if (!fgets(line, sizeof(line), stdin) ||
+        sscanf(line, "%u %63s %n", &scalarTrial, number, &nameStart) != 2 ||
+        nameStart == 0 || scalarTrial != trial ||
+        strncmp(line + nameStart, check, strlen(check)) != 0 ||
+        line[nameStart + strlen(check)] != '\n')
+    {
+        printf("%s: trial %u has no matching scalar result\n",
+            check, trial);
+        exit(1);
+    }
+
+    double expected = strtod(number, NULL);
+    unsigned long long ulps = ulpsBetween(expected, value);
+    if (ulps > largestUlps) largestUlps = ulps;
+    compared++;
+    if (ulps > allowedUlps)
+    {
+        const static unsigned printed = 10;
+        if (failures < printed)
+        {
+            printf("%s: trial %u scalar %.17g vector %.17g\n",
+                check, trial, expected, (double)value);
+        }
+        failures++;
+    }
+}
+
+static void result(const char *check, unsigned trial, const Vector3 &v)
+{
+    result(check, trial, v.x);
+    result(check, trial, v.y);
+    result(check, trial, v.z);
+}
+
+static void result(const char *check, unsigned trial, const Quaternion &q)
+{
+    result(check, trial, q.r);
+    result(check, trial, q.i);
+    result(check, trial, q.j);
+    result(check, trial, q.k);
+}
+
+static void result(const char *check, unsigned trial, const Matrix3 &m)
+{
+    for (unsigned i = 0; i < 9; i++) result(check, trial, m.data[i]);
+}
+
+static void result(const char *check, unsigned trial, const Matrix4 &m)
+{
+    for (unsigned i = 0; i < 12; i++) result(check, trial, m.data[i]);
+}
+
+/**
+ * Returns a real of random sign whose size is anywhere between a
+ * thousandth and a thousand.
+ */
+static real randomSized(cyclone::Random *random)
+{
+    real size = (real)pow((real)10, random->randomReal(-3, 3));
+    return random->randomBinomial(1) > 0 ? size : -size;
+}
+
+static Vector3 randomVector(cyclone::Random *random)
+{
+    return Vector3(randomSized(random), randomSized(random),
+                   randomSized(random));
+}
+
+static Quaternion randomQuaternion(cyclone::Random *random)
+{
+    return Quaternion(randomSized(random), randomSized(random),
+                      randomSized(random), randomSized(random));
+}
+
+static Matrix3 randomMatrix3(cyclone::Random *random)
+{
+    Matrix3 m;
+    for (unsigned i = 0; i < 9; i++) m.data[i] = randomSized(random);
+    return m;
+}
+
+static Matrix4 randomMatrix4(cyclone::Random *random)
+{
+    Matrix4 m;
+    for (unsigned i = 0; i < 12; i++) m.data[i] = randomSized(random);
+    return m;
+}
+
+/**
+ * Returns a matrix whose last row is a combination of the first two,
+ * nudged by the given amount, so the matrix is singular when the
+ * nudge is zero.
+ */
+static Matrix3 nearlySingular(cyclone::Random *random, real nudge)
+{
+    Matrix3 m = randomMatrix3(random);
+    real a = random->randomReal(-2, 2);
+    real b = random->randomReal(-2, 2);
+    for (unsigned i = 0; i < 3; i++)
+    {
+        m.data[6+i] = a*m.data[i] + b*m.data[3+i] + nudge*m.data[6+i];
+    }
+    return m;
+}
+
+/** Returns a rotation and translation matrix. */
+static Matrix4 randomTransform(cyclone::Random *random)
+{
+    Matrix4 m;
+    m.setOrientationAndPos(random->randomQuaternion(), randomVector(random));
+    return m;
+}
+
+/**
+ * Works every vector operation on a pair of vectors and a scale.
+ */
+static void checkVector(unsigned trial,
+                        const Vector3 &a, const Vector3 &b, real scale)
+{
+    Vector3 v = a;
+    v += b;
+    result("vector +=", trial, v);
+    result("vector +", trial, a + b);
+    v = a;
+    v -= b;
+    result("vector -=", trial, v);
+    result("vector -", trial, a - b);
+    v = a;
+    v *= scale;
+    result("vector *= scale", trial, v);
+    result("vector * scale", trial, a * scale);
+    result("vector componentProduct", trial, a.componentProduct(b));
+    v = a;
+    v.componentProductUpdate(b);
+    result("vector componentProductUpdate", trial, v);
+    result("vector vectorProduct", trial, a.vectorProduct(b));
+    v = a;
+    v %= b;
+    result("vector %=", trial, v);
+    result("vector %", trial, a % b);
+    result("vector scalarProduct", trial, a.scalarProduct(b));
+    result("vector * vector", trial, a * b);
+    v = a;
+    v.addScaledVector(b, scale);
+    result("vector addScaledVector", trial, v);
+    result("vector magnitude", trial, a.magnitude());
+    result("vector squareMagnitude", trial, a.squareMagnitude());
+    v = a;
+    v.normalise();
+    result("vector normalise", trial, v);
+    result("vector unit", trial, a.unit());
+    v = a;
+    v.trim(real_abs(scale));
+    result("vector trim", trial, v);
+    v = a;
+    v.invert();
+    result("vector invert", trial, v);
+}
+
+/**
+ * Works every quaternion operation on a pair of quaternions, a
+ * vector and a scale.
+ */
+static void checkQuaternion(unsigned trial,
+                            const Quaternion &a, const Quaternion &b,
+                            const Vector3 &vector, real scale)
+{
+    Quaternion q = a;
+    q.normalise();
+    result("quaternion normalise", trial, q);
+    q = a;
+    q *= b;
+    result("quaternion *=", trial, q);
+    q = a;
+    q.addScaledVector(vector, scale);
+    result("quaternion addScaledVector", trial, q);
+    q = a;
+    q.rotateByVector(vector);
+    result("quaternion rotateByVector", trial, q);
+}
+
+/**
+ * Works every three by three matrix operation on a pair of matrices
+ * and a vector.
+ */
+static void checkMatrix3(unsigned trial,
+                         const Matrix3 &a, const Matrix3 &b,
+                         const Vector3 &vector)
+{
+    result("matrix3 * vector", trial, a * vector);
+    result("matrix3 transform", trial, a.transform(vector));
+    result("matrix3 transformTranspose", trial,
+        a.transformTranspose(vector));
+    result("matrix3 * matrix3", trial, a * b);
+    Matrix3 m = a;
+    m *= b;
+    result("matrix3 *= matrix3", trial, m);
+    m = a;
+    m.invert();
+    result("matrix3 invert", trial, m);
+    result("matrix3 inverse * vector", trial, m * vector);
+}
+
+/**
+ * Works every transform matrix operation on a pair of matrices and a
+ * vector.
+ */
+static void checkMatrix4(unsigned trial,
+                         const Matrix4 &a, const Matrix4 &b,
+                         const Vector3 &vector)
+{
+    result("matrix4 * matrix4", trial, a * b);
+    result("matrix4 * vector", trial, a * vector);
+    result("matrix4 transform", trial, a.transform(vector));
+    result("matrix4 transformDirection", trial,
+        a.transformDirection(vector));
+    result("matrix4 transformInverseDirection", trial,
+        a.transformInverseDirection(vector));
+    result("matrix4 transformInverse", trial, a.transformInverse(vector));
+    result("matrix4 getDeterminant", trial, a.getDeterminant());
+    Matrix4 m = a;
+    m.invert();
+    result("matrix4 invert", trial, m);
+    result("matrix4 inverse * vector", trial, m * vector);
+}
+
+/**
+ * Checks every operation on random inputs.
+ */
+static void checkRandom()
+{
+    cyclone::Random random(1);
+    for (unsigned trial = 0; trial < trials; trial++)
+    {
+        Vector3 a = randomVector(&random);
+        Vector3 b = randomVector(&random);
+        real scale = randomSized(&random);
+        checkVector(trial, a, b, scale);
+        checkQuaternion(trial, randomQuaternion(&random),
+            randomQuaternion(&random), a, scale);
+        checkMatrix3(trial, randomMatrix3(&random),
+            randomMatrix3(&random), a);
+        checkMatrix4(trial, randomMatrix4(&random),
+            randomMatrix4(&random), a);
+        checkMatrix4(trial, randomTransform(&random),
+            randomTransform(&random), b);
+    }
+}
+
+/**
+ * Checks every operation on the awkward inputs: zero, tiny and huge
+ * vectors and quaternions, and singular and nearly singular matrices.
+ */
+static void checkDegenerate()
+{
+    const Vector3 vectors[] = {
+        Vector3(0, 0, 0),
+        Vector3(-0.0, 0, -0.0),
+        Vector3(1e-300, 0, 0),
+        Vector3(1e-170, -1e-170, 1e-170),
+        Vector3(1e150, -1e150, 1e150),
+        Vector3(0, 0, 1),
+        Vector3(1, 1, 1)
+    };
+    const unsigned vectorCount = sizeof(vectors) / sizeof(vectors[0]);
+
+    const Quaternion quaternions[] = {
+        Quaternion(0, 0, 0, 0),
+        Quaternion(1e-10, 0, 0, 0),
+        Quaternion(0, 1e-300, 0, 0),
+        Quaternion(1, 0, 0, 0),
+        Quaternion(0, 0, 0, 1),
+        Quaternion(1e100, -1e100, 1e100, -1e100)
+    };
+    const unsigned quaternionCount =
+        sizeof(quaternions) / sizeof(quaternions[0]);
+
+    unsigned trial = 0;
+    for (unsigned i = 0; i < vectorCount; i++)
+    {
+        for (unsigned j = 0; j < vectorCount; j++)
+        {
+            checkVector(trial, vectors[i], vectors[j], 0);
+            checkVector(trial, vectors[i], vectors[j], -1);
+            trial++;
+        }
+    }
+
+    trial = 0;
+    for (unsigned i = 0; i < quaternionCount; i++)
+    {
+        for (unsigned j = 0; j < quaternionCount; j++)
+        {
+            checkQuaternion(trial, quaternions[i], quaternions[j],
+                vectors[trial % vectorCount], 1);
+            trial++;
+        }
+    }
+
+    // The zero matrix, then singular matrices and matrices a little
+    // way from singular.
+    cyclone::Random random(2);
+    Matrix3 zero;
+    Matrix4 zeroTransform;
+    zeroTransform.setDiagonal(0, 0, 0);
+    checkMatrix3(0, zero, randomMatrix3(&random), vectors[6]);
+    checkMatrix4(0, zeroTransform, randomMatrix4(&random), vectors[6]);
+    for (trial = 1; trial < trials; trial++)
+    {
+        real nudge = trial % 4 == 0 ? 0 :
+            (real)pow((real)10, random.randomReal(-15, -6));
+        Matrix3 m = nearlySingular(&random, nudge);
+        Vector3 vector = vectors[trial % vectorCount];
+        checkMatrix3(trial, m, nearlySingular(&random, nudge), vector);
+
+        Matrix4 transform = randomMatrix4(&random);
+        for (unsigned row = 0; row < 3; row++)
+        {
+            for (unsigned column = 0; column < 3; column++)
+            {
+                transform.data[row*4 + column] = m.data[row*3 + column];
+            }
+        }
+        checkMatrix4(trial, transform, randomTransform(&random), vector);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    writing = argc > 1 && strcmp(argv[1], "-write") == 0;
+
+#ifndef CYCLONE_SIMD
+    if (!writing)
+    {
+        printf("the vector code isn't used on this target, "
+               "so there is nothing to compare\n");
+        return 0;
+    }
+#endif
+
+    checkRandom();
+    checkDegenerate();
+
+    if (writing) return 0;
+    if (fgetc(stdin) != EOF)
+    {
+        printf("the scalar build has more results than this one\n");
+        return 1;
+    }
+    printf("%u of %u failed, largest difference %llu ulps\n",
+        failures, compared, largestUlps);
+    return failures > 0 ? 1 : 0;
+}
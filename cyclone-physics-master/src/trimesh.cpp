@@ -0,0 +1,1104 @@
+/*
+ * Implementation file for triangle mesh primitives, and for the
+ * collision tests against surfaces made of triangles.
+ *
+ * Part of the Cyclone physics system.
+ *
+ * Copyright (c) Icosagon 2003. All Rights Reserved.
+ *
+ * This software is distributed under licence. Use of this software
+ * implies agreement with all terms and conditions of the accompanying
+ * software licence.
+ */
+
+#include <cyclone/trimesh.h>
+#include <algorithm>
+#include <cstring>
+
+using namespace cyclone;
+
+const unsigned TriangleMeshData::blobVersion;
+
+/**
+ * Rounds a size in bytes up to the next multiple of eight.
+ */
+static size_t alignBlob(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+/**
+ * The largest offset a box in the tree can be stored with.
+ */
+const static real quantisedRange = (real)65535;
+
+/**
+ * Converts a coordinate to an offset, rounding down.
+ */
+static unsigned short quantiseDown(real value, real origin, real scale)
+{
+    real q = (value - origin) * scale;
+    if (q <= 0) return 0;
+    if (q >= quantisedRange) return 65535;
+    return (unsigned short)q;
+}
+
+/**
+ * Converts a coordinate to an offset, rounding up.
+ */
+static unsigned short quantiseUp(real value, real origin, real scale)
+{
+    real q = (value - origin) * scale;
+    if (q <= 0) return 0;
+    if (q >= quantisedRange) return 65535;
+    unsigned short result = (unsigned short)q;
+    if (result < q) result++;
+    return result;
+}
+
+TriangleMeshData::TriangleMeshData()
+:
+references(1),
+header(NULL),
+blobSize(0),
+vertices(NULL),
+triangles(NULL),
+nodes(NULL)
+{
+}
+
+size_t TriangleMeshData::getLayout(unsigned vertexCount,
+                                   unsigned triangleCount,
+                                   unsigned nodeCount,
+                                   size_t *triangleOffset,
+                                   size_t *nodeOffset)
+{
+    size_t size = alignBlob(sizeof(BlobHeader));
+    size = alignBlob(size + sizeof(real) * 3 * vertexCount);
+    *triangleOffset = size;
+    size = alignBlob(size + sizeof(unsigned) * 3 * triangleCount);
+    *nodeOffset = size;
+    return alignBlob(size + sizeof(Node) * nodeCount);
+}
+
+void TriangleMeshData::setBlob(const void *blob, size_t size)
+{
+    const char *bytes = (const char *)blob;
+    header = (const BlobHeader *)blob;
+    blobSize = size;
+
+    size_t triangleOffset, nodeOffset;
+    getLayout(header->vertexCount, header->triangleCount, header->nodeCount,
+              &triangleOffset, &nodeOffset);
+    vertices = (const real *)(bytes + alignBlob(sizeof(BlobHeader)));
+    triangles = (const unsigned *)(bytes + triangleOffset);
+    nodes = (const Node *)(bytes + nodeOffset);
+}
+
+/**
+ * Holds a triangle while the tree is being built.
+ */
+struct BuildTriangle
+{
+    BoundingBox box;
+    Vector3 centre;
+    unsigned index;
+};
+
+/**
+ * Orders triangles by the position of their centre along an axis.
+ */
+struct CentreIsLess
+{
+    unsigned axis;
+
+    bool operator()(const BuildTriangle &one, const BuildTriangle &two) const
+    {
+        return one.centre[axis] < two.centre[axis];
+    }
+};
+
+/**
+ * Builds the subtree holding the given range of triangles, writing
+ * its nodes in depth first order from the given node onwards.
+ * Returns the number of nodes written.
+ */
+static unsigned buildNode(BuildTriangle *triangles,
+                          unsigned count,
+                          const real *origin,
+                          const real *scale,
+                          TriangleMeshData::Node *nodes)
+{
+    BoundingBox box = triangles[0].box;
+    BoundingBox centres(triangles[0].centre, triangles[0].centre);
+    for (unsigned i = 1; i < count; i++)
+    {
+        box = BoundingBox(box, triangles[i].box);
+        centres = BoundingBox(centres,
+            BoundingBox(triangles[i].centre, triangles[i].centre));
+    }
+
+    TriangleMeshData::Node &node = nodes[0];
+    for (unsigned i = 0; i < 3; i++)
+    {
+        node.lower[i] = quantiseDown(box.lower[i], origin[i], scale[i]);
+        node.upper[i] = quantiseUp(box.upper[i], origin[i], scale[i]);
+    }
+
+    if (count == 1)
+    {
+        node.index = (int)triangles[0].index;
+        return 1;
+    }
+
+    // Split at the middle triangle along the axis the centres are
+    // most spread out on, which keeps the tree balanced.
+    Vector3 spread = centres.upper - centres.lower;
+    CentreIsLess less;
+    less.axis = 0;
+    if (spread.y > spread[less.axis]) less.axis = 1;
+    if (spread.z > spread[less.axis]) less.axis = 2;
+
+    unsigned half = count / 2;
+    std::nth_element(triangles, triangles + half, triangles + count, less);
+
+    unsigned used = 1;
+    used += buildNode(triangles, half, origin, scale, nodes + used);
+    used += buildNode(triangles + half, count - half, origin, scale,
+                      nodes + used);
+    node.index = -(int)used;
+    return used;
+}
+
+TriangleMeshData* TriangleMeshData::create(const Vector3 *vertices,
+                                           unsigned vertexCount,
+                                           const unsigned *indices,
+                                           unsigned triangleCount)
+{
+    if (triangleCount == 0) return NULL;
+    for (unsigned i = 0; i < triangleCount * 3; i++)
+    {
+        if (indices[i] >= vertexCount) return NULL;
+    }
+
+    std::vector<BuildTriangle> build(triangleCount);
+    BoundingBox bounds(vertices[indices[0]], vertices[indices[0]]);
+    for (unsigned i = 0; i < triangleCount; i++)
+    {
+        const Vector3 &a = vertices[indices[i*3]];
+        const Vector3 &b = vertices[indices[i*3+1]];
+        const Vector3 &c = vertices[indices[i*3+2]];
+
+        BuildTriangle &triangle = build[i];
+        triangle.box = BoundingBox(BoundingBox(a, a), BoundingBox(b, b));
+        triangle.box = BoundingBox(triangle.box, BoundingBox(c, c));
+        triangle.centre = (a + b + c) * ((real)1.0 / (real)3.0);
+        triangle.index = i;
+        bounds = BoundingBox(bounds, triangle.box);
+    }
+
+    TriangleMeshData *data = new TriangleMeshData();
+    unsigned nodeCount = triangleCount * 2 - 1;
+    size_t triangleOffset, nodeOffset;
+    size_t size = getLayout(vertexCount, triangleCount, nodeCount,
+                            &triangleOffset, &nodeOffset);
+    data->storage.resize(size / sizeof(double));
+    char *bytes = (char *)&data->storage[0];
+    memset(bytes, 0, size);
+
+    BlobHeader *header = (BlobHeader *)bytes;
+    memcpy(header->magic, "CTRM", 4);
+    header->version = blobVersion;
+    header->realSize = sizeof(real);
+    header->vertexCount = vertexCount;
+    header->triangleCount = triangleCount;
+    header->nodeCount = nodeCount;
+
+    // Flat meshes still need a range on every axis to be stored in.
+    Vector3 extent = bounds.upper - bounds.lower;
+    real largest = extent.x;
+    if (extent.y > largest) largest = extent.y;
+    if (extent.z > largest) largest = extent.z;
+    real minimum = largest > 0 ? largest * (real)0.0001 : (real)1;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real range = extent[i] > minimum ? extent[i] : minimum;
+        header->origin[i] = bounds.lower[i];
+        header->scale[i] = quantisedRange / range;
+    }
+
+    real *vertexData = (real *)(bytes + alignBlob(sizeof(BlobHeader)));
+    for (unsigned i = 0; i < vertexCount; i++)
+    {
+        vertexData[i*3] = vertices[i].x;
+        vertexData[i*3+1] = vertices[i].y;
+        vertexData[i*3+2] = vertices[i].z;
+    }
+    memcpy(bytes + triangleOffset, indices,
+           sizeof(unsigned) * 3 * triangleCount);
+
+    buildNode(&build[0], triangleCount, header->origin, header->scale,
+              (Node *)(bytes + nodeOffset));
+
+    data->setBlob(bytes, size);
+    return data;
+}
+
+TriangleMeshData* TriangleMeshData::createFromBlob(const void *blob,
+                                                   size_t size)
+{
+    if (!blob || ((size_t)blob & 7) != 0) return NULL;
+    if (size < sizeof(BlobHeader)) return NULL;
+
+    const BlobHeader *header = (const BlobHeader *)blob;
+    if (memcmp(header->magic, "CTRM", 4) != 0) return NULL;
+    if (header->version != blobVersion) return NULL;
+    if (header->realSize != sizeof(real)) return NULL;
+    if (header->triangleCount == 0) return NULL;
+    if (header->nodeCount != header->triangleCount * 2 - 1) return NULL;
+
+    size_t triangleOffset, nodeOffset;
+    size_t needed = getLayout(header->vertexCount, header->triangleCount,
+                              header->nodeCount,
+                              &triangleOffset, &nodeOffset);
+    if (size < needed) return NULL;
+
+    TriangleMeshData *data = new TriangleMeshData();
+    data->setBlob(blob, needed);
+    return data;
+}
+
+void TriangleMeshData::addReference()
+{
+    references++;
+}
+
+void TriangleMeshData::release()
+{
+    if (--references == 0) delete this;
+}
+
+BoundingBox TriangleMeshData::getBounds() const
+{
+    const Node &root = nodes[0];
+    Vector3 lower, upper;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        lower[i] = header->origin[i] + root.lower[i] / header->scale[i];
+        upper[i] = header->origin[i] + root.upper[i] / header->scale[i];
+    }
+    return BoundingBox(lower, upper);
+}
+
+void TriangleMeshData::findTriangles(const BoundingBox &box,
+                                     TriangleCallback *callback) const
+{
+    // Offsets are clamped to the range of the mesh, so boxes outside
+    // it must be thrown out first.
+    unsigned short lower[3], upper[3];
+    for (unsigned i = 0; i < 3; i++)
+    {
+        real origin = header->origin[i];
+        real scale = header->scale[i];
+        if (box.upper[i] < origin) return;
+        if (box.lower[i] > origin + quantisedRange / scale) return;
+        lower[i] = quantiseDown(box.lower[i], origin, scale);
+        upper[i] = quantiseUp(box.upper[i], origin, scale);
+    }
+
+    // Walk the nodes in order, jumping over the subtree of any node
+    // that doesn't overlap.
+    unsigned count = header->nodeCount;
+    unsigned index = 0;
+    while (index < count)
+    {
+        const Node &node = nodes[index];
+        bool overlaps =
+            node.lower[0] <= upper[0] && node.upper[0] >= lower[0] &&
+            node.lower[1] <= upper[1] && node.upper[1] >= lower[1] &&
+            node.lower[2] <= upper[2] && node.upper[2] >= lower[2];
+
+        if (node.index >= 0)
+        {
+            if (overlaps) callback->reportTriangle((unsigned)node.index);
+            index++;
+        }
+        else if (overlaps) index++;
+        else index += (unsigned)(-node.index);
+    }
+}
+
+bool TriangleMeshData::raycast(const Vector3 &origin,
+                               const Vector3 &direction,
+                               real maxDistance,
+                               unsigned *triangle,
+                               real *distance) const
+{
+    bool found = false;
+    real nearest = maxDistance;
+
+    unsigned count = header->nodeCount;
+    unsigned index = 0;
+    while (index < count)
+    {
+        const Node &node = nodes[index];
+
+        // Clip the ray against the slab between each pair of faces
+        // of the node's box.
+        real entry = 0;
+        real leave = nearest;
+        bool enters = true;
+        for (unsigned i = 0; i < 3 && enters; i++)
+        {
+            real lower = header->origin[i] + node.lower[i] / header->scale[i];
+            real upper = header->origin[i] + node.upper[i] / header->scale[i];
+
+            // A ray parallel to the slab is either always in it or never.
+            if (direction[i] == 0)
+            {
+                if (origin[i] < lower || origin[i] > upper) enters = false;
+                continue;
+            }
+
+            real one = (lower - origin[i]) / direction[i];
+            real two = (upper - origin[i]) / direction[i];
+            if (one > two)
+            {
+                real swap = one; one = two; two = swap;
+            }
+            if (one > entry) entry = one;
+            if (two < leave) leave = two;
+            if (entry > leave) enters = false;
+        }
+
+        if (node.index < 0)
+        {
+            if (enters) index++;
+            else index += (unsigned)(-node.index);
+            continue;
+        }
+        index++;
+        if (!enters) continue;
+
+        Vector3 corners[3];
+        getTriangle((unsigned)node.index, corners);
+        real t;
+        if (!IntersectionTests::rayAndTriangle(
+                origin, direction, corners, nearest, &t))
+        {
+            continue;
+        }
+
+        nearest = t;
+        *triangle = (unsigned)node.index;
+        found = true;
+    }
+
+    if (found) *distance = nearest;
+    return found;
+}
+
+CollisionTriangleMesh::CollisionTriangleMesh(TriangleMeshData *data)
+:
+TriangleSurface(TYPE_TRIANGLE_MESH),
+data(data)
+{
+    if (data) data->addReference();
+}
+
+CollisionTriangleMesh::CollisionTriangleMesh(const CollisionTriangleMesh &other)
+:
+TriangleSurface(other),
+data(other.data)
+{
+    if (data) data->addReference();
+}
+
+CollisionTriangleMesh& CollisionTriangleMesh::operator=(
+    const CollisionTriangleMesh &other)
+{
+    TriangleSurface::operator=(other);
+    setData(other.data);
+    return *this;
+}
+
+CollisionTriangleMesh::~CollisionTriangleMesh()
+{
+    if (data) data->release();
+}
+
+void CollisionTriangleMesh::setData(TriangleMeshData *data)
+{
+    // Add the new reference first, in case the data is the same.
+    if (data) data->addReference();
+    if (CollisionTriangleMesh::data) CollisionTriangleMesh::data->release();
+    CollisionTriangleMesh::data = data;
+}
+
+BoundingBox CollisionTriangleMesh::getBoundingBox() const
+{
+    if (!data)
+    {
+        Vector3 position = getAxis(3);
+        return BoundingBox(position, position);
+    }
+
+    // Each axis of the mesh adds its projection of the mesh's box
+    // onto the world axes.
+    BoundingBox bounds = data->getBounds();
+    Vector3 centre = transform.transform(
+        (bounds.lower + bounds.upper) * ((real)0.5));
+    Vector3 halfSize = (bounds.upper - bounds.lower) * ((real)0.5);
+    Vector3 extent;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 axis = getAxis(i) * halfSize[i];
+        extent.x += real_abs(axis.x);
+        extent.y += real_abs(axis.y);
+        extent.z += real_abs(axis.z);
+    }
+    return BoundingBox(centre - extent, centre + extent);
+}
+
+void CollisionTriangleMesh::getTriangle(unsigned triangle,
+                                        Vector3 *corners) const
+{
+    data->getTriangle(triangle, corners);
+}
+
+void CollisionTriangleMesh::findTriangles(const BoundingBox &box,
+                                          TriangleCallback *callback) const
+{
+    if (data) data->findTriangles(box, callback);
+}
+
+bool CollisionTriangleMesh::raycastTriangles(const Vector3 &origin,
+                                             const Vector3 &direction,
+                                             real maxDistance,
+                                             unsigned *triangle,
+                                             real *distance) const
+{
+    if (!data) return false;
+    return data->raycast(origin, direction, maxDistance, triangle, distance);
+}
+
+bool IntersectionTests::rayAndTriangle(
+    const Vector3 &origin,
+    const Vector3 &direction,
+    const Vector3 *corners,
+    real maxDistance,
+    real *distance)
+{
+    // Find where the ray crosses the plane of the triangle, and
+    // where that is in terms of the triangle's edges.
+    Vector3 edgeOne = corners[1] - corners[0];
+    Vector3 edgeTwo = corners[2] - corners[0];
+    Vector3 p = direction % edgeTwo;
+    real determinant = edgeOne * p;
+    if (determinant == 0) return false;
+    real inverse = ((real)1.0) / determinant;
+
+    Vector3 offset = origin - corners[0];
+    real u = (offset * p) * inverse;
+    if (u < 0 || u > 1) return false;
+
+    Vector3 q = offset % edgeOne;
+    real v = (direction * q) * inverse;
+    if (v < 0 || u + v > 1) return false;
+
+    real t = (edgeTwo * q) * inverse;
+    if (t < 0 || t > maxDistance) return false;
+
+    *distance = t;
+    return true;
+}
+
+/**
+ * Returns the point on the given triangle closest to the given point.
+ */
+static Vector3 closestPointOnTriangle(const Vector3 &point,
+                                      const Vector3 *corners)
+{
+    const Vector3 &a = corners[0];
+    const Vector3 &b = corners[1];
+    const Vector3 &c = corners[2];
+    Vector3 ab = b - a;
+    Vector3 ac = c - a;
+
+    // Check the region beyond each corner, then beyond each edge,
+    // and otherwise the point is over the face.
+    Vector3 ap = point - a;
+    real d1 = ab * ap;
+    real d2 = ac * ap;
+    if (d1 <= 0 && d2 <= 0) return a;
+
+    Vector3 bp = point - b;
+    real d3 = ab * bp;
+    real d4 = ac * bp;
+    if (d3 >= 0 && d4 <= d3) return b;
+
+    real vc = d1*d4 - d3*d2;
+    if (vc <= 0 && d1 >= 0 && d3 <= 0)
+    {
+        return a + ab * (d1 / (d1 - d3));
+    }
+
+    Vector3 cp = point - c;
+    real d5 = ab * cp;
+    real d6 = ac * cp;
+    if (d6 >= 0 && d5 <= d6) return c;
+
+    real vb = d5*d2 - d1*d6;
+    if (vb <= 0 && d2 >= 0 && d6 <= 0)
+    {
+        return a + ac * (d2 / (d2 - d6));
+    }
+
+    real va = d3*d6 - d5*d4;
+    if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0)
+    {
+        return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+    }
+
+    real denominator = ((real)1.0) / (va + vb + vc);
+    return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+/**
+ * Works out the unit normal of the front of the given triangle.
+ * Returns false if the triangle has no area.
+ */
+static bool triangleNormal(const Vector3 *corners, Vector3 *normal)
+{
+    *normal = (corners[1] - corners[0]) % (corners[2] - corners[0]);
+    real length = normal->magnitude();
+    if (length <= 0) return false;
+    *normal *= ((real)1.0) / length;
+    return true;
+}
+
+/**
+ * Contacts closer together than this, for the same surface, are
+ * taken to be the same contact found through neighbouring triangles.
+ */
+const static real duplicateDistance = (real)1e-6;
+
+/**
+ * Checks if a contact at the given point has already been written
+ * since the contact with the given offset in the data's contact
+ * array. Contacts are found by their offsets, as the array moves when
+ * a growable buffer runs out of room.
+ */
+static bool isDuplicate(unsigned first,
+                        const CollisionData *data,
+                        const Vector3 &point)
+{
+    for (unsigned i = first; i < data->contactCount; i++)
+    {
+        const Contact *contact = data->contactArray + i;
+        if ((contact->contactPoint - point).squareMagnitude() <
+            duplicateDistance * duplicateDistance)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Writes a contact between a primitive and a surface, unless there is
+ * no room left or the same contact has already been found. Returns
+ * the number of contacts written.
+ */
+static unsigned addSurfaceContact(const CollisionPrimitive &primitive,
+                                  const TriangleSurface &surface,
+                                  unsigned first,
+                                  const Vector3 &normal,
+                                  const Vector3 &point,
+                                  real penetration,
+                                  unsigned feature,
+                                  CollisionData *data)
+{
+    if (data->contactsLeft <= 0) return 0;
+    if (isDuplicate(first, data, point)) return 0;
+
+    Contact *contact = data->contacts;
+    contact->contactNormal = normal;
+    contact->contactPoint = point;
+    contact->penetration = penetration;
+    contact->setBodyData(primitive.body, surface.body,
+        data->friction, data->restitution);
+    contact->feature = feature;
+    data->addContacts(1);
+    return 1;
+}
+
+/**
+ * Contacts on an edge or corner closer than this to the plane of a
+ * face contact already found are taken to be on the same surface.
+ */
+const static real surfaceDistance = (real)1e-4;
+
+/**
+ * Generates the contacts between a sphere and each triangle of a
+ * surface reported to it. The triangles are visited twice: first for
+ * spheres over their faces, then for spheres beyond their edges and
+ * corners. An edge or corner in the plane of a face contact is part
+ * of a flat surface the face contact already pushes the sphere out
+ * of, so it is skipped. This stops spheres catching on the edges
+ * between flat triangles.
+ */
+struct SphereSurfaceCollider : public TriangleCallback
+{
+    const CollisionSphere *sphere;
+    const TriangleSurface *surface;
+    CollisionData *data;
+
+    /**
+     * Holds the offset in the data's contact array of the first
+     * contact for this sphere.
+     */
+    unsigned first;
+
+    /** Holds the centre of the sphere in the surface's coordinates. */
+    Vector3 centre;
+
+    /** Is set for the visit to the edges and corners. */
+    bool edges;
+
+    /** Holds the offset of the end of the face contacts. */
+    unsigned facesEnd;
+
+    unsigned written;
+
+    /**
+     * Checks if the given point is in the plane of a face contact.
+     */
+    bool onFace(const Vector3 &point) const
+    {
+        for (unsigned i = first; i < facesEnd; i++)
+        {
+            const Contact *contact = data->contactArray + i;
+            real height =
+                contact->contactNormal * (point - contact->contactPoint);
+            if (real_abs(height) < surfaceDistance) return true;
+        }
+        return false;
+    }
+
+    virtual void reportTriangle(unsigned triangle)
+    {
+        Vector3 corners[3], normal;
+        surface->getTriangle(triangle, corners);
+        if (!triangleNormal(corners, &normal)) return;
+
+        real radius = sphere->radius;
+        real height = normal * (centre - corners[0]);
+        if (height > radius + data->tolerance) return;
+
+        bool overFace = true;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            Vector3 side = (corners[(i+1) % 3] - corners[i]) % normal;
+            if (side * (centre - corners[i]) > 0) overFace = false;
+        }
+
+        const Matrix4 &transform = surface->getTransform();
+        if (!edges)
+        {
+            // A centre behind the triangle is only pushed out through
+            // the face, and only if it is over it.
+            if (!overFace || height < -radius) return;
+
+            written += addSurfaceContact(*sphere, *surface, first,
+                transform.transformDirection(normal),
+                transform.transform(centre - normal * height),
+                radius - height, triangle, data);
+            return;
+        }
+        if (overFace || height <= 0) return;
+
+        Vector3 closest = closestPointOnTriangle(centre, corners);
+        Vector3 separation = centre - closest;
+        real length = separation.magnitude();
+        if (length > radius + data->tolerance) return;
+
+        Vector3 point = transform.transform(closest);
+        if (onFace(point)) return;
+
+        written += addSurfaceContact(*sphere, *surface, first,
+            transform.transformDirection(separation) * (((real)1.0) / length),
+            point, radius - length, triangle, data);
+    }
+};
+
+unsigned CollisionDetector::sphereAndTriangles(
+    const CollisionSphere &sphere,
+    const TriangleSurface &surface,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    SphereSurfaceCollider collider;
+    collider.sphere = &sphere;
+    collider.surface = &surface;
+    collider.data = data;
+    collider.first = data->contactCount;
+    collider.centre =
+        surface.getTransform().transformInverse(sphere.getAxis(3));
+    collider.written = 0;
+
+    real reach = sphere.radius + data->tolerance;
+    Vector3 extent(reach, reach, reach);
+    BoundingBox box(collider.centre - extent, collider.centre + extent);
+
+    collider.edges = false;
+    collider.facesEnd = data->contactCount;
+    surface.findTriangles(box, &collider);
+
+    collider.edges = true;
+    collider.facesEnd = data->contactCount;
+    surface.findTriangles(box, &collider);
+    return collider.written;
+}
+
+/**
+ * The most points a face clipped to a triangle can have: a square
+ * clipped by three planes.
+ */
+const static unsigned boxSurfacePoints = 8;
+
+/**
+ * Generates the contacts between a box and each triangle of a
+ * surface reported to it. The tests are done in the box's coordinates, where
+ * it is centred on the origin and aligned with the axes.
+ *
+ * Each triangle pushes the box out along its normal, as if it were
+ * a half-space cut down to the triangle. Pushing along an edge of a
+ * triangle would catch boxes sliding over the edges between flat
+ * triangles, so the other axes are only used to find triangles that
+ * don't touch the box at all.
+ */
+struct BoxSurfaceCollider : public TriangleCallback
+{
+    const CollisionBox *box;
+    const TriangleSurface *surface;
+    CollisionData *data;
+
+    /**
+     * Holds the offset in the data's contact array of the first
+     * contact for this box.
+     */
+    unsigned first;
+
+    /** Holds the transform from the surface's coordinates to the box's. */
+    Matrix4 surfaceToBox;
+
+    unsigned written;
+
+    /**
+     * Writes a contact given in the box's coordinates.
+     */
+    void addContact(const Vector3 &normal, const Vector3 &point,
+                    real penetration, unsigned feature)
+    {
+        const Matrix4 &transform = box->getTransform();
+        written += addSurfaceContact(*box, *surface, first,
+            transform.transformDirection(normal),
+            transform.transform(point),
+            penetration, feature, data);
+    }
+
+    /**
+     * Checks if the triangle and box are apart along the given axis.
+     */
+    bool separated(const Vector3 &axis, const Vector3 *corners) const
+    {
+        const Vector3 &halfSize = box->halfSize;
+        real radius = halfSize.x * real_abs(axis.x) +
+            halfSize.y * real_abs(axis.y) +
+            halfSize.z * real_abs(axis.z);
+        real lowest = axis * corners[0];
+        real highest = lowest;
+        for (unsigned k = 1; k < 3; k++)
+        {
+            real projection = axis * corners[k];
+            if (projection < lowest) lowest = projection;
+            if (projection > highest) highest = projection;
+        }
+
+        return lowest > radius + data->tolerance ||
+            highest < -radius - data->tolerance;
+    }
+
+    virtual void reportTriangle(unsigned triangle)
+    {
+        if (data->contactsLeft <= 0) return;
+
+        Vector3 corners[3], normal;
+        surface->getTriangle(triangle, corners);
+        for (unsigned i = 0; i < 3; i++)
+        {
+            corners[i] = surfaceToBox.transform(corners[i]);
+        }
+        if (!triangleNormal(corners, &normal)) return;
+
+        const Vector3 &halfSize = box->halfSize;
+
+        // The centre of the box must be in front of the triangle.
+        real height = -(normal * corners[0]);
+        if (height < 0) return;
+
+        real depth = halfSize.x * real_abs(normal.x) +
+            halfSize.y * real_abs(normal.y) +
+            halfSize.z * real_abs(normal.z) - height;
+        if (depth < -data->tolerance) return;
+
+        // Check the axes of the box, and those across each pair of
+        // edges.
+        Vector3 edges[3];
+        for (unsigned i = 0; i < 3; i++)
+        {
+            edges[i] = corners[(i+1) % 3] - corners[i];
+        }
+
+        for (unsigned i = 0; i < 3; i++)
+        {
+            Vector3 boxAxis;
+            boxAxis[i] = 1;
+            if (separated(boxAxis, corners)) return;
+
+            for (unsigned j = 0; j < 3; j++)
+            {
+                Vector3 axis = boxAxis % edges[j];
+                real length = axis.magnitude();
+                if (length < (real)1e-6) continue;
+                axis *= ((real)1.0) / length;
+
+                if (separated(axis, corners)) return;
+            }
+        }
+
+        // Clip each face of the box that faces the triangle to the
+        // triangle's edges, and keep the points below the triangle.
+        const static real square[4][2] = {{1,1},{-1,1},{-1,-1},{1,-1}};
+        Vector3 points[boxSurfacePoints * 3];
+        real depths[boxSurfacePoints * 3];
+        real offset = normal * corners[0];
+        unsigned kept = 0;
+        for (unsigned axis = 0; axis < 3; axis++)
+        {
+            if (real_abs(normal[axis]) < (real)1e-6) continue;
+            unsigned j = (axis + 1) % 3;
+            unsigned k = (axis + 2) % 3;
+
+            Vector3 clipped[2][boxSurfacePoints];
+            for (unsigned c = 0; c < 4; c++)
+            {
+                Vector3 &corner = clipped[0][c];
+                corner[axis] = normal[axis] > 0 ?
+                    -halfSize[axis] : halfSize[axis];
+                corner[j] = square[c][0] * halfSize[j];
+                corner[k] = square[c][1] * halfSize[k];
+            }
+
+            unsigned count = 4;
+            unsigned current = 0;
+            for (unsigned i = 0; i < 3 && count > 0; i++)
+            {
+                Vector3 side = edges[i] % normal;
+                count = CollisionDetector::clipPolygon(
+                    clipped[current], count, side, side * corners[i],
+                    clipped[1-current]);
+                current = 1 - current;
+            }
+
+            for (unsigned i = 0; i < count; i++)
+            {
+                real pointDepth = offset - normal * clipped[current][i];
+                if (pointDepth < -data->tolerance) continue;
+                points[kept] = clipped[current][i];
+                depths[kept] = pointDepth;
+                kept++;
+            }
+        }
+
+        unsigned selected[4];
+        unsigned selectedCount = CollisionDetector::selectContacts(
+            points, depths, kept, normal, selected);
+        for (unsigned i = 0; i < selectedCount; i++)
+        {
+            addContact(normal, points[selected[i]], depths[selected[i]],
+                       (triangle << 2) | i);
+        }
+    }
+};
+
+unsigned CollisionDetector::boxAndTriangles(
+    const CollisionBox &box,
+    const TriangleSurface &surface,
+    CollisionData *data
+    )
+{
+    if (data->contactsLeft <= 0) return 0;
+
+    BoxSurfaceCollider collider;
+    collider.box = &box;
+    collider.surface = &surface;
+    collider.data = data;
+    collider.first = data->contactCount;
+    collider.surfaceToBox =
+        box.getTransform().inverse() * surface.getTransform();
+    collider.written = 0;
+
+    // Find the box around the box in the surface's coordinates.
+    Matrix4 boxToSurface =
+        surface.getTransform().inverse() * box.getTransform();
+    Vector3 centre = boxToSurface.getAxisVector(3);
+    Vector3 extent(data->tolerance, data->tolerance, data->tolerance);
+    for (unsigned i = 0; i < 3; i++)
+    {
+        Vector3 axis = boxToSurface.getAxisVector(i) * box.halfSize[i];
+        extent.x += real_abs(axis.x);
+        extent.y += real_abs(axis.y);
+        extent.z += real_abs(axis.z);
+    }
+    surface.findTriangles(
+        BoundingBox(centre - extent, centre + extent), &collider);
+    return collider.written;
+}
+
+/**
+ * Casts a sphere at each triangle of a surface reported to it,
+ * keeping the nearest hit.
+ */
+struct SphereCaster : public TriangleCallback
+{
+    const TriangleSurface *surface;
+
+    /** Holds the ray in the surface's coordinates. */
+    Vector3 origin;
+    Vector3 direction;
+
+    real radius;
+    real stopDistance;
+
+    /** Holds the nearest hit so far, or the end of the ray. */
+    real nearest;
+    bool found;
+    bool startsInside;
+    Vector3 point;
+    Vector3 normal;
+
+    virtual void reportTriangle(unsigned triangle)
+    {
+        Vector3 corners[3];
+        surface->getTriangle(triangle, corners);
+
+        // The distance from a point moving in a straight line to a
+        // triangle changes as a convex function of time, so stepping
+        // by the distance divided by the closing speed lands on or
+        // before the first touch.
+        const static unsigned maxSteps = 32;
+        real t = 0;
+        for (unsigned step = 0; step < maxSteps; step++)
+        {
+            Vector3 centre = origin;
+            centre.addScaledVector(direction, t);
+
+            Vector3 closest = closestPointOnTriangle(centre, corners);
+            Vector3 separation = centre - closest;
+            real length = separation.magnitude();
+            real distance = length - radius;
+            if (distance <= stopDistance)
+            {
+                if (t <= 0 && length < radius) startsInside = true;
+                else if (length > 0)
+                {
+                    normal = separation * (((real)1.0) / length);
+                    point = closest;
+                }
+                else return;
+                nearest = t;
+                found = true;
+                return;
+            }
+
+            // Once the sphere stops getting closer it never will.
+            real closing = -(separation * direction) / length;
+            if (closing <= 0) return;
+
+            t += distance / closing;
+            if (t >= nearest) return;
+        }
+    }
+};
+
+bool IntersectionTests::rayAndTriangles(
+    const Ray &ray,
+    real radius,
+    const TriangleSurface &surface,
+    RayHit *hit,
+    real tolerance)
+{
+    // Work in the surface's coordinates.
+    const Matrix4 &transform = surface.getTransform();
+    Vector3 origin = transform.transformInverse(ray.origin);
+    Vector3 direction = transform.transformInverseDirection(ray.direction);
+
+    if (radius > 0)
+    {
+        SphereCaster caster;
+        caster.surface = &surface;
+        caster.origin = origin;
+        caster.direction = direction;
+        caster.radius = radius;
+        caster.stopDistance = radius * tolerance;
+        caster.nearest = ray.maxDistance;
+        caster.found = false;
+        caster.startsInside = false;
+
+        Vector3 end = origin;
+        end.addScaledVector(direction, ray.maxDistance);
+        Vector3 extent(radius, radius, radius);
+        surface.findTriangles(
+            BoundingBox(BoundingBox(origin - extent, origin + extent),
+                        BoundingBox(end - extent, end + extent)),
+            &caster);
+        if (!caster.found) return false;
+
+        hit->primitive = &surface;
+        if (caster.startsInside)
+        {
+            hit->point = ray.origin;
+            hit->normal = ray.direction * -1;
+            hit->distance = 0;
+            return true;
+        }
+        hit->point = transform.transform(caster.point);
+        hit->normal = transform.transformDirection(caster.normal);
+        hit->distance = caster.nearest;
+        return true;
+    }
+
+    unsigned triangle;
+    real distance;
+    if (!surface.raycastTriangles(origin, direction, ray.maxDistance,
+                                  &triangle, &distance))
+    {
+        return false;
+    }
+
+    // The normal faces back towards the ray, whichever side it hit.
+    Vector3 corners[3], normal;
+    surface.getTriangle(triangle, corners);
+    triangleNormal(corners, &normal);
+    if (normal * direction > 0) normal.invert();
+
+    hit->primitive = &surface;
+    hit->point = ray.origin + ray.direction * distance;
+    hit->normal = transform.transformDirection(normal);
+    hit->distance = distance;
+    return true;
+}
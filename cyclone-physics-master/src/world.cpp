@@ -11,83 +11,947 @@
  */
 
 #include <cstdlib>
+#include <algorithm>
 #include <cyclone/world.h>
+#include <cyclone/capsule.h>
 
 using namespace cyclone;
 
-World::World(unsigned maxContacts, unsigned iterations)
+const unsigned World::noIslandBody;
+const unsigned World::HandleTable::noSlot;
+const unsigned World::HandleTable::noEntry;
+
+World::HandleTable::HandleTable()
+:
+freeSlot(noSlot)
+{
+}
+
+World::Handle World::HandleTable::create()
+{
+    // Reuse a free slot if there is one. Its generation was moved on
+    // when it was freed, so old handles to it stay stale.
+    unsigned slot = freeSlot;
+    if (slot != noSlot)
+    {
+        freeSlot = slots[slot].index;
+    }
+    else
+    {
+        slot = (unsigned)slots.size();
+        Slot fresh;
+        fresh.generation = 1;
+        slots.push_back(fresh);
+    }
+
+    slots[slot].index = (unsigned)entrySlots.size();
+    entrySlots.push_back(slot);
+
+    Handle handle;
+    handle.slot = slot;
+    handle.generation = slots[slot].generation;
+    return handle;
+}
+
+unsigned World::HandleTable::find(Handle handle) const
+{
+    if (handle.slot >= slots.size() ||
+        slots[handle.slot].generation != handle.generation)
+    {
+        return noEntry;
+    }
+    return slots[handle.slot].index;
+}
+
+unsigned World::HandleTable::destroy(Handle handle)
+{
+    unsigned index = find(handle);
+    if (index == noEntry) return noEntry;
+
+    // The last entry moves into the removed one's place.
+    unsigned moved = entrySlots.back();
+    entrySlots[index] = moved;
+    slots[moved].index = index;
+    entrySlots.pop_back();
+
+    Slot &slot = slots[handle.slot];
+    slot.generation++;
+    slot.index = freeSlot;
+    freeSlot = handle.slot;
+    return index;
+}
+
+World::Handle World::HandleTable::getHandle(unsigned index) const
+{
+    Handle handle;
+    handle.slot = entrySlots[index];
+    handle.generation = slots[handle.slot].generation;
+    return handle;
+}
+
+void World::HandleTable::clear()
+{
+    while (!entrySlots.empty())
+    {
+        destroy(getHandle((unsigned)entrySlots.size() - 1));
+    }
+}
+
+World::World(unsigned contactCapacity, unsigned iterations)
 :
-firstBody(NULL),
 resolver(iterations),
-firstContactGen(NULL),
-maxContacts(maxContacts)
+contacts(contactCapacity),
+executor(NULL),
+contactCache(NULL),
+frameDuration(0),
+frameBodyCount(0),
+framePrimitiveCount(0),
+framePairCount(0),
+collisionItemCount(0)
 {
-    contacts = new Contact[maxContacts];
+    islandContacts.resize(contactCapacity);
     calculateIterations = (iterations == 0);
+
+    potentialContacts.resize(contactCapacity > 0 ? contactCapacity : 1);
+    collisionData.axisCache = &axisCache;
+    setCollisionProperties((real)0.9, (real)0.1, (real)0.0);
+
+    buildFrameGraph();
 }
 
 World::~World()
 {
-    delete[] contacts;
+}
+
+void World::setExecutor(TaskExecutor *executor)
+{
+    World::executor = executor;
+
+    resolver.setExecutor(executor);
+    for (unsigned i = 0; i < islandResolvers.size(); i++)
+    {
+        islandResolvers[i].setExecutor(executor);
+    }
+}
+
+void World::setContactCache(ContactCache *contactCache)
+{
+    World::contactCache = contactCache;
+
+    bool warmStarting = (contactCache != NULL);
+    resolver.setWarmStarting(warmStarting);
+    for (unsigned i = 0; i < islandResolvers.size(); i++)
+    {
+        islandResolvers[i].setWarmStarting(warmStarting);
+    }
+}
+
+void World::setVelocitySolver(ContactResolver::VelocitySolver velocitySolver,
+                              unsigned sweeps)
+{
+    resolver.setVelocitySolver(velocitySolver, sweeps);
+    for (unsigned i = 0; i < islandResolvers.size(); i++)
+    {
+        islandResolvers[i].setVelocitySolver(velocitySolver, sweeps);
+    }
+}
+
+World::Handle World::addPrimitive(CollisionPrimitive *primitive)
+{
+    primitive->calculateInternals();
+    primitives.push_back(primitive);
+    primitiveProxies.push_back(broadphase.createProxy(
+        primitive->getBoundingBox(), primitive->body, primitive));
+    return primitiveHandles.create();
+}
+
+bool World::removePrimitive(Handle handle)
+{
+    unsigned index = primitiveHandles.find(handle);
+    if (index == HandleTable::noEntry) return false;
+
+    removePrimitiveAt(index);
+    return true;
+}
+
+CollisionPrimitive* World::getPrimitive(Handle handle) const
+{
+    unsigned index = primitiveHandles.find(handle);
+    if (index == HandleTable::noEntry) return NULL;
+    return primitives[index];
+}
+
+void World::removePrimitiveAt(unsigned index)
+{
+    primitiveHandles.destroy(primitiveHandles.getHandle(index));
+    broadphase.destroyProxy(primitiveProxies[index]);
+    primitives[index] = primitives.back();
+    primitives.pop_back();
+    primitiveProxies[index] = primitiveProxies.back();
+    primitiveProxies.pop_back();
+}
+
+void World::removeBodyPrimitives(RigidBody *const *sortedBodies,
+                                 unsigned count)
+{
+    if (count == 0) return;
+
+    // Removing a primitive moves the last one into its place, so the
+    // same position is looked at again.
+    unsigned i = 0;
+    while (i < primitives.size())
+    {
+        RigidBody *body = primitives[i]->body;
+        if (body != NULL &&
+            std::binary_search(sortedBodies, sortedBodies + count, body))
+        {
+            removePrimitiveAt(i);
+        }
+        else
+        {
+            i++;
+        }
+    }
+}
+
+void World::addPlane(CollisionPlane *plane)
+{
+    planes.push_back(plane);
+}
+
+void World::removePlane(CollisionPlane *plane)
+{
+    std::vector<CollisionPlane*>::iterator found =
+        std::find(planes.begin(), planes.end(), plane);
+    if (found != planes.end()) planes.erase(found);
+}
+
+void World::setCollisionProperties(real friction,
+                                   real restitution,
+                                   real tolerance)
+{
+    collisionData.friction = friction;
+    collisionData.restitution = restitution;
+    collisionData.tolerance = tolerance;
+}
+
+void World::updatePrimitives(real duration)
+{
+    frameDuration = duration;
+    countPrimitives();
+    placePrimitives(0, framePrimitiveCount);
+    moveProxies();
+}
+
+void World::countPrimitives()
+{
+    framePrimitiveCount = (unsigned)primitives.size();
+    if (primitiveBoxes.size() < framePrimitiveCount)
+    {
+        primitiveBoxes.resize(framePrimitiveCount);
+        primitiveDisplacements.resize(framePrimitiveCount);
+    }
+    planeBatch.resize(framePrimitiveCount);
+}
+
+void World::placePrimitives(unsigned begin, unsigned end)
+{
+    for (unsigned i = begin; i < end; i++)
+    {
+        CollisionPrimitive *primitive = primitives[i];
+        primitive->calculateInternals();
+        primitiveBoxes[i] = primitive->getBoundingBox();
+        planeBatch.set(i, isActive(primitive->body) ? primitive : NULL,
+            primitiveBoxes[i]);
+
+        // Sleeping bodies won't move, so don't need their box
+        // stretched, and nor do primitives without a body.
+        Vector3 displacement;
+        if (primitive->body && primitive->body->getAwake())
+        {
+            displacement = primitive->body->getVelocity() * frameDuration;
+        }
+        primitiveDisplacements[i] = displacement;
+    }
+}
+
+void World::moveProxies()
+{
+    for (unsigned i = 0; i < framePrimitiveCount; i++)
+    {
+        broadphase.moveProxy(primitiveProxies[i],
+            primitiveBoxes[i], primitiveDisplacements[i]);
+    }
+}
+
+World::Handle World::addBody(RigidBody *body)
+{
+    bodies.push_back(body);
+    return bodyHandles.create();
+}
+
+void World::addBodies(RigidBody *const *bodies, unsigned count,
+                      Handle *handles)
+{
+    World::bodies.reserve(World::bodies.size() + count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        Handle handle = addBody(bodies[i]);
+        if (handles) handles[i] = handle;
+    }
+}
+
+bool World::removeBody(Handle handle)
+{
+    unsigned index = bodyHandles.destroy(handle);
+    if (index == HandleTable::noEntry) return false;
+
+    RigidBody *body = bodies[index];
+    bodies[index] = bodies.back();
+    bodies.pop_back();
+    removeBodyPrimitives(&body, 1);
+    return true;
+}
+
+void World::removeBodies(const Handle *handles, unsigned count)
+{
+    // The bodies are gathered first, so that all their primitives can
+    // be found in one pass rather than one pass for each body.
+    removedBodies.clear();
+    for (unsigned i = 0; i < count; i++)
+    {
+        unsigned index = bodyHandles.destroy(handles[i]);
+        if (index == HandleTable::noEntry) continue;
+
+        removedBodies.push_back(bodies[index]);
+        bodies[index] = bodies.back();
+        bodies.pop_back();
+    }
+    if (removedBodies.empty()) return;
+
+    std::sort(removedBodies.begin(), removedBodies.end());
+    removeBodyPrimitives(&removedBodies[0], (unsigned)removedBodies.size());
+}
+
+RigidBody* World::getBody(Handle handle) const
+{
+    unsigned index = bodyHandles.find(handle);
+    if (index == HandleTable::noEntry) return NULL;
+    return bodies[index];
+}
+
+World::Handle World::addContactGenerator(ContactGenerator *generator)
+{
+    contactGenerators.push_back(generator);
+    return contactGenHandles.create();
+}
+
+bool World::removeContactGenerator(Handle handle)
+{
+    unsigned index = contactGenHandles.destroy(handle);
+    if (index == HandleTable::noEntry) return false;
+
+    contactGenerators[index] = contactGenerators.back();
+    contactGenerators.pop_back();
+    return true;
+}
+
+ContactGenerator* World::getContactGenerator(Handle handle) const
+{
+    unsigned index = contactGenHandles.find(handle);
+    if (index == HandleTable::noEntry) return NULL;
+    return contactGenerators[index];
+}
+
+void World::clearRegistrations()
+{
+    bodies.clear();
+    bodyHandles.clear();
+    for (unsigned i = 0; i < primitiveProxies.size(); i++)
+    {
+        broadphase.destroyProxy(primitiveProxies[i]);
+    }
+    primitives.clear();
+    primitiveProxies.clear();
+    primitiveHandles.clear();
+    contactGenerators.clear();
+    contactGenHandles.clear();
 }
 
 void World::startFrame()
 {
-    BodyRegistration *reg = firstBody;
-    while (reg)
+    for (unsigned i = 0; i < bodies.size(); i++)
     {
         // Remove all forces from the accumulator
-        reg->body->clearAccumulators();
-        reg->body->calculateDerivedData();
-
-        // Get the next registration
-        reg = reg->next;
+        bodies[i]->clearAccumulators();
+        bodies[i]->calculateDerivedData();
     }
 }
 
 unsigned World::generateContacts()
 {
-    unsigned limit = maxContacts;
-    Contact *nextContact = contacts;
+    runContactGenerators(0, 1);
+
+    // Then the contacts between primitives.
+    generateCollisions();
+
+    // Return the number of contacts used.
+    return contacts.getCount();
+}
 
-    ContactGenRegistration * reg = firstContactGen;
-    while (reg)
+unsigned World::generateCollisions()
+{
+    collisionData.setBuffer(&contacts);
+
+    // Find the pairs that might be touching, making more room if the
+    // broadphase filled the buffer.
+    unsigned numPairs;
+    for (;;)
     {
-        unsigned used = reg->gen->addContact(nextContact, limit);
-        limit -= used;
-        nextContact += used;
+        numPairs = broadphase.getPotentialContacts(
+            &potentialContacts[0], (unsigned)potentialContacts.size());
+        if (numPairs < potentialContacts.size()) break;
+        potentialContacts.resize(potentialContacts.size() * 2);
+    }
 
-        // We've run out of contacts to fill. This means we're missing
-        // contacts.
-        if (limit <= 0) break;
+    collideItems(0, numPairs + (unsigned)primitives.size(), numPairs,
+                 &collisionData);
+    axisCache.update();
 
-        reg = reg->next;
+    return collisionData.contactCount;
+}
+
+void World::collideItems(unsigned begin, unsigned end,
+                         unsigned numPairs, CollisionData *data)
+{
+    unsigned pairsEnd = end < numPairs ? end : numPairs;
+    for (unsigned i = begin; i < pairsEnd && data->hasMoreContacts(); i++)
+    {
+        const PotentialContact &pair = potentialContacts[i];
+
+        // Only pairs with something that can move need checking.
+        if (!isActive(pair.body[0]) && !isActive(pair.body[1])) continue;
+
+        CollisionDetector::collide(
+            *pair.primitive[0], *pair.primitive[1], data);
     }
 
-    // Return the number of contacts used.
-    return maxContacts - limit;
+    // The primitives are tested against the planes from the batch,
+    // which only has slots for those that can move.
+    if (end <= numPairs || planes.empty()) return;
+    unsigned first = begin > numPairs ? begin - numPairs : 0;
+    CollisionDetector::collideWithPlanes(planeBatch, first, end - numPairs,
+        &planes[0], (unsigned)planes.size(), data);
 }
 
 void World::runPhysics(real duration)
 {
-    // First apply the force generators
-    //registry.updateForces(duration);
+    frameDuration = duration;
+    frameGraph.run(executor);
+}
+
+void World::FrameTask::run(unsigned begin, unsigned end)
+{
+    (world->*stage)(begin, end);
+}
+
+void World::buildFrameGraph()
+{
+    // The number of items each thread takes at a time in the stages
+    // that are split up.
+    const static unsigned bodyGrain = 64;
+    const static unsigned primitiveGrain = 64;
 
-    // Then integrate the objects
-    BodyRegistration *reg = firstBody;
-    while (reg)
+    void (World::*stages[8])(unsigned, unsigned) = {
+        &World::beginStep,
+        &World::integrateBodies,
+        &World::finishIntegration,
+        &World::placePrimitives,
+        &World::findPairs,
+        &World::runContactGenerators,
+        &World::collideBatch,
+        &World::resolveFrame
+    };
+    for (unsigned i = 0; i < 8; i++)
     {
-        // Remove all forces from the accumulator
-        reg->body->integrate(duration);
+        frameTasks[i].world = this;
+        frameTasks[i].stage = stages[i];
+    }
+
+    frameGraph.clear();
+    unsigned begin = frameGraph.addTask(&frameTasks[0]);
+    unsigned integrate = frameGraph.addTask(&frameTasks[1], 0, bodyGrain);
+    unsigned finish = frameGraph.addTask(&frameTasks[2]);
+    unsigned place = frameGraph.addTask(&frameTasks[3], 0, primitiveGrain);
+    unsigned pairs = frameGraph.addTask(&frameTasks[4]);
+    unsigned generators = frameGraph.addTask(&frameTasks[5]);
+    unsigned collide =
+        frameGraph.addTask(&frameTasks[6], 0, collisionBatchSize);
+    unsigned resolve = frameGraph.addTask(&frameTasks[7]);
+
+    frameGraph.setCountSource(integrate, &frameBodyCount);
+    frameGraph.setCountSource(place, &framePrimitiveCount);
+    frameGraph.setCountSource(collide, &collisionItemCount);
+
+    frameGraph.addDependency(begin, integrate);
+    frameGraph.addDependency(integrate, finish);
+    frameGraph.addDependency(finish, place);
+    frameGraph.addDependency(place, pairs);
+    frameGraph.addDependency(place, generators);
+    frameGraph.addDependency(pairs, collide);
+    frameGraph.addDependency(generators, resolve);
+    frameGraph.addDependency(collide, resolve);
+}
+
+void World::beginStep(unsigned, unsigned)
+{
+    frameBodyCount = (unsigned)bodies.size();
+
+    // Note where the bullets start
+    findBullets();
+}
+
+void World::integrateBodies(unsigned begin, unsigned end)
+{
+    for (unsigned i = begin; i < end; i++)
+    {
+        bodies[i]->integrate(frameDuration);
+    }
+}
+
+void World::finishIntegration(unsigned, unsigned)
+{
+    // Stop any bullets at the first thing in their path
+    sweepBullets();
+
+    countPrimitives();
+}
+
+void World::findPairs(unsigned, unsigned)
+{
+    moveProxies();
+
+    // Find the pairs that might be touching, making more room if the
+    // broadphase filled the buffer.
+    for (;;)
+    {
+        framePairCount = broadphase.getPotentialContacts(
+            &potentialContacts[0], (unsigned)potentialContacts.size());
+        if (framePairCount < potentialContacts.size()) break;
+        potentialContacts.resize(potentialContacts.size() * 2);
+    }
 
-        // Get the next registration
-        reg = reg->next;
+    // Make a batch for each range of items the narrowphase will be
+    // split into.
+    collisionItemCount = framePairCount + framePrimitiveCount;
+    unsigned numBatches =
+        (collisionItemCount + collisionBatchSize - 1) / collisionBatchSize;
+    if (collisionBatches.size() < numBatches)
+    {
+        collisionBatches.resize(numBatches);
+        for (unsigned i = 0; i < numBatches; i++)
+        {
+            collisionBatches[i].axes.setSource(&axisCache);
+        }
+    }
+    for (unsigned i = 0; i < collisionBatches.size(); i++)
+    {
+        collisionBatches[i].contacts.clear();
+    }
+}
+
+void World::runContactGenerators(unsigned, unsigned)
+{
+    contacts.clear();
+    for (unsigned i = 0; i < contactGenerators.size(); i++)
+    {
+        // A generator that fills the room it is given may have had
+        // more contacts to write, so it is run again with more room.
+        unsigned space = 1;
+        for (;;)
+        {
+            Contact *nextContact = contacts.reserve(space);
+            space = contacts.getSpace();
+            unsigned used = contactGenerators[i]->addContact(nextContact, space);
+            if (used < space)
+            {
+                contacts.add(used);
+                break;
+            }
+            space *= 2;
+        }
+    }
+}
+
+void World::collideBatch(unsigned begin, unsigned end)
+{
+    // A task run without an executor is given all its items at once,
+    // and they all go in the first batch.
+    CollisionBatch &batch = collisionBatches[begin / collisionBatchSize];
+
+    CollisionData data;
+    data.friction = collisionData.friction;
+    data.restitution = collisionData.restitution;
+    data.tolerance = collisionData.tolerance;
+    data.axisCache = &batch.axes;
+
+    // Start with room for a few contacts per item. The buffer grows
+    // if the batch needs more.
+    batch.contacts.clear();
+    batch.contacts.reserve((end - begin) * 4 + 16);
+    data.setBuffer(&batch.contacts);
+    collideItems(begin, end, framePairCount, &data);
+}
+
+void World::resolveFrame(unsigned, unsigned)
+{
+    // Join the batches on after the generators' contacts, in order.
+    unsigned batchContacts = 0;
+    for (unsigned i = 0; i < collisionBatches.size(); i++)
+    {
+        batchContacts += collisionBatches[i].contacts.getCount();
     }
 
-    // Generate contacts
-    unsigned usedContacts = generateContacts();
+    Contact *nextContact = contacts.reserve(batchContacts);
+    for (unsigned i = 0; i < collisionBatches.size(); i++)
+    {
+        CollisionBatch &batch = collisionBatches[i];
+        unsigned count = batch.contacts.getCount();
+        const Contact *batchContact = batch.contacts.getContacts();
+        for (unsigned j = 0; j < count; j++)
+        {
+            nextContact[j] = batchContact[j];
+        }
+        nextContact += count;
+        axisCache.merge(batch.axes);
+    }
+    contacts.add(batchContacts);
+    axisCache.update();
+
+    // Pick up the impulses from the last frame
+    unsigned usedContacts = contacts.getCount();
+    if (contactCache) contactCache->load(contacts.getContacts(), usedContacts);
+
+    // And process them, one island at a time
+    unsigned numIslands = buildIslands(usedContacts);
+    resolveIslands(numIslands, frameDuration);
+
+    // Keep the impulses for the next frame
+    if (contactCache) contactCache->store(islandContacts.data(), usedContacts);
+}
+
+const real World::bulletPenetration = (real)0.05;
+
+const unsigned World::collisionBatchSize = 32;
+
+void World::findBullets()
+{
+    bulletPrimitives.clear();
+    for (unsigned i = 0; i < primitives.size(); i++)
+    {
+        CollisionPrimitive *primitive = primitives[i];
+        if (primitive->getType() != CollisionPrimitive::TYPE_SPHERE) continue;
+        if (!isActive(primitive->body) || !primitive->body->getBullet()) continue;
+
+        // The body's transform is up to date from startFrame.
+        primitive->calculateInternals();
+        bulletPrimitives.push_back(i);
+    }
+}
+
+void World::sweepBullets()
+{
+    for (unsigned i = 0; i < bulletPrimitives.size(); i++)
+    {
+        const CollisionSphere &sphere =
+            *(const CollisionSphere *)primitives[bulletPrimitives[i]];
+        RigidBody *body = sphere.body;
+
+        // The primitive is still where it started, and the body is
+        // where it has been integrated to.
+        Vector3 end = (body->getTransform() * sphere.offset).getAxisVector(3);
+        Vector3 displacement = end - sphere.getAxis(3);
 
-    // And process them
-    if (calculateIterations) resolver.setIterations(usedContacts * 4);
-    resolver.resolveContacts(contacts, usedContacts, duration);
+        // A sphere moving less than its radius each frame can't
+        // pass through anything without touching it.
+        real distance = displacement.magnitude();
+        if (distance <= sphere.radius) continue;
+
+        real time = sweepSphere(sphere, displacement);
+        if (time >= 1) continue;
+
+        // Move the body back, leaving the sphere a little way in.
+        time += sphere.radius * bulletPenetration / distance;
+        if (time >= 1) continue;
+        body->setPosition(
+            body->getPosition() - displacement * ((real)1 - time));
+        body->calculateDerivedData();
+    }
+}
+
+real World::sweepSphere(const CollisionSphere &sphere,
+                        const Vector3 &displacement)
+{
+    real first = 1;
+    real time;
+
+    for (unsigned i = 0; i < planes.size(); i++)
+    {
+        if (!planes[i]->canCollideWith(sphere)) continue;
+        if (IntersectionTests::sweptSphereAndHalfSpace(
+                sphere, displacement, *planes[i], &time) &&
+            time > 0 && time < first)
+        {
+            first = time;
+        }
+    }
+
+    // Find the primitives whose boxes overlap the whole path.
+    Vector3 centre = sphere.getAxis(3);
+    Vector3 extent(sphere.radius, sphere.radius, sphere.radius);
+    BoundingBox path(
+        BoundingBox(centre - extent, centre + extent),
+        BoundingBox(centre + displacement - extent,
+                    centre + displacement + extent));
+
+    unsigned count;
+    if (sweptProxies.size() < 16) sweptProxies.resize(16);
+    for (;;)
+    {
+        count = broadphase.query(
+            path, &sweptProxies[0], (unsigned)sweptProxies.size());
+        if (count < sweptProxies.size()) break;
+        sweptProxies.resize(sweptProxies.size() * 2);
+    }
+
+    // The path of the centre, for the shapes swept as a fat ray.
+    Ray ray;
+    ray.origin = centre;
+    ray.maxDistance = displacement.magnitude();
+    ray.direction = displacement * ((real)1.0 / ray.maxDistance);
+    RayHit rayHit;
+
+    for (unsigned i = 0; i < count; i++)
+    {
+        const CollisionPrimitive *other =
+            broadphase.getPrimitive(sweptProxies[i]);
+        if (!other || other->body == sphere.body) continue;
+        if (!sphere.canCollideWith(*other)) continue;
+
+        bool hit = false;
+        switch (other->getType())
+        {
+        case CollisionPrimitive::TYPE_SPHERE:
+            hit = IntersectionTests::sweptSphereAndSphere(sphere,
+                displacement, *(const CollisionSphere *)other, &time);
+            break;
+        case CollisionPrimitive::TYPE_BOX:
+            hit = IntersectionTests::sweptSphereAndBox(sphere,
+                displacement, *(const CollisionBox *)other, &time);
+            break;
+        case CollisionPrimitive::TYPE_CAPSULE:
+            hit = IntersectionTests::rayAndCapsule(ray, sphere.radius,
+                *(const CollisionCapsule *)other, &rayHit);
+            time = rayHit.distance / ray.maxDistance;
+            break;
+        case CollisionPrimitive::TYPE_TRIANGLE_MESH:
+        case CollisionPrimitive::TYPE_HEIGHTFIELD:
+            hit = IntersectionTests::rayAndTriangles(ray, sphere.radius,
+                *(const TriangleSurface *)other, &rayHit);
+            time = rayHit.distance / ray.maxDistance;
+            break;
+        default:
+            break;
+        }
+        if (hit && time > 0 && time < first) first = time;
+    }
+    return first;
+}
+
+unsigned World::findIslandBody(RigidBody *body) const
+{
+    // Bodies that can't move don't join islands together.
+    if (!body || body->isImmovable()) return noIslandBody;
+
+    std::vector<RigidBody*>::const_iterator found = std::lower_bound(
+        islandBodies.begin(), islandBodies.end(), body);
+    return (unsigned)(found - islandBodies.begin());
+}
+
+unsigned World::findIslandRoot(unsigned node)
+{
+    unsigned root = node;
+    while (islandParent[root] != root) root = islandParent[root];
+
+    // Point everything on the way directly at the root.
+    while (islandParent[node] != root)
+    {
+        unsigned next = islandParent[node];
+        islandParent[node] = root;
+        node = next;
+    }
+    return root;
+}
+
+unsigned World::buildIslands(unsigned numContacts)
+{
+    const Contact *frameContacts = contacts.getContacts();
+
+    // Find all the movable bodies that are in contact.
+    islandBodies.clear();
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        for (unsigned b = 0; b < 2; b++)
+        {
+            RigidBody *body = frameContacts[i].body[b];
+            if (body && !body->isImmovable())
+            {
+                islandBodies.push_back(body);
+            }
+        }
+    }
+    std::sort(islandBodies.begin(), islandBodies.end());
+    islandBodies.erase(
+        std::unique(islandBodies.begin(), islandBodies.end()),
+        islandBodies.end());
+
+    // Join together the bodies at either end of each contact.
+    islandParent.resize(islandBodies.size());
+    for (unsigned i = 0; i < islandParent.size(); i++) islandParent[i] = i;
+
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        unsigned one = findIslandBody(frameContacts[i].body[0]);
+        unsigned two = findIslandBody(frameContacts[i].body[1]);
+        if (one == noIslandBody || two == noIslandBody) continue;
+
+        one = findIslandRoot(one);
+        two = findIslandRoot(two);
+        if (one != two) islandParent[two] = one;
+    }
+
+    // Number the islands in order of their first contact. A contact
+    // with no movable body at all gets an island to itself.
+    std::vector<unsigned> roots(islandBodies.size(), noIslandBody);
+    contactIsland.resize(numContacts);
+    islandStart.clear();
+    islandAwake.clear();
+
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        unsigned node = findIslandBody(frameContacts[i].body[0]);
+        if (node == noIslandBody) node = findIslandBody(frameContacts[i].body[1]);
+
+        unsigned island;
+        if (node == noIslandBody)
+        {
+            island = (unsigned)islandStart.size();
+            islandStart.push_back(0);
+            islandAwake.push_back(false);
+        }
+        else
+        {
+            unsigned root = findIslandRoot(node);
+            if (roots[root] == noIslandBody)
+            {
+                roots[root] = (unsigned)islandStart.size();
+                islandStart.push_back(0);
+                islandAwake.push_back(false);
+            }
+            island = roots[root];
+        }
+        contactIsland[i] = island;
+        islandStart[island]++;
+
+        // An island is awake if any of its movable bodies are.
+        for (unsigned b = 0; b < 2; b++)
+        {
+            RigidBody *body = frameContacts[i].body[b];
+            if (body && !body->isImmovable() && body->getAwake())
+            {
+                islandAwake[island] = true;
+            }
+        }
+    }
+
+    // Turn the counts into offsets, and copy the contacts across in
+    // island order, keeping their relative order within each island.
+    unsigned numIslands = (unsigned)islandStart.size();
+    unsigned offset = 0;
+    for (unsigned island = 0; island < numIslands; island++)
+    {
+        unsigned size = islandStart[island];
+        islandStart[island] = offset;
+        offset += size;
+    }
+    islandStart.push_back(offset);
+
+    if (islandContacts.size() < numContacts) islandContacts.resize(numContacts);
+    std::vector<unsigned> next(islandStart.begin(), islandStart.end() - 1);
+    for (unsigned i = 0; i < numContacts; i++)
+    {
+        islandContacts[next[contactIsland[i]]++] = frameContacts[i];
+    }
+
+    return numIslands;
+}
+
+void World::IslandSolver::run(unsigned begin, unsigned end)
+{
+    for (unsigned k = begin; k < end; k++)
+    {
+        unsigned island = islands ? islands[k] : k;
+        if (!world->islandAwake[island]) continue;
+
+        unsigned first = world->islandStart[island];
+        unsigned count = world->islandStart[island+1] - first;
+
+        ContactResolver &islandResolver = world->islandResolvers[island];
+        if (world->calculateIterations) islandResolver.setIterations(count * 4);
+        islandResolver.resolveContacts(
+            world->islandContacts.data() + first, count, duration);
+    }
+}
+
+void World::resolveIslands(unsigned numIslands, real duration)
+{
+    if (numIslands == 0) return;
+
+    // Make sure there's a resolver for each island.
+    if (islandResolvers.size() < numIslands)
+    {
+        islandResolvers.resize(numIslands, resolver);
+    }
+
+    IslandSolver solver;
+    solver.world = this;
+    solver.islands = NULL;
+    solver.duration = duration;
+
+    if (executor &&
+        resolver.getVelocitySolver() == ContactResolver::VELOCITY_COLOURED)
+    {
+        // Islands with this many contacts keep the executor busy by
+        // themselves.
+        const static unsigned minLargeIsland = 256;
+
+        // Resolve the large islands on this thread, so the executor
+        // is free to take the contacts in each of their colours.
+        // The rest are shared out between threads as usual.
+        smallIslands.clear();
+        for (unsigned island = 0; island < numIslands; island++)
+        {
+            unsigned count = islandStart[island+1] - islandStart[island];
+            if (count >= minLargeIsland) solver.run(island, island+1);
+            else smallIslands.push_back(island);
+        }
+
+        if (!smallIslands.empty())
+        {
+            solver.islands = &smallIslands[0];
+            executor->parallelFor(&solver, (unsigned)smallIslands.size());
+        }
+    }
+    else if (executor) executor->parallelFor(&solver, numIslands);
+    else solver.run(0, numIslands);
 }